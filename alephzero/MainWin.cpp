@@ -115,52 +115,98 @@ std::string formatBalance(u256 _b)
 
 void Main::refresh()
 {
+	// Only what's changed since last time is redrawn; nothing below holds the client's lock but the peers.
+	ClientChanges c = m_client.changes();
+	auto const& s = *c.state;
+	ui->balance->setText(QString::fromStdString(formatBalance(s.balance(m_myKey.address()))));
+	ui->address->setText(QString::fromStdString(asHex(s.address().asArray())));
+
+	if (c.allAccounts)
+	{
+		ui->accounts->clear();
+		m_accountItems.clear();
+	}
+	for (auto const& a: c.goneAccounts)
+	{
+		auto it = m_accountItems.find(a);
+		if (it != m_accountItems.end())
+		{
+			delete it->second;
+			m_accountItems.erase(it);
+		}
+	}
+	for (auto const& i: c.accounts)
+	{
+		QString t = QString("%1 @ %2").arg(formatBalance(i.second).c_str()).arg(asHex(i.first.asArray()).c_str());
+		auto& item = m_accountItems[i.first];
+		if (item)
+			item->setText(t);
+		else
+		{
+			item = new QListWidgetItem(t);
+			ui->accounts->addItem(item);
+		}
+	}
+
 	m_client.lock();
-	ui->balance->setText(QString::fromStdString(formatBalance(m_client.state().balance(m_myKey.address()))));
 	ui->peerCount->setText(QString::fromStdString(toString(m_client.peerCount())) + " peer(s)");
-	ui->address->setText(QString::fromStdString(asHex(m_client.state().address().asArray())));
 	ui->peers->clear();
 	for (PeerInfo const& i: m_client.peers())
 		ui->peers->addItem(QString("%3 ms - %1:%2 - %4").arg(i.host.c_str()).arg(i.port).arg(chrono::duration_cast<chrono::milliseconds>(i.lastPing).count()).arg(i.clientVersion.c_str()));
+	m_client.unlock();
 
-	auto d = m_client.blockChain().details();
-	auto diff = BlockInfo(m_client.blockChain().block()).difficulty;
+	auto const& bc = *c.chain;
+	auto d = bc.details();
+	auto b = bc.block();
+	auto diff = BlockInfo(b.ref()).difficulty;
 	ui->blockChain->setText(QString("#%1 @%3 T%2").arg(d.number).arg(toLog2(d.totalDifficulty)).arg(toLog2(diff)));
+	if (ui->mine->isChecked())
+		ui->blockChain->setText(ui->blockChain->text() + QString(" %1 H/s").arg(m_client.miningProgress().rate()));
 
-	auto acs = m_client.state().addresses();
-	ui->accounts->clear();
-	for (auto i: acs)
-		ui->accounts->addItem(QString("%1 @ %2").arg(formatBalance(i.second).c_str()).arg(asHex(i.first.asArray()).c_str()));
-
-	ui->transactionQueue->clear();
-	for (pair<h256, bytes> const& i: m_client.transactionQueue().transactions())
+	for (auto const& h: c.oldTransactions)
+	{
+		auto it = m_queueItems.find(h);
+		if (it != m_queueItems.end())
+		{
+			delete it->second;
+			m_queueItems.erase(it);
+		}
+	}
+	for (auto const& i: c.newTransactions)
 	{
 		Transaction t(i.second);
-		ui->transactionQueue->addItem(QString("%1 (%2 fee) @ %3 <- %4")
+		auto item = new QListWidgetItem(QString("%1 (%2 fee) @ %3 <- %4")
 							  .arg(formatBalance(t.value).c_str())
 							  .arg(formatBalance(t.fee).c_str())
 							  .arg(asHex(t.receiveAddress.asArray()).c_str())
 							  .arg(asHex(t.sender().asArray()).c_str()) );
+		ui->transactionQueue->addItem(item);
+		m_queueItems[i.first] = item;
 	}
 
-	ui->transactions->clear();
-	auto const& bc = m_client.blockChain();
-	for (auto h = bc.currentHash(); h != bc.genesisHash(); h = bc.details(h).parent)
+	// Newest block first, each followed by its transactions; blocks come and go at the top.
+	for (unsigned b = 0; b < c.oldBlocks.size() && m_blockRows.size(); ++b)
+	{
+		for (unsigned i = m_blockRows.front(); i; --i)
+			delete ui->transactions->takeItem(0);
+		m_blockRows.pop_front();
+	}
+	for (auto const& h: c.newBlocks)
 	{
-		auto d = bc.details(h);
-		ui->transactions->addItem(QString("# %1 ==== %2").arg(d.number).arg(asHex(h.asArray()).c_str()));
-		for (auto const& i: RLP(bc.block(h))[1])
+		unsigned row = 0;
+		ui->transactions->insertItem(row++, QString("# %1 ==== %2").arg(bc.details(h).number).arg(asHex(h.asArray()).c_str()));
+		auto b = bc.block(h);
+		for (auto const& i: RLP(b.ref())[1])
 		{
 			Transaction t(i.data());
-			ui->transactions->addItem(QString("%1 wei (%2 fee) @ %3 <- %4")
+			ui->transactions->insertItem(row++, QString("%1 wei (%2 fee) @ %3 <- %4")
 							  .arg(toString(t.value).c_str())
 							  .arg(toString(t.fee).c_str())
 							  .arg(asHex(t.receiveAddress.asArray()).c_str())
 							  .arg(asHex(t.sender().asArray()).c_str()) );
 		}
+		m_blockRows.push_front(row);
 	}
-
-	m_client.unlock();
 }
 
 void Main::on_net_toggled()
@@ -5,8 +5,11 @@
 #include <QAbstractListModel>
 #include <QDialog>
 #include <QMutex>
+#include <deque>
 #include <libethereum/Client.h>
 
+class QListWidgetItem;
+
 namespace Ui {
 class Main;
 }
@@ -39,6 +42,10 @@ private:
 	eth::KeyPair m_myKey;
 	std::vector<bi::tcp::endpoint> m_peers;
 
+	std::map<eth::Address, QListWidgetItem*> m_accountItems;		///< Each address's row of ui->accounts.
+	std::unordered_map<eth::h256, QListWidgetItem*> m_queueItems;	///< Each queued transaction's row of ui->transactionQueue.
+	std::deque<unsigned> m_blockRows;	///< The number of rows of ui->transactions for each block shown, newest first.
+
 	QMutex m_guiLock;
 	QTimer* m_refresh;
 	QStringList m_servers;
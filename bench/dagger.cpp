@@ -0,0 +1,73 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file dagger.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * Dagger benchmark: eval & verify throughput, then Miner hash rate across thread counts.
+ * Usage: benchdagger [milliseconds per measurement]
+ */
+
+#include <chrono>
+#include <thread>
+#include "Dagger.h"
+#include "Miner.h"
+using namespace std;
+using namespace std::chrono;
+using namespace eth;
+
+template <class _F> double perSecond(unsigned _ms, _F const& _f)
+{
+	eth::uint n = 0;
+	auto s = steady_clock::now();
+	for (; steady_clock::now() - s < milliseconds(_ms); n += 64)
+		for (unsigned i = 0; i < 64; ++i)
+			_f(n + i);
+	return n * 1000.0 / duration_cast<milliseconds>(steady_clock::now() - s).count();
+}
+
+int main(int argc, char** argv)
+{
+	unsigned ms = argc > 1 ? atoi(argv[1]) : 2000;
+#if FAKE_DAGGER
+	cout << "Dagger: FAKE_DAGGER" << endl;
+#else
+	cout << "Dagger: full" << endl;
+#endif
+
+	h256 root = sha3(bytes(1, 42));
+	u256 difficulty = u256(1) << 22;
+	h256 sink;
+	cout << "eval:   " << perSecond(ms, [&](eth::uint i){ sink ^= Dagger::eval(root, i); }) << " /s" << endl;
+	cout << "verify: " << perSecond(ms, [&](eth::uint i){ sink[0] ^= Dagger::verify(root, i, difficulty); }) << " /s" << endl;
+
+	// Impossible difficulty so the threads never stop.
+	unsigned cores = max(1u, thread::hardware_concurrency());
+	for (unsigned t = 1; t <= cores; t = (t == cores || t * 2 <= cores) ? t * 2 : cores)
+	{
+		Miner m(t);
+		m.setWork(root, ~u256(0));
+		this_thread::sleep_for(milliseconds(100));
+		u256 nonce;
+		m.wait(nonce, 0);
+		eth::uint hashes = 0;
+		auto s = steady_clock::now();
+		while (steady_clock::now() - s < milliseconds(ms))
+			hashes += m.wait(nonce, 100).hashes;
+		cout << "Miner x" << t << ": " << hashes * 1000.0 / duration_cast<milliseconds>(steady_clock::now() - s).count() << " H/s" << endl;
+	}
+	return sink[0] == 42 && sink[1] == 42 ? 1 : 0;
+}
@@ -0,0 +1,177 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file playback.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * Chain playback benchmark: imports a recorded chain into a fresh database, timing all but the first blocks.
+ * Usage: benchplayback <file written by --export-chain | database directory> [--from N] [--trusted] [--threads N] [--json]
+ * With --json the results are written as a single JSON object, on the last line.
+ */
+
+#include <fstream>
+#include <chrono>
+#include <sys/resource.h>
+#include <boost/filesystem.hpp>
+#include "Exceptions.h"
+#include "RLP.h"
+#include "TrieDB.h"
+#include "State.h"
+#include "BlockChain.h"
+using namespace std;
+using namespace std::chrono;
+using namespace eth;
+namespace fs = boost::filesystem;
+
+/// Blocks given to BlockChain::importBatch at once; as importChain does.
+static const unsigned c_batch = 256;
+
+/// @returns the blocks of a file written by BlockChain::exportChain, or of the longest chain of the database in
+/// directory @a _source.
+static vector<bytes> loadChain(string const& _source)
+{
+	string data;
+	if (fs::is_directory(_source))
+	{
+		ostringstream out;
+		BlockChain(_source).exportChain(out);
+		data = out.str();
+	}
+	else
+	{
+		ifstream in(_source, ios::binary);
+		data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	}
+
+	vector<bytes> ret;
+	for (bytesConstRef d((byte const*)data.data(), data.size()); d.size();)
+	{
+		RLP r(d);
+		if (!r.isList() || r.actualSize() > d.size())
+			throw InvalidBlockFormat();
+		ret.push_back(d.cropped(0, r.actualSize()).toBytes());
+		d = d.cropped(r.actualSize());
+	}
+	return ret;
+}
+
+/// @returns the bytes taken by the files under @a _dir.
+static uint64_t diskUsage(fs::path const& _dir)
+{
+	uint64_t ret = 0;
+	for (fs::recursive_directory_iterator it(_dir), end; it != end; ++it)
+		if (fs::is_regular_file(it->status()))
+			ret += fs::file_size(it->path());
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	string source;
+	unsigned from = 0;
+	bool trusted = false;
+	bool json = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		string arg = argv[i];
+		if (arg == "--from" && i + 1 < argc)
+			from = atoi(argv[++i]);
+		else if (arg == "--trusted")
+			trusted = true;
+		else if (arg == "--threads" && i + 1 < argc)
+			Defaults::setPlaybackThreads(atoi(argv[++i]));
+		else if (arg == "--json")
+			json = true;
+		else
+			source = arg;
+	}
+	if (source.empty())
+	{
+		cerr << "Usage: benchplayback <chain file | database directory> [--from N] [--trusted] [--threads N] [--json]" << endl;
+		return -1;
+	}
+
+	// Logging would only skew the timings (and garble the output).
+	g_logVerbosity = 0;
+	g_debugPost = [](std::string const&, unsigned char){};
+
+	vector<bytes> blocks = loadChain(source);
+	from = min<size_t>(from, blocks.size());
+	uint64_t transactions = 0;
+	for (size_t i = from; i < blocks.size(); ++i)
+		transactions += RLP(blocks[i])[1].itemCount();
+
+	fs::path dir = fs::temp_directory_path() / fs::unique_path("benchplayback-%%%%-%%%%");
+	fs::create_directories(dir);
+
+	unsigned imported = 0;
+	double seconds = 0;
+	uint64_t nodes = 0;
+	uint64_t nodeBytes = 0;
+	{
+		Overlay stateDB = State::openDB(dir.string(), true);
+		BlockChain bc(dir.string(), true);
+
+		// Play back up to the checkpoint untimed, then the rest.
+		auto playback = [&](size_t _begin, size_t _end)
+		{
+			vector<bytes> batch;
+			size_t waiting = 0;
+			for (size_t i = _begin; i < _end; ++i)
+			{
+				batch.push_back(blocks[i]);
+				if (batch.size() >= waiting + c_batch || i + 1 == _end)
+				{
+					imported += bc.importBatch(batch, stateDB, !trusted);
+					waiting = batch.size();
+				}
+			}
+		};
+		playback(0, from);
+		imported = 0;
+		nodes = Overlay::nodesWritten();
+		nodeBytes = Overlay::nodeBytesWritten();
+		auto start = steady_clock::now();
+		playback(from, blocks.size());
+		seconds = duration_cast<microseconds>(steady_clock::now() - start).count() / 1000000.0;
+		nodes = Overlay::nodesWritten() - nodes;
+		nodeBytes = Overlay::nodeBytesWritten() - nodeBytes;
+	}
+	uint64_t dbBytes = diskUsage(dir);
+	fs::remove_all(dir);
+
+	rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	uint64_t peakRSS = (uint64_t)ru.ru_maxrss * 1024;
+
+	if (json)
+		cout << "{\"blocks\":" << imported << ",\"transactions\":" << transactions << ",\"seconds\":" << seconds
+			<< ",\"blocksPerSecond\":" << (imported / seconds) << ",\"transactionsPerSecond\":" << (transactions / seconds)
+			<< ",\"trieNodesWritten\":" << nodes << ",\"trieBytesWritten\":" << nodeBytes
+			<< ",\"dbBytes\":" << dbBytes << ",\"peakRSS\":" << peakRSS << "}" << endl;
+	else
+	{
+		cout << "Blocks:             " << imported << " of " << (blocks.size() - from) << " (after " << from << ")" << endl;
+		cout << "Transactions:       " << transactions << endl;
+		cout << "Time:               " << seconds << " s" << endl;
+		cout << "Blocks/s:           " << (imported / seconds) << endl;
+		cout << "Transactions/s:     " << (transactions / seconds) << endl;
+		cout << "Trie nodes written: " << nodes << " (" << nodeBytes << " bytes)" << endl;
+		cout << "Database on disk:   " << dbBytes << " bytes" << endl;
+		cout << "Peak RSS:           " << peakRSS << " bytes" << endl;
+	}
+	return imported == blocks.size() - from ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file secp.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * secp256k1 benchmark: sign, verify, recover and batch recover throughput for each field implementation built.
+ * Usage: benchsecp [milliseconds per measurement]
+ */
+
+#include <chrono>
+#include <secp256k1.h>
+#include "Common.h"
+using namespace std;
+using namespace std::chrono;
+using namespace eth;
+
+template <class _F> double perSecond(unsigned _ms, _F const& _f)
+{
+	eth::uint n = 0;
+	auto s = steady_clock::now();
+	for (; steady_clock::now() - s < milliseconds(_ms); n += 16)
+		for (unsigned i = 0; i < 16; ++i)
+			_f(n + i);
+	return n * 1000.0 / duration_cast<milliseconds>(steady_clock::now() - s).count();
+}
+
+int main(int argc, char** argv)
+{
+	unsigned ms = argc > 1 ? atoi(argv[1]) : 1000;
+
+	// A handful of keys and messages, signed both ways; recovered keys must agree across implementations.
+	static const unsigned c_keys = 64;
+	std::vector<h256> secrets;
+	std::vector<h256> msgs;
+	for (unsigned i = 0; i < c_keys; ++i)
+	{
+		secrets.push_back(sha3("secret" + toString(i)));
+		msgs.push_back(sha3("message" + toString(i)));
+	}
+	bytes expected;
+
+	int ret = 0;
+	for (auto b = secp256k1_backends(); *b; ++b)
+	{
+		secp256k1_set_backend(*b);
+		secp256k1_start();
+		cout << secp256k1_backend() << ":" << endl;
+
+		std::vector<bytes> pubkeys(c_keys, bytes(65));
+		std::vector<bytes> ders(c_keys, bytes(72));
+		std::vector<std::array<byte, 64>> compacts(c_keys);
+		std::vector<int> recids(c_keys);
+		for (unsigned i = 0; i < c_keys; ++i)
+		{
+			int l = 65;
+			secp256k1_ecdsa_pubkey_create(pubkeys[i].data(), &l, secrets[i].data(), 0);
+			h256 nonce = sha3(msgs[i].asBytes() + secrets[i].asBytes());
+			l = 72;
+			secp256k1_ecdsa_sign(msgs[i].data(), 32, ders[i].data(), &l, secrets[i].data(), nonce.data());
+			ders[i].resize(l);
+			secp256k1_ecdsa_sign_compact(msgs[i].data(), 32, compacts[i].data(), secrets[i].data(), nonce.data(), &recids[i]);
+		}
+
+		bytes recovered;
+		for (unsigned i = 0; i < c_keys; ++i)
+		{
+			byte pub[65];
+			int l = 65;
+			if (secp256k1_ecdsa_recover_compact(msgs[i].data(), 32, compacts[i].data(), pub, &l, 0, recids[i]) != 1 || bytes(pub, pub + 65) != pubkeys[i] || secp256k1_ecdsa_verify(msgs[i].data(), 32, ders[i].data(), ders[i].size(), pubkeys[i].data(), 65) != 1)
+			{
+				cout << "  FAILED: signature " << i << " doesn't check out." << endl;
+				ret = 1;
+			}
+			recovered += pubkeys[i];
+		}
+		if (expected.empty())
+			expected = recovered;
+		else if (recovered != expected)
+		{
+			cout << "  FAILED: keys differ from " << secp256k1_backends()[0] << "'s." << endl;
+			ret = 1;
+		}
+
+		h256 nonce = sha3("nonce");
+		byte sig[64];
+		int recid;
+		cout << "  sign:          " << perSecond(ms, [&](eth::uint i){ secp256k1_ecdsa_sign_compact(msgs[i % c_keys].data(), 32, sig, secrets[i % c_keys].data(), nonce.data(), &recid); }) << " /s" << endl;
+		cout << "  verify:        " << perSecond(ms, [&](eth::uint i){ secp256k1_ecdsa_verify(msgs[i % c_keys].data(), 32, ders[i % c_keys].data(), ders[i % c_keys].size(), pubkeys[i % c_keys].data(), 65); }) << " /s" << endl;
+		cout << "  recover:       " << perSecond(ms, [&](eth::uint i){ byte pub[65]; int l = 65; secp256k1_ecdsa_recover_compact(msgs[i % c_keys].data(), 32, compacts[i % c_keys].data(), pub, &l, 0, recids[i % c_keys]); }) << " /s" << endl;
+
+		std::vector<unsigned char const*> msgPtrs;
+		std::vector<unsigned char const*> sigPtrs;
+		std::vector<std::array<byte, 65>> pubs(c_keys);
+		std::vector<unsigned char*> pubPtrs;
+		std::vector<int> pubLens(c_keys, 65);
+		std::vector<int> results(c_keys);
+		for (unsigned i = 0; i < c_keys; ++i)
+		{
+			msgPtrs.push_back(msgs[i].data());
+			sigPtrs.push_back(compacts[i].data());
+			pubPtrs.push_back(pubs[i].data());
+		}
+		double batches = perSecond(ms, [&](eth::uint){ secp256k1_ecdsa_recover_compact_batch(c_keys, msgPtrs.data(), sigPtrs.data(), pubPtrs.data(), pubLens.data(), 0, recids.data(), results.data()); });
+		cout << "  batch recover: " << batches * c_keys << " /s" << endl;
+	}
+	secp256k1_stop();
+	return ret;
+}
@@ -0,0 +1,181 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file trie.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * Trie and RLP benchmark: insert, lookup, root and remove throughput of each trie implementation for random 20- and
+ * 32-byte keys, from 1,000 entries up by powers of ten; then RLP encoding and decoding of transactions and blocks.
+ * Usage: benchtrie [most entries, default 1000000] [milliseconds per RLP measurement]
+ */
+
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <boost/filesystem.hpp>
+#include "RLP.h"
+#include "MemTrie.h"
+#include "TrieDB.h"
+#include "TrieHash.h"
+#include "State.h"
+#include "Transaction.h"
+using namespace std;
+using namespace std::chrono;
+using namespace eth;
+namespace fs = boost::filesystem;
+
+/// Somewhere for results to go, so they can't be optimised away.
+static size_t s_sink = 0;
+
+template <class _F> double perSecond(unsigned _ms, _F const& _f)
+{
+	eth::uint n = 0;
+	auto s = steady_clock::now();
+	for (; steady_clock::now() - s < milliseconds(_ms); n += 16)
+		for (unsigned i = 0; i < 16; ++i)
+			_f(n + i);
+	return n * 1000.0 / duration_cast<milliseconds>(steady_clock::now() - s).count();
+}
+
+/// @returns the seconds taken by @a _f.
+template <class _F> double timed(_F const& _f)
+{
+	auto s = steady_clock::now();
+	_f();
+	return duration_cast<microseconds>(steady_clock::now() - s).count() / 1000000.0;
+}
+
+/// Print throughputs of @a _n operations, each taking the given time; the root's time is in microseconds as it's done
+/// only once. Negative times are for things that don't apply.
+static void report(string const& _name, size_t _n, double _insert, double _lookup, double _root, double _remove)
+{
+	auto rate = [&](double _s) { if (_s < 0) cout << setw(12) << "-"; else cout << setw(12) << (unsigned)(_n / max(_s, 1e-6)); };
+	cout << left << setw(28) << _name << right;
+	rate(_insert);
+	rate(_lookup);
+	if (_root < 0)
+		cout << setw(12) << "-";
+	else
+		cout << setw(12) << (unsigned)(_root * 1000000);
+	rate(_remove);
+	cout << endl;
+}
+
+/// Insert, look up, take the root of and remove @a _keys (each with a value from @a _values) in a GenericTrieDB over
+/// @a _db; the root's time includes @a _commit.
+template <class DB, class _Commit> void benchTrieDB(string const& _name, DB& _db, vector<string> const& _keys, vector<string> const& _values, _Commit const& _commit)
+{
+	GenericTrieDB<DB> t(&_db);
+	t.init();
+	double insert = timed([&](){ for (size_t i = 0; i < _keys.size(); ++i) t.insert(_keys[i], _values[i]); });
+	double root = timed([&](){ s_sink += t.root()[0]; _commit(); });
+	double lookup = timed([&](){ for (auto const& k: _keys) s_sink += t.at(k).size(); });
+	double remove = timed([&](){ for (auto const& k: _keys) t.remove(k); });
+	report(_name, _keys.size(), insert, lookup, root, remove);
+}
+
+int main(int argc, char** argv)
+{
+	size_t most = argc > 1 ? atol(argv[1]) : 1000000;
+	unsigned ms = argc > 2 ? atoi(argv[2]) : 1000;
+
+	mt19937_64 rng(42);
+	fs::path dir = fs::temp_directory_path() / fs::unique_path("benchtrie-%%%%-%%%%");
+
+	cout << left << setw(28) << "Trie (entries)" << right << setw(12) << "insert/s" << setw(12) << "lookup/s" << setw(12) << "root us" << setw(12) << "remove/s" << endl;
+	for (size_t n = 1000; n <= most; n *= 10)
+		for (unsigned keyLength: { 20, 32 })
+		{
+			vector<string> keys(n, string(keyLength, '\0'));
+			vector<string> values(n, string(32, '\0'));
+			for (auto* v: { &keys, &values })
+				for (auto& s: *v)
+					for (auto& c: s)
+						c = (char)rng();
+			string suffix = " " + toString(keyLength) + "B (" + toString(n) + ")";
+
+			for (bool pooled: { true, false })
+			{
+				MemTrie t(pooled);
+				double insert = timed([&](){ for (size_t i = 0; i < n; ++i) t.insert(keys[i], values[i]); });
+				double root = timed([&](){ s_sink += t.hash256()[0]; });
+				double lookup = timed([&](){ for (auto const& k: keys) s_sink += t.at(k).size(); });
+				double remove = timed([&](){ for (auto const& k: keys) t.remove(k); });
+				report((pooled ? "MemTrie" : "MemTrie heap") + suffix, n, insert, lookup, root, remove);
+			}
+			{
+				StringMap m;
+				double insert = timed([&](){ for (size_t i = 0; i < n; ++i) m[keys[i]] = values[i]; });
+				double root = timed([&](){ s_sink += hash256(m)[0]; });
+				report("hash256" + suffix, n, insert, -1, root, -1);
+			}
+			{
+				BasicMap m;
+				benchTrieDB("TrieDB<BasicMap>" + suffix, m, keys, values, [](){});
+			}
+			{
+				Overlay db = State::openDB(dir.string(), true);
+				benchTrieDB("TrieDB<Overlay>" + suffix, db, keys, values, [&](){ db.commit(); });
+			}
+		}
+	fs::remove_all(dir);
+
+	// A typical transaction, and a block of a hundred of them.
+	Transaction t;
+	t.nonce = 42;
+	t.value = (u256)1 << 70;
+	t.fee = 10000;
+	t.receiveAddress = toAddress(sha3("to"));
+	t.data = { 1, 2, (u256)sha3("data") };
+	t.sign(sha3("from"));
+	bytes tx = t.rlp();
+	static const unsigned c_blockTransactions = 100;
+	auto encodeBlock = [&]()
+	{
+		RLPStream s(3);
+		s.appendList(9) << h256() << sha3("uncles") << t.receiveAddress << sha3("state") << sha3("transactions") << ((u256)1 << 22) << (u256)1400000000 << bytes() << sha3("nonce");
+		s.appendList(c_blockTransactions);
+		for (unsigned i = 0; i < c_blockTransactions; ++i)
+			s.appendRaw(tx);
+		s.appendList(0);
+		return s.out();
+	};
+	bytes block = encodeBlock();
+	u256 sink = 0;
+	auto decodeTransaction = [&](RLP const& _r)
+	{
+		sink += _r[0].toInt<u256>() + _r[2].toInt<u256>() + _r[3].toInt<u256>() + (u160)_r[1].toHash<Address>();
+		for (auto const& d: _r[4])
+			sink += d.toInt<u256>();
+		sink += _r[5].toInt<byte>() + _r[6].toInt<u256>() + _r[7].toInt<u256>();
+	};
+
+	auto report = [&](char const* _name, double _rate) { cout << _name << _rate << " /s" << endl; };
+	cout << endl;
+	report("RLP encode transaction: ", perSecond(ms, [&](eth::uint){ sink += t.rlp().size(); }));
+	report("RLP decode transaction: ", perSecond(ms, [&](eth::uint){ decodeTransaction(RLP(tx)); }));
+	report("RLP encode block:       ", perSecond(ms, [&](eth::uint){ sink += encodeBlock().size(); }));
+	report("RLP decode block:       ", perSecond(ms, [&](eth::uint)
+	{
+		RLP b(block);
+		for (auto const& i: b[0])
+			sink += i.isInt() ? i.toInt<u256>() : 0;
+		for (auto const& i: b[1])
+			decodeTransaction(i);
+	}));
+
+	return sink == 42 || s_sink == 42;
+}
@@ -0,0 +1,76 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file vm.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * VM arithmetic benchmark: throughput of the arithmetic and elliptic curve opcodes, with small and worst-case operands.
+ * Usage: benchvm [milliseconds per measurement]
+ */
+
+#include <chrono>
+#include <secp256k1.h>
+#include "Common.h"
+using namespace std;
+using namespace std::chrono;
+using namespace eth;
+
+template <class _F> double perSecond(unsigned _ms, _F const& _f)
+{
+	eth::uint n = 0;
+	auto s = steady_clock::now();
+	for (; steady_clock::now() - s < milliseconds(_ms); n += 64)
+		for (unsigned i = 0; i < 64; ++i)
+			_f(n + i);
+	return n * 1000.0 / duration_cast<milliseconds>(steady_clock::now() - s).count();
+}
+
+int main(int argc, char** argv)
+{
+	unsigned ms = argc > 1 ? atoi(argv[1]) : 1000;
+
+	u256 big = (u256)sha3("big");
+	u256 max = ~(u256)0;
+	u256 sink = 0;
+	auto report = [&](char const* _name, double _rate) { cout << _name << _rate << " /s" << endl; };
+
+	report("ADD:                 ", perSecond(ms, [&](eth::uint i){ sink += big + i; }));
+	report("MUL:                 ", perSecond(ms, [&](eth::uint i){ sink += big * (big + i); }));
+	report("DIV:                 ", perSecond(ms, [&](eth::uint i){ sink += big / (i + 3); }));
+	report("MOD:                 ", perSecond(ms, [&](eth::uint i){ sink += big % (big >> 7 | i); }));
+	report("EXP (small):         ", perSecond(ms, [&](eth::uint i){ sink += exp256(i, 5); }));
+	report("EXP (2 ^ x):         ", perSecond(ms, [&](eth::uint i){ sink += exp256(2, i & 255); }));
+	report("EXP (worst case):    ", perSecond(ms, [&](eth::uint i){ sink += exp256(big + i, max); }));
+	report("modExp (worst case): ", perSecond(ms, [&](eth::uint i){ sink += modExp(big + i, max, big | 1); }));
+
+	// The point arithmetic as ECMUL, ECADD and ECVALID do it, on a public key and a 256-bit scalar.
+	secp256k1_start();
+	byte pub[65];
+	int l = 65;
+	secp256k1_ecdsa_pubkey_create(pub, &l, sha3("secret").data(), 0);
+	uint64_t x[4], y[4], n[4], rx[4], ry[4];
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		x[i] = (uint64_t)((u256)h256(pub + 1) >> (64 * i));
+		y[i] = (uint64_t)((u256)h256(pub + 33) >> (64 * i));
+		n[i] = (uint64_t)(big >> (64 * i));
+	}
+	report("ECMUL:               ", perSecond(ms / 10, [&](eth::uint i){ n[0] = i; secp256k1_ec_point_mul(rx, ry, x, y, n); sink += rx[0]; }));
+	report("ECADD:               ", perSecond(ms, [&](eth::uint){ secp256k1_ec_point_add(rx, ry, x, y, x, y); sink += rx[0]; }));
+	report("ECVALID:             ", perSecond(ms, [&](eth::uint){ sink += secp256k1_ec_point_valid(x, y); }));
+
+	return sink == 42;
+}
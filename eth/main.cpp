@@ -25,6 +25,8 @@
 #include "PeerNetwork.h"
 #include "BlockChain.h"
 #include "State.h"
+#include "VMProfiler.h"
+#include "Metrics.h"
 using namespace std;
 using namespace eth;
 
@@ -48,6 +50,64 @@ void writeFile(std::string const& _file, bytes const& _data)
 	ofstream(_file, ios::trunc).write((char const*)_data.data(), _data.size());
 }
 
+/// Seconds a metrics request may take, from being accepted to the answer being written, before it's dropped.
+static const unsigned c_metricsTimeout = 5;
+
+/// Answer the request on @a _s with our metrics, unless it takes too long.
+static void answerMetrics(ba::io_service& _io, shared_ptr<bi::tcp::socket> const& _s)
+{
+	// One that doesn't send its request (or read our answer) in time is cut off, so can't hold up the rest.
+	auto timer = make_shared<ba::deadline_timer>(_io, boost::posix_time::seconds(c_metricsTimeout));
+	timer->async_wait([=](boost::system::error_code const& _ec) { if (!_ec) { boost::system::error_code ec; _s->close(ec); } });
+	// Whatever's asked for, the answer's the same; just take the request off the wire.
+	auto request = make_shared<array<char, 1024>>();
+	_s->async_read_some(ba::buffer(*request), [=](boost::system::error_code const& _ec, size_t)
+	{
+		if (_ec)
+			return;
+		string body = Metrics::text();
+		auto response = make_shared<string>("HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + toString(body.size()) + "\r\n\r\n" + body);
+		// The response is held by the handler till it's been written.
+		ba::async_write(*_s, ba::buffer(*response), [_s, timer, response](boost::system::error_code const&, size_t)
+		{
+			timer->cancel();
+			boost::system::error_code ec;
+			_s->close(ec);
+		});
+	});
+}
+
+/// Accept the next connection to @a _acceptor, and so on for as long as we run.
+static void answerMetrics(shared_ptr<ba::io_service> const& _io, shared_ptr<bi::tcp::acceptor> const& _acceptor)
+{
+	auto s = make_shared<bi::tcp::socket>(*_io);
+	_acceptor->async_accept(*s, [=](boost::system::error_code const& _ec)
+	{
+		if (!_ec)
+			answerMetrics(*_io, s);
+		answerMetrics(_io, _acceptor);
+	});
+}
+
+/// Answer each connection to @a _address:@a _port with our metrics, over HTTP, for as long as we run, on a thread of
+/// its own. Requests are handled asynchronously, each with a time limit. @returns false if it can't be listened on.
+bool serveMetrics(std::string const& _address, unsigned short _port)
+{
+	auto io = make_shared<ba::io_service>();
+	shared_ptr<bi::tcp::acceptor> acceptor;
+	try
+	{
+		acceptor = make_shared<bi::tcp::acceptor>(*io, bi::tcp::endpoint(bi::address::from_string(_address), _port));
+	}
+	catch (...)
+	{
+		return false;
+	}
+	answerMetrics(io, acceptor);
+	thread([=]() { io->run(); }).detach();
+	return true;
+}
+
 bool isTrue(std::string const& _m)
 {
 	return _m == "on" || _m == "yes" || _m == "true" || _m == "1";
@@ -71,6 +131,12 @@ int main(int argc, char** argv)
 	unsigned peers = 5;
 	string publicIP;
 	bool upnp = true;
+	string profileFile;
+	string exportFile;
+	string importFile;
+	bool trustImport = false;
+	unsigned short metricsPort = 0;
+	string metricsAddress = "127.0.0.1";
 
 	// Our address.
 	KeyPair us = KeyPair::create();
@@ -139,9 +205,51 @@ int main(int argc, char** argv)
 			}
 		}
 		else if ((arg == "-v" || arg == "--verbosity") && i + 1 < argc)
+		{
 			verbosity = atoi(argv[++i]);
+			g_logVerbosity = verbosity;
+		}
 		else if ((arg == "-x" || arg == "--peers") && i + 1 < argc)
 			peers = atoi(argv[++i]);
+		else if ((arg == "-t" || arg == "--db-tuning") && i + 1 < argc)
+		{
+			// <blocks|details|state>:<cache MB>,<bloom bits per key>,<write buffer MB>,<compress>
+			string t = argv[++i];
+			auto colon = t.find(':');
+			string name = t.substr(0, colon);
+			Database db = name == "blocks" ? Database::Blocks : name == "details" ? Database::Details : Database::State;
+			DBTuning tuning;
+			char compress[8] = "";
+			if (colon == string::npos || (name != "blocks" && name != "details" && name != "state") ||
+				sscanf(t.c_str() + colon + 1, "%zu,%d,%zu,%7s", &tuning.cacheSize, &tuning.bloomBits, &tuning.writeBuffer, compress) != 4)
+			{
+				cerr << "Bad DB tuning: " << t << endl;
+				return -1;
+			}
+			tuning.cacheSize <<= 20;
+			tuning.writeBuffer <<= 20;
+			tuning.compress = isTrue(compress);
+			Defaults::setDBTuning(db, tuning);
+		}
+		else if (arg == "--export-chain" && i + 1 < argc)
+			exportFile = argv[++i];
+		else if (arg == "--import-chain" && i + 1 < argc)
+			importFile = argv[++i];
+		else if (arg == "--trust-import")
+			trustImport = true;
+		else if (arg == "--metrics-port" && i + 1 < argc)
+			metricsPort = atoi(argv[++i]);
+		else if (arg == "--metrics-address" && i + 1 < argc)
+			metricsAddress = argv[++i];
+		else if (arg == "--memory-budget" && i + 1 < argc)
+			Defaults::setMemoryBudget((size_t)atoi(argv[++i]) << 20);
+		else if ((arg == "-b" || arg == "--flat-blocks") && i + 1 < argc)
+			Defaults::setFlatBlocks(isTrue(argv[++i]));
+		else if ((arg == "-f" || arg == "--profile") && i + 1 < argc)
+		{
+			profileFile = argv[++i];
+			VMProfiler::setEnabled(true);
+		}
 		else if ((arg == "-o" || arg == "--mode") && i + 1 < argc)
 		{
 			string m = argv[++i];
@@ -159,7 +267,24 @@ int main(int argc, char** argv)
 			remoteHost = argv[i];
 	}
 
+	if (metricsPort && !serveMetrics(metricsAddress, metricsPort))
+	{
+		cerr << "Can't serve metrics on " << metricsAddress << ":" << metricsPort << endl;
+		return -1;
+	}
+
 	Client c("Ethereum(++)/v0.1", coinbase, dbPath);
+	if (importFile.size())
+	{
+		ifstream in(importFile, ios::binary);
+		cout << "Imported " << c.importChain(in, trustImport) << " blocks from " << importFile << endl;
+	}
+	if (exportFile.size())
+	{
+		ofstream out(exportFile, ios::binary | ios::trunc);
+		cout << "Exported " << c.exportChain(out) << " blocks to " << exportFile << endl;
+		return 0;
+	}
 	if (interactive)
 	{
 		cout << "Ethereum (++)" << endl;
@@ -196,6 +321,11 @@ int main(int argc, char** argv)
 			{
 				c.stopMining();
 			}
+			else if (cmd == "minestat")
+			{
+				MineProgress p = c.miningProgress();
+				cout << p.rate() << " H/s (" << p.hashes << " hashes in " << p.ms << " ms; best 2^" << p.best << ", requires 2^" << p.requirement << ")" << endl;
+			}
 			else if (cmd == "transact")
 			{
 				string sechex;
@@ -216,18 +346,56 @@ int main(int argc, char** argv)
 				Address dest = h160(fromUserHex(rechex));
 				c.transact(us.secret(), dest, amount, fee);
 			}
+			else if (cmd == "dbstats")
+			{
+				cout << c.dbStats();
+			}
+			else if (cmd == "metrics")
+			{
+				cout << Metrics::text();
+			}
+			else if (cmd == "memory")
+			{
+				auto u = c.memoryUsage();
+				cout << "blocks: " << (u.blocks >> 10) << " KB, details: " << (u.details >> 10) << " KB, state nodes: " << (u.nodes >> 10) << " KB, state: " << (u.state >> 10) << " KB, transactions: " << (u.transactions >> 10) << " KB, network: " << (u.network >> 10) << " KB, mining: " << (u.mining >> 10) << " KB; total " << (u.total() >> 10) << " KB" << endl;
+			}
+			else if (cmd == "profilestart")
+			{
+				VMProfiler::setEnabled(true);
+			}
+			else if (cmd == "profilestop")
+			{
+				VMProfiler::setEnabled(false);
+			}
+			else if (cmd == "profilereset")
+			{
+				VMProfiler::reset();
+			}
+			else if (cmd == "profiledump")
+			{
+				string file;
+				cin >> file;
+				ofstream out(file, ios::trunc);
+				VMProfiler::streamCSV(out);
+			}
 		}
 	}
 	else
 	{
 		c.startNetwork(listenPort, remoteHost, remotePort, verbosity, mode, peers, publicIP, upnp);
 		eth::uint n = c.blockChain().details().number;
-		while (true)
+		for (unsigned i = 1;; ++i)
 		{
 			if (c.blockChain().details().number - n >= mining)
 				c.stopMining();
 			else
 				c.startMining();
+			// Rewrite the profile every ten seconds, so it's there to look at whenever we're stopped.
+			if (profileFile.size() && i % 100 == 0)
+			{
+				ofstream out(profileFile, ios::trunc);
+				VMProfiler::streamCSV(out);
+			}
 			usleep(100000);
 		}
 	}
@@ -19,7 +19,68 @@
  * @date 2014
  */
 
+#include <algorithm>
 #include "AddressState.h"
 using namespace std;
 using namespace eth;
 
+
+u256& MemoryMap::insert(u256 const& _k)
+{
+	++m_size;
+	auto const& b = _k.backend();
+	if (b.size() == 1 && *b.limbs() < c_denseLimit)
+	{
+		size_t i = (size_t)*b.limbs();
+		if (i >= m_dense.size())
+		{
+			size_t n = min<size_t>(max<size_t>(i + 1, m_dense.size() * 2), c_denseLimit);
+			m_dense.resize(n);
+			m_denseUsed.resize(n);
+		}
+		m_denseUsed[i] = 1;
+		return m_dense[i] = 0;
+	}
+
+	if ((m_sparse + 1) * 2 > m_slots.size())
+		rehash(max<size_t>(16, m_slots.size() * 2));
+	++m_sparse;
+	size_t mask = m_slots.size() - 1;
+	size_t i = hash(_k) & mask;
+	while (m_slots[i].used)
+		i = (i + 1) & mask;
+	m_slots[i].used = true;
+	m_slots[i].key = _k;
+	return m_slots[i].value = 0;
+}
+
+void MemoryMap::rehash(size_t _slots)
+{
+	vector<Slot> old(_slots);
+	old.swap(m_slots);
+	size_t mask = _slots - 1;
+	for (auto& s: old)
+		if (s.used)
+		{
+			size_t i = hash(s.key) & mask;
+			while (m_slots[i].used)
+				i = (i + 1) & mask;
+			m_slots[i] = move(s);
+		}
+}
+
+vector<pair<u256, u256>> MemoryMap::ordered() const
+{
+	vector<pair<u256, u256>> ret;
+	ret.reserve(m_size);
+	for (size_t i = 0; i < m_dense.size(); ++i)
+		if (m_denseUsed[i])
+			ret.push_back(make_pair(u256(i), m_dense[i]));
+	// The dense positions come first, being the lowest, and are in order already.
+	size_t dense = ret.size();
+	for (auto const& s: m_slots)
+		if (s.used)
+			ret.push_back(make_pair(s.key, s.value));
+	sort(ret.begin() + dense, ret.end(), [](pair<u256, u256> const& _a, pair<u256, u256> const& _b) { return _a.first < _b.first; });
+	return ret;
+}
@@ -27,6 +27,75 @@
 namespace eth
 {
 
+/**
+ * @brief Contract memory positions and their values, as the VM reads and writes them at every step. Positions below
+ * c_denseLimit, where the code lives, are kept in an array indexed by position; the rest in an open-addressed hash
+ * table keyed by the position's limbs. Neither part is ordered; ordered() sorts the lot for writing to the trie.
+ */
+class MemoryMap
+{
+public:
+	/// @returns the value at position @a _k, or nullptr if it's not in the map.
+	u256 const* find(u256 const& _k) const
+	{
+		auto const& b = _k.backend();
+		if (b.size() == 1 && *b.limbs() < c_denseLimit)
+			return *b.limbs() < m_denseUsed.size() && m_denseUsed[(size_t)*b.limbs()] ? &m_dense[(size_t)*b.limbs()] : nullptr;
+		if (m_slots.empty())
+			return nullptr;
+		size_t mask = m_slots.size() - 1;
+		for (size_t i = hash(_k) & mask;; i = (i + 1) & mask)
+			if (!m_slots[i].used)
+				return nullptr;
+			else if (m_slots[i].key == _k)
+				return &m_slots[i].value;
+	}
+	u256* find(u256 const& _k) { return const_cast<u256*>(const_cast<MemoryMap const*>(this)->find(_k)); }
+	bool count(u256 const& _k) const { return !!find(_k); }
+
+	/// @returns the value at position @a _k, inserting a zero first if it's not in the map.
+	u256& operator[](u256 const& _k) { if (auto v = find(_k)) return *v; return insert(_k); }
+
+	bool empty() const { return !m_size; }
+	size_t size() const { return m_size; }
+	void clear() { m_dense.clear(); m_denseUsed.clear(); m_slots.clear(); m_sparse = 0; m_size = 0; }
+	/// @returns the number of bytes allocated to hold the map.
+	size_t bytes() const { return m_dense.capacity() * sizeof(u256) + m_denseUsed.capacity() + m_slots.capacity() * sizeof(Slot); }
+
+	/// @returns all positions and their values, in order of position.
+	std::vector<std::pair<u256, u256>> ordered() const;
+
+private:
+	static const unsigned c_denseLimit = 1024;
+
+	struct Slot
+	{
+		u256 key;
+		u256 value;
+		bool used = false;
+	};
+
+	static size_t hash(u256 const& _k)
+	{
+		auto const& b = _k.backend();
+		uint64_t h = 0;
+		for (unsigned i = 0; i < b.size(); ++i)
+			h = (h ^ b.limbs()[i]) * 0x9e3779b97f4a7c15ull;
+		return (size_t)(h ^ (h >> 29));
+	}
+
+	/// Add position @a _k, which isn't yet in the map, with a zero value.
+	u256& insert(u256 const& _k);
+	/// Resize the hash table to @a _slots slots (a power of two), rehashing what's in it.
+	void rehash(size_t _slots);
+
+	std::vector<u256> m_dense;
+	std::vector<uint8_t> m_denseUsed;	///< Whether each position of m_dense is in the map.
+	std::vector<Slot> m_slots;			///< Linearly probed; never more than half full.
+	size_t m_sparse = 0;				///< The number of used slots.
+	size_t m_size = 0;
+};
+
 enum class AddressType
 {
 	Dead,
@@ -50,18 +119,18 @@ public:
 	u256 const& balance() const { return m_balance; }
 	u256& nonce() { return m_nonce; }
 	u256 const& nonce() const { return m_nonce; }
-	bool haveMemory() const { return m_memory.empty() && m_contractRoot != h256(); }	// TODO: best to switch to m_haveMemory flag rather than try to infer.
-	h256 oldRoot() const { assert(!haveMemory()); return m_contractRoot; }
-	std::map<u256, u256>& takeMemory() { assert(m_type == AddressType::Contract && haveMemory()); m_contractRoot = h256(); return m_memory; }
-	std::map<u256, u256> const& memory() const { assert(m_type == AddressType::Contract && haveMemory()); return m_memory; }
+	/// The root of the contract's memory trie as of the last commit. Changes since then are in memory().
+	h256 oldRoot() const { assert(m_type == AddressType::Contract); return m_contractRoot; }
+	/// The memory positions written since the last commit, with their new values (zero for a cleared position).
+	MemoryMap& memory() { assert(m_type == AddressType::Contract); return m_memory; }
+	MemoryMap const& memory() const { assert(m_type == AddressType::Contract); return m_memory; }
 
 private:
 	AddressType m_type;
 	u256 m_balance;
 	u256 m_nonce;
 	h256 m_contractRoot;
-	// TODO: change to unordered_map.
-	std::map<u256, u256> m_memory;
+	MemoryMap m_memory;
 };
 
 }
@@ -19,18 +19,69 @@
  * @date 2014
  */
 
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <boost/filesystem.hpp>
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+#include <leveldb/write_batch.h>
 #include "Common.h"
 #include "RLP.h"
 #include "Exceptions.h"
 #include "Dagger.h"
 #include "BlockInfo.h"
+#include "BlockStore.h"
+#include "Metrics.h"
 #include "State.h"
 #include "BlockChain.h"
 using namespace std;
 using namespace eth;
 
 std::string Defaults::s_dbPath = string(getenv("HOME")) + "/.ethereum";
+bool Defaults::s_syncWrites = false;
+eth::uint Defaults::s_recentStates = 127;
+eth::uint Defaults::s_restoreInterval = 60 * 24 * 7;
+eth::uint Defaults::s_restorePoints = 4;
+eth::uint Defaults::s_playbackThreads = 0;
+bool Defaults::s_flatBlocks = false;
+size_t Defaults::s_memoryBudget = 0;
+DBTuning Defaults::s_dbTuning[3] =
+{
+	{ 8 << 20, 10, 4 << 20, true },		// Blocks: we cache blocks ourselves; the filters save disk reads on the misses of import.
+	{ 8 << 20, 10, 4 << 20, true },		// Details
+	{ 64 << 20, 10, 16 << 20, false }	// State: hashes don't compress.
+};
+
+size_t Defaults::memoryLimit(Cache _c, size_t _default)
+{
+	// Percentages of the budget, in the order of Cache. The state's nodes are the most often reread.
+	static const unsigned c_shares[] = { 25, 10, 35, 5, 15, 10 };
+	return s_memoryBudget ? s_memoryBudget / 100 * c_shares[(int)_c] : _default;
+}
+
+ldb::Options eth::dbOptions(Database _db)
+{
+	DBTuning const& t = Defaults::dbTuning(_db);
+	ldb::Options o;
+	o.create_if_missing = true;
+	o.write_buffer_size = t.writeBuffer;
+	o.compression = t.compress ? ldb::kSnappyCompression : ldb::kNoCompression;
+	// Like the databases themselves, these are never freed.
+	if (t.cacheSize)
+		o.block_cache = ldb::NewLRUCache(t.cacheSize);
+	if (t.bloomBits)
+		o.filter_policy = ldb::NewBloomFilterPolicy(t.bloomBits);
+	return o;
+}
+
+/// Key in the details DB of the number index's entry for block number @a _n: "n" and the number, big-endian.
+static std::string numberKey(eth::uint _n)
+{
+	std::string num(4, '\0');
+	toBigEndian(_n, num);
+	return "n" + num;
+}
 
 namespace eth
 {
@@ -39,7 +90,7 @@ std::ostream& operator<<(std::ostream& _out, BlockChain const& _bc)
 	string cmp = toBigEndianString(_bc.m_lastBlockHash);
 	auto it = _bc.m_detailsDB->NewIterator(_bc.m_readOptions);
 	for (it->SeekToFirst(); it->Valid(); it->Next())
-		if (it->key().ToString() != "best")
+		if (it->key().size() == 32)
 		{
 			BlockDetails d(RLP(it->value().ToString()));
 			_out << asHex(it->key().ToString()) << ":   " << d.number << " @ " << d.parent << (cmp == it->key().ToString() ? "  BEST" : "") << std::endl;
@@ -71,12 +122,17 @@ BlockChain::BlockChain(std::string _path, bool _killExisting)
 	{
 		boost::filesystem::remove_all(_path + "/blocks");
 		boost::filesystem::remove_all(_path + "/details");
+		boost::filesystem::remove_all(_path + "/segments");
 	}
 
-	ldb::Options o;
-	o.create_if_missing = true;
-	auto s = ldb::DB::Open(o, _path + "/blocks", &m_db);
-	s = ldb::DB::Open(o, _path + "/details", &m_detailsDB);
+	m_writeOptions.sync = Defaults::s_syncWrites;
+	m_cacheLimit = Defaults::memoryLimit(Cache::Blocks, c_defaultCacheLimit);
+	m_detailsLimit = Defaults::memoryLimit(Cache::Details, c_defaultDetailsLimit);
+
+	auto s = ldb::DB::Open(dbOptions(Database::Blocks), _path + "/blocks", &m_db);
+	s = ldb::DB::Open(dbOptions(Database::Details), _path + "/details", &m_detailsDB);
+	if (Defaults::s_flatBlocks)
+		m_store.reset(new BlockStore(_path + "/segments", m_db));
 
 	// Initialise with the genesis as the last block on the longest chain.
 	m_genesisHash = BlockInfo::genesis().hash;
@@ -90,20 +146,50 @@ BlockChain::BlockChain(std::string _path, bool _killExisting)
 		m_detailsDB->Put(m_writeOptions, ldb::Slice((char const*)&m_genesisHash, 32), (ldb::Slice)eth::ref(r));
 	}
 
-	checkConsistency();
-
-	// TODO: Implement ability to rebuild details map from DB.
 	std::string l;
 	m_detailsDB->Get(m_readOptions, ldb::Slice("best"), &l);
 	m_lastBlockHash = l.empty() ? m_genesisHash : *(h256*)l.data();
 
-	cout << "Opened blockchain db. Latest: " << m_lastBlockHash << endl;
+	// The number index is written along with "best", so if it leads to our best block the DB is as we left it.
+	// Otherwise it predates the index: audit it and build the index from scratch.
+	if (numberHash(details().number) != m_lastBlockHash)
+	{
+		verifyAll();
+		ldb::WriteBatch batch;
+		noteCanonical(m_lastBlockHash, 0, batch);
+		m_detailsDB->Write(m_writeOptions, &batch);
+	}
+
+	clogv(ChainChannel, 1) << "Opened blockchain db. Latest:" << m_lastBlockHash;
 }
 
 BlockChain::~BlockChain()
 {
 }
 
+/// Rough bytes taken by each entry of the hash tables, beyond their keys and values: node, links and bucket.
+static const size_t c_entryOverhead = 48;
+
+size_t BlockChain::detailsSize() const
+{
+	// A block typically has the one child; that's all the details hold outside the entry itself.
+	return m_details.size() * (sizeof(h256) + sizeof(BlockDetails) + sizeof(h256) + c_entryOverhead)
+		+ m_numberHashes.size() * (sizeof(eth::uint) + sizeof(h256) + c_entryOverhead)
+		+ m_infos.size() * (sizeof(h256) + sizeof(CachedInfo) + c_entryOverhead)
+		+ m_infoHeaders.size() * (2 * sizeof(h256) + c_entryOverhead);
+}
+
+void BlockChain::process()
+{
+	if (detailsSize() <= m_detailsLimit)
+		return;
+	clogv(ChainChannel, 3) << "Dropping" << m_details.size() << "details and" << m_numberHashes.size() << "number index entries.";
+	m_details.clear();
+	m_numberHashes.clear();
+	m_infos.clear();
+	m_infoHeaders.clear();
+}
+
 template <class T, class V>
 bool contains(T const& _t, V const& _v)
 {
@@ -119,7 +205,189 @@ void BlockChain::import(bytes const& _block, Overlay const& _db)
 	BlockInfo bi(&_block);
 	bi.verifyInternals(&_block);
 
-	auto newHash = eth::sha3(_block);
+	ldb::WriteBatch batch;
+	import(_block, bi, _db, batch);
+	m_detailsDB->Write(m_writeOptions, &batch);
+}
+
+/// Blocks kept by importBatch to await their parents; beyond it the oldest are dropped.
+static const size_t c_maxPendingBlocks = 1024;
+
+unsigned BlockChain::importBatch(std::vector<bytes>& io_blocks, Overlay const& _db, bool _checkNonce)
+{
+	// VERIFY: the headers (proof of work being the lion's share) and internal coherence of each, in parallel.
+	std::vector<BlockInfo> infos(io_blocks.size());
+	std::vector<char> valid(io_blocks.size(), 0);
+	{
+		atomic<size_t> next(0);
+		auto verify = [&]()
+		{
+			for (size_t i; (i = next++) < io_blocks.size();)
+				try
+				{
+					infos[i].populate(&io_blocks[i], sha3(io_blocks[i]), _checkNonce);
+					infos[i].verifyInternals(&io_blocks[i]);
+					valid[i] = 1;
+				}
+				catch (...) {}
+		};
+		vector<thread> workers;
+		for (size_t t = 1; t < min<size_t>(thread::hardware_concurrency(), io_blocks.size()); ++t)
+			workers.push_back(thread(verify));
+		verify();
+		for (auto& t: workers)
+			t.join();
+	}
+
+	// ORDER: each block after its parent, starting with those whose parents we already have.
+	std::vector<size_t> order;
+	std::unordered_map<h256, std::vector<size_t>> waiting;
+	for (size_t i = 0; i < io_blocks.size(); ++i)
+		if (valid[i])
+		{
+			if (details(infos[i].parentHash))
+				order.push_back(i);
+			else
+				waiting[infos[i].parentHash].push_back(i);
+		}
+
+	// A block rejected takes all those waiting on it, however far down, with it; they could never be imported.
+	auto reject = [&](h256 const& _hash)
+	{
+		for (std::vector<h256> q{_hash}; !q.empty();)
+		{
+			auto it = waiting.find(q.back());
+			q.pop_back();
+			if (it != waiting.end())
+			{
+				for (auto j: it->second)
+					q.push_back(infos[j].hash);
+				waiting.erase(it);
+			}
+		}
+	};
+	for (size_t i = 0; i < io_blocks.size(); ++i)
+		if (!valid[i])
+			reject(infos[i].hash);
+
+	// EXECUTE: in order; the details of all go to the DB in one write.
+	ldb::WriteBatch batch;
+	unsigned ret = 0;
+	for (size_t q = 0; q < order.size(); ++q)
+	{
+		size_t i = order[q];
+		try
+		{
+			import(io_blocks[i], infos[i], _db, batch);
+			++ret;
+		}
+		catch (...)
+		{
+			// Invalid (or already known, in which case none wait on it) - drop it along with its descendants.
+			valid[i] = 0;
+			reject(infos[i].hash);
+			continue;
+		}
+		auto it = waiting.find(infos[i].hash);
+		if (it != waiting.end())
+		{
+			order.insert(order.end(), it->second.begin(), it->second.end());
+			waiting.erase(it);
+		}
+	}
+	m_detailsDB->Write(m_writeOptions, &batch);
+
+	// Keep just those still waiting on their parent, and of them no more than the latest c_maxPendingBlocks.
+	std::vector<size_t> pending;
+	for (auto const& i: waiting)
+		pending.insert(pending.end(), i.second.begin(), i.second.end());
+	sort(pending.begin(), pending.end());
+	if (pending.size() > c_maxPendingBlocks)
+		pending.erase(pending.begin(), pending.end() - c_maxPendingBlocks);
+	std::vector<bytes> left;
+	for (auto j: pending)
+		left.push_back(move(io_blocks[j]));
+	io_blocks.swap(left);
+	return ret;
+}
+
+/// Blocks read from a chain file and imported together.
+static const unsigned c_importChainBatch = 256;
+
+static Counter& s_blocksImported = Metrics::counter("eth_blocks_imported", "Blocks imported into the chain.");
+static Histogram& s_importTime = Metrics::histogram("eth_block_import_microseconds", "Time taken to check, play back and store each block imported.");
+static Gauge& s_chainHeight = Metrics::gauge("eth_chain_height", "Number of the best block.");
+
+unsigned BlockChain::exportChain(std::ostream& _out) const
+{
+	unsigned n = 1;
+	for (h256 h; (h = numberHash(n)); ++n)
+	{
+		auto b = block(h);
+		_out.write((char const*)b.data(), b.size());
+	}
+	return n - 1;
+}
+
+/// Bytes of an item read from a chain file at a time.
+static const size_t c_readListChunk = 1 << 16;
+
+/// Read an RLP list (as a block is) from @a _in into @a o_item.
+/// @returns false if there's nothing more to read; throws if what's there isn't a whole list.
+static bool readList(std::istream& _in, bytes& o_item)
+{
+	int c = _in.get();
+	if (c == EOF)
+		return false;
+	if (c < c_rlpListStart)
+		throw InvalidBlockFormat();
+	o_item.assign(1, (byte)c);
+	size_t lengthBytes = c > c_rlpListIndLenZero ? c - c_rlpListIndLenZero : 0;
+	size_t length = lengthBytes ? 0 : c - c_rlpListStart;
+	for (size_t i = 0; i < lengthBytes; ++i)
+	{
+		if ((c = _in.get()) == EOF)
+			throw InvalidBlockFormat();
+		o_item.push_back((byte)c);
+		length = (length << 8) | (byte)c;
+	}
+	// The length is only what the file claims; grow the item as its bytes actually turn up, so a bad one can't have us
+	// allocate more than the file holds.
+	for (size_t left = length; left;)
+	{
+		size_t n = min(left, c_readListChunk);
+		size_t at = o_item.size();
+		o_item.resize(at + n);
+		if (!_in.read((char*)o_item.data() + at, n))
+			throw InvalidBlockFormat();
+		left -= n;
+	}
+	return true;
+}
+
+unsigned BlockChain::importChain(std::istream& _in, Overlay const& _db, bool _trusted)
+{
+	unsigned ret = 0;
+	std::vector<bytes> blocks;
+	size_t waiting = 0;		///< Blocks left over from the last batch, awaiting their parents.
+	for (bool more = true; more;)
+	{
+		bytes b;
+		if ((more = readList(_in, b)))
+			blocks.push_back(move(b));
+		if (blocks.size() >= waiting + c_importChainBatch || (!more && blocks.size() > waiting))
+		{
+			ret += importBatch(blocks, _db, !_trusted);
+			waiting = blocks.size();
+		}
+	}
+	return ret;
+}
+
+void BlockChain::import(bytes const& _block, BlockInfo const& _bi, Overlay const& _db, ldb::WriteBatch& io_details)
+{
+	auto start = chrono::steady_clock::now();
+	auto newHash = _bi.hash;
 
 	// Check block doesn't already exist first!
 	if (details(newHash))
@@ -128,88 +396,245 @@ void BlockChain::import(bytes const& _block, Overlay const& _db)
 		throw AlreadyHaveBlock();
 	}
 
-	cout << "Attempting import of " << newHash << "..." << endl;
+	clogv(ChainChannel, 5) << "Attempting import of" << newHash;
 
 	// Work out its number as the parent's number + 1
-	auto pd = details(bi.parentHash);
+	auto pd = details(_bi.parentHash);
 	if (!pd)
 	{
-		cout << "   Unknown parent " << bi.parentHash << endl;
+		clogv(ChainChannel, 4) << "Unknown parent" << _bi.parentHash << "of" << newHash;
 		// We don't know the parent (yet) - discard for now. It'll get resent to us if we find out about its ancestry later on.
 		throw UnknownParent();
 	}
 
-	// Check family:
-	BlockInfo biParent(block(bi.parentHash));
-	bi.verifyParent(biParent);
+	// Check family. The parent's proof of work was checked when it was imported.
+	BlockInfo biParent = info(_bi.parentHash);
+	_bi.verifyParent(biParent);
 
 	// Check transactions are valid and that they result in a state equivalent to our state_root.
-	State s(bi.coinbaseAddress, _db);
-	s.sync(*this, bi.parentHash);
+	// A block extending our best plays back on the state we keep there; any other needs a state synced to its parent.
+	std::unique_ptr<State> s;
+	if (m_headState && m_headState->db().db() == _db.db() && m_headState->previousBlock().hash == _bi.parentHash)
+		s = move(m_headState);
+	else
+	{
+		s.reset(new State(_bi.coinbaseAddress, _db));
+		s->sync(*this, _bi.parentHash);
+	}
 
 	// Get total difficulty increase and update state, checking it.
 	BlockInfo biGrandParent;
 	if (pd.number)
-		biGrandParent.populate(block(pd.parent));
-	auto tdIncrease = s.playback(&_block, bi, biParent, biGrandParent, true);
+		biGrandParent = info(pd.parent);
+	auto tdIncrease = s->playback(&_block, _bi, biParent, biGrandParent, true, this);
 	u256 td = pd.totalDifficulty + tdIncrease;
 
-	checkConsistency();
+	checkConsistency(_bi.parentHash);
 
-	// All ok - insert into DB
-	m_details[newHash] = BlockDetails((uint)pd.number + 1, td, bi.parentHash, {});
-	m_detailsDB->Put(m_writeOptions, ldb::Slice((char const*)&newHash, 32), (ldb::Slice)eth::ref(m_details[newHash].rlp()));
+	// All ok - insert into DB.
+	// Block data goes first: should we die before the details are written, the block is merely unknown to us.
+	if (!m_store || !m_store->insert(newHash, &_block, m_writeOptions))
+		m_db->Put(m_writeOptions, ldb::Slice((char const*)&newHash, 32), (ldb::Slice)ref(_block));
 
-	m_details[bi.parentHash].children.push_back(newHash);
-	m_detailsDB->Put(m_writeOptions, ldb::Slice((char const*)&bi.parentHash, 32), (ldb::Slice)eth::ref(m_details[bi.parentHash].rlp()));
+	bool best = td > m_details[m_lastBlockHash].totalDifficulty;
+	m_details[newHash] = BlockDetails((uint)pd.number + 1, td, _bi.parentHash, {});
+	m_details[_bi.parentHash].children.push_back(newHash);
 
-	m_db->Put(m_writeOptions, ldb::Slice((char const*)&newHash, 32), (ldb::Slice)ref(_block));
+	// Details of the block, its parent and (possibly) our best block are batched, to be written together atomically.
+	io_details.Put(ldb::Slice((char const*)&newHash, 32), (ldb::Slice)eth::ref(m_details[newHash].rlp()));
+	io_details.Put(ldb::Slice((char const*)&_bi.parentHash, 32), (ldb::Slice)eth::ref(m_details[_bi.parentHash].rlp()));
+	if (best)
+	{
+		io_details.Put(ldb::Slice("best"), ldb::Slice((char const*)&newHash, 32));
+		noteCanonical(newHash, details(m_lastBlockHash).number, io_details);
+	}
 
-	checkConsistency();
+	checkConsistency(newHash);
+	noteInfo(_bi, pd.number + 1, &_block);
 
-//	cout << "Parent " << bi.parentHash << " has " << details(bi.parentHash).children.size() << " children." << endl;
+//	cout << "Parent " << _bi.parentHash << " has " << details(_bi.parentHash).children.size() << " children." << endl;
 
 	// This might be the new last block...
-	if (td > m_details[m_lastBlockHash].totalDifficulty)
+	if (best)
 	{
 		m_lastBlockHash = newHash;
-		m_detailsDB->Put(m_writeOptions, ldb::Slice("best"), ldb::Slice((char const*)&newHash, 32));
-		cout << "   Imported and best." << endl;
+		clogv(ChainChannel, 3) << "Imported and best:" << newHash;
+		s->prune(*this);
+		m_headState = move(s);
+		s_chainHeight.set(pd.number + 1);
 	}
 	else
 	{
-		cout << "   Imported." << endl;
+		clogv(ChainChannel, 4) << "Imported:" << newHash;
 //		cerr << "*** WARNING: Imported block not newest (otd=" << m_details[m_lastBlockHash].totalDifficulty << ", td=" << td << ")" << endl;
 	}
+	++s_blocksImported;
+	s_importTime.record(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
 }
 
-void BlockChain::checkConsistency()
+std::string BlockChain::dbStats() const
+{
+	std::string b;
+	std::string d;
+	m_db->GetProperty("leveldb.stats", &b);
+	m_detailsDB->GetProperty("leveldb.stats", &d);
+	return "blocks:\n" + b + "details:\n" + d;
+}
+
+void BlockChain::verifyAll()
 {
 	m_details.clear();
 	ldb::Iterator* it = m_detailsDB->NewIterator(m_readOptions);
 	for (it->SeekToFirst(); it->Valid(); it->Next())
 		if (it->key().size() == 32)
-		{
-			h256 h((byte const*)it->key().data());
-			auto dh = details(h);
-			auto p = dh.parent;
-			if (p != h256())
-			{
-				auto dp = details(p);
-				assert(contains(dp.children, h));
-				assert(dp.number == dh.number - 1);
-			}
-		}
+			checkConsistency(h256((byte const*)it->key().data()));
 	delete it;
 }
 
-bytesConstRef BlockChain::block(h256 _hash) const
+void BlockChain::checkConsistency(h256 _h) const
+{
+	auto const& dh = details(_h);
+	assert(dh);
+	auto p = dh.parent;
+	if (p != h256())
+	{
+		auto const& dp = details(p);
+		assert(contains(dp.children, _h));
+		assert(dp.number == dh.number - 1);
+	}
+}
+
+void BlockChain::noteCanonical(h256 _head, uint _oldNumber, ldb::WriteBatch& io_details)
+{
+	uint n = details(_head).number;
+	for (uint i = n + 1; i <= _oldNumber; ++i)
+	{
+		m_numberHashes[i] = h256();
+		io_details.Delete(numberKey(i));
+	}
+	for (h256 h = _head; numberHash(n) != h; h = details(h).parent, --n)
+	{
+		m_numberHashes[n] = h;
+		io_details.Put(numberKey(n), ldb::Slice((char const*)&h, 32));
+		if (!n)
+			break;
+	}
+}
+
+h256 BlockChain::numberHash(uint _n) const
+{
+	auto it = m_numberHashes.find(_n);
+	if (it == m_numberHashes.end())
+	{
+		std::string s;
+		m_detailsDB->Get(m_readOptions, ldb::Slice(numberKey(_n)), &s);
+		it = m_numberHashes.insert(make_pair(_n, s.size() == 32 ? *(h256*)s.data() : h256())).first;
+	}
+	return it->second;
+}
+
+h256 BlockChain::ancestor(h256 _hash, uint _n) const
+{
+	// Walk back until we're on the longest chain, then look it up.
+	uint n = details(_hash).number;
+	for (; n > _n && numberHash(n) != _hash; --n)
+		_hash = details(_hash).parent;
+	return n > _n ? numberHash(_n) : _hash;
+}
+
+BlockData BlockChain::block(h256 _hash) const
 {
 	if (_hash == m_genesisHash)
-		return &m_genesisBlock;
+		return BlockData(&m_genesisBlock);
 
-	m_db->Get(m_readOptions, ldb::Slice((char const*)&_hash, 32), &m_cache[_hash]);
-	return bytesConstRef(&m_cache[_hash]);
+	if (m_store)
+		if (auto b = m_store->block(_hash))
+			return BlockData(b);
+
+	auto it = m_cache.find(_hash);
+	if (it != m_cache.end())
+	{
+		++m_cacheHits;
+		m_cacheUsage.splice(m_cacheUsage.begin(), m_cacheUsage, it->second.usage);
+		return BlockData(it->second.data);
+	}
+
+	++m_cacheMisses;
+	string d;
+	m_db->Get(m_readOptions, ldb::Slice((char const*)&_hash, 32), &d);
+	if (d.empty())
+		return BlockData();
+
+	it = m_cache.insert(make_pair(_hash, CachedBlock())).first;
+	it->second.data = make_shared<bytes const>(asBytes(d));
+	m_cacheUsage.push_front(_hash);
+	it->second.usage = m_cacheUsage.begin();
+	m_cacheSize += it->second.data->size();
+
+	// Evict the least-recently used blocks, though never the one we're about to return. Those still held by a
+	// BlockData live on until it's dropped.
+	while (m_cacheSize > m_cacheLimit && m_cacheUsage.back() != _hash)
+	{
+		auto e = m_cache.find(m_cacheUsage.back());
+		m_cacheSize -= e->second.data->size();
+		m_cache.erase(e);
+		m_cacheUsage.pop_back();
+	}
+	return BlockData(it->second.data);
+}
+
+BlockInfo BlockChain::info(h256 _hash) const
+{
+	auto it = m_infos.find(_hash);
+	if (it != m_infos.end())
+		return it->second.info;
+	auto b = block(_hash);
+	if (b.empty())
+		throw UnknownBlock();
+	// It's in the chain, so its proof of work was checked when it was imported.
+	BlockInfo ret;
+	ret.populate(b.ref(), _hash, false);
+	noteInfo(ret, details(_hash).number, b.ref());
+	return ret;
+}
+
+bool BlockChain::cachedHeader(bytesConstRef _header, BlockInfo& o_info) const
+{
+	auto it = m_infoHeaders.find(sha3(_header));
+	if (it == m_infoHeaders.end())
+		return false;
+	o_info = m_infos.at(it->second).info;
+	return true;
+}
+
+void BlockChain::noteInfo(BlockInfo const& _info, uint _number, bytesConstRef _block) const
+{
+	uint best = details(m_lastBlockHash).number;
+	if (_number + c_headerWindow < best || m_infos.count(_info.hash))
+		return;
+	m_infos[_info.hash] = CachedInfo{_info, _number};
+	m_infoHeaders[sha3(RLP(_block)[0].data())] = _info.hash;
+
+	// Sweep out those fallen behind now and then, rather than on every import.
+	if (m_infos.size() > c_headerWindow * 2)
+	{
+		for (auto it = m_infoHeaders.begin(); it != m_infoHeaders.end();)
+			if (m_infos.at(it->second).number + c_headerWindow < best)
+				it = m_infoHeaders.erase(it);
+			else
+				++it;
+		for (auto it = m_infos.begin(); it != m_infos.end();)
+			if (it->second.number + c_headerWindow < best)
+				it = m_infos.erase(it);
+			else
+				++it;
+		// Should there be many recent branches, start afresh.
+		if (m_infos.size() > c_headerWindow * 4)
+		{
+			m_infos.clear();
+			m_infoHeaders.clear();
+		}
+	}
 }
 
 BlockDetails const& BlockChain::details(h256 _h) const
@@ -229,3 +654,55 @@ BlockDetails const& BlockChain::details(h256 _h) const
 	}
 	return it->second;
 }
+
+BlockChainSnapshot BlockChain::snapshot() const
+{
+	return BlockChainSnapshot(*this);
+}
+
+/// @returns a snapshot of @a _db, released when the last copy of it goes.
+static shared_ptr<ldb::Snapshot const> dbSnapshot(ldb::DB* _db)
+{
+	return shared_ptr<ldb::Snapshot const>(_db->GetSnapshot(), [=](ldb::Snapshot const* _s){ _db->ReleaseSnapshot(_s); });
+}
+
+BlockChainSnapshot::BlockChainSnapshot(BlockChain const& _bc):
+	m_bc(&_bc),
+	// Details first: a block's data is always written before its details, so any block they know of can be read.
+	m_details(dbSnapshot(_bc.m_detailsDB)),
+	m_blocks(dbSnapshot(_bc.m_db))
+{
+	m_detailsOptions.snapshot = m_details.get();
+	m_blocksOptions.snapshot = m_blocks.get();
+	// The best block's hash is written along with its details, so it's read from the same snapshot.
+	string l;
+	_bc.m_detailsDB->Get(m_detailsOptions, ldb::Slice("best"), &l);
+	m_lastBlockHash = l.size() == 32 ? *(h256*)l.data() : _bc.m_genesisHash;
+}
+
+BlockDetails BlockChainSnapshot::details(h256 _hash) const
+{
+	string s;
+	m_bc->m_detailsDB->Get(m_detailsOptions, ldb::Slice((char const*)&_hash, 32), &s);
+	return s.empty() ? NullBlockDetails : BlockDetails(RLP(s));
+}
+
+BlockData BlockChainSnapshot::block(h256 _hash) const
+{
+	if (_hash == m_bc->m_genesisHash)
+		return BlockData(&m_bc->m_genesisBlock);
+	// Flat-stored blocks never change once written, so needn't be read through the snapshot.
+	if (m_bc->m_store)
+		if (auto b = m_bc->m_store->block(_hash))
+			return BlockData(b);
+	string d;
+	m_bc->m_db->Get(m_blocksOptions, ldb::Slice((char const*)&_hash, 32), &d);
+	return d.empty() ? BlockData() : BlockData(make_shared<bytes const>(asBytes(d)));
+}
+
+h256 BlockChainSnapshot::numberHash(uint _n) const
+{
+	string s;
+	m_bc->m_detailsDB->Get(m_detailsOptions, ldb::Slice(numberKey(_n)), &s);
+	return s.size() == 32 ? *(h256*)s.data() : h256();
+}
@@ -21,25 +21,97 @@
 
 #pragma once
 
+#include <list>
+#include <memory>
 #include "Common.h"
+#include "BlockInfo.h"
 namespace ldb = leveldb;
 
 namespace eth
 {
 
+/// Our LevelDB databases.
+enum class Database
+{
+	Blocks,		///< Block data, keyed by hash: written once, read mostly in sequence.
+	Details,	///< Block details and the number index: small values, many point lookups.
+	State		///< The state tries' nodes, keyed by hash: random point lookups, often of keys that aren't there.
+};
+
+/// How one of our LevelDB databases is tuned.
+struct DBTuning
+{
+	size_t cacheSize;		///< Bytes of (uncompressed) table blocks kept cached in memory.
+	int bloomBits;			///< Bits per key of the tables' bloom filters; zero for no filters.
+	size_t writeBuffer;		///< Bytes buffered in memory (and the log) before they're sorted out into a table.
+	bool compress;			///< Whether tables are compressed with Snappy.
+};
+
+/// Our in-memory caches, each of which is given its share of the memory budget; see Defaults::setMemoryBudget().
+enum class Cache
+{
+	Blocks,			///< BlockChain's cache of block data.
+	Details,		///< BlockChain's decoded block details, number index and recent headers.
+	StateNodes,		///< The state tries' nodes, shared by all Overlays.
+	Transactions,	///< The transaction queue.
+	IncomingBlocks,	///< Blocks received from peers awaiting import.
+	MiningNodes		///< The nodes of the proof-of-work DAGs, shared by all those mining.
+};
+
 struct Defaults
 {
 	friend class BlockChain;
 	friend class State;
 public:
 	static void setDBPath(std::string _dbPath) { s_dbPath = _dbPath; }
+	static std::string const& dbPath() { return s_dbPath; }
+
+	/// Set how many past states are kept on disk: the last @a _recent blocks' states plus, as restore points,
+	/// the state of every @a _restoreInterval'th block for the last @a _restorePoints such blocks.
+	/// A @a _recent of zero disables pruning altogether.
+	static void setStateRetention(uint _recent, uint _restoreInterval, uint _restorePoints) { s_recentStates = _recent; s_restoreInterval = _restoreInterval; s_restorePoints = _restorePoints; }
+
+	/// Set whether each block's writes to the DBs are flushed to disk before continuing. Slower, but safe against power loss.
+	static void setSyncWrites(bool _sync) { s_syncWrites = _sync; }
+
+	/// Set how many threads play back a block's transactions: zero for one per core; one to play them back strictly
+	/// in order, on the calling thread alone.
+	static void setPlaybackThreads(uint _threads) { s_playbackThreads = _threads; }
+
+	/// Set whether new blocks' data is kept in flat, memory-mapped segment files rather than in LevelDB.
+	/// Blocks already in LevelDB stay readable either way.
+	static void setFlatBlocks(bool _flat) { s_flatBlocks = _flat; }
+
+	/// Set how database @a _db is tuned when it's next opened.
+	static void setDBTuning(Database _db, DBTuning const& _t) { s_dbTuning[(int)_db] = _t; }
+	static DBTuning const& dbTuning(Database _db) { return s_dbTuning[(int)_db]; }
+
+	/// Set roughly how many bytes our in-memory caches may use between them, each taking a fixed share; zero (the
+	/// default) leaves each at its own default size. Takes effect for those made afterwards. LevelDB's own caches
+	/// aren't included; see setDBTuning().
+	static void setMemoryBudget(size_t _bytes) { s_memoryBudget = _bytes; }
+	static size_t memoryBudget() { return s_memoryBudget; }
+	/// @returns the number of bytes cache @a _c may use: its share of the memory budget, or @a _default if there's none.
+	static size_t memoryLimit(Cache _c, size_t _default);
 
 private:
 	static std::string s_dbPath;
+	static bool s_syncWrites;
+	static uint s_recentStates;
+	static uint s_restoreInterval;
+	static uint s_restorePoints;
+	static uint s_playbackThreads;
+	static bool s_flatBlocks;
+	static DBTuning s_dbTuning[3];
+	static size_t s_memoryBudget;
 };
 
+/// @returns the options with which to open database @a _db, according to its tuning.
+ldb::Options dbOptions(Database _db);
+
 class RLP;
 class RLPStream;
+class State;
 
 struct BlockDetails
 {
@@ -61,9 +133,48 @@ static const BlockDetails NullBlockDetails;
 static const h256s NullH256s;
 
 class Overlay;
+class BlockStore;
+class BlockChainSnapshot;
+
+/// Default number of bytes of block data a BlockChain keeps cached in memory.
+static const size_t c_defaultCacheLimit = 16 * 1024 * 1024;
+/// Default number of bytes a BlockChain's decoded details, number index and headers may take before process() drops them.
+static const size_t c_defaultDetailsLimit = 32 * 1024 * 1024;
+/// How many blocks back from our best a block may be numbered and still have its header kept decoded; see BlockChain::info().
+static const unsigned c_headerWindow = 256;
+
+/**
+ * @brief A block's data (RLP format), handed out without being copied. It either shares a block in BlockChain's
+ * cache, which it keeps alive however soon that's evicted, or points into the chain's own memory (the genesis block,
+ * a BlockStore's mapping), which lasts as long as the chain does. Empty if the block's unknown.
+ */
+class BlockData
+{
+public:
+	BlockData() {}
+	/// Share @a _d, which stays alive for as long as any copy of this does.
+	explicit BlockData(std::shared_ptr<bytes const> const& _d): m_owner(_d), m_ref(_d ? bytesConstRef(_d.get()) : bytesConstRef()) {}
+	/// Point at @a _d, which must outlive this.
+	explicit BlockData(bytesConstRef _d): m_ref(_d) {}
+
+	bytesConstRef ref() const { return m_ref; }
+	byte const* data() const { return m_ref.data(); }
+	size_t size() const { return m_ref.size(); }
+	bool empty() const { return m_ref.empty(); }
+	explicit operator bool() const { return !empty(); }
+	bytes toBytes() const { return m_ref.toBytes(); }
+
+	bool operator==(BlockData const& _c) const { return size() == _c.size() && !memcmp(data(), _c.data(), size()); }
+	bool operator!=(BlockData const& _c) const { return !operator==(_c); }
+
+private:
+	std::shared_ptr<bytes const> m_owner;
+	bytesConstRef m_ref;
+};
 
 class AlreadyHaveBlock: public std::exception {};
 class UnknownParent: public std::exception {};
+class UnknownBlock: public std::exception {};
 
 /**
  * @brief Implements the blockchain database. All data this gives is disk-backed.
@@ -75,8 +186,9 @@ public:
 	BlockChain(std::string _path, bool _killExisting = false);
 	~BlockChain();
 
-	/// (Potentially) renders invalid existing bytesConstRef returned by lastBlock.
-	/// To be called from main loop every 100ms or so.
+	/// (Potentially) renders invalid existing bytesConstRef returned by lastBlock, and references returned by details().
+	/// To be called from main loop every 100ms or so; drops the decoded details, number index and headers if they've
+	/// outgrown their limit. They're all on disk, so are merely read again as needed.
 	void process();
 	
 	/// Attempt to import the given block.
@@ -85,32 +197,126 @@ public:
 	/// Import block into disk-backed DB
 	void import(bytes const& _block, Overlay const& _stateDB);
 
+	/// Import as many of @a io_blocks as possible, whatever their order. Their headers (including proof of work)
+	/// are verified in parallel, then they're played back parents first and the details of all those imported
+	/// are written to the DB together.
+	/// On return @a io_blocks holds just those blocks that still await an unknown parent, in the order given and at most
+	/// the last 1024 of them; invalid ones, and any descending from them, are dropped.
+	/// Proofs of work are only checked if @a _checkNonce; skip that only for blocks from a trusted source.
+	/// @returns the number of blocks imported.
+	unsigned importBatch(std::vector<bytes>& io_blocks, Overlay const& _stateDB, bool _checkNonce = true);
+
+	/// Write the blocks of the longest chain after the genesis to @a _out, oldest first, each in its RLP encoding.
+	/// @returns the number written.
+	unsigned exportChain(std::ostream& _out) const;
+	/// Import a file written by exportChain() from @a _in, in batches. Proofs of work are checked unless @a _trusted.
+	/// @returns the number of blocks imported.
+	unsigned importChain(std::istream& _in, Overlay const& _stateDB, bool _trusted = false);
+
 	/// Get the number of the last block of the longest chain.
 	BlockDetails const& details(h256 _hash) const;
 	BlockDetails const& details() const { return details(currentHash()); }
 
-	/// Get a given block (RLP format).
-	bytesConstRef block(h256 _hash) const;
-	bytesConstRef block() const { return block(currentHash()); }
+	/// Get a given block (RLP format), or empty if it's unknown. Nothing's copied: the data stays valid for as long as
+	/// the handle is kept, however the cache it came from evicts blocks meanwhile.
+	BlockData block(h256 _hash) const;
+	BlockData block() const { return block(currentHash()); }
+
+	/// Get the header of a given block, decoded; throws if the block's unknown. The headers of blocks within
+	/// c_headerWindow of our best, on any branch, are kept decoded, so checking a new block against its parent,
+	/// grandparent and uncles needn't read or decode them again.
+	BlockInfo info(h256 _hash) const;
+	/// Get the header of the block whose header alone (RLP format, as an uncle's is given) is @a _header, but only if
+	/// it's one we keep decoded. @returns false, leaving @a o_info alone, if not.
+	bool cachedHeader(bytesConstRef _header, BlockInfo& o_info) const;
 
 	/// Get a given block (RLP format).
 	h256 currentHash() const { return m_lastBlockHash; }
 
+	/// Get the hash of block number @a _n on the longest chain, or null if it's longer than that.
+	h256 numberHash(uint _n) const;
+	/// Get the ancestor of block @a _hash that's block number @a _n. Cheap once the ancestry meets the longest chain.
+	h256 ancestor(h256 _hash, uint _n) const;
+
 	/// Get the coinbase address of a given block.
 	Address coinbaseAddress(h256 _hash) const;
 	Address coinbaseAddress() const { return coinbaseAddress(currentHash()); }
 
 	h256 genesisHash() const { return m_genesisHash; }
 
+	/// Set the maximum number of bytes of block data to keep in the memory cache.
+	void setCacheLimit(size_t _bytes) { m_cacheLimit = _bytes; }
+	size_t cacheLimit() const { return m_cacheLimit; }
+	/// Number of bytes of block data currently held in the memory cache.
+	size_t cacheSize() const { return m_cacheSize; }
+	/// Number of block() requests served from/missed by the cache since we opened.
+	uint cacheHits() const { return m_cacheHits; }
+	uint cacheMisses() const { return m_cacheMisses; }
+	/// Set the maximum number of bytes the decoded details, number index and headers may take; see process().
+	void setDetailsLimit(size_t _bytes) { m_detailsLimit = _bytes; }
+	/// Roughly how many bytes the decoded details, number index and headers currently take.
+	size_t detailsSize() const;
+
+	/// @returns a consistent view of the chain as it is now, unaffected by later imports, for reading from any thread.
+	/// Thread-safe.
+	BlockChainSnapshot snapshot() const;
+
+	/// Audit the entire details DB, checking every block against its parent. O(chain length).
+	void verifyAll();
+
+	/// @returns LevelDB's own statistics for the blocks and details databases.
+	std::string dbStats() const;
+
 private:
-	void checkConsistency();
+	/// Import a block whose header @a _bi has already been verified, adding the details it changes to @a io_details.
+	void import(bytes const& _block, BlockInfo const& _bi, Overlay const& _stateDB, ldb::WriteBatch& io_details);
+
+	/// Check a single block's details are coherent with those of its parent.
+	void checkConsistency(h256 _hash) const;
+
+	/// Make @a _head, of which the longest chain was up to block number @a _oldNumber, the head of the number index.
+	/// Entries are rewritten back as far as the two chains differ; the changes go to @a io_details.
+	void noteCanonical(h256 _head, uint _oldNumber, ldb::WriteBatch& io_details);
+
+	/// Keep @a _info, the header of block number @a _number whose data is @a _block, decoded if it's recent enough;
+	/// those that no longer are are dropped.
+	void noteInfo(BlockInfo const& _info, uint _number, bytesConstRef _block) const;
 
 	/// Get fully populated from disk DB.
-	mutable std::map<h256, BlockDetails> m_details;
-	mutable std::map<h256, std::string> m_cache;
+	mutable std::unordered_map<h256, BlockDetails> m_details;
+
+	/// A recent block's header, decoded, and its number.
+	struct CachedInfo
+	{
+		BlockInfo info;
+		uint number;
+	};
+	mutable std::unordered_map<h256, CachedInfo> m_infos;		///< Recent blocks' headers, by block hash.
+	mutable std::unordered_map<h256, h256> m_infoHeaders;		///< The block hash of each in m_infos, by the hash of its header alone.
+	/// Entries of the number index (in the details DB) we've read or written; null for those removed.
+	mutable std::unordered_map<uint, h256> m_numberHashes;
+
+	/// LRU cache of block data; m_cacheUsage is ordered most-recently-used first.
+	struct CachedBlock
+	{
+		std::shared_ptr<bytes const> data;
+		std::list<h256>::iterator usage;
+	};
+	mutable std::unordered_map<h256, CachedBlock> m_cache;
+	mutable std::list<h256> m_cacheUsage;
+	mutable size_t m_cacheSize = 0;
+	size_t m_cacheLimit = c_defaultCacheLimit;
+	size_t m_detailsLimit = c_defaultDetailsLimit;
+	mutable uint m_cacheHits = 0;
+	mutable uint m_cacheMisses = 0;
 
 	ldb::DB* m_db;
 	ldb::DB* m_detailsDB;
+	/// Where new blocks' data goes if we're using flat block files; null otherwise.
+	std::unique_ptr<BlockStore> m_store;
+
+	/// A state positioned at our best block, kept so that importing its children needn't build one afresh.
+	std::unique_ptr<State> m_headState;
 
 	/// Hash of the last (valid) block on the longest chain.
 	h256 m_lastBlockHash;
@@ -120,9 +326,41 @@ private:
 	ldb::ReadOptions m_readOptions;
 	ldb::WriteOptions m_writeOptions;
 
+	friend class BlockChainSnapshot;
 	friend std::ostream& operator<<(std::ostream& _out, BlockChain const& _bc);
 };
 
+/**
+ * @brief A BlockChain as it was when BlockChain::snapshot() was called.
+ * Reads go straight to snapshots of the chain's databases, rather than through its caches, so any number of threads
+ * may use one while the chain goes on importing. Everything is returned by value. Must not outlive the chain.
+ */
+class BlockChainSnapshot
+{
+public:
+	explicit BlockChainSnapshot(BlockChain const& _bc);
+
+	/// Hash of the best block as of the snapshot.
+	h256 currentHash() const { return m_lastBlockHash; }
+	h256 genesisHash() const { return m_bc->m_genesisHash; }
+
+	BlockDetails details(h256 _hash) const;
+	BlockDetails details() const { return details(m_lastBlockHash); }
+	/// @returns the block @a _hash (RLP format), empty if it isn't in the chain.
+	BlockData block(h256 _hash) const;
+	BlockData block() const { return block(m_lastBlockHash); }
+	/// @returns the hash of block number @a _n on the longest chain, or null if it's longer than that.
+	h256 numberHash(uint _n) const;
+
+private:
+	BlockChain const* m_bc;
+	std::shared_ptr<ldb::Snapshot const> m_details;	///< Taken before m_blocks.
+	std::shared_ptr<ldb::Snapshot const> m_blocks;
+	ldb::ReadOptions m_detailsOptions;
+	ldb::ReadOptions m_blocksOptions;
+	h256 m_lastBlockHash;
+};
+
 std::ostream& operator<<(std::ostream& _out, BlockChain const& _bc);
 
 }
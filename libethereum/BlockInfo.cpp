@@ -39,6 +39,11 @@ BlockInfo::BlockInfo(bytesConstRef _block)
 	populate(_block);
 }
 
+BlockInfo::BlockInfo(bytesConstRef _block, h256 const& _hash)
+{
+	populate(_block, _hash);
+}
+
 bytes BlockInfo::createGenesisBlock()
 {
 	RLPStream block(3);
@@ -64,9 +69,9 @@ bytes BlockInfo::createGenesisBlock()
 
 h256 BlockInfo::headerHashWithoutNonce() const
 {
-	RLPStream s;
-	fillStream(s, false);
-	return sha3(s.out());
+	ScratchRLPStream s;
+	fillStream(*s, false);
+	return sha3(s->out());
 }
 
 void BlockInfo::fillStream(RLPStream& _s, bool _nonce) const
@@ -83,29 +88,45 @@ void BlockInfo::populateGenesis()
 }
 
 void BlockInfo::populate(bytesConstRef _block)
+{
+	populate(_block, eth::sha3(_block));
+}
+
+void BlockInfo::populate(bytesConstRef _block, h256 const& _hash, bool _checkNonce)
 {
 	RLP root(_block);
+	hash = _hash;
+	try
+	{
+		populateFromHeader(root[0], _checkNonce);
+	}
+	catch (RLP::BadCast const&)
+	{
+		throw InvalidBlockFormat();
+	}
+}
+
+void BlockInfo::populateFromHeader(RLP const& _header, bool _checkNonce)
+{
 	try
 	{
-		RLP header = root[0];
-		hash = eth::sha3(_block);
-		parentHash = header[0].toHash<h256>();
-		sha3Uncles = header[1].toHash<h256>();
-		coinbaseAddress = header[2].toHash<Address>();
-		stateRoot = header[3].toHash<h256>();
-		sha3Transactions = header[4].toHash<h256>();
-		difficulty = header[5].toInt<u256>();
-		timestamp = header[6].toInt<u256>();
-		extraData = header[7].toBytes();
-		nonce = header[8].toInt<u256>();
+		parentHash = _header[0].toHash<h256>();
+		sha3Uncles = _header[1].toHash<h256>();
+		coinbaseAddress = _header[2].toHash<Address>();
+		stateRoot = _header[3].toHash<h256>();
+		sha3Transactions = _header[4].toHash<h256>();
+		difficulty = _header[5].toInt<u256>();
+		timestamp = _header[6].toInt<u256>();
+		extraData = _header[7].toBytes();
+		nonce = _header[8].toInt<u256>();
 	}
-	catch (RLP::BadCast)
+	catch (RLP::BadCast const&)
 	{
 		throw InvalidBlockFormat();
 	}
 
 	// check it hashes according to proof of work or that it's the genesis block.
-	if (parentHash && !Dagger::verify(headerHashWithoutNonce(), nonce, difficulty))
+	if (_checkNonce && parentHash && !Dagger::verify(headerHashWithoutNonce(), nonce, difficulty))
 		throw InvalidNonce();
 }
 
@@ -43,6 +43,8 @@ public:
 
 	BlockInfo();
 	explicit BlockInfo(bytesConstRef _block);
+	/// As above, but for a block whose hash @a _hash is already known (e.g. it was looked up by it), so it isn't rehashed.
+	BlockInfo(bytesConstRef _block, h256 const& _hash);
 
 	explicit operator bool() const { return timestamp != Invalid256; }
 
@@ -62,6 +64,11 @@ public:
 
 	static BlockInfo const& genesis() { if (!s_genesis) (s_genesis = new BlockInfo)->populateGenesis(); return *s_genesis; }
 	void populate(bytesConstRef _block);
+	/// Populate from a block whose hash @a _hash is known; its proof-of-work is checked only if @a _checkNonce.
+	void populate(bytesConstRef _block, h256 const& _hash, bool _checkNonce = true);
+	/// Populate from the header alone, checking its proof-of-work if @a _checkNonce. Leaves hash untouched, since
+	/// that's of the entire block.
+	void populateFromHeader(RLP const& _header, bool _checkNonce = true);
 	void verifyInternals(bytesConstRef _block) const;
 	void verifyParent(BlockInfo const& _parent) const;
 
@@ -0,0 +1,113 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file BlockStore.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "Exceptions.h"
+#include "BlockStore.h"
+using namespace std;
+using namespace eth;
+
+/// Key in the index of where the block with hash @a _hash lies.
+static string indexKey(h256 const& _hash)
+{
+	return "f" + string((char const*)_hash.data(), 32);
+}
+
+BlockStore::BlockStore(std::string const& _path, ldb::DB* _index):
+	m_path(_path),
+	m_index(_index)
+{
+	boost::filesystem::create_directory(m_path);
+	for (unsigned n = 0; !n || boost::filesystem::exists(m_path + "/" + toString(n)); ++n)
+		openSegment(n);
+}
+
+BlockStore::~BlockStore()
+{
+	for (auto const& s: m_segments)
+	{
+		munmap(s.data, c_segmentSize);
+		close(s.fd);
+	}
+}
+
+void BlockStore::openSegment(unsigned _n)
+{
+	Segment s;
+	s.fd = open((m_path + "/" + toString(_n)).c_str(), O_RDWR | O_CREAT, 0644);
+	if (s.fd < 0)
+		throw BlockStoreError();
+	struct stat st;
+	fstat(s.fd, &st);
+	s.size = st.st_size;
+	// Map the whole of it now, so later appends are visible without remapping.
+	void* d = mmap(nullptr, c_segmentSize, PROT_READ, MAP_SHARED, s.fd, 0);
+	if (d == MAP_FAILED)
+	{
+		close(s.fd);
+		throw BlockStoreError();
+	}
+	s.data = (byte*)d;
+	lock_guard<mutex> l(m_x);
+	m_segments.push_back(s);
+}
+
+bytesConstRef BlockStore::block(h256 _hash) const
+{
+	string v;
+	m_index->Get(ldb::ReadOptions(), ldb::Slice(indexKey(_hash)), &v);
+	if (v.size() != 12)
+		return bytesConstRef();
+	auto n = fromBigEndian<uint32_t>(v.substr(0, 4));
+	auto offset = fromBigEndian<uint32_t>(v.substr(4, 4));
+	auto length = fromBigEndian<uint32_t>(v.substr(8, 4));
+	lock_guard<mutex> l(m_x);
+	if (n >= m_segments.size() || offset + (size_t)length > m_segments[n].size)
+		return bytesConstRef();
+	return bytesConstRef(m_segments[n].data + offset, length);
+}
+
+bool BlockStore::insert(h256 _hash, bytesConstRef _block, ldb::WriteOptions const& _o)
+{
+	if (_block.size() > c_segmentSize)
+		return false;
+	if (m_segments.back().size + _block.size() > c_segmentSize)
+		openSegment(m_segments.size());
+
+	// Data first: should we die before the index is written, it's merely space wasted.
+	Segment& s = m_segments.back();
+	if (pwrite(s.fd, _block.data(), _block.size(), s.size) != (ssize_t)_block.size() || (_o.sync && fdatasync(s.fd)))
+		throw BlockStoreError();
+
+	string v(12, '\0');
+	auto put = [&](size_t _at, uint32_t _x) { string b(4, '\0'); toBigEndian(_x, b); v.replace(_at, 4, b); };
+	put(0, (uint32_t)(m_segments.size() - 1));
+	put(4, (uint32_t)s.size);
+	put(8, (uint32_t)_block.size());
+	m_index->Put(_o, ldb::Slice(indexKey(_hash)), ldb::Slice(v));
+	lock_guard<mutex> l(m_x);
+	s.size += _block.size();
+	return true;
+}
@@ -0,0 +1,74 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file BlockStore.h
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include "Common.h"
+namespace ldb = leveldb;
+
+namespace eth
+{
+
+/**
+ * @brief Append-only store of block data, read through memory mappings.
+ * Blocks are appended to segment files in a directory, each up to c_segmentSize bytes; where each one lies is
+ * recorded in a LevelDB (under "f" and its hash). Blocks never change once written, so the data returned by block()
+ * can point straight into the mapping and stays valid for as long as the store is open.
+ * block() may be called from any thread; insert() only from one at a time.
+ * POSIX only.
+ */
+class BlockStore
+{
+public:
+	/// Open (or create) the segments in directory @a _path, with their index in @a _index.
+	BlockStore(std::string const& _path, ldb::DB* _index);
+	~BlockStore();
+
+	/// @returns the data of the block with hash @a _hash, or an empty reference if it's not in the store.
+	bytesConstRef block(h256 _hash) const;
+
+	/// Append @a _block, with hash @a _hash. The data's flushed to disk first if @a _o asks for synchronous writes.
+	/// @returns false (and stores nothing) if it's too big to fit in a segment.
+	bool insert(h256 _hash, bytesConstRef _block, ldb::WriteOptions const& _o);
+
+	/// Largest size of a segment file.
+	static const size_t c_segmentSize = (size_t)1 << 28;
+
+private:
+	struct Segment
+	{
+		int fd;
+		byte* data;		///< Mapping of c_segmentSize bytes; only what's been written may be read.
+		size_t size;	///< Bytes written.
+	};
+
+	/// Open segment number @a _n, creating it if needed.
+	void openSegment(unsigned _n);
+
+	std::string m_path;
+	ldb::DB* m_index;
+	std::vector<Segment> m_segments;	///< All of them, by number. We only append to the last.
+	mutable std::mutex m_x;				///< Guards changes to m_segments, and reads of it other than by insert().
+};
+
+}
@@ -19,46 +19,128 @@
  * @date 2014
  */
 
+#include <chrono>
+#include <fstream>
+#include <algorithm>
 #include "Common.h"
+#include "Metrics.h"
 #include "Client.h"
 using namespace std;
 using namespace eth;
 
+static Gauge& s_memoryBlocks = Metrics::gauge("eth_memory_blocks_bytes", "Bytes of block data cached.");
+static Gauge& s_memoryDetails = Metrics::gauge("eth_memory_details_bytes", "Bytes of block details, number index and headers kept decoded.");
+static Gauge& s_memoryNodes = Metrics::gauge("eth_memory_state_nodes_bytes", "Bytes of state trie nodes cached.");
+static Gauge& s_memoryState = Metrics::gauge("eth_memory_state_bytes", "Bytes of addresses cached and nodes not yet committed by the present state.");
+static Gauge& s_memoryTransactions = Metrics::gauge("eth_memory_transactions_bytes", "Bytes of the transaction queue.");
+static Gauge& s_memoryNetwork = Metrics::gauge("eth_memory_network_bytes", "Bytes of what's been received awaiting import, and of the peers' buffers.");
+static Gauge& s_memoryMining = Metrics::gauge("eth_memory_mining_bytes", "Bytes of proof-of-work DAG nodes cached.");
+
 Client::Client(std::string const& _clientVersion, Address _us, std::string const& _dbPath):
 	m_clientVersion(_clientVersion),
+	m_dbPath(_dbPath.empty() ? Defaults::dbPath() : _dbPath),
 	m_bc(_dbPath),
 	m_stateDB(State::openDB(_dbPath)),
 	m_s(_us, m_stateDB)
 {
 	Defaults::setDBPath(_dbPath);
+	m_tq.setLimit(Defaults::memoryLimit(Cache::Transactions, m_tq.limit() * c_queuedTransactionBytes) / c_queuedTransactionBytes);
 
 	// Synchronise the state according to the block chain - i.e. replay all transactions in block chain, in order.
 	// In practise this won't need to be done since the State DB will contain the keys for the tries for most recent (and many old) blocks.
 	// TODO: currently it contains keys for *all* blocks. Make it remove old ones.
 	m_s.sync(m_bc);
 	m_s.sync(m_tq);
+	publishState();
 	m_changed = true;
 
-	m_work = new thread([&](){ while (m_workState != Deleting) work(); m_workState = Deleted; });
+	// Newly verified transactions and proofs-of-work found are for the work thread to act on at once.
+	m_tq.onVerified([=](){ signal(); });
+	m_miner.onFound([=](){ signal(); });
+
+	m_work = new thread([&](){ setThreadName("work"); while (m_workState != Deleting) work(); m_workState = Deleted; });
 }
 
 Client::~Client()
 {
 	if (m_workState == Active)
 		m_workState = Deleting;
+	signal();
 	while (m_workState != Deleted)
 		usleep(10000);
+	stopNetwork();
+}
+
+unsigned Client::exportChain(std::ostream& _out)
+{
+	lock_guard<mutex> l(m_lock);
+	return m_bc.exportChain(_out);
+}
+
+unsigned Client::importChain(std::istream& _in, bool _trusted)
+{
+	unsigned ret;
+	{
+		lock_guard<mutex> l(m_lock);
+		ret = m_bc.importChain(_in, m_stateDB, _trusted);
+	}
+	m_changed = true;
+	signal();
+	return ret;
+}
+
+std::string Client::dbStats() const
+{
+	std::string s;
+	m_stateDB.db()->GetProperty("leveldb.stats", &s);
+	return m_bc.dbStats() + "state:\n" + s;
+}
+
+MemoryUsage Client::memoryUsage()
+{
+	lock_guard<mutex> l(m_lock);
+	return measureMemory();
+}
+
+MemoryUsage Client::measureMemory() const
+{
+	MemoryUsage ret;
+	ret.blocks = m_bc.cacheSize();
+	ret.details = m_bc.detailsSize();
+	ret.nodes = m_stateDB.nodeCache() ? m_stateDB.nodeCache()->bytes() : 0;
+	ret.state = m_s.memoryUsed();
+	ret.transactions = m_tq.memoryUsed();
+	ret.network = m_net ? m_net->memoryUsed() : 0;
+	ret.mining = Dagger::cacheBytes();
+	return ret;
 }
 
 void Client::startNetwork(short _listenPort, std::string const& _seedHost, short _port, unsigned _verbosity, NodeMode _mode, unsigned _peers, string const& _publicIP, bool _upnp)
 {
 	if (m_net)
 		return;
-	m_net = new PeerServer(m_clientVersion, m_bc, 0, _listenPort, _mode, _publicIP, _upnp);
-	m_net->setIdealPeerCount(_peers);
-	m_net->setVerbosity(_verbosity);
+	auto net = make_shared<PeerServer>(m_clientVersion, m_bc, 0, _listenPort, _mode, _publicIP, _upnp);
+	net->setIdealPeerCount(_peers);
+	net->setVerbosity(_verbosity);
 	if (_seedHost.size())
-		m_net->connect(_seedHost, _port);
+		net->connect(_seedHost, _port);
+
+	// Pick up with whoever we were talking to last time.
+	ifstream in(m_dbPath + "/nodes.rlp", ios::binary);
+	bytes b((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+	if (b.size())
+		net->restoreNodes(&b);
+	lock_guard<mutex> l(m_lock);
+	m_lastNodesSave = chrono::steady_clock::now();
+	lock_guard<mutex> sl(m_signalLock);
+	m_net = net;
+}
+
+void Client::saveNodes()
+{
+	bytes b = m_net->saveNodes();
+	ofstream(m_dbPath + "/nodes.rlp", ios::binary | ios::trunc).write((char const*)b.data(), b.size());
+	m_lastNodesSave = chrono::steady_clock::now();
 }
 
 void Client::connect(std::string const& _seedHost, short _port)
@@ -70,44 +152,154 @@ void Client::connect(std::string const& _seedHost, short _port)
 
 void Client::stopNetwork()
 {
-	delete m_net;
-	m_net = nullptr;
+	// The work thread may yet be waiting on it; if so, it's the last to let go of it.
+	shared_ptr<PeerServer> net;
+	{
+		lock_guard<mutex> l(m_lock);
+		if (m_net)
+			saveNodes();
+		lock_guard<mutex> sl(m_signalLock);
+		net.swap(m_net);
+	}
 }
 
 void Client::startMining()
 {
+	m_lastMined = chrono::steady_clock::now();
 	m_doMine = true;
+	signal();
 }
 
 void Client::stopMining()
 {
 	m_doMine = false;
+	m_miner.stop();
+	m_mineProgress = MineProgress();
+}
+
+void Client::signal()
+{
+	lock_guard<mutex> l(m_signalLock);
+	m_signalled = true;
+	m_signal.notify_one();
+	if (m_net)
+		m_net->interrupt();
+}
+
+void Client::waitForWork(unsigned _ms)
+{
+	shared_ptr<PeerServer> net;
+	{
+		unique_lock<mutex> l(m_signalLock);
+		if (!m_signalled && !m_net)
+			m_signal.wait_for(l, chrono::milliseconds(_ms), [&](){ return m_signalled; });
+		if (m_signalled || !m_net)
+		{
+			m_signalled = false;
+			return;
+		}
+		net = m_net;
+	}
+	// The network's events wake us as well as signal()s, which interrupt it.
+	net->wait(_ms);
+	lock_guard<mutex> l(m_signalLock);
+	m_signalled = false;
 }
 
 void Client::transact(Secret _secret, Address _dest, u256 _amount, u256 _fee, u256s _data)
 {
-	m_lock.lock();
 	Transaction t;
+	m_lock.lock();
 	t.nonce = m_s.transactionsFrom(toAddress(_secret));
+	m_lock.unlock();
 	t.receiveAddress = _dest;
 	t.value = _amount;
 	t.fee = _fee;
 	t.data = _data;
 	t.sign(_secret);
-	m_tq.attemptImport(t.rlp());
-	m_lock.unlock();
+	m_tq.enqueue(t.rlp());
 	m_changed = true;
 }
 
+void Client::publishState()
+{
+	auto s = make_shared<State const>(m_s.snapshot());
+	lock_guard<mutex> l(m_snapshotLock);
+	m_snapshot = s;
+}
+
+ClientChanges Client::changes()
+{
+	ClientChanges ret;
+	ret.chain = make_shared<BlockChainSnapshot const>(m_bc.snapshot());
+	BlockChainSnapshot const& bc = *ret.chain;
+
+	// Go back from the old best block and the new until they meet; the first time, the old is the genesis.
+	h256 n = bc.currentHash();
+	h256 o = m_reportedHead ? m_reportedHead : bc.genesisHash();
+	uint nn = bc.details(n).number;
+	uint on = bc.details(o).number;
+	for (; nn > on; --nn, n = bc.details(n).parent)
+		ret.newBlocks.push_back(n);
+	for (; on > nn; --on, o = bc.details(o).parent)
+		ret.oldBlocks.push_back(o);
+	for (; n != o; n = bc.details(n).parent, o = bc.details(o).parent)
+	{
+		ret.newBlocks.push_back(n);
+		ret.oldBlocks.push_back(o);
+	}
+	reverse(ret.newBlocks.begin(), ret.newBlocks.end());
+	m_reportedHead = bc.currentHash();
+
+	{
+		lock_guard<mutex> l(m_lock);
+		auto const& q = m_tq.transactions();
+		for (auto const& i: q)
+			if (!m_reportedQueue.count(i.first))
+				ret.newTransactions.insert(i);
+		for (auto const& h: m_reportedQueue)
+			if (!q.count(h))
+				ret.oldTransactions.push_back(h);
+	}
+	for (auto const& h: ret.oldTransactions)
+		m_reportedQueue.erase(h);
+	for (auto const& i: ret.newTransactions)
+		m_reportedQueue.insert(i.first);
+
+	ret.state = state();
+	try
+	{
+		if (m_reportedState)
+			ret.accounts = ret.state->addressesChanged(*m_reportedState, ret.goneAccounts);
+		else
+			ret.allAccounts = true;
+	}
+	catch (MissingTrieNode const&)
+	{
+		// The state we last reported has been pruned from under us.
+		ret.goneAccounts.clear();
+		ret.allAccounts = true;
+	}
+	if (ret.allAccounts)
+		ret.accounts = ret.state->addresses();
+	m_reportedState = ret.state;
+	return ret;
+}
+
 void Client::work()
 {
 	m_lock.lock();
+	bool stateChanged = false;
 	// Process network events.
 	// Synchronise block chain with network.
 	// Will broadcast any of our (new) transactions and blocks, and collect & add any of their (new) transactions and blocks.
 	if (m_net)
+	{
 		if (m_net->process(m_bc, m_tq, m_stateDB))
 			m_changed = true;
+		if (chrono::steady_clock::now() > m_lastNodesSave + chrono::minutes(1))
+			saveNodes();
+	}
 
 	// Synchronise state to block chain.
 	// This should remove any transactions on our queue that are included within our state.
@@ -117,19 +309,43 @@ void Client::work()
 	//   all blocks.
 	 // Resynchronise state with block chain & trans
 	if (m_s.sync(m_bc))
+		m_changed = stateChanged = true;
+	// Admit newly verified transactions, except those that plainly can't yet be executed.
+	if (m_tq.flush([&](TransactionView const& _t, Address const& _sender) { return _t.nonce() >= m_s.transactionsFrom(_sender) && m_s.balance(_sender) >= (bigint)_t.value() + _t.fee(); }))
 		m_changed = true;
 	if (m_s.sync(m_tq))
-		m_changed = true;
+		m_changed = stateChanged = true;
+	if (stateChanged)
+		publishState();
+
+	// Keep the chain's decoded details within their budget, and tell how much we're holding.
+	m_bc.process();
+	if (chrono::steady_clock::now() > m_lastMemoryCheck + chrono::seconds(1))
+	{
+		m_lastMemoryCheck = chrono::steady_clock::now();
+		auto u = measureMemory();
+		s_memoryBlocks.set(u.blocks);
+		s_memoryDetails.set(u.details);
+		s_memoryNodes.set(u.nodes);
+		s_memoryState.set(u.state);
+		s_memoryTransactions.set(u.transactions);
+		s_memoryNetwork.set(u.network);
+		s_memoryMining.set(u.mining);
+	}
 
 	m_lock.unlock();
 	if (m_doMine)
 	{
-		// Mine for a while.
+		// Give the miner the latest block to work on and collect its progress since last time.
 		m_s.commitToMine(m_bc);
-		MineInfo mineInfo = m_s.mine(100);
+		MineInfo mineInfo = m_s.mine(m_miner, 0);
+		auto now = chrono::steady_clock::now();
 		m_mineProgress.best = max(m_mineProgress.best, mineInfo.best);
 		m_mineProgress.current = mineInfo.best;
 		m_mineProgress.requirement = mineInfo.requirement;
+		m_mineProgress.hashes += mineInfo.hashes;
+		m_mineProgress.ms += chrono::duration_cast<chrono::milliseconds>(now - m_lastMined).count();
+		m_lastMined = now;
 
 		if (mineInfo.completed)
 		{
@@ -137,12 +353,21 @@ void Client::work()
 			m_lock.lock();
 			m_bc.attemptImport(m_s.blockData(), m_stateDB);
 			m_mineProgress.best = 0;
+			m_mineProgress.hashes = 0;
+			m_mineProgress.ms = 0;
 			m_lock.unlock();
 			m_changed = true;
+
+			// Straight on to the next block.
+			return;
 		}
 	}
 	else
-		usleep(100000);
+		m_miner.stop();
+
+	// Sleep until there's something to do: a block or transaction from the network, a transaction verified or a
+	// proof-of-work found. Wake up anyway now and then for the timestamp and peer upkeep.
+	waitForWork(100);
 }
 
 void Client::lock()
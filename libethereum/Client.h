@@ -23,11 +23,14 @@
 
 #include <thread>
 #include <mutex>
+#include <chrono>
+#include <condition_variable>
 #include "Common.h"
 #include "BlockChain.h"
 #include "TransactionQueue.h"
 #include "State.h"
 #include "Dagger.h"
+#include "Miner.h"
 #include "PeerNetwork.h"
 
 namespace eth
@@ -35,9 +38,43 @@ namespace eth
 
 struct MineProgress
 {
-	uint requirement;
-	uint best;
-	uint current;
+	uint requirement = 0;
+	uint best = 0;
+	uint current = 0;
+	uint hashes = 0;	///< Nonces tried so far for the block we're mining.
+	uint ms = 0;		///< Milliseconds spent mining it.
+
+	/// @returns the hash rate in hashes per second.
+	uint rate() const { return ms ? (uint)((uint64_t)hashes * 1000 / ms) : 0; }
+};
+
+/// Roughly how many bytes each part of a Client holds in memory; see Defaults::setMemoryBudget() for limiting them.
+struct MemoryUsage
+{
+	size_t blocks = 0;			///< Block data cached.
+	size_t details = 0;			///< Block details, number index and headers kept decoded.
+	size_t nodes = 0;			///< State trie nodes cached.
+	size_t state = 0;			///< Addresses cached and nodes not yet committed by our present state.
+	size_t transactions = 0;	///< The transaction queue.
+	size_t network = 0;			///< Blocks and transactions received, awaiting import, and the peers' buffers.
+	size_t mining = 0;			///< Proof-of-work DAG nodes cached.
+
+	size_t total() const { return blocks + details + nodes + state + transactions + network + mining; }
+};
+
+/// What's changed since the last Client::changes(), for a front end to bring what it shows up to date with.
+/// The first time, everything is new.
+struct ClientChanges
+{
+	std::shared_ptr<BlockChainSnapshot const> chain;	///< The chain as of these changes; the blocks below may be read from it.
+	h256s newBlocks;					///< Blocks now on the longest chain that weren't, oldest first.
+	h256s oldBlocks;					///< Blocks no longer on the longest chain, newest first.
+	std::unordered_map<h256, bytes> newTransactions;	///< Transactions now queued that weren't.
+	h256s oldTransactions;				///< Transactions no longer queued (being in a block, replaced or dropped).
+	std::shared_ptr<State const> state;	///< The state as of these changes.
+	std::map<Address, u256> accounts;	///< Addresses newly in use or whose balances have changed, with their balances.
+	Addresses goneAccounts;				///< Addresses no longer in use.
+	bool allAccounts = false;			///< Whether accounts is every address in use rather than just the changes.
 };
 
 class Client
@@ -53,9 +90,24 @@ public:
 
 	bool changed() const { auto ret = m_changed; m_changed = false; return ret; }
 
-	State const& state() const { return m_s; }
+	/// @returns the state as of the work thread's last change to it. Needn't be lock()ed, and may be read from any thread.
+	std::shared_ptr<State const> state() const { std::lock_guard<std::mutex> l(m_snapshotLock); return m_snapshot; }
 	BlockChain const& blockChain() const { return m_bc; }
+	/// @returns what's changed since the last call. Needn't be lock()ed: it takes the lock just long enough to compare
+	/// the transaction queue; the chain and state are compared through snapshots, reading only what differs. Call it
+	/// from one thread only.
+	ClientChanges changes();
+	/// Write our longest chain to @a _out (see BlockChain::exportChain()). @returns the number of blocks written.
+	unsigned exportChain(std::ostream& _out);
+	/// Import blocks written by exportChain() from @a _in; their proofs of work aren't checked if @a _trusted.
+	/// @returns the number of blocks imported.
+	unsigned importChain(std::istream& _in, bool _trusted = false);
+
+	/// @returns LevelDB's statistics for each of our databases. Their tuning is set through Defaults::setDBTuning().
+	std::string dbStats() const;
 	TransactionQueue const& transactionQueue() const { return m_tq; }
+	/// @returns roughly how much memory each of our parts holds. Takes the lock.
+	MemoryUsage memoryUsage();
 
 	std::vector<PeerInfo> peers() { return m_net ? m_net->peers() : std::vector<PeerInfo>(); }
 	unsigned peerCount() const { return m_net ? m_net->peerCount() : 0; }
@@ -73,17 +125,45 @@ public:
 private:
 	void work();
 
+	/// Publish a snapshot of m_s for state() to return.
+	void publishState();
+
+	/// Wake the work thread if it's waiting for something to do.
+	void signal();
+	/// Wait up to @a _ms milliseconds for network activity or a signal(), unless there's been one since we last waited.
+	void waitForWork(unsigned _ms);
+
+	/// Write the network's address book to the database directory, for startNetwork() to pick up next time.
+	void saveNodes();
+
+	/// @returns roughly how much memory each of our parts holds; call with the lock held.
+	MemoryUsage measureMemory() const;
+
 	std::string m_clientVersion;		///< Our end-application client's name/version.
+	std::string m_dbPath;				///< Where the databases (and the network's address book) are kept.
 	BlockChain m_bc;					///< Maintains block database.
+	// Before m_tq and m_miner, whose threads signal() until they're destroyed.
+	std::mutex m_signalLock;			///< Guards m_signalled, and m_net for those not holding m_lock.
+	std::condition_variable m_signal;	///< Signalled along with m_signalled.
+	bool m_signalled = false;			///< Whether there's been a signal() since the work thread last waited.
 	TransactionQueue m_tq;				///< Maintains list of incoming transactions not yet on the block chain.
 	Overlay m_stateDB;					///< Acts as the central point for the state database, so multiple States can share it.
 	State m_s;							///< The present state of the client.
-	PeerServer* m_net = nullptr;		///< Should run in background and send us events when blocks found and allow us to send blocks as required.
+	std::shared_ptr<PeerServer> m_net;	///< Should run in background and send us events when blocks found and allow us to send blocks as required. Changed only with both m_lock and m_signalLock held.
+	std::chrono::steady_clock::time_point m_lastNodesSave;	///< When we last saved the network's address book.
+	std::chrono::steady_clock::time_point m_lastMemoryCheck;	///< When we last published our memory usage.
 	std::thread* m_work;				///< The work thread.
 	std::mutex m_lock;
+	std::shared_ptr<State const> m_snapshot;	///< A read-only copy of m_s, replaced whenever it changes.
+	mutable std::mutex m_snapshotLock;	///< Guards m_snapshot (but not the State it points to, which is never changed).
+	h256 m_reportedHead;				///< The best block as of the last changes(); null before the first.
+	h256Hash m_reportedQueue;			///< The transactions queued as of the last changes().
+	std::shared_ptr<State const> m_reportedState;	///< The state as of the last changes().
 	enum { Active = 0, Deleting, Deleted } m_workState = Active;
 	bool m_doMine = false;				///< Are we supposed to be mining?
+	Miner m_miner;						///< Searches for the proof-of-work on all cores while we're mining.
 	MineProgress m_mineProgress;
+	std::chrono::steady_clock::time_point m_lastMined;	///< When we last collected the miner's progress.
 
 	mutable bool m_changed;
 };
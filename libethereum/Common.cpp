@@ -25,26 +25,154 @@
 #pragma GCC diagnostic ignored "-Wunused-function"
 #endif
 #include <secp256k1.h>
-#include <sha3.h>
 #if WIN32
 #pragma warning(pop)
 #else
 #endif
 #include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include "Common.h"
 #include "Exceptions.h"
 using namespace std;
 using namespace eth;
 
 // Logging
-bool eth::g_debugEnabled[256] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, true, true, true, true, true, true};
-char const* g_debugName[256] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ">>>", "<<<", "LOG", "---", "***", "!!!"};
+bool eth::g_debugEnabled[256] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, true, true, true, true, true, true, true, true};
+char const* g_debugName[256] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "NET", "BLK", ">>>", "<<<", "LOG", "---", "***", "!!!"};
+
+unsigned eth::g_logVerbosity = 1;
+
+namespace eth
+{
+
+/**
+ * @brief Writes log lines to stdout from a thread of its own.
+ * Lines queue up while it's writing and go out together next time, so however much is logged, those logging only
+ * ever wait on a lock. Should stdout fall behind by c_maxQueued bytes, further lines are dropped (and a count of them
+ * written) until it catches up. What's queued is written before the program exits.
+ */
+class LogSink
+{
+public:
+	LogSink(): m_thread([=](){ run(); }) {}
+	~LogSink()
+	{
+		{
+			lock_guard<mutex> l(m_x);
+			m_stopping = true;
+		}
+		m_cv.notify_one();
+		m_thread.join();
+	}
+
+	void post(string const& _line)
+	{
+		{
+			lock_guard<mutex> l(m_x);
+			if (m_lines.size() + _line.size() > c_maxQueued)
+			{
+				++m_dropped;
+				return;
+			}
+			m_lines += _line;
+		}
+		m_cv.notify_one();
+	}
+
+	/// @returns the name of the calling thread, making one up if it's not been named. Call with m_x held.
+	string const& threadName()
+	{
+		auto& n = m_threadNames[this_thread::get_id()];
+		if (n.empty())
+			n = "#" + toString(m_threadNames.size());
+		return n;
+	}
+
+	void setThreadName(string const& _n)
+	{
+		lock_guard<mutex> l(m_x);
+		m_threadNames[this_thread::get_id()] = _n;
+	}
+
+	mutex m_x;
+
+private:
+	void run()
+	{
+		string out;
+		while (true)
+		{
+			{
+				unique_lock<mutex> l(m_x);
+				m_cv.wait(l, [&](){ return m_stopping || !m_lines.empty(); });
+				if (m_lines.empty())
+					break;
+				swap(out, m_lines);
+				if (m_dropped)
+					out += "... " + toString(m_dropped) + " lines dropped; output is behind.\n";
+				m_dropped = 0;
+			}
+			fwrite(out.data(), 1, out.size(), stdout);
+			fflush(stdout);
+			out.clear();
+		}
+	}
+
+	static const size_t c_maxQueued = 1 << 22;	///< Bytes waiting to be written beyond which lines are dropped.
+
+	string m_lines;							///< Waiting to be written.
+	unsigned m_dropped = 0;					///< Lines dropped since m_lines was last taken.
+	bool m_stopping = false;
+	map<thread::id, string> m_threadNames;
+	condition_variable m_cv;
+	thread m_thread;
+};
+
+static LogSink& logSink()
+{
+	static LogSink s_sink;
+	return s_sink;
+}
+
+}
+
+void eth::setThreadName(std::string const& _n)
+{
+	logSink().setThreadName(_n);
+}
 
 void eth::simpleDebugOut(std::string const& _s, unsigned char _id)
 {
-	// TODO: Time & thread.
-	if (g_debugEnabled[_id])
-		std::cout << (g_debugName[_id] ? g_debugName[_id] : "   ") << " " << _s << std::endl << std::flush;
+	if (!g_debugEnabled[_id])
+		return;
+	auto now = chrono::system_clock::now();
+	time_t t = chrono::system_clock::to_time_t(now);
+	unsigned ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+
+	auto& sink = logSink();
+	string line;
+	{
+		// localtime() isn't thread-safe; the lock covers it too.
+		lock_guard<mutex> l(sink.m_x);
+		char stamp[32];
+		size_t n = strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+		snprintf(stamp + n, sizeof(stamp) - n, ".%03u ", ms);
+		line = stamp + sink.threadName() + " ";
+	}
+	line += (g_debugName[_id] ? g_debugName[_id] : "   ");
+	line += " " + _s + "\n";
+	sink.post(line);
 }
 
 std::function<void(std::string const&, unsigned char)> eth::g_debugPost = simpleDebugOut;
@@ -116,12 +244,33 @@ bytes eth::fromUserHex(std::string const& _s)
 
 bytes eth::toHex(std::string const& _s)
 {
-	std::vector<uint8_t> ret;
-	ret.reserve(_s.size() * 2);
-	for (auto i: _s)
+	bytes ret(_s.size() * 2);
+	byte const* in = (byte const*)_s.data();
+	byte* out = ret.data();
+	size_t i = 0;
+	// Sixteen bytes at a time: split into high and low nibbles, then interleave them.
+#if defined(__SSE2__) || defined(_M_X64)
+	__m128i const lowMask = _mm_set1_epi8(0x0f);
+	for (; i + 16 <= _s.size(); i += 16)
+	{
+		__m128i x = _mm_loadu_si128((__m128i const*)(in + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), lowMask);
+		__m128i lo = _mm_and_si128(x, lowMask);
+		_mm_storeu_si128((__m128i*)(out + i * 2), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*)(out + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 16 <= _s.size(); i += 16)
+	{
+		uint8x16_t x = vld1q_u8(in + i);
+		uint8x16x2_t n = {{ vshrq_n_u8(x, 4), vandq_u8(x, vdupq_n_u8(0x0f)) }};
+		vst2q_u8(out + i * 2, n);
+	}
+#endif
+	for (; i < _s.size(); ++i)
 	{
-		ret.push_back(i / 16);
-		ret.push_back(i % 16);
+		out[i * 2] = in[i] / 16;
+		out[i * 2 + 1] = in[i] % 16;
 	}
 	return ret;
 }
@@ -143,12 +292,183 @@ std::string eth::sha3(std::string const& _input, bool _hex)
 	return ret;
 }
 
+/// Keccak-256, as used for eth's SHA-3: 1600-bit state, 1088-bit rate, padding byte 0x01.
+static const unsigned c_keccakRate = 136;
+static const unsigned c_keccakRateWords = c_keccakRate / 8;
+
+static const uint64_t c_keccakRoundConstants[24] =
+{
+	0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808aULL, 0x8000000080008000ULL,
+	0x000000000000808bULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+	0x000000000000008aULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000aULL,
+	0x000000008000808bULL, 0x800000000000008bULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+	0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800aULL, 0x800000008000000aULL,
+	0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL
+};
+
+static inline uint64_t rol64(uint64_t _x, unsigned _s) { return _s ? (_x << _s) | (_x >> (64 - _s)) : _x; }
+
+/// The Keccak-f[1600] permutation on @a L states at once; word i of state l is @a a[i * L + l], so each step is a
+/// loop over the states that the compiler can turn into vector instructions. Theta, rho and pi are fused, each word
+/// of b being the lane that pi moves there, theta-mixed and rho-rotated; chi and iota then write it all back.
+template <unsigned L> static void keccakF(uint64_t* a)
+{
+	for (unsigned round = 0; round < 24; ++round)
+	{
+		uint64_t c[5][L];
+		uint64_t d[5][L];
+		uint64_t b[25][L];
+		for (unsigned l = 0; l < L; ++l)
+		{
+			c[0][l] = a[0 * L + l] ^ a[5 * L + l] ^ a[10 * L + l] ^ a[15 * L + l] ^ a[20 * L + l];
+			c[1][l] = a[1 * L + l] ^ a[6 * L + l] ^ a[11 * L + l] ^ a[16 * L + l] ^ a[21 * L + l];
+			c[2][l] = a[2 * L + l] ^ a[7 * L + l] ^ a[12 * L + l] ^ a[17 * L + l] ^ a[22 * L + l];
+			c[3][l] = a[3 * L + l] ^ a[8 * L + l] ^ a[13 * L + l] ^ a[18 * L + l] ^ a[23 * L + l];
+			c[4][l] = a[4 * L + l] ^ a[9 * L + l] ^ a[14 * L + l] ^ a[19 * L + l] ^ a[24 * L + l];
+			d[0][l] = c[4][l] ^ rol64(c[1][l], 1);
+			d[1][l] = c[0][l] ^ rol64(c[2][l], 1);
+			d[2][l] = c[1][l] ^ rol64(c[3][l], 1);
+			d[3][l] = c[2][l] ^ rol64(c[4][l], 1);
+			d[4][l] = c[3][l] ^ rol64(c[0][l], 1);
+			b[0][l] = a[0 * L + l] ^ d[0][l];
+			b[1][l] = rol64(a[6 * L + l] ^ d[1][l], 44);
+			b[2][l] = rol64(a[12 * L + l] ^ d[2][l], 43);
+			b[3][l] = rol64(a[18 * L + l] ^ d[3][l], 21);
+			b[4][l] = rol64(a[24 * L + l] ^ d[4][l], 14);
+			b[5][l] = rol64(a[3 * L + l] ^ d[3][l], 28);
+			b[6][l] = rol64(a[9 * L + l] ^ d[4][l], 20);
+			b[7][l] = rol64(a[10 * L + l] ^ d[0][l], 3);
+			b[8][l] = rol64(a[16 * L + l] ^ d[1][l], 45);
+			b[9][l] = rol64(a[22 * L + l] ^ d[2][l], 61);
+			b[10][l] = rol64(a[1 * L + l] ^ d[1][l], 1);
+			b[11][l] = rol64(a[7 * L + l] ^ d[2][l], 6);
+			b[12][l] = rol64(a[13 * L + l] ^ d[3][l], 25);
+			b[13][l] = rol64(a[19 * L + l] ^ d[4][l], 8);
+			b[14][l] = rol64(a[20 * L + l] ^ d[0][l], 18);
+			b[15][l] = rol64(a[4 * L + l] ^ d[4][l], 27);
+			b[16][l] = rol64(a[5 * L + l] ^ d[0][l], 36);
+			b[17][l] = rol64(a[11 * L + l] ^ d[1][l], 10);
+			b[18][l] = rol64(a[17 * L + l] ^ d[2][l], 15);
+			b[19][l] = rol64(a[23 * L + l] ^ d[3][l], 56);
+			b[20][l] = rol64(a[2 * L + l] ^ d[2][l], 62);
+			b[21][l] = rol64(a[8 * L + l] ^ d[3][l], 55);
+			b[22][l] = rol64(a[14 * L + l] ^ d[4][l], 39);
+			b[23][l] = rol64(a[15 * L + l] ^ d[0][l], 41);
+			b[24][l] = rol64(a[21 * L + l] ^ d[1][l], 2);
+			a[0 * L + l] = b[0][l] ^ (~b[1][l] & b[2][l]);
+			a[1 * L + l] = b[1][l] ^ (~b[2][l] & b[3][l]);
+			a[2 * L + l] = b[2][l] ^ (~b[3][l] & b[4][l]);
+			a[3 * L + l] = b[3][l] ^ (~b[4][l] & b[0][l]);
+			a[4 * L + l] = b[4][l] ^ (~b[0][l] & b[1][l]);
+			a[5 * L + l] = b[5][l] ^ (~b[6][l] & b[7][l]);
+			a[6 * L + l] = b[6][l] ^ (~b[7][l] & b[8][l]);
+			a[7 * L + l] = b[7][l] ^ (~b[8][l] & b[9][l]);
+			a[8 * L + l] = b[8][l] ^ (~b[9][l] & b[5][l]);
+			a[9 * L + l] = b[9][l] ^ (~b[5][l] & b[6][l]);
+			a[10 * L + l] = b[10][l] ^ (~b[11][l] & b[12][l]);
+			a[11 * L + l] = b[11][l] ^ (~b[12][l] & b[13][l]);
+			a[12 * L + l] = b[12][l] ^ (~b[13][l] & b[14][l]);
+			a[13 * L + l] = b[13][l] ^ (~b[14][l] & b[10][l]);
+			a[14 * L + l] = b[14][l] ^ (~b[10][l] & b[11][l]);
+			a[15 * L + l] = b[15][l] ^ (~b[16][l] & b[17][l]);
+			a[16 * L + l] = b[16][l] ^ (~b[17][l] & b[18][l]);
+			a[17 * L + l] = b[17][l] ^ (~b[18][l] & b[19][l]);
+			a[18 * L + l] = b[18][l] ^ (~b[19][l] & b[15][l]);
+			a[19 * L + l] = b[19][l] ^ (~b[15][l] & b[16][l]);
+			a[20 * L + l] = b[20][l] ^ (~b[21][l] & b[22][l]);
+			a[21 * L + l] = b[21][l] ^ (~b[22][l] & b[23][l]);
+			a[22 * L + l] = b[22][l] ^ (~b[23][l] & b[24][l]);
+			a[23 * L + l] = b[23][l] ^ (~b[24][l] & b[20][l]);
+			a[24 * L + l] = b[24][l] ^ (~b[20][l] & b[21][l]);
+			a[l] ^= c_keccakRoundConstants[round];
+		}
+	}
+}
+
+static inline uint64_t load64(byte const* _p)
+{
+	uint64_t ret = 0;
+	for (unsigned i = 8; i--;)
+		ret = (ret << 8) | _p[i];
+	return ret;
+}
+
+static inline void store64(byte* _p, uint64_t _v)
+{
+	for (unsigned i = 0; i < 8; ++i, _v >>= 8)
+		_p[i] = (byte)_v;
+}
+
+/// @returns the number of blocks @a _input takes once padded.
+static inline size_t keccakBlocks(bytesConstRef _input) { return _input.size() / c_keccakRate + 1; }
+
+/// @returns block @a _k of @a _input; the last, padded, one is written into @a o_pad.
+static inline byte const* keccakBlock(bytesConstRef _input, size_t _k, byte* o_pad)
+{
+	if (_k + 1 < keccakBlocks(_input))
+		return _input.data() + _k * c_keccakRate;
+	size_t r = _input.size() - _k * c_keccakRate;
+	memcpy(o_pad, _input.data() + _k * c_keccakRate, r);
+	memset(o_pad + r, 0, c_keccakRate - r);
+	o_pad[r] ^= 0x01;
+	o_pad[c_keccakRate - 1] ^= 0x80;
+	return o_pad;
+}
+
+/// Hash @a L inputs that take the same number of blocks.
+template <unsigned L> static void keccak256(bytesConstRef const* _inputs, byte* const* o_outs)
+{
+	uint64_t a[25 * L] = {};
+	byte pad[c_keccakRate];
+	for (size_t k = 0, n = keccakBlocks(_inputs[0]); k < n; ++k)
+	{
+		for (unsigned l = 0; l < L; ++l)
+		{
+			byte const* b = keccakBlock(_inputs[l], k, pad);
+			for (unsigned i = 0; i < c_keccakRateWords; ++i)
+				a[i * L + l] ^= load64(b + i * 8);
+		}
+		keccakF<L>(a);
+	}
+	for (unsigned l = 0; l < L; ++l)
+		for (unsigned i = 0; i < 4; ++i)
+			store64(o_outs[l] + i * 8, a[i * L + l]);
+}
+
 void eth::sha3(bytesConstRef _input, bytesRef _output)
 {
-	CryptoPP::SHA3_256 ctx;
-	ctx.Update((byte*)_input.data(), _input.size());
 	assert(_output.size() >= 32);
-	ctx.Final(_output.data());
+	byte* o = _output.data();
+	keccak256<1>(&_input, &o);
+}
+
+void eth::sha3Batch(std::vector<bytesConstRef> const& _inputs, h256* o_out)
+{
+	static const unsigned c_lanes = 4;
+	// Group by length so each four share a block count.
+	std::vector<unsigned> order(_inputs.size());
+	for (unsigned i = 0; i < order.size(); ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](unsigned a, unsigned b) { return keccakBlocks(_inputs[a]) < keccakBlocks(_inputs[b]); });
+
+	unsigned i = 0;
+	while (i < order.size())
+	{
+		bytesConstRef in[c_lanes];
+		byte* out[c_lanes];
+		unsigned n = 0;
+		for (; n < c_lanes && i + n < order.size() && keccakBlocks(_inputs[order[i + n]]) == keccakBlocks(_inputs[order[i]]); ++n)
+		{
+			in[n] = _inputs[order[i + n]];
+			out[n] = o_out[order[i + n]].data();
+		}
+		if (n == c_lanes)
+			keccak256<c_lanes>(in, out);
+		else
+			for (unsigned j = 0; j < n; ++j)
+				keccak256<1>(&in[j], &out[j]);
+		i += n;
+	}
 }
 
 bytes eth::sha3Bytes(bytesConstRef _input)
@@ -191,6 +511,59 @@ Address eth::toAddress(Secret _private)
 	return ret;
 }
 
+u256 eth::exp256(u256 _base, u256 _exp)
+{
+	// Powers of two are just shifts; anything else is square-and-multiply over the exponent's bits, high first.
+	if (!_exp)
+		return 1;
+	if (_base < 2)
+		return _base;
+	if (_base == 2)
+		return _exp < 256 ? (u256)1 << (unsigned)_exp : 0;
+	u256 ret = 1;
+	for (int i = (int)boost::multiprecision::msb(_exp); i >= 0 && ret; --i)
+	{
+		ret *= ret;
+		if (boost::multiprecision::bit_test(_exp, i))
+			ret *= _base;
+	}
+	return ret;
+}
+
+u256 eth::modExp(u256 _base, u256 _exp, u256 _mod)
+{
+	using u512 = boost::multiprecision::number<boost::multiprecision::cpp_int_backend<512, 512, boost::multiprecision::unsigned_magnitude, boost::multiprecision::unchecked, void>>;
+	if (!_mod)
+		return 0;
+	u512 m = _mod;
+	u512 b = _base % _mod;
+	u512 ret = 1 % m;
+	if (!_exp)
+		return (u256)ret;
+	for (int i = (int)boost::multiprecision::msb(_exp); i >= 0 && ret; --i)
+	{
+		ret = ret * ret % m;
+		if (boost::multiprecision::bit_test(_exp, i))
+			ret = ret * b % m;
+	}
+	return (u256)ret;
+}
+
+void eth::parallelFor(unsigned _n, unsigned _threads, std::function<void(unsigned)> const& _f)
+{
+	if (!_threads)
+		_threads = max(1u, thread::hardware_concurrency());
+	_threads = min(_threads, _n);
+	atomic<unsigned> next(0);
+	auto run = [&]() { for (unsigned i; (i = next++) < _n;) _f(i); };
+	vector<thread> helpers;
+	for (unsigned i = 1; i < _threads; ++i)
+		helpers.push_back(thread(run));
+	run();
+	for (auto& t: helpers)
+		t.join();
+}
+
 KeyPair KeyPair::create()
 {
 	static std::mt19937_64 s_eng(time(0));
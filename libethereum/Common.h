@@ -31,10 +31,13 @@
 #include <array>
 #include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <string>
 #include <cassert>
 #include <sstream>
 #include <cstdint>
+#include <functional>
 #include <type_traits>
 #include <boost/multiprecision/cpp_int.hpp>
 #include "vector_ref.h"
@@ -73,25 +76,26 @@ public:
 	enum { size = N };
 
 	FixedHash() { m_data.fill(0); }
-	FixedHash(Arith const& _arith) { toBigEndian(_arith, m_data); }
+	FixedHash(Arith _arith) { for (unsigned i = c_words; i-- != 0; _arith >>= c_wordBits) setWordBigEndian(i, (Word)_arith); }
 	explicit FixedHash(bytes const& _b) { memcpy(m_data.data(), _b.data(), std::min<uint>(_b.size(), N)); }
 	explicit FixedHash(byte const* _bs) { memcpy(m_data.data(), _bs, N); }
 
-	operator Arith() const { return fromBigEndian<Arith>(m_data); }
+	operator Arith() const { Arith ret = 0; for (unsigned i = 0; i < c_words; ++i) ret = (ret << c_wordBits) | wordBigEndian(i); return ret; }
 
-	operator bool() const { return ((Arith)*this) != 0; }
+	operator bool() const { Word ret = 0; for (unsigned i = 0; i < c_words; ++i) ret |= word(i); return ret != 0; }
 
-	bool operator==(FixedHash const& _c) const { return m_data == _c.m_data; }
-	bool operator!=(FixedHash const& _c) const { return m_data != _c.m_data; }
-	bool operator<(FixedHash const& _c) const { return m_data < _c.m_data; }
+	bool operator==(FixedHash const& _c) const { for (unsigned i = 0; i < c_words; ++i) if (word(i) != _c.word(i)) return false; return true; }
+	bool operator!=(FixedHash const& _c) const { return !operator==(_c); }
+	/// Orders as the big-endian numbers would; only the first word that differs need be put in that order.
+	bool operator<(FixedHash const& _c) const { for (unsigned i = 0; i < c_words; ++i) if (word(i) != _c.word(i)) return wordBigEndian(i) < _c.wordBigEndian(i); return false; }
 
-	FixedHash& operator^=(FixedHash const& _c) { for (auto i = 0; i < N; ++i) m_data[i] ^= _c.m_data[i]; return *this; }
+	FixedHash& operator^=(FixedHash const& _c) { for (unsigned i = 0; i < c_words; ++i) setWord(i, word(i) ^ _c.word(i)); return *this; }
 	FixedHash operator^(FixedHash const& _c) const { return FixedHash(*this) ^= _c; }
-	FixedHash& operator|=(FixedHash const& _c) { for (auto i = 0; i < N; ++i) m_data[i] |= _c.m_data[i]; return *this; }
+	FixedHash& operator|=(FixedHash const& _c) { for (unsigned i = 0; i < c_words; ++i) setWord(i, word(i) | _c.word(i)); return *this; }
 	FixedHash operator|(FixedHash const& _c) const { return FixedHash(*this) |= _c; }
-	FixedHash& operator&=(FixedHash const& _c) { for (auto i = 0; i < N; ++i) m_data[i] &= _c.m_data[i]; return *this; }
+	FixedHash& operator&=(FixedHash const& _c) { for (unsigned i = 0; i < c_words; ++i) setWord(i, word(i) & _c.word(i)); return *this; }
 	FixedHash operator&(FixedHash const& _c) const { return FixedHash(*this) &= _c; }
-	FixedHash& operator~() { for (auto i = 0; i < N; ++i) m_data[i] = ~m_data[i]; return *this; }
+	FixedHash& operator~() { for (unsigned i = 0; i < c_words; ++i) setWord(i, ~word(i)); return *this; }
 
 	byte& operator[](unsigned _i) { return m_data[_i]; }
 	byte operator[](unsigned _i) const { return m_data[_i]; }
@@ -107,7 +111,18 @@ public:
 	std::array<byte, N> const& asArray() const { return m_data; }
 
 private:
-	std::array<byte, N> m_data;
+	/// The widest word that divides the size, in which the data is handled. The data is aligned to it, so the size is
+	/// unchanged, and the words are read and written through memcpy, which the compiler makes single loads and stores.
+	using Word = typename std::conditional<N % 8 == 0, uint64_t, typename std::conditional<N % 4 == 0, uint32_t, byte>::type>::type;
+	static const unsigned c_words = N / sizeof(Word);
+	static const unsigned c_wordBits = sizeof(Word) * 8;
+
+	Word word(unsigned _i) const { Word ret; memcpy(&ret, m_data.data() + _i * sizeof(Word), sizeof(Word)); return ret; }
+	void setWord(unsigned _i, Word _w) { memcpy(m_data.data() + _i * sizeof(Word), &_w, sizeof(Word)); }
+	Word wordBigEndian(unsigned _i) const { Word ret = 0; for (unsigned j = 0; j < sizeof(Word); ++j) ret = (Word)(ret << 8) | m_data[_i * sizeof(Word) + j]; return ret; }
+	void setWordBigEndian(unsigned _i, Word _w) { for (unsigned j = sizeof(Word); j-- != 0; _w >>= 8) m_data[_i * sizeof(Word) + j] = (byte)_w; }
+
+	alignas(sizeof(Word)) std::array<byte, N> m_data;
 };
 
 template <unsigned N>
@@ -120,12 +135,31 @@ inline std::ostream& operator<<(std::ostream& _out, FixedHash<N> const& _h)
 	return _out;
 }
 
+}
+
+namespace std
+{
+
+/// Fixed hashes are (almost always) already uniformly distributed, so one word of them will do as a hash.
+/// The last word is taken, as numbers converted to hashes are zero at the front.
+template <unsigned N> struct hash<eth::FixedHash<N>>
+{
+	size_t operator()(eth::FixedHash<N> const& _h) const { size_t ret; memcpy(&ret, _h.data() + N - sizeof(size_t), sizeof(size_t)); return ret; }
+};
+
+}
+
+namespace eth
+{
+
 using h256 = FixedHash<32>;
 using h160 = FixedHash<20>;
 using h256s = std::vector<h256>;
 using h160s = std::vector<h160>;
 using h256Set = std::set<h256>;
 using h160Set = std::set<h160>;
+using h256Hash = std::unordered_set<h256>;
+using h160Hash = std::unordered_set<h160>;
 
 using Secret = h256;
 using Address = h160;
@@ -155,6 +189,14 @@ static const uint8_t DebugChannel = 253;
 static const uint8_t LogChannel = 252;
 static const uint8_t LeftChannel = 251;
 static const uint8_t RightChannel = 250;
+static const uint8_t ChainChannel = 249;
+static const uint8_t NetChannel = 248;
+
+/// Greatest verbosity of messages written; those of greater verbosity are dropped before they're even formatted.
+extern unsigned g_logVerbosity;
+
+/// Name the calling thread, for the log.
+void setThreadName(std::string const& _n);
 // Unused for now.
 /*template <uint8_t _Channel> struct LogName { static const char constexpr* name = "   "; };
 template <> struct LogName<LeftChannel> { static const char constexpr* name = "<<<"; };
@@ -167,7 +209,9 @@ template <> struct LogName<LogChannel> { static const char constexpr* name = "LO
 extern std::function<void(std::string const&, unsigned char)> g_debugPost;
 extern std::function<void(char, std::string const&)> g_syslogPost;
 
-void simpleDebugOut(std::string const&, unsigned char);
+/// Stamp @a _s with the time and thread and write it out (if channel @a _id is enabled). Writing happens on a thread of
+/// its own, so those logging don't wait on the terminal.
+void simpleDebugOut(std::string const& _s, unsigned char _id);
 
 template <unsigned char _Id = 0, bool _AutoSpacing = true>
 class DebugOutputStream
@@ -211,6 +255,13 @@ public:
 
 #define clog eth::SysLogOutputStream<true>()
 
+/// Messages of greater verbosity than this aren't compiled in at all.
+#ifndef ETH_LOG_MAX
+#define ETH_LOG_MAX 9
+#endif
+
+/// Log to channel @a C at verbosity @a V. What follows is evaluated only if the message is to be written.
+#define clogv(C, V) if ((V) > ETH_LOG_MAX || (V) > eth::g_logVerbosity || !eth::g_debugEnabled[C]) {} else eth::DebugOutputStream<C>()
 
 
 
@@ -380,6 +431,13 @@ inline u160 high160(u256 const& _t)
 	return (u160)(_t >> 96);
 }
 
+/// @returns @a _base raised to the power of @a _exp, modulo 2^256. At most 512 multiplications, whatever the operands.
+u256 exp256(u256 _base, u256 _exp);
+
+/// @returns @a _base raised to the power of @a _exp, modulo @a _mod (zero if @a _mod is zero). Intermediates are
+/// 512-bit, so like exp256() the cost is bounded by the bit length of @a _exp.
+u256 modExp(u256 _base, u256 _exp, u256 _mod);
+
 
 /// Concatenate two vectors of elements. _T must be POD.
 template <class _T>
@@ -410,6 +468,14 @@ h256 sha3(bytesConstRef _input);
 inline h256 sha3(bytes const& _input) { return sha3(bytesConstRef((bytes*)&_input)); }
 inline h256 sha3(std::string const& _input) { return sha3(bytesConstRef(_input)); }
 
+/// Hash each of @a _inputs into the corresponding element of @a o_out. Inputs taking the same number of Keccak
+/// blocks are hashed four at a time, their states interleaved so the permutation works on them side by side.
+void sha3Batch(std::vector<bytesConstRef> const& _inputs, h256* o_out);
+
+/// Call @a _f with each of 0 to @a _n - 1, spread across up to @a _threads threads (one per core if zero), the calling
+/// thread among them. Returns once all the calls have.
+void parallelFor(unsigned _n, unsigned _threads, std::function<void(unsigned)> const& _f);
+
 /// Convert a private key into the public key equivalent.
 /// @returns 0 if it's not a valid private key.
 Address toAddress(h256 _private);
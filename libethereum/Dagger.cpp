@@ -1,6 +1,9 @@
 #include <boost/detail/endian.hpp>
 #include <chrono>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #if WIN32
 #pragma warning(push)
 #pragma warning(disable:4244)
@@ -13,6 +16,7 @@
 #endif
 #include <random>
 #include "Common.h"
+#include "BlockChain.h"
 #include "Dagger.h"
 using namespace std;
 using namespace std::chrono;
@@ -22,29 +26,71 @@ namespace eth
 
 #if FAKE_DAGGER
 
+h256 Dagger::target(u256 const& _difficulty)
+{
+	return (u256)min<bigint>((bigint(1) << 256) / _difficulty, ~u256(0));
+}
+
+bool Dagger::search(h256 const& _root, u256& io_nonce, h256 const& _target, unsigned _count, h256& io_highest)
+{
+	// Attempts are hashed four at a time, each being the root followed by the big-endian bytes of the nonce that
+	// eval() would hash; the nonce is kept as those bytes and incremented in place.
+	unsigned const c_batch = 4;
+	std::array<bytes, c_batch> in;
+	std::vector<bytesConstRef> refs;
+	for (auto& i: in)
+	{
+		i = _root.asBytes() + bytes(32);
+		refs.push_back(&i);
+	}
+	h256 nonce = io_nonce;
+	std::array<h256, c_batch> e;
+	for (unsigned i = 0; i < _count; i += c_batch)
+	{
+		unsigned n = min(c_batch, _count - i);
+		refs.resize(n);
+		for (unsigned j = 0; j < n; ++j)
+		{
+			memcpy(in[j].data() + 32, nonce.data(), 32);
+			for (unsigned k = 32; k-- && !++nonce[k];) {}
+		}
+		sha3Batch(refs, e.data());
+		for (unsigned j = 0; j < n; ++j)
+		{
+			if (io_highest < e[j])
+				io_highest = e[j];
+			if (!(_target < e[j]))
+			{
+				io_nonce = (u256)h256(in[j].data() + 32);
+				return true;
+			}
+		}
+	}
+	io_nonce = (u256)nonce;
+	return false;
+}
+
 MineInfo Dagger::mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout, bool const& _continue)
 {
-	MineInfo ret{0, 0, false};
+	MineInfo ret{0, 0, false, 0};
 	static std::mt19937_64 s_eng((time(0)));
 	o_solution = std::uniform_int_distribution<uint>(0, ~(uint)0)(s_eng);
 
-	bigint d = (bigint(1) << 256) / _difficulty;
-	ret.requirement = toLog2((u256)d);
+	h256 t = target(_difficulty);
+	ret.requirement = toLog2((u256)t);
 
 	// 2^ 0      32      64      128      256
 	//   [--------*-------------------------]
 	//
 	// evaluate until we run out of time
-	for (auto startTime = steady_clock::now(); (steady_clock::now() - startTime) < milliseconds(_msTimeout) && _continue; o_solution += 1)
+	h256 highest;
+	for (auto startTime = steady_clock::now(); (steady_clock::now() - startTime) < milliseconds(_msTimeout) && _continue && !ret.completed; )
 	{
-		auto e = (bigint)(u256)eval(_root, o_solution);
-		ret.best = max(ret.best, toLog2((u256)e));
-		if (e <= d)
-		{
-			ret.completed = true;
-			break;
-		}
+		u256 from = o_solution;
+		ret.completed = search(_root, o_solution, t, 1024, highest);
+		ret.hashes += (uint)(o_solution - from) + (ret.completed ? 1 : 0);
 	}
+	ret.best = toLog2((u256)highest);
 
 	if (ret.completed)
 		assert(verify(_root, o_solution, _difficulty));
@@ -72,8 +118,28 @@ bool Dagger::verify(h256 const& _root, u256 const& _nonce, u256 const& _difficul
 	return eval(_root, _nonce) < bound(_difficulty);
 }
 
-bool Dagger::mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout, bool const& _continue)
+h256 Dagger::target(u256 const& _difficulty)
+{
+	return bound(_difficulty) - 1;
+}
+
+bool Dagger::search(h256 const& _root, u256& io_nonce, h256 const& _target, unsigned _count, h256& io_highest)
+{
+	for (unsigned i = 0; i < _count; ++i, ++io_nonce)
+	{
+		auto e = eval(_root, io_nonce);
+		if (io_highest < e)
+			io_highest = e;
+		if (!(_target < e))
+			return true;
+	}
+	return false;
+}
+
+MineInfo Dagger::mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout, bool const& _continue)
 {
+	MineInfo ret{toLog2(bound(_difficulty)), 0, false, 0};
+
 	// restart search if root has changed
 	if (m_root != _root)
 	{
@@ -87,13 +153,17 @@ bool Dagger::mine(u256& o_solution, h256 const& _root, u256 const& _difficulty,
 	// evaluate until we run out of time
 	for (auto startTime = steady_clock::now(); (steady_clock::now() - startTime) < milliseconds(_msTimeout) && _continue; m_nonce += 1)
 	{
-		if (eval(_root, m_nonce) < b)
+		auto e = eval(_root, m_nonce);
+		++ret.hashes;
+		ret.best = max(ret.best, toLog2((u256)e));
+		if (e < b)
 		{
 			o_solution = m_nonce;
-			return true;
+			ret.completed = true;
+			break;
 		}
 	}
-	return false;
+	return ret;
 }
 
 template <class _T>
@@ -124,10 +194,100 @@ inline h256 get(_T& _sha)
 	return ret;
 }
 
-h256 Dagger::node(h256 const& _root, h256 const& _xn, uint_fast32_t _L, uint_fast32_t _i)
+/// Nodes held by all NodeCaches between them.
+static atomic<size_t> s_nodes(0);
+
+/// Nodes of one (root, extranonce) DAG, filled in as they're first evaluated. Sharded so that several
+/// mining threads can use it at once. Stops taking new nodes once all the caches between them fill their
+/// share of the memory budget (Cache::MiningNodes).
+class Dagger::NodeCache
+{
+public:
+	~NodeCache() { s_nodes -= m_count; }
+
+	/// Roughly what a node takes in a shard's map.
+	static const size_t c_nodeBytes = 64;
+	/// The bytes all caches may hold between them when there's no memory budget.
+	static const size_t c_defaultLimit = 64 * 1024 * 1024;
+
+	bool get(uint_fast32_t _L, uint_fast32_t _i, h256& o_node)
+	{
+		auto k = key(_L, _i);
+		Shard& s = m_shards[k % c_shards];
+		lock_guard<mutex> l(s.x);
+		auto it = s.nodes.find(k);
+		if (it == s.nodes.end())
+			return false;
+		o_node = it->second;
+		return true;
+	}
+
+	void put(uint_fast32_t _L, uint_fast32_t _i, h256 const& _node)
+	{
+		auto k = key(_L, _i);
+		Shard& s = m_shards[k % c_shards];
+		if (s_nodes >= Defaults::memoryLimit(Cache::MiningNodes, c_defaultLimit) / c_nodeBytes)
+			return;
+		lock_guard<mutex> l(s.x);
+		if (s.nodes.insert(make_pair(k, _node)).second)
+		{
+			++s_nodes;
+			++m_count;
+		}
+	}
+
+private:
+	static const unsigned c_shards = 64;
+
+	static uint64_t key(uint_fast32_t _L, uint_fast32_t _i) { return ((uint64_t)_L << 32) | _i; }
+
+	struct Shard
+	{
+		mutex x;
+		unordered_map<uint64_t, h256> nodes;
+	};
+	std::array<Shard, c_shards> m_shards;
+	atomic<size_t> m_count{0};		///< Nodes held by this cache, given back to s_nodes when it goes.
+};
+
+size_t Dagger::cacheBytes()
+{
+	return s_nodes * NodeCache::c_nodeBytes;
+}
+
+/// The number of DAGs we keep nodes for; with several mining threads there's one per thread's extranonce.
+static const unsigned c_maxCaches = 16;
+
+shared_ptr<Dagger::NodeCache> Dagger::cache(h256 const& _root, h256 const& _xn)
+{
+	static mutex s_x;
+	static vector<pair<pair<h256, h256>, shared_ptr<NodeCache>>> s_caches;	// most recently used last.
+	lock_guard<mutex> l(s_x);
+	auto k = make_pair(_root, _xn);
+	for (auto it = s_caches.begin(); it != s_caches.end(); ++it)
+		if (it->first == k)
+		{
+			auto ret = it->second;
+			if (it + 1 != s_caches.end())
+			{
+				s_caches.erase(it);
+				s_caches.push_back(make_pair(k, ret));
+			}
+			return ret;
+		}
+	if (s_caches.size() == c_maxCaches)
+		s_caches.erase(s_caches.begin());
+	s_caches.push_back(make_pair(k, make_shared<NodeCache>()));
+	return s_caches.back().second;
+}
+
+h256 Dagger::node(h256 const& _root, h256 const& _xn, uint_fast32_t _L, uint_fast32_t _i, NodeCache& _cache)
 {
 	if (_L == _i)
 		return _root;
+	h256 ret;
+	if (_cache.get(_L, _i, ret))
+		return ret;
 	u256 m = (_L == 9) ? 16 : 3;
 	CryptoPP::SHA3_256 bsha;
 	for (uint_fast32_t k = 0; k < m; ++k)
@@ -139,15 +299,18 @@ h256 Dagger::node(h256 const& _root, h256 const& _xn, uint_fast32_t _L, uint_fas
 		update(sha, (u256)_i);
 		update(sha, (u256)k);
 		uint_fast32_t pk = (uint_fast32_t)(u256)get(sha) & ((1 << ((_L - 1) * 3)) - 1);
-		auto u = node(_root, _xn, _L - 1, pk);
+		auto u = node(_root, _xn, _L - 1, pk, _cache);
 		update(bsha, u);
 	}
-	return get(bsha);
+	ret = get(bsha);
+	_cache.put(_L, _i, ret);
+	return ret;
 }
 
 h256 Dagger::eval(h256 const& _root, u256 const& _nonce)
 {
 	h256 extranonce = _nonce >> 26;				// with xn = floor(n / 2^26) -> assuming this is with xn = floor(N / 2^26)
+	auto c = cache(_root, extranonce);
 	CryptoPP::SHA3_256 bsha;
 	for (uint_fast32_t k = 0; k < 4; ++k)
 	{
@@ -158,7 +321,7 @@ h256 Dagger::eval(h256 const& _root, u256 const& _nonce)
 		update(sha, _nonce);
 		update(sha, (u256)k);
 		uint_fast32_t pk = (uint_fast32_t)(u256)get(sha) & 0x1ffffff;	// mod 8^8 * 2  [ == mod 2^25 ?! ] [ == & ((1 << 25) - 1) ] [ == & 0x1ffffff ]
-		auto u = node(_root, extranonce, 9, pk);
+		auto u = node(_root, extranonce, 9, pk, *c);
 		update(bsha, u);
 	}
 	return get(bsha);
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <memory>
 #include "Common.h"
 
+#ifndef FAKE_DAGGER
 #define FAKE_DAGGER 1
+#endif
 
 namespace eth
 {
@@ -17,6 +20,7 @@ struct MineInfo
 	uint requirement;
 	uint best;
 	bool completed;
+	uint hashes;		///< Number of nonces tried.
 };
 
 #if FAKE_DAGGER
@@ -26,8 +30,17 @@ class Dagger
 public:
 	static h256 eval(h256 const& _root, u256 const& _nonce) { h256 b[2] = { _root, (h256)_nonce }; return sha3(bytesConstRef((byte const*)&b[0], 64)); }
 	static bool verify(h256 const& _root, u256 const& _nonce, u256 const& _difficulty) { return (bigint)(u256)eval(_root, _nonce) <= (bigint(1) << 256) / _difficulty; }
+	/// @returns the greatest value of eval() that satisfies @a _difficulty.
+	static h256 target(u256 const& _difficulty);
+	/// Try @a _count nonces from @a io_nonce upwards for one whose eval() is no greater than @a _target.
+	/// @returns true if one was found, leaving it in @a io_nonce; otherwise @a io_nonce is left just after the last tried.
+	/// @a io_highest is raised to the greatest eval() seen (which is what MineInfo::best reports).
+	static bool search(h256 const& _root, u256& io_nonce, h256 const& _target, unsigned _count, h256& io_highest);
 
 	MineInfo mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout = 100, bool const& _continue = bool(true));
+
+	/// @returns the bytes of DAG nodes cached, of which there are none here.
+	static size_t cacheBytes() { return 0; }
 };
 
 #else
@@ -42,12 +55,24 @@ public:
 	static u256 bound(u256 const& _difficulty);
 	static h256 eval(h256 const& _root, u256 const& _nonce);
 	static bool verify(h256 const& _root, u256 const& _nonce, u256 const& _difficulty);
+	/// @returns the greatest value of eval() that satisfies @a _difficulty.
+	static h256 target(u256 const& _difficulty);
+	/// Try @a _count nonces from @a io_nonce upwards for one whose eval() is no greater than @a _target.
+	/// @returns true if one was found, leaving it in @a io_nonce; otherwise @a io_nonce is left just after the last tried.
+	/// @a io_highest is raised to the greatest eval() seen (which is what MineInfo::best reports).
+	static bool search(h256 const& _root, u256& io_nonce, h256 const& _target, unsigned _count, h256& io_highest);
+
+	MineInfo mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout = 100, bool const& _continue = bool(true));
 
-	bool mine(u256& o_solution, h256 const& _root, u256 const& _difficulty, uint _msTimeout = 100, bool const& _continue = bool(true));
+	/// @returns the bytes of DAG nodes cached between all the DAGs, kept within Cache::MiningNodes's share of the budget.
+	static size_t cacheBytes();
 
 private:
+	class NodeCache;
 
-	static h256 node(h256 const& _root, h256 const& _xn, uint_fast32_t _L, uint_fast32_t _i);
+	/// @returns the DAG node cache for @a _root and @a _xn, shared between all threads evaluating them.
+	static std::shared_ptr<NodeCache> cache(h256 const& _root, h256 const& _xn);
+	static h256 node(h256 const& _root, h256 const& _xn, uint_fast32_t _L, uint_fast32_t _i, NodeCache& _cache);
 
 	h256 m_root;
 	u256 m_nonce;
@@ -36,12 +36,93 @@ namespace eth
 #define APPEND_CHILD appendRaw
 /**/
 
+/**
+ * @brief Slab allocator for the nodes of a single MemTrie.
+ * Each allocation is prefixed with a pointer back to its pool so that nodes can be deleted as normal. Freed
+ * allocations are recycled through per-size free lists and the slabs themselves are released all at once with
+ * the pool.
+ */
+class MemTriePool
+{
+public:
+	MemTriePool(bool _pooled): m_pooled(_pooled) { m_free.fill(nullptr); }
+	~MemTriePool() { for (auto i: m_slabs) ::operator delete(i); }
+
+	void* allocate(size_t _size);
+	void deallocate(void* _p, size_t _size);
+
+	/// @returns the pool which allocated @a _p.
+	static MemTriePool* owner(void const* _p) { return ((MemTriePool* const*)_p)[-1]; }
+
+private:
+	static const size_t c_align = 16;
+	static const size_t c_slabSize = 64 * 1024;
+	static const size_t c_classes = 16;
+
+	/// @returns the size of the allocation (header included) for an object of @a _size, in units of c_align.
+	static size_t units(size_t _size) { return (_size + c_align - 1) / c_align + 1; }
+
+	bool m_pooled;
+	std::vector<void*> m_slabs;
+	byte* m_next = nullptr;
+	byte* m_end = nullptr;
+	std::array<void*, c_classes> m_free;	///< Heads of the free lists, indexed by units(); each links through its first word.
+};
+
+void* MemTriePool::allocate(size_t _size)
+{
+	size_t u = units(_size);
+	byte* ret;
+	if (!m_pooled || u >= c_classes)
+		ret = (byte*)::operator new(u * c_align);
+	else if (m_free[u])
+	{
+		ret = (byte*)m_free[u];
+		m_free[u] = *(void**)ret;
+	}
+	else
+	{
+		if (m_next + u * c_align > m_end)
+		{
+			m_slabs.push_back(::operator new(c_slabSize));
+			m_next = (byte*)m_slabs.back();
+			m_end = m_next + c_slabSize;
+		}
+		ret = m_next;
+		m_next += u * c_align;
+	}
+	*(MemTriePool**)(ret + c_align - sizeof(MemTriePool*)) = this;
+	return ret + c_align;
+}
+
+void MemTriePool::deallocate(void* _p, size_t _size)
+{
+	size_t u = units(_size);
+	byte* p = (byte*)_p - c_align;
+	if (!m_pooled || u >= c_classes)
+		::operator delete(p);
+	else
+	{
+		*(void**)p = m_free[u];
+		m_free[u] = p;
+	}
+}
+
 class MemTrieNode
 {
 public:
 	MemTrieNode() {}
 	virtual ~MemTrieNode() {}
 
+	/// Nodes may only be allocated from a pool; deleting them returns them to it.
+	static void* operator new(size_t _size, MemTriePool& _pool) { return _pool.allocate(_size); }
+	static void operator delete(void* _p, MemTriePool& _pool) { _pool.deallocate(_p, sizeof(MemTrieNode)); }
+	static void operator delete(void* _p, size_t _size) { MemTriePool::owner(_p)->deallocate(_p, _size); }
+	static void* operator new(size_t) = delete;
+
+	/// @returns the pool this node was allocated from.
+	MemTriePool& pool() const { return *MemTriePool::owner(this); }
+
 	virtual std::string const& at(bytesConstRef _key) const = 0;
 	virtual MemTrieNode* insert(bytesConstRef _key, std::string const& _value) = 0;
 	virtual MemTrieNode* remove(bytesConstRef _key) = 0;
@@ -52,9 +133,11 @@ public:
 #endif
 
 	/// 256-bit hash of the node - this is a SHA-3/256 hash of the RLP of the node.
-	h256 hash256() const { RLPStream s; makeRLP(s); return eth::sha3(s.out()); }
-	bytes rlp() const { RLPStream s; makeRLP(s); return s.out(); }
-	void mark() { m_hash256 = h256(); }
+	h256 const& hash256() const { if (m_hash256 == h256()) m_hash256 = eth::sha3(rlp()); return m_hash256; }
+	/// RLP of the node; cached until the node is next marked.
+	bytes const& rlp() const { if (m_rlp.empty()) { RLPStream s; makeRLP(s); s.swapOut(m_rlp); } return m_rlp; }
+	/// Invalidate the cached RLP and hash. Must be called whenever the node or anything beneath it changes.
+	void mark() { m_hash256 = h256(); m_rlp.clear(); }
 
 protected:
 	virtual void makeRLP(RLPStream& _intoStream) const = 0;
@@ -63,10 +146,11 @@ protected:
 	virtual void debugPrintBody(std::string const& _indent = "") const = 0;
 #endif
 
-	static MemTrieNode* newBranch(bytesConstRef _k1, std::string const& _v1, bytesConstRef _k2, std::string const& _v2);
+	static MemTrieNode* newBranch(MemTriePool& _pool, bytesConstRef _k1, std::string const& _v1, bytesConstRef _k2, std::string const& _v2);
 
 private:
 	mutable h256 m_hash256;
+	mutable bytes m_rlp;
 };
 
 static const std::string c_nullString;
@@ -192,17 +276,19 @@ private:
 
 void MemTrieNode::putRLP(RLPStream& _parentStream) const
 {
-	RLPStream s;
-	makeRLP(s);
-	if (s.out().size() < 32)
-		_parentStream.APPEND_CHILD(s.out());
+	if (rlp().size() < 32)
+		_parentStream.APPEND_CHILD(rlp());
 	else
-		_parentStream << eth::sha3(s.out());
+		_parentStream << hash256();
 }
 
 void TrieBranchNode::makeRLP(RLPStream& _intoStream) const
 {
-	_intoStream.appendList(17);
+	// The children's encodings are cached, so the size of ours is known near enough before it's written.
+	uint size = m_value.size() + 1;
+	for (auto i: m_nodes)
+		size += i ? std::min<uint>(i->rlp().size(), 33) : 1;
+	_intoStream.appendList(17, size);
 	for (auto i: m_nodes)
 		if (i)
 			i->putRLP(_intoStream);
@@ -224,21 +310,21 @@ void TrieInfixNode::makeRLP(RLPStream& _intoStream) const
 	m_next->putRLP(_intoStream);
 }
 
-MemTrieNode* MemTrieNode::newBranch(bytesConstRef _k1, std::string const& _v1, bytesConstRef _k2, std::string const& _v2)
+MemTrieNode* MemTrieNode::newBranch(MemTriePool& _pool, bytesConstRef _k1, std::string const& _v1, bytesConstRef _k2, std::string const& _v2)
 {
 	uint prefix = commonPrefix(_k1, _k2);
 
 	MemTrieNode* ret;
 	if (_k1.size() == prefix)
-		ret = new TrieBranchNode(_k2[prefix], new TrieLeafNode(_k2.cropped(prefix + 1), _v2), _v1);
+		ret = new (_pool) TrieBranchNode(_k2[prefix], new (_pool) TrieLeafNode(_k2.cropped(prefix + 1), _v2), _v1);
 	else if (_k2.size() == prefix)
-		ret = new TrieBranchNode(_k1[prefix], new TrieLeafNode(_k1.cropped(prefix + 1), _v1), _v2);
+		ret = new (_pool) TrieBranchNode(_k1[prefix], new (_pool) TrieLeafNode(_k1.cropped(prefix + 1), _v1), _v2);
 	else // both continue after split
-		ret = new TrieBranchNode(_k1[prefix], new TrieLeafNode(_k1.cropped(prefix + 1), _v1), _k2[prefix], new TrieLeafNode(_k2.cropped(prefix + 1), _v2));
+		ret = new (_pool) TrieBranchNode(_k1[prefix], new (_pool) TrieLeafNode(_k1.cropped(prefix + 1), _v1), _k2[prefix], new (_pool) TrieLeafNode(_k2.cropped(prefix + 1), _v2));
 
 	if (prefix)
 		// have shared prefix - split.
-		ret = new TrieInfixNode(_k1.cropped(0, prefix), ret);
+		ret = new (_pool) TrieInfixNode(_k1.cropped(0, prefix), ret);
 
 	return ret;
 }
@@ -260,7 +346,7 @@ MemTrieNode* TrieBranchNode::insert(bytesConstRef _key, std::string const& _valu
 		m_value = _value;
 	else
 		if (!m_nodes[_key[0]])
-			m_nodes[_key[0]] = new TrieLeafNode(_key.cropped(1), _value);
+			m_nodes[_key[0]] = new (pool()) TrieLeafNode(_key.cropped(1), _value);
 		else
 			m_nodes[_key[0]] = m_nodes[_key[0]]->insert(_key.cropped(1), _value);
 	return this;
@@ -291,7 +377,7 @@ MemTrieNode* TrieBranchNode::rejig()
 	if (n == (byte)-1 && m_value.size())
 	{
 		// switch to leaf
-		auto r = new TrieLeafNode(bytesConstRef(), m_value);
+		auto r = new (pool()) TrieLeafNode(bytesConstRef(), m_value);
 		delete this;
 		return r;
 	}
@@ -301,9 +387,10 @@ MemTrieNode* TrieBranchNode::rejig()
 		if (auto b = dynamic_cast<TrieBranchNode*>(m_nodes[n]))
 		{
 			// switch to infix
+			auto r = new (pool()) TrieInfixNode(bytesConstRef(&n, 1), b);
 			m_nodes[n] = nullptr;
 			delete this;
-			return new TrieInfixNode(bytesConstRef(&n, 1), b);
+			return r;
 		}
 		else
 		{
@@ -311,6 +398,7 @@ MemTrieNode* TrieBranchNode::rejig()
 			assert(x);
 			// include in child
 			pushFront(x->m_ext, n);
+			x->mark();
 			m_nodes[n] = nullptr;
 			delete this;
 			return x;
@@ -352,7 +440,7 @@ MemTrieNode* TrieInfixNode::insert(bytesConstRef _key, std::string const& _value
 			// instead of pop_front()...
 			trimFront(m_ext, prefix);
 
-			return new TrieInfixNode(_key.cropped(0, prefix), insert(_key.cropped(prefix), _value));
+			return new (pool()) TrieInfixNode(_key.cropped(0, prefix), insert(_key.cropped(prefix), _value));
 		}
 		else
 		{
@@ -360,12 +448,12 @@ MemTrieNode* TrieInfixNode::insert(bytesConstRef _key, std::string const& _value
 			auto f = m_ext[0];
 			trimFront(m_ext, 1);
 			MemTrieNode* n = m_ext.empty() ? m_next : this;
+			TrieBranchNode* ret = new (pool()) TrieBranchNode(f, n);
 			if (n != this)
 			{
 				m_next = nullptr;
 				delete this;
 			}
-			TrieBranchNode* ret = new TrieBranchNode(f, n);
 			ret->insert(_key, _value);
 			return ret;
 		}
@@ -411,7 +499,7 @@ MemTrieNode* TrieLeafNode::insert(bytesConstRef _key, std::string const& _value)
 	else
 	{
 		// create new trie.
-		auto n = MemTrieNode::newBranch(_key, _value, bytesConstRef(&m_ext), m_value);
+		auto n = MemTrieNode::newBranch(pool(), _key, _value, bytesConstRef(&m_ext), m_value);
 		delete this;
 		return n;
 	}
@@ -427,6 +515,10 @@ MemTrieNode* TrieLeafNode::remove(bytesConstRef _key)
 	return this;
 }
 
+MemTrie::MemTrie(bool _pooled): m_pool(new MemTriePool(_pooled)), m_root(nullptr)
+{
+}
+
 MemTrie::~MemTrie()
 {
 	delete m_root;
@@ -463,7 +555,7 @@ void MemTrie::insert(std::string const& _key, std::string const& _value)
 	if (_value.empty())
 		remove(_key);
 	auto h = toHex(_key);
-	m_root = m_root ? m_root->insert(&h, _value) : new TrieLeafNode(bytesConstRef(&h), _value);
+	m_root = m_root ? m_root->insert(&h, _value) : new (*m_pool) TrieLeafNode(bytesConstRef(&h), _value);
 }
 
 void MemTrie::remove(std::string const& _key)
@@ -21,12 +21,14 @@
 
 #pragma once
 
+#include <memory>
 #include "Common.h"
 
 namespace eth
 {
 
 class MemTrieNode;
+class MemTriePool;
 
 /**
  * @brief Merkle Patricia Tree "Trie": a modifed base-16 Radix tree.
@@ -34,7 +36,8 @@ class MemTrieNode;
 class MemTrie
 {
 public:
-	MemTrie(): m_root(nullptr) {}
+	/// If @a _pooled is false, nodes are allocated individually on the heap rather than from the trie's slabs.
+	MemTrie(bool _pooled = true);
 	~MemTrie();
 
 	h256 hash256() const;
@@ -47,6 +50,7 @@ public:
 	void remove(std::string const& _key);
 
 private:
+	std::unique_ptr<MemTriePool> m_pool;
 	MemTrieNode* m_root;
 };
 
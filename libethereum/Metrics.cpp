@@ -0,0 +1,119 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Metrics.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include "Metrics.h"
+using namespace std;
+using namespace eth;
+
+namespace eth
+{
+
+template <class _T> struct Metric
+{
+	string help;
+	unique_ptr<_T> value;
+};
+
+struct Registry
+{
+	mutex x;
+	map<string, Metric<Counter>> counters;
+	map<string, Metric<Gauge>> gauges;
+	map<string, Metric<Histogram>> histograms;
+};
+
+/// Made on first use, so metrics may be asked for during static initialisation.
+static Registry& registry()
+{
+	static Registry s_registry;
+	return s_registry;
+}
+
+template <class _T> static _T& metric(map<string, Metric<_T>>& _m, string const& _name, string const& _help)
+{
+	lock_guard<mutex> l(registry().x);
+	auto& ret = _m[_name];
+	if (!ret.value)
+	{
+		ret.help = _help;
+		ret.value.reset(new _T);
+	}
+	return *ret.value;
+}
+
+}
+
+Counter& Metrics::counter(std::string const& _name, std::string const& _help)
+{
+	return metric(registry().counters, _name, _help);
+}
+
+Gauge& Metrics::gauge(std::string const& _name, std::string const& _help)
+{
+	return metric(registry().gauges, _name, _help);
+}
+
+Histogram& Metrics::histogram(std::string const& _name, std::string const& _help)
+{
+	return metric(registry().histograms, _name, _help);
+}
+
+std::string Metrics::text()
+{
+	Registry& r = registry();
+	lock_guard<mutex> l(r.x);
+	ostringstream out;
+	auto header = [&](string const& _name, string const& _help, char const* _type)
+	{
+		out << "# HELP " << _name << " " << _help << "\n# TYPE " << _name << " " << _type << "\n";
+	};
+	for (auto const& i: r.counters)
+	{
+		header(i.first, i.second.help, "counter");
+		out << i.first << " " << i.second.value->value() << "\n";
+	}
+	for (auto const& i: r.gauges)
+	{
+		header(i.first, i.second.help, "gauge");
+		out << i.first << " " << i.second.value->value() << "\n";
+	}
+	for (auto const& i: r.histograms)
+	{
+		Histogram const& h = *i.second.value;
+		header(i.first, i.second.help, "histogram");
+		// Buckets are cumulative, each up to and including its bound; the last is unbounded.
+		uint64_t total = 0;
+		for (unsigned b = 0; b < Histogram::c_buckets - 1; ++b)
+		{
+			total += h.bucket(b);
+			out << i.first << "_bucket{le=\"" << (((uint64_t)1 << b) - 1) << "\"} " << total << "\n";
+		}
+		total += h.bucket(Histogram::c_buckets - 1);
+		out << i.first << "_bucket{le=\"+Inf\"} " << total << "\n";
+		out << i.first << "_sum " << h.sum() << "\n";
+		out << i.first << "_count " << h.count() << "\n";
+	}
+	return out.str();
+}
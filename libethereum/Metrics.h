@@ -0,0 +1,101 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Metrics.h
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+namespace eth
+{
+
+/// A count that only goes up, e.g. of blocks imported. Lock-free.
+class Counter
+{
+public:
+	Counter& operator+=(uint64_t _n) { m_value.fetch_add(_n, std::memory_order_relaxed); return *this; }
+	Counter& operator++() { return *this += 1; }
+	uint64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<uint64_t> m_value{0};
+};
+
+/// A level that may go either way, e.g. the size of the transaction queue. Lock-free.
+class Gauge
+{
+public:
+	void set(int64_t _v) { m_value.store(_v, std::memory_order_relaxed); }
+	Gauge& operator+=(int64_t _n) { m_value.fetch_add(_n, std::memory_order_relaxed); return *this; }
+	int64_t value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<int64_t> m_value{0};
+};
+
+/// The distribution of a quantity, e.g. the time taken by each import, in buckets by powers of two. Lock-free.
+class Histogram
+{
+public:
+	/// Bucket 0 counts zeroes; bucket @a i, values of @a i bits. The last also counts everything larger.
+	static const unsigned c_buckets = 40;
+
+	Histogram() { for (auto& b: m_buckets) b = 0; }
+
+	void record(uint64_t _v)
+	{
+		unsigned b = 0;
+		for (; b < c_buckets - 1 && _v >> b; ++b) {}
+		m_buckets[b].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(_v, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const { return m_count.load(std::memory_order_relaxed); }
+	uint64_t sum() const { return m_sum.load(std::memory_order_relaxed); }
+	uint64_t bucket(unsigned _b) const { return m_buckets[_b].load(std::memory_order_relaxed); }
+
+private:
+	std::array<std::atomic<uint64_t>, c_buckets> m_buckets;
+	std::atomic<uint64_t> m_count{0};
+	std::atomic<uint64_t> m_sum{0};
+};
+
+/**
+ * @brief The process's metrics, by name, for monitoring.
+ * Each is made when first asked for and lasts as long as the process, so a reference to it may be kept (typically in a
+ * static) and updated with no further lookup; only asking for it takes a lock. Asking again for the same name gives
+ * the same one.
+ */
+class Metrics
+{
+public:
+	static Counter& counter(std::string const& _name, std::string const& _help);
+	static Gauge& gauge(std::string const& _name, std::string const& _help);
+	static Histogram& histogram(std::string const& _name, std::string const& _help);
+
+	/// @returns the values of all metrics, in the Prometheus text format.
+	static std::string text();
+};
+
+}
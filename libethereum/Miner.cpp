@@ -0,0 +1,139 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Miner.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#include <random>
+#include <chrono>
+#include "Miner.h"
+using namespace std;
+using namespace eth;
+
+/// Attempts each thread makes between checks for new work.
+#if FAKE_DAGGER
+static const unsigned c_batchSize = 1024;
+#else
+static const unsigned c_batchSize = 8;
+#endif
+
+Miner::Miner(unsigned _threads):
+	m_generation(0)
+{
+	if (!_threads)
+		_threads = max(1u, thread::hardware_concurrency());
+	for (unsigned i = 0; i < _threads; ++i)
+		m_threads.push_back(thread([=](){ setThreadName("miner" + toString(i)); run(i); }));
+}
+
+Miner::~Miner()
+{
+	{
+		lock_guard<mutex> l(m_x);
+		m_exiting = true;
+		++m_generation;
+	}
+	m_changed.notify_all();
+	for (auto& t: m_threads)
+		t.join();
+}
+
+void Miner::setWork(h256 const& _headerHash, u256 const& _difficulty)
+{
+	{
+		lock_guard<mutex> l(m_x);
+		if (_headerHash == m_headerHash && _difficulty == m_difficulty && (m_working || m_found))
+			return;
+		m_headerHash = _headerHash;
+		m_difficulty = _difficulty;
+		m_working = true;
+		m_found = false;
+		m_best = 0;
+		++m_generation;
+	}
+	m_changed.notify_all();
+}
+
+void Miner::stop()
+{
+	lock_guard<mutex> l(m_x);
+	if (m_working)
+	{
+		m_working = false;
+		++m_generation;
+	}
+}
+
+MineInfo Miner::wait(u256& o_nonce, uint _msTimeout)
+{
+	unique_lock<mutex> l(m_x);
+	m_changed.wait_for(l, chrono::milliseconds(_msTimeout), [&](){ return m_found || !m_working; });
+	MineInfo ret{m_difficulty ? toLog2((u256)((bigint(1) << 256) / m_difficulty)) : 0, m_best, m_found, m_hashes};
+	if (m_found)
+		o_nonce = m_nonce;
+	m_best = 0;
+	m_hashes = 0;
+	return ret;
+}
+
+void Miner::run(unsigned _index)
+{
+	mt19937_64 eng(time(0) + _index);
+	unsigned generation = 0;
+	while (true)
+	{
+		h256 headerHash;
+		h256 target;
+		{
+			unique_lock<mutex> l(m_x);
+			m_changed.wait(l, [&](){ return m_exiting || (m_working && m_generation != generation); });
+			if (m_exiting)
+				return;
+			generation = m_generation;
+			headerHash = m_headerHash;
+			target = Dagger::target(m_difficulty);
+		}
+
+		// Each thread has its own 2^248-nonce slice, in which it starts somewhere at random.
+		u256 nonce = ((u256)_index << 248) + eng();
+		h256 highest;
+		bool solved = false;
+		while (m_generation == generation)
+		{
+			u256 from = nonce;
+			bool found = Dagger::search(headerHash, nonce, target, c_batchSize, highest);
+			{
+				lock_guard<mutex> l(m_x);
+				m_hashes += (uint)(nonce - from) + (found ? 1 : 0);
+				if (found && m_generation == generation && !m_found)
+				{
+					m_found = true;
+					m_nonce = nonce;
+					m_working = false;
+					solved = true;
+				}
+				if (m_generation != generation || !m_working)
+					break;
+				m_best = max(m_best, toLog2((u256)highest));
+			}
+		}
+		m_changed.notify_all();
+		if (solved && m_onFound)
+			m_onFound();
+	}
+}
@@ -0,0 +1,82 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file Miner.h
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include "Common.h"
+#include "Dagger.h"
+
+namespace eth
+{
+
+/**
+ * @brief Searches for proof-of-work on several threads at once.
+ * Each thread works through its own slice of the nonce space against the current work package.
+ * A new package (i.e. a new header, due to a new block or new transactions) may be swapped in at
+ * any time with setWork(); the threads pick it up as soon as they finish their current batch.
+ */
+class Miner
+{
+public:
+	/// Start @a _threads worker threads, or one per core if zero. They sit idle until given work.
+	explicit Miner(unsigned _threads = 0);
+	~Miner();
+
+	/// Search for a nonce for the header whose nonceless hash is @a _headerHash at @a _difficulty.
+	/// Does nothing if that's the work we already have.
+	void setWork(h256 const& _headerHash, u256 const& _difficulty);
+	/// Stop searching until setWork() is next called with different work.
+	void stop();
+
+	/// Wait up to @a _msTimeout milliseconds for a solution to the current work.
+	/// @returns the progress (best & number of hashes) since the last call; if completed, @a o_nonce is the solution.
+	MineInfo wait(u256& o_nonce, uint _msTimeout);
+
+	unsigned threadCount() const { return m_threads.size(); }
+
+	/// Have @a _f called (from a mining thread) whenever a solution is found. Set it before giving any work.
+	void onFound(std::function<void()> const& _f) { m_onFound = _f; }
+
+private:
+	void run(unsigned _index);
+
+	std::vector<std::thread> m_threads;
+	std::function<void()> m_onFound;
+
+	std::mutex m_x;								///< Guards everything below but m_generation's reads.
+	std::condition_variable m_changed;			///< Signalled on new work, a solution or exit.
+	std::atomic<unsigned> m_generation;			///< Bumped whenever the work changes, so the threads know to drop what they're doing.
+	bool m_working = false;
+	bool m_exiting = false;
+	h256 m_headerHash;
+	u256 m_difficulty;
+	bool m_found = false;
+	u256 m_nonce;
+	uint m_best = 0;
+	uint m_hashes = 0;							///< Nonces tried since the last wait().
+};
+
+}
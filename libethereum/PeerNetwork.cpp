@@ -22,12 +22,16 @@
 #include <sys/types.h>
 #include <ifaddrs.h>
 
+#include <cmath>
 #include <chrono>
+#include <random>
 #include <miniupnpc/miniupnpc.h>
+#include <snappy.h>
 #include "Common.h"
 #include "BlockChain.h"
 #include "BlockInfo.h"
 #include "TransactionQueue.h"
+#include "Metrics.h"
 #include "PeerNetwork.h"
 using namespace std;
 using namespace eth;
@@ -35,6 +39,40 @@ using namespace eth;
 static const eth::uint c_maxHashes = 256;		///< Maximum number of hashes GetChain will ever send.
 static const eth::uint c_maxBlocks = 128;		///< Maximum number of blocks Blocks will ever send. BUG: if this gets too big (e.g. 2048) stuff starts going wrong.
 static const eth::uint c_maxBlocksAsk = 2048;	///< Maximum number of blocks we ask to receive in Blocks (when using GetChain).
+static const eth::uint c_maxHeaders = 512;		///< Maximum number of headers Headers will ever send.
+static const eth::uint c_capHeaders = 0x08;		///< Capability bit for peers that understand GetHeaders, Headers & GetBlocks.
+static const eth::uint c_capAnnounce = 0x10;	///< Capability bit for peers that understand NewBlockHashes.
+static const eth::uint c_capCompress = 0x20;	///< Capability bit for peers that understand Compressed.
+static const size_t c_compressThreshold = 1024;	///< Smallest message worth compressing.
+static const size_t c_maxUncompressed = 1 << 24;	///< Largest packet we'll decompress.
+static const unsigned c_knownBlocks = 1024;			///< Blocks we're sure to remember each peer knowing of.
+static const unsigned c_knownTransactions = 8192;	///< Transactions we're sure to remember each peer having sent us.
+static const unsigned c_transactionsSent = 65536;	///< Transactions we're sure to remember having relayed.
+static const eth::uint c_minBlocksAsk = 16;		///< Fewest blocks we ask a peer for in GetBlocks, if there are that many to get.
+static const double c_blocksAskSeconds = 2;		///< Time we'd like each GetBlocks to take to answer, given the peer's rate so far.
+static const chrono::seconds c_blocksStall(10);	///< Time after which an unanswered GetBlocks is given to someone else.
+static const chrono::seconds c_pingInterval(30);	///< Time between pings to each peer.
+static const chrono::seconds c_drainTimeout(2);	///< Time a closing server gives its peers to take its Disconnects.
+static const size_t c_maxNodes = 1024;				///< Most nodes we keep in the address book.
+static const size_t c_readSize = 65536;			///< Least room we leave at the end of the incoming buffer for each read.
+static const size_t c_maxGather = 64;				///< Most messages written to a peer in one go.
+static const size_t c_maxGatherBytes = 1 << 18;		///< Bytes beyond which no more messages are added to a write.
+static const size_t c_writeHighWater = 1 << 20;		///< Bytes queued for a peer beyond which we stop relaying it transactions.
+static const size_t c_hubReadSize = 4096;			///< Least room left for each read by a peer server, whose peers send little.
+static const size_t c_peersSample = 128;			///< Most peers a peer server gives in answer to GetPeers.
+static const chrono::seconds c_peersRefresh(5);	///< Time for which a peer server gives the same answer to GetPeers.
+static const size_t c_incomingBlocksLimit = 32 << 20;	///< Default bytes of received blocks that may await import.
+
+// Network logging, filtered by the server's verbosity; what follows is evaluated only if the message is to be written.
+#define clogS(X) if ((X) > ETH_LOG_MAX || m_server->m_verbosity < (X)) {} else eth::DebugOutputStream<eth::NetChannel, false>("") << std::setw(2) << m_handle << " | "
+#define clogN(X) if ((X) > ETH_LOG_MAX || m_verbosity < (X)) {} else eth::DebugOutputStream<eth::NetChannel, false>("")
+
+static Gauge& s_peers = Metrics::gauge("eth_net_peers", "Peers connected.");
+static Counter& s_packetsSent = Metrics::counter("eth_net_packets_sent", "Packets written to peers.");
+static Counter& s_bytesSent = Metrics::counter("eth_net_bytes_sent", "Bytes of packets written to peers.");
+static Counter& s_packetsReceived = Metrics::counter("eth_net_packets_received", "Packets received from peers.");
+static Counter& s_bytesReceived = Metrics::counter("eth_net_bytes_received", "Bytes of packets received from peers, once decompressed.");
+static Counter& s_blocksShed = Metrics::counter("eth_net_blocks_shed", "Blocks received but dropped, there being too many awaiting import already.");
 
 // Addresses we will skip during network interface discovery
 // Use a vector as the list is small
@@ -47,14 +85,67 @@ static const vector<bi::address> c_rejectAddresses = {
 	{bi::address_v6::from_string("::")}
 };
 
+RollingBloom::RollingBloom(unsigned _capacity, double _falsePositive):
+	m_capacity(max(_capacity, 1u))
+{
+	// Either filter may give a false positive, so each gets half the allowance. Optimal sizing for the rest.
+	double ln2 = log(2.0);
+	double bits = -(double)m_capacity * log(_falsePositive / 2) / (ln2 * ln2);
+	m_bits = ((size_t)ceil(bits) + 63) / 64 * 64;
+	m_hashes = max(1u, (unsigned)round(m_bits * ln2 / m_capacity));
+	m_filters[0].resize(m_bits / 64);
+	m_filters[1].resize(m_bits / 64);
+}
+
+size_t RollingBloom::bit(h256 const& _h, unsigned _i) const
+{
+	uint64_t w[2];
+	memcpy(w, _h.data(), sizeof(w));
+	return (size_t)((w[0] + _i * (w[1] | 1)) % m_bits);
+}
+
+bool RollingBloom::contains(std::vector<uint64_t> const& _f, h256 const& _h) const
+{
+	for (unsigned i = 0; i < m_hashes; ++i)
+	{
+		size_t b = bit(_h, i);
+		if (!(_f[b / 64] & ((uint64_t)1 << (b % 64))))
+			return false;
+	}
+	return true;
+}
+
+void RollingBloom::insert(h256 const& _h)
+{
+	if (m_inserted == m_capacity)
+	{
+		swap(m_filters[0], m_filters[1]);
+		m_filters[0].assign(m_filters[0].size(), 0);
+		m_inserted = 0;
+	}
+	for (unsigned i = 0; i < m_hashes; ++i)
+	{
+		size_t b = bit(_h, i);
+		m_filters[0][b / 64] |= (uint64_t)1 << (b % 64);
+	}
+	++m_inserted;
+}
+
 PeerSession::PeerSession(PeerServer* _s, bi::tcp::socket _socket, uint _rNId):
 	m_server(_s),
 	m_socket(std::move(_socket)),
 	m_reqNetworkId(_rNId),
-	m_rating(0)
+	m_rating(0),
+	// A peer server neither relays nor takes blocks or transactions, so needn't remember its peers' at all.
+	m_knownBlocks(_s->m_mode == NodeMode::PeerServer ? 1 : c_knownBlocks),
+	m_knownTransactions(_s->m_mode == NodeMode::PeerServer ? 1 : c_knownTransactions)
 {
 	m_disconnect = std::chrono::steady_clock::time_point::max();
-	m_connect = std::chrono::steady_clock::now();
+	m_connect = m_lastReceived = std::chrono::steady_clock::now();
+	try {
+		m_remote = m_socket.remote_endpoint();
+	} catch (...) {}
+	m_handle = m_socket.native_handle();
 }
 
 PeerSession::~PeerSession()
@@ -64,11 +155,8 @@ PeerSession::~PeerSession()
 
 bi::tcp::endpoint PeerSession::endpoint() const
 {
-	if (m_socket.is_open())
-		try {
-			return bi::tcp::endpoint(m_socket.remote_endpoint().address(), m_listenPort);
-		} catch (...){}
-
+	if (m_open && m_remote.port())
+		return bi::tcp::endpoint(m_remote.address(), m_listenPort);
 	return bi::tcp::endpoint();
 }
 
@@ -76,9 +164,17 @@ bi::tcp::endpoint PeerSession::endpoint() const
 
 bool PeerSession::interpret(RLP const& _r)
 {
-	if (m_server->m_verbosity >= 8)
-		cout << ">>> " << _r << endl;
-	switch (_r[0].toInt<unsigned>())
+	clogS(8) << ">>> " << _r;
+	unsigned type = _r[0].toInt<unsigned>();
+	m_lastReceived = chrono::steady_clock::now();
+	if (type < c_packetTypes)
+	{
+		++m_received[type].packets;
+		m_received[type].bytes += _r.data().size() + 8;
+	}
+	++s_packetsReceived;
+	s_bytesReceived += _r.data().size() + 8;
+	switch (type)
 	{
 	case Hello:
 	{
@@ -88,34 +184,40 @@ bool PeerSession::interpret(RLP const& _r)
 		m_caps = _r.itemCount() > 4 ? _r[4].toInt<uint>() : 0x07;
 		m_listenPort = _r.itemCount() > 5 ? _r[5].toInt<short>() : 0;
 
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | Hello: " << clientVersion << " " << showbase << hex << m_caps << dec << " " << m_listenPort << endl;
+		clogS(2) << "Hello: " << clientVersion << " " << showbase << hex << m_caps << dec << " " << m_listenPort;
 
 		if (m_protocolVersion != 0 || m_networkId != m_reqNetworkId)
 		{
 			disconnect();
 			return false;
 		}
-		try
-			{ m_info = PeerInfo({clientVersion, m_socket.remote_endpoint().address().to_string(), (short)m_socket.remote_endpoint().port(), std::chrono::steady_clock::duration()}); }
-		catch (...)
+		if (!m_remote.port())
 		{
+			// Gone before we could even ask who it was.
 			disconnect();
 			return false;
 		}
+		m_info = PeerInfo({clientVersion, m_remote.address().to_string(), (short)m_remote.port(), std::chrono::steady_clock::duration(), 0});
 
-		// Grab their block chain off them.
+		if (m_listenPort)
+			m_server->noteNode(endpoint());
+
+		// Grab their block chain off them; headers first if they can, otherwise whole blocks.
+		if (m_server->m_mode == NodeMode::Full && (m_caps & c_capHeaders))
+			requestHeaders(m_server->m_latestBlockSent);
+		else
 		{
-			unsigned count = std::min<unsigned>(c_maxHashes, m_server->m_chain->details(m_server->m_latestBlockSent).number + 1);
+			h256s l = locator(m_server->m_latestBlockSent);
 			RLPStream s;
-			prep(s).appendList(2 + count);
+			prep(s).appendList(2 + l.size());
 			s << (uint)GetChain;
-			auto h = m_server->m_latestBlockSent;
-			for (unsigned i = 0; i < count; ++i, h = m_server->m_chain->details(h).parent)
+			for (auto const& h: l)
 				s << h;
 			s << c_maxBlocksAsk;
 			sealAndSend(s);
-			s.clear();
+		}
+		{
+			RLPStream s;
 			prep(s).appendList(1);
 			s << GetTransactions;
 			sealAndSend(s);
@@ -123,16 +225,15 @@ bool PeerSession::interpret(RLP const& _r)
 		break;
 	}
 	case Disconnect:
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | Disconnect" << endl;
-		if (m_server->m_verbosity >= 1)
+		clogS(2) << "Disconnect";
+		if (m_open)
 		{
-			if (m_socket.is_open())
-				cout << "Closing " << m_socket.remote_endpoint() << endl;
-			else
-				cout << "Remote closed on " << m_socket.native_handle() << endl;
+			clogS(1) << "Closing " << m_remote;
 		}
-		m_socket.close();
+		else
+			clogS(1) << "Remote closed";
+		returnBlocksAsked();
+		close();
 		return false;
 	case Ping:
 	{
@@ -142,62 +243,68 @@ bool PeerSession::interpret(RLP const& _r)
 		break;
 	}
 	case Pong:
+		if (!m_awaitingPong)
+			break;
+		m_awaitingPong = false;
 		m_info.lastPing = std::chrono::steady_clock::now() - m_ping;
+		m_latency = m_latency.count() ? (m_latency * 7 + m_info.lastPing) / 8 : m_info.lastPing;
 //		cout << "Latency: " << chrono::duration_cast<chrono::milliseconds>(m_lastPing).count() << " ms" << endl;
 		break;
 	case GetPeers:
 	{
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | GetPeers" << endl;
+		clogS(2) << "GetPeers";
+		if (m_server->m_mode == NodeMode::PeerServer)
+		{
+			send(m_server->peersMessage());
+			break;
+		}
 		std::vector<bi::tcp::endpoint> peers = m_server->potentialPeers();
 		RLPStream s;
 		prep(s).appendList(peers.size() + 1);
 		s << (uint)Peers;
 		for (auto i: peers)
 		{
-			if (m_server->m_verbosity >= 3)
-				cout << "  Sending peer " << i << endl;
+			clogS(3) << "  Sending peer " << i;
 			s.appendList(2) << i.address().to_v4().to_bytes() << i.port();
 		}
 		sealAndSend(s);
 		break;
 	}
 	case Peers:
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | Peers (" << dec << (_r.itemCount() - 1) << " entries)" << endl;
+		clogS(2) << "Peers (" << dec << (_r.itemCount() - 1) << " entries)";
 		for (unsigned i = 1; i < _r.itemCount(); ++i)
 		{
 			auto ep = bi::tcp::endpoint(bi::address_v4(_r[i][0].toArray<byte, 4>()), _r[i][1].toInt<short>());
-			if (m_server->m_verbosity >= 6)
-				cout << "Checking: " << ep << endl;
+			clogS(6) << "Checking: " << ep;
 			// check that we're not already connected to addr:
 			if (!ep.port())
 				goto CONTINUE;
 			for (auto i: m_server->m_addresses)
 				if (ep.address() == i && ep.port() == m_server->listenPort())
 					goto CONTINUE;
+			m_server->noteNode(ep);
+			// A peer server waits to be connected to, rather than checking each against all its peers to dial it.
+			if (m_server->m_mode == NodeMode::PeerServer)
+				goto CONTINUE;
 			for (auto i: m_server->m_peers)
 				if (shared_ptr<PeerSession> p = i.lock())
 				{
-					if (m_server->m_verbosity >= 6)
-						cout << "   ...against " << p->endpoint() << endl;
-					if (p->m_socket.is_open() && p->endpoint() == ep)
+					clogS(6) << "   ...against " << p->endpoint();
+					if (p->m_open && p->endpoint() == ep)
 						goto CONTINUE;
 				}
 			for (auto i: m_server->m_incomingPeers)
 				if (i == ep)
 					goto CONTINUE;
 			m_server->m_incomingPeers.push_back(ep);
-			if (m_server->m_verbosity >= 3)
-				cout << "New peer: " << ep << endl;
+			clogS(3) << "New peer: " << ep;
 			CONTINUE:;
 		}
 		break;
 	case Transactions:
 		if (m_server->m_mode == NodeMode::PeerServer)
 			break;
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | Transactions (" << dec << (_r.itemCount() - 1) << " entries)" << endl;
+		clogS(2) << "Transactions (" << dec << (_r.itemCount() - 1) << " entries)";
 		m_rating += _r.itemCount() - 1;
 		for (unsigned i = 1; i < _r.itemCount(); ++i)
 		{
@@ -208,13 +315,23 @@ bool PeerSession::interpret(RLP const& _r)
 	case Blocks:
 		if (m_server->m_mode == NodeMode::PeerServer)
 			break;
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | Blocks (" << dec << (_r.itemCount() - 1) << " entries)" << endl;
+		clogS(2) << "Blocks (" << dec << (_r.itemCount() - 1) << " entries)";
+	{
 		m_rating += _r.itemCount() - 1;
+		h256Hash got;
 		for (unsigned i = 1; i < _r.itemCount(); ++i)
 		{
+			auto h = sha3(_r[i].data());
+			if (!m_server->m_blocksWanted.erase(h) && m_server->m_incomingBlocksSize >= m_server->m_incomingBlocksLimit)
+			{
+				// Unasked for, and we're behind already; it'll be announced again (or filled in from headers) later.
+				++s_blocksShed;
+				continue;
+			}
 			m_server->m_incomingBlocks.push_back(_r[i].data().toBytes());
-			m_knownBlocks.insert(sha3(_r[i].data()));
+			m_server->m_incomingBlocksSize += _r[i].data().size();
+			m_knownBlocks.insert(h);
+			got.insert(h);
 		}
 		if (m_server->m_verbosity >= 3)
 			for (unsigned i = 1; i < _r.itemCount(); ++i)
@@ -222,11 +339,48 @@ bool PeerSession::interpret(RLP const& _r)
 				auto h = sha3(_r[i].data());
 				BlockInfo bi(_r[i].data());
 				if (!m_server->m_chain->details(bi.parentHash) && !m_knownBlocks.count(bi.parentHash))
-					cerr << "*** Unknown parent " << bi.parentHash << " of block " << h << endl;
+				{
+					clogS(3) << "Unknown parent " << bi.parentHash << " of block " << h;
+				}
 				else
-					cerr << "--- Known parent " << bi.parentHash << " of block " << h << endl;
+					clogS(3) << "Known parent " << bi.parentHash << " of block " << h;
 			}
-		if (_r.itemCount() > 1)	// we received some - check if there's any more
+		bool reply = _r.itemCount() == 1;
+		for (auto const& h: m_blocksAsked)
+			reply = reply || got.count(h);
+		if (m_blocksAsked.size() && reply)
+		{
+			// The answer to our GetBlocks; whatever they left out they don't have, so someone else will have to be asked.
+			h256s lacking;
+			for (auto const& h: m_blocksAsked)
+				if (!got.count(h))
+					lacking.push_back(h);
+			if (lacking.size() < m_blocksAsked.size())
+			{
+				double secs = max(chrono::duration<double>(chrono::steady_clock::now() - m_blocksAskedAt).count(), 0.001);
+				double rate = (m_blocksAsked.size() - lacking.size()) / secs;
+				m_blockRate = m_blockRate ? m_blockRate * 0.75 + rate * 0.25 : rate;
+			}
+			m_lacksBlocks = !lacking.empty();
+			m_blocksAsked.swap(lacking);
+			returnBlocksAsked();
+			requestBlocks();
+		}
+		else if (m_server->m_mode == NodeMode::Full && (m_caps & c_capHeaders))
+		{
+			// Announced blocks; if we can't place one then fill in the gap, headers first.
+			m_lacksBlocks = false;
+			for (unsigned i = 1; i < _r.itemCount(); ++i)
+			{
+				auto p = BlockInfo(_r[i].data()).parentHash;
+				if (!m_server->m_chain->details(p) && !got.count(p) && !m_server->m_blocksWanted.count(p))
+				{
+					requestHeaders(m_server->m_chain->currentHash());
+					break;
+				}
+			}
+		}
+		else if (_r.itemCount() > 1)	// we received some - check if there's any more
 		{
 			RLPStream s;
 			prep(s).appendList(3);
@@ -236,6 +390,7 @@ bool PeerSession::interpret(RLP const& _r)
 			sealAndSend(s);
 		}
 		break;
+	}
 	case GetChain:
 	{
 		if (m_server->m_mode == NodeMode::PeerServer)
@@ -246,14 +401,12 @@ bool PeerSession::interpret(RLP const& _r)
 		parents.reserve(_r.itemCount() - 2);
 		for (unsigned i = 1; i < _r.itemCount() - 1; ++i)
 			parents.push_back(_r[i].toHash<h256>());
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | GetChain (" << (_r.itemCount() - 2) << " hashes, " << (_r[_r.itemCount() - 1].toInt<bigint>()) << ")" << endl;
+		clogS(2) << "GetChain (" << (_r.itemCount() - 2) << " hashes, " << (_r[_r.itemCount() - 1].toInt<bigint>()) << ")";
 		if (_r.itemCount() == 2)
 			break;
 		// return 2048 block max.
 		uint baseCount = (uint)min<bigint>(_r[_r.itemCount() - 1].toInt<bigint>(), c_maxBlocks);
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | GetChain (" << baseCount << " max, from " << parents.front() << " to " << parents.back() << ")" << endl;
+		clogS(2) << "GetChain (" << baseCount << " max, from " << parents.front() << " to " << parents.back() << ")";
 		for (auto parent: parents)
 		{
 			auto h = m_server->m_chain->currentHash();
@@ -267,27 +420,22 @@ bool PeerSession::interpret(RLP const& _r)
 				latestNumber = m_server->m_chain->details(latest).number;
 				parentNumber = m_server->m_chain->details(parent).number;
 				uint count = min<uint>(latestNumber - parentNumber, baseCount);
-				if (m_server->m_verbosity >= 6)
-					cout << "Requires " << dec << (latestNumber - parentNumber) << " blocks from " << latestNumber << " to " << parentNumber << endl
-					<< latest << " - " << parent << endl;
+				clogS(6) << "Requires " << dec << (latestNumber - parentNumber) << " blocks from " << latestNumber << " to " << parentNumber << " (" << latest << " - " << parent << ")";
 
 				prep(s);
 				s.appendList(1 + count) << (uint)Blocks;
 				uint endNumber = m_server->m_chain->details(parent).number;
 				uint startNumber = endNumber + count;
-				if (m_server->m_verbosity >= 6)
-					cout << "Sending " << dec << count << " blocks from " << startNumber << " to " << endNumber << endl;
+				clogS(6) << "Sending " << dec << count << " blocks from " << startNumber << " to " << endNumber;
 
-				uint n = latestNumber;
-				for (; n > startNumber; n--, h = m_server->m_chain->details(h).parent) {}
+				uint n = startNumber;
+				h = m_server->m_chain->numberHash(n);
 				for (uint i = 0; h != parent && n > endNumber && i < count; ++i, --n, h = m_server->m_chain->details(h).parent)
 				{
-					if (m_server->m_verbosity >= 6)
-						cout << "   " << dec << i << " " << h << endl;
-					s.appendRaw(m_server->m_chain->block(h));
+					clogS(6) << "   " << dec << i << " " << h;
+					s.appendRaw(m_server->m_chain->block(h).ref());
 				}
-				if (m_server->m_verbosity >= 6)
-					cout << "Parent: " << h << endl;
+				clogS(6) << "Parent: " << h;
 			}
 			else if (parent != parents.back())
 				continue;
@@ -298,8 +446,7 @@ bool PeerSession::interpret(RLP const& _r)
 				if (parent == parents.back())
 				{
 					// out of parents...
-					if (m_server->m_verbosity >= 6)
-						cout << std::setw(2) << m_socket.native_handle() << " | GetChain failed; not in chain" << endl;
+					clogS(6) << "GetChain failed; not in chain";
 					// No good - must have been on a different branch.
 					s.clear();
 					prep(s).appendList(2) << (uint)NotInChain << parents.back();
@@ -320,12 +467,10 @@ bool PeerSession::interpret(RLP const& _r)
 		if (m_server->m_mode == NodeMode::PeerServer)
 			break;
 		h256 noGood = _r[1].toHash<h256>();
-		if (m_server->m_verbosity >= 2)
-			cout << std::setw(2) << m_socket.native_handle() << " | NotInChain (" << noGood << ")" << endl;
+		clogS(2) << "NotInChain (" << noGood << ")";
 		if (noGood == m_server->m_chain->genesisHash())
 		{
-			if (m_server->m_verbosity)
-				cout << std::setw(2) << m_socket.native_handle() << " | Discordance over genesis block! Disconnect." << endl;
+			clogS(1) << "Discordance over genesis block! Disconnect.";
 			disconnect();
 		}
 		else
@@ -349,17 +494,268 @@ bool PeerSession::interpret(RLP const& _r)
 		m_requireTransactions = true;
 		break;
 	}
+	case GetHeaders:
+	{
+		if (m_server->m_mode == NodeMode::PeerServer || _r.itemCount() < 3)
+			break;
+		auto const& bc = *m_server->m_chain;
+		unsigned max = (unsigned)min<bigint>(_r[1].toInt<bigint>(), c_maxHeaders);
+		clogS(2) << "GetHeaders (" << (_r.itemCount() - 2) << " hashes, " << max << " max)";
+
+		// The first of their hashes that's on our best chain; what follows it there is read from the number index, so
+		// however far back it is, no more than we send is looked at.
+		uint best = bc.details().number;
+		uint from = 0;
+		bool found = false;
+		for (unsigned i = 2; i < _r.itemCount() && !found; ++i)
+		{
+			h256 l = _r[i].toHash<h256>();
+			auto const& d = bc.details(l);
+			if (d && d.number <= best && bc.numberHash(d.number) == l)
+			{
+				from = d.number;
+				found = true;
+			}
+		}
+
+		RLPStream s;
+		if (found)
+		{
+			unsigned count = (unsigned)min<uint>(best - from, max);
+			prep(s).appendList(count + 1) << (uint)Headers;
+			for (unsigned i = 1; i <= count; ++i)
+			{
+				auto b = bc.numberHash(from + i);
+				s.appendList(2) << b;
+				s.appendRaw(RLP(bc.block(b).ref())[0].data());
+			}
+		}
+		else
+			prep(s).appendList(2) << (uint)NotInChain << _r[_r.itemCount() - 1].toHash<h256>();
+		sealAndSend(s);
+		break;
+	}
+	case Headers:
+	{
+		if (m_server->m_mode == NodeMode::PeerServer)
+			break;
+		clogS(2) << "Headers (" << dec << (_r.itemCount() - 1) << " entries)";
+		if (_r.itemCount() - 1 > c_maxHeaders)
+		{
+			clogS(1) << "Too many headers. Disconnect.";
+			disconnect();
+			return false;
+		}
+
+		// Each header must carry valid proof-of-work and follow on from the one before; the first from a block we already know of.
+		auto const& bc = *m_server->m_chain;
+		h256 last;
+		for (unsigned i = 1; i < _r.itemCount(); ++i)
+		{
+			h256 h = _r[i][0].toHash<h256>();
+			BlockInfo bi;
+			try
+			{
+				bi.populateFromHeader(_r[i][1]);
+			}
+			catch (...)
+			{
+				clogS(1) << "Bad header " << h << ". Disconnect.";
+				disconnect();
+				return false;
+			}
+			if (last ? bi.parentHash != last : (!bc.details(bi.parentHash) && !m_server->m_blocksWanted.count(bi.parentHash)))
+			{
+				clogS(1) << "Unlinked header " << h << ". Disconnect.";
+				disconnect();
+				return false;
+			}
+			last = h;
+			if (!bc.details(h) && !m_server->m_blocksWanted.count(h))
+			{
+				m_server->m_blocksNeeded.push_back(h);
+				m_server->m_blocksWanted.insert(h);
+				++m_rating;
+			}
+		}
+
+		// A full batch means there's probably more; ask for it while the bodies of this lot come in.
+		if (_r.itemCount() - 1 == c_maxHeaders)
+			requestHeaders(last);
+		m_lacksBlocks = false;
+		requestBlocks();
+		break;
+	}
+	case GetBlocks:
+	{
+		if (m_server->m_mode == NodeMode::PeerServer)
+			break;
+		clogS(2) << "GetBlocks (" << dec << (_r.itemCount() - 1) << " entries)";
+		h256s have;
+		for (unsigned i = 1; i < _r.itemCount() && have.size() < c_maxBlocks; ++i)
+		{
+			auto h = _r[i].toHash<h256>();
+			if (m_server->m_chain->details(h))
+				have.push_back(h);
+		}
+		RLPStream s;
+		prep(s).appendList(have.size() + 1) << (uint)Blocks;
+		for (auto const& h: have)
+			s.appendRaw(m_server->m_chain->block(h).ref());
+		sealAndSend(s);
+		break;
+	}
+	case Compressed:
+	{
+		// Another packet, squeezed with Snappy.
+		bytesConstRef z = _r[1].toBytesConstRef();
+		size_t size;
+		bytes d;
+		if (snappy::GetUncompressedLength((char const*)z.data(), z.size(), &size) && size <= c_maxUncompressed)
+		{
+			d.resize(size);
+			if (!snappy::RawUncompress((char const*)z.data(), z.size(), (char*)d.data()))
+				d.clear();
+		}
+		if (d.empty() || RLP(&d)[0].toInt<unsigned>() == Compressed)
+		{
+			clogS(1) << "Bad compressed packet. Disconnect.";
+			disconnect();
+			return false;
+		}
+		return interpret(RLP(&d));
+	}
+	case NewBlockHashes:
+	{
+		if (m_server->m_mode == NodeMode::PeerServer)
+			break;
+		clogS(2) << "NewBlockHashes (" << dec << (_r.itemCount() - 1) << " entries)";
+
+		// Each is [hash, number, total difficulty]. Fetch the bodies of any that would better our chain; if one's beyond
+		// the block after our head then there's a gap, which is filled in headers first.
+		auto const& bc = *m_server->m_chain;
+		auto best = bc.details();
+		bool gap = false;
+		bool wanted = false;
+		for (unsigned i = 1; i < _r.itemCount(); ++i)
+		{
+			auto h = _r[i][0].toHash<h256>();
+			m_knownBlocks.insert(h);
+			if (bc.details(h) || m_server->m_blocksWanted.count(h) || _r[i][2].toInt<u256>() <= best.totalDifficulty)
+				continue;
+			if (_r[i][1].toInt<uint>() > best.number + 1)
+				gap = true;
+			else
+			{
+				m_server->m_blocksNeeded.push_back(h);
+				m_server->m_blocksWanted.insert(h);
+				wanted = true;
+			}
+		}
+		if (gap)
+			requestHeaders(bc.currentHash());
+		if (wanted)
+		{
+			m_lacksBlocks = false;
+			requestBlocks();
+		}
+		break;
+	}
 	default:
 		break;
 	}
 	return true;
 }
 
+h256s PeerSession::locator(h256 _h) const
+{
+	auto const& bc = *m_server->m_chain;
+	h256s ret;
+	for (unsigned step = 1; _h != bc.genesisHash() && bc.details(_h); )
+	{
+		ret.push_back(_h);
+		if (ret.size() > 10)
+			step *= 2;
+		uint n = bc.details(_h).number;
+		_h = bc.ancestor(_h, n > step ? n - step : 0);
+	}
+	ret.push_back(bc.genesisHash());
+	return ret;
+}
+
+void PeerSession::requestHeaders(h256 _from)
+{
+	// _from may be a header we've yet to get the block for; fall back on our own chain in case they've since reorganised.
+	h256s l;
+	if (m_server->m_chain->details(_from))
+		l = locator(_from);
+	else
+	{
+		l = locator(m_server->m_chain->currentHash());
+		l.insert(l.begin(), _from);
+	}
+
+	RLPStream s;
+	prep(s).appendList(2 + l.size());
+	s << (uint)GetHeaders << c_maxHeaders;
+	for (auto const& h: l)
+		s << h;
+	sealAndSend(s);
+}
+
+void PeerSession::requestBlocks()
+{
+	// Ask for no more while what's come in already is over budget; process() asks again as it's imported.
+	if (m_blocksAsked.size() || m_lacksBlocks || m_server->m_incomingBlocksSize >= m_server->m_incomingBlocksLimit)
+		return;
+	auto& needed = m_server->m_blocksNeeded;
+	eth::uint ask = m_blockRate ? max(c_minBlocksAsk, min(c_maxBlocks, (eth::uint)(m_blockRate * c_blocksAskSeconds))) : c_minBlocksAsk;
+	while (m_blocksAsked.size() < ask && needed.size())
+	{
+		auto h = needed.front();
+		needed.pop_front();
+		if (m_server->m_chain->details(h))
+			m_server->m_blocksWanted.erase(h);
+		else
+			m_blocksAsked.push_back(h);
+	}
+	if (m_blocksAsked.empty())
+		return;
+	m_blocksAskedAt = chrono::steady_clock::now();
+
+	RLPStream s;
+	prep(s).appendList(m_blocksAsked.size() + 1) << (uint)GetBlocks;
+	for (auto const& h: m_blocksAsked)
+		s << h;
+	sealAndSend(s);
+}
+
+void PeerSession::returnBlocksAsked()
+{
+	// They're the lowest outstanding, so the ones most likely holding up the import.
+	auto& needed = m_server->m_blocksNeeded;
+	needed.insert(needed.begin(), m_blocksAsked.begin(), m_blocksAsked.end());
+	m_blocksAsked.clear();
+}
+
 void PeerSession::ping()
 {
 	RLPStream s;
 	sealAndSend(prep(s).appendList(1) << Ping);
-	m_ping = std::chrono::steady_clock::now();
+	// Should the last still be unanswered, it's from that one we measure.
+	if (!m_awaitingPong)
+		m_ping = std::chrono::steady_clock::now();
+	m_awaitingPong = true;
+}
+
+chrono::steady_clock::duration PeerSession::latency(chrono::steady_clock::time_point _now) const
+{
+	return m_awaitingPong ? max(m_latency, _now - m_ping) : m_latency;
+}
+
+double PeerSession::worth(chrono::steady_clock::time_point _now) const
+{
+	return (m_rating + 1) / (1 + chrono::duration<double>(latency(_now)).count() * 4);
 }
 
 RLPStream& PeerSession::prep(RLPStream& _s)
@@ -369,8 +765,7 @@ RLPStream& PeerSession::prep(RLPStream& _s)
 
 void PeerServer::seal(bytes& _b)
 {
-	if (m_verbosity >= 9)
-		cout << "<<< " << RLP(bytesConstRef(&_b).cropped(8)) << endl;
+	clogN(9) << "<<< " << RLP(bytesConstRef(&_b).cropped(8));
 	_b[0] = 0x22;
 	_b[1] = 0x40;
 	_b[2] = 0x08;
@@ -394,40 +789,99 @@ void PeerSession::sendDestroy(bytes& _msg)
 {
 	std::shared_ptr<bytes> buffer = std::make_shared<bytes>();
 	swap(*buffer, _msg);
-	assert((*buffer)[0] == 0x22);
-//	cout << "Sending " << (buffer->size() - 8) << endl;
-//	cout << "Sending " << RLP(bytesConstRef(buffer.get()).cropped(8)) << endl;
-	ba::async_write(m_socket, ba::buffer(*buffer), [=](boost::system::error_code ec, std::size_t length)
+	send(buffer);
+}
+
+void PeerSession::send(std::shared_ptr<bytes const> const& _msg)
+{
+	assert((*_msg)[0] == 0x22);
+	std::shared_ptr<bytes const> msg = _msg;
+	if ((m_caps & c_capCompress) && _msg->size() >= c_compressThreshold)
 	{
-		if (ec)
-			dropped();
-//		cout << length << " bytes written (EC: " << ec << ")" << endl;
+		// Worth it only if it saves more than the wrapping costs.
+		string z;
+		snappy::Compress((char const*)_msg->data() + 8, _msg->size() - 8, &z);
+		if (z.size() + 16 < _msg->size())
+		{
+			RLPStream s;
+			prep(s).appendList(2) << (uint)Compressed << bytesConstRef((byte const*)z.data(), z.size());
+			auto b = make_shared<bytes>();
+			s.swapOut(*b);
+			m_server->seal(*b);
+			msg = b;
+		}
+	}
+//	cout << "Sending " << (msg->size() - 8) << endl;// RLP(bytesConstRef(msg.get()).cropped(8)) << endl;
+	m_queuedBytes += msg->size();
+	auto self(shared_from_this());
+	m_server->m_ioService.post([this, self, msg]()
+	{
+		m_writeQueue.push_back(msg);
+		if (!m_writing)
+			write();
 	});
 }
 
-void PeerSession::send(bytesConstRef _msg)
+void PeerSession::write()
 {
-	std::shared_ptr<bytes> buffer = std::make_shared<bytes>(_msg.toBytes());
-	assert((*buffer)[0] == 0x22);
-//	cout << "Sending " << (_msg.size() - 8) << endl;// RLP(bytesConstRef(buffer.get()).cropped(8)) << endl;
-	ba::async_write(m_socket, ba::buffer(*buffer), [=](boost::system::error_code ec, std::size_t length)
+	// Whatever has queued up since the last write goes out together, in one system call.
+	m_writeBuffers.clear();
+	size_t total = 0;
+	for (m_writing = 0; m_writing < m_writeQueue.size() && m_writing < c_maxGather && total < c_maxGatherBytes; ++m_writing)
+	{
+		m_writeBuffers.push_back(ba::buffer(*m_writeQueue[m_writing]));
+		total += m_writeQueue[m_writing]->size();
+	}
+
+	auto self(shared_from_this());
+	ba::async_write(m_socket, m_writeBuffers, [this, self, total](boost::system::error_code ec, std::size_t /*length*/)
 	{
-		if (ec)
-			dropped();
 //		cout << length << " bytes written (EC: " << ec << ")" << endl;
+		if (ec)
+		{
+			for (auto const& i: m_writeQueue)
+				m_queuedBytes -= i->size();
+			m_writeQueue.clear();
+			m_writing = 0;
+			if (m_closeAfterWrites)
+				m_socket.close();
+			m_server->handOff(self, bytes());
+			return;
+		}
+		{
+			lock_guard<mutex> l(m_sentLock);
+			for (size_t i = 0; i < m_writing; ++i)
+			{
+				auto const& m = *m_writeQueue[i];
+				unsigned type = RLP(bytesConstRef(&m).cropped(8))[0].toInt<unsigned>();
+				if (type < c_packetTypes)
+				{
+					++m_sent[type].packets;
+					m_sent[type].bytes += m.size();
+				}
+			}
+		}
+		s_packetsSent += m_writing;
+		s_bytesSent += total;
+		m_writeQueue.erase(m_writeQueue.begin(), m_writeQueue.begin() + m_writing);
+		m_writing = 0;
+		m_queuedBytes -= total;
+		if (!m_writeQueue.empty())
+			write();
+		else if (m_closeAfterWrites)
+			m_socket.close();
 	});
 }
 
 void PeerSession::dropped()
 {
-	if (m_server->m_verbosity >= 1)
-	{
-		if (m_socket.is_open())
-			try {
-				cout << "Closing " << m_socket.remote_endpoint() << endl;
-			}catch (...){}
-	}
-	m_socket.close();
+	if (m_dropped)
+		return;
+	m_dropped = true;
+	if (m_open)
+		clogS(1) << "Closing " << m_remote;
+	returnBlocksAsked();
+	close();
 	for (auto i = m_server->m_peers.begin(); i != m_server->m_peers.end(); ++i)
 		if (i->lock().get() == this)
 		{
@@ -438,7 +892,8 @@ void PeerSession::dropped()
 
 void PeerSession::disconnect()
 {
-	if (m_socket.is_open())
+	returnBlocksAsked();
+	if (m_open)
 	{
 		if (m_disconnect == chrono::steady_clock::time_point::max())
 		{
@@ -450,25 +905,30 @@ void PeerSession::disconnect()
 		}
 		else
 		{
-			if (m_server->m_verbosity >= 1)
-			{
-				if (m_socket.is_open())
-					try {
-						cout << "Closing " << m_socket.remote_endpoint() << endl;
-					} catch (...){}
-				else
-					cout << "Remote closed on" << m_socket.native_handle() << endl;
-			}
-			m_socket.close();
+			clogS(1) << "Closing " << m_remote;
+			close();
 		}
 	}
 }
 
+void PeerSession::close(bool _afterWrites)
+{
+	m_open = false;
+	auto self(shared_from_this());
+	m_server->m_ioService.post([this, self, _afterWrites]()
+	{
+		if (_afterWrites && m_writing)
+			m_closeAfterWrites = true;
+		else
+			m_socket.close();
+	});
+}
+
 void PeerSession::start()
 {
 	RLPStream s;
 	prep(s);
-	s.appendList(m_server->m_public.port() ? 6 : 5) << (uint)Hello << (uint)0 << (uint)0 << m_server->m_clientVersion << (m_server->m_mode == NodeMode::Full ? 0x07 : m_server->m_mode == NodeMode::PeerServer ? 0x01 : 0);
+	s.appendList(m_server->m_public.port() ? 6 : 5) << (uint)Hello << (uint)0 << (uint)0 << m_server->m_clientVersion << (m_server->m_mode == NodeMode::Full ? 0x07 | c_capHeaders | c_capAnnounce | c_capCompress : m_server->m_mode == NodeMode::PeerServer ? 0x01 : 0);
 	if (m_server->m_public.port())
 		s << m_server->m_public.port();
 	sealAndSend(s);
@@ -480,49 +940,67 @@ void PeerSession::start()
 
 void PeerSession::doRead()
 {
+	// Make room for the read at the end of the buffer, reclaiming what's already been interpreted before growing it.
+	if (m_incomingBegin == m_incomingEnd)
+		m_incomingBegin = m_incomingEnd = 0;
+	size_t readSize = m_server->m_mode == NodeMode::PeerServer ? c_hubReadSize : c_readSize;
+	if (m_incoming.size() - m_incomingEnd < readSize && m_incomingBegin)
+	{
+		memmove(m_incoming.data(), m_incoming.data() + m_incomingBegin, m_incomingEnd - m_incomingBegin);
+		m_incomingEnd -= m_incomingBegin;
+		m_incomingBegin = 0;
+	}
+	if (m_incoming.size() - m_incomingEnd < readSize)
+		m_incoming.resize(m_incomingEnd + readSize);
+
 	auto self(shared_from_this());
-	m_socket.async_read_some(boost::asio::buffer(m_data), [this, self](boost::system::error_code ec, std::size_t length)
+	m_socket.async_read_some(boost::asio::buffer(m_incoming.data() + m_incomingEnd, m_incoming.size() - m_incomingEnd), [this, self](boost::system::error_code ec, std::size_t length)
 	{
 		if (ec)
-			dropped();
+			m_server->handOff(self, bytes());
 		else
 		{
 			try
 			{
-				m_incoming.resize(m_incoming.size() + length);
-				memcpy(m_incoming.data() + m_incoming.size() - length, m_data.data(), length);
-				while (m_incoming.size() > 8)
+				m_incomingEnd += length;
+				while (m_incomingEnd - m_incomingBegin > 8)
 				{
-					if (m_incoming[0] != 0x22 || m_incoming[1] != 0x40 || m_incoming[2] != 0x08 || m_incoming[3] != 0x91)
+					byte const* b = m_incoming.data() + m_incomingBegin;
+					if (b[0] != 0x22 || b[1] != 0x40 || b[2] != 0x08 || b[3] != 0x91)
 					{
-						if (m_server->m_verbosity)
-							cerr << std::setw(2) << m_socket.native_handle() << " | Out of alignment. Skipping: " << hex << showbase << (int)m_incoming[0] << dec << endl;
-						memmove(m_incoming.data(), m_incoming.data() + 1, m_incoming.size() - 1);
-						m_incoming.resize(m_incoming.size() - 1);
+						// Skip to the next byte that could start a packet.
+						auto next = (byte const*)memchr(b + 1, 0x22, m_incomingEnd - m_incomingBegin - 1);
+						size_t skip = next ? next - b : m_incomingEnd - m_incomingBegin;
+						clogS(1) << "Out of alignment. Skipping " << skip << " bytes from: " << hex << showbase << (int)b[0] << dec;
+						m_incomingBegin += skip;
 					}
 					else
 					{
-						uint32_t len = fromBigEndian<uint32_t>(bytesConstRef(m_incoming.data() + 4, 4));
+						uint32_t len = fromBigEndian<uint32_t>(bytesConstRef(b + 4, 4));
 	//					cout << "Received packet of " << len << " bytes" << endl;
-						if (m_incoming.size() - 8 < len)
+						if (m_incomingEnd - m_incomingBegin - 8 < len)
 							break;
 
-						// enough has come in.
-						RLP r(bytesConstRef(m_incoming.data() + 8, len));
-						if (!interpret(r))
-							// error
-							break;
-						memmove(m_incoming.data(), m_incoming.data() + len + 8, m_incoming.size() - (len + 8));
-						m_incoming.resize(m_incoming.size() - (len + 8));
+						// enough has come in. Pings are answered here, so that a work thread busy importing doesn't
+						// leave the peer thinking us gone; the rest are for process() to interpret.
+						bytesConstRef packet(b + 8, len);
+						m_incomingBegin += len + 8;
+						RLP r(packet);
+						if (r[0].toInt<unsigned>() == Ping)
+						{
+							RLPStream s;
+							sealAndSend(prep(s).appendList(1) << (uint)Pong);
+						}
+						else
+							m_server->handOff(self, packet.toBytes());
 					}
 				}
 				doRead();
 			}
 			catch (std::exception const& _e)
 			{
-				if (m_server->m_verbosity)
-					cerr << std::setw(2) << m_socket.native_handle() << " | ERROR: " << _e.what() << endl;
-				dropped();
+				clogS(1) << "ERROR: " << _e.what();
+				m_server->handOff(self, bytes());
 			}
 		}
 	});
@@ -695,13 +1173,15 @@ PeerServer::PeerServer(std::string const& _clientVersion, BlockChain const& _ch,
 	m_chain(&_ch),
 	m_acceptor(m_ioService, bi::tcp::endpoint(bi::tcp::v4(), _port)),
 	m_socket(m_ioService),
-	m_requiredNetworkId(_networkId)
+	m_requiredNetworkId(_networkId),
+	m_incomingBlocksLimit(Defaults::memoryLimit(Cache::IncomingBlocks, c_incomingBlocksLimit)),
+	m_transactionsSent(c_transactionsSent, 1e-6)
 {
 	populateAddresses();
 	determinePublic(_publicAddress, _upnp);
 	ensureAccepting();
-	if (m_verbosity)
-		cout << "Mode: " << (_m == NodeMode::PeerServer ? "PeerServer" : "Full") << endl;
+	startIO();
+	clogN(1) << "Mode: " << (_m == NodeMode::PeerServer ? "PeerServer" : "Full");
 }
 
 PeerServer::PeerServer(std::string const& _clientVersion, uint _networkId):
@@ -709,22 +1189,109 @@ PeerServer::PeerServer(std::string const& _clientVersion, uint _networkId):
 	m_listenPort(-1),
 	m_acceptor(m_ioService, bi::tcp::endpoint(bi::tcp::v4(), 0)),
 	m_socket(m_ioService),
-	m_requiredNetworkId(_networkId)
+	m_requiredNetworkId(_networkId),
+	m_incomingBlocksLimit(Defaults::memoryLimit(Cache::IncomingBlocks, c_incomingBlocksLimit)),
+	m_transactionsSent(c_transactionsSent, 1e-6)
 {
 	// populate addresses.
 	populateAddresses();
-	if (m_verbosity)
-		cout << "Genesis: " << m_chain->genesisHash() << endl;
+	startIO();
+	clogN(1) << "Genesis: " << m_chain->genesisHash();
 }
 
 PeerServer::~PeerServer()
 {
+	// Tell each peer we're going, closing once that's been written; that ends their reads and, with the acceptor closed
+	// too, leaves the I/O thread nothing more to do. Peers not taking what we write get c_drainTimeout.
 	for (auto const& i: m_peers)
 		if (auto p = i.lock())
+		{
 			p->disconnect();
+			p->close(true);
+		}
+	{
+		lock_guard<mutex> l(m_x);
+		for (auto const& p: m_newPeers)
+			p->close(true);
+	}
+	m_ioService.post([=](){ m_acceptor.close(); });
+	m_ioWork.reset();
+	for (auto deadline = chrono::steady_clock::now() + c_drainTimeout; !m_ioDone && chrono::steady_clock::now() < deadline;)
+		this_thread::sleep_for(chrono::milliseconds(10));
+	m_ioService.stop();
+	m_ioThread.join();
 	delete m_upnp;
 }
 
+void PeerServer::startIO()
+{
+	m_ioWork.reset(new ba::io_service::work(m_ioService));
+	m_ioThread = std::thread([=]()
+	{
+		setThreadName("net");
+		while (true)
+			try
+			{
+				m_ioService.run();
+				break;
+			}
+			catch (std::exception const& _e)
+			{
+				clogN(1) << "*** ERROR: " << _e.what();
+			}
+		m_ioDone = true;
+	});
+}
+
+void PeerServer::handOff(std::shared_ptr<PeerSession> const& _p)
+{
+	{
+		lock_guard<mutex> l(m_x);
+		m_newPeers.push_back(_p);
+	}
+	m_handedOff.notify_all();
+}
+
+void PeerServer::handOff(std::shared_ptr<PeerSession> const& _p, bytes&& _packet)
+{
+	{
+		lock_guard<mutex> l(m_x);
+		m_handOffs.push_back(make_pair(_p, move(_packet)));
+	}
+	m_handedOff.notify_all();
+}
+
+void PeerServer::processHandOffs()
+{
+	std::vector<std::shared_ptr<PeerSession>> newPeers;
+	std::deque<std::pair<std::shared_ptr<PeerSession>, bytes>> handOffs;
+	{
+		lock_guard<mutex> l(m_x);
+		swap(newPeers, m_newPeers);
+		swap(handOffs, m_handOffs);
+	}
+	for (auto const& p: newPeers)
+		m_peers.push_back(p);
+	for (auto const& i: handOffs)
+	{
+		auto const& p = i.first;
+		if (p->m_dropped)
+			continue;
+		if (i.second.empty())
+			p->dropped();
+		else
+			try
+			{
+				p->interpret(RLP(i.second));
+			}
+			catch (std::exception const& _e)
+			{
+				clogN(1) << std::setw(2) << p->m_handle << " | ERROR: " << _e.what();
+				p->dropped();
+			}
+	}
+}
+
 void PeerServer::determinePublic(string const& _publicAddress, bool _upnp)
 {
 	if (_upnp)
@@ -797,8 +1364,7 @@ void PeerServer::populateAddresses()
 			bool isLocal = std::find(c_rejectAddresses.begin(), c_rejectAddresses.end(), ad) != c_rejectAddresses.end();
 			if (!isLocal)
 				m_peerAddresses.push_back(ad.to_v4());
-			if (m_verbosity >= 1)
-				cout << "Address: " << host << " = " << m_addresses.back() << (isLocal ? " [LOCAL]" : " [PEER]") << endl;
+			clogN(1) << "Address: " << host << " = " << m_addresses.back() << (isLocal ? " [LOCAL]" : " [PEER]");
 		}
 	}
 
@@ -820,34 +1386,60 @@ std::vector<bi::tcp::endpoint> PeerServer::potentialPeers()
 	return ret;
 }
 
+std::shared_ptr<bytes const> PeerServer::peersMessage()
+{
+	auto now = chrono::steady_clock::now();
+	if (!m_peersMessage || now > m_peersMessageAt + c_peersRefresh)
+	{
+		// Ourselves first, then a random sample of the rest, so that being dialled is shared out between them.
+		static mt19937 s_rng(random_device{}());
+		std::vector<bi::tcp::endpoint> peers = potentialPeers();
+		bool us = !m_public.address().is_unspecified();
+		if (peers.size() > c_peersSample)
+		{
+			shuffle(peers.begin() + us, peers.end(), s_rng);
+			peers.resize(c_peersSample);
+		}
+		RLPStream s;
+		PeerSession::prep(s).appendList(peers.size() + 1);
+		s << (uint)Peers;
+		for (auto const& i: peers)
+			s.appendList(2) << i.address().to_v4().to_bytes() << i.port();
+		auto m = make_shared<bytes>();
+		s.swapOut(*m);
+		seal(*m);
+		m_peersMessage = m;
+		m_peersMessageAt = now;
+	}
+	return m_peersMessage;
+}
+
 void PeerServer::ensureAccepting()
 {
 	if (m_accepting == false)
 	{
-		if (m_verbosity >= 1)
-			cout << "Listening on local port " << m_listenPort << " (public: " << m_public << ")" << endl;
+		clogN(1) << "Listening on local port " << m_listenPort << " (public: " << m_public << ")";
 		m_accepting = true;
 		m_acceptor.async_accept(m_socket, [=](boost::system::error_code ec)
 		{
 			if (!ec)
 				try
 				{
-					if (m_verbosity >= 1)
-						try {
-							cout << "Accepted connection from " << m_socket.remote_endpoint() << std::endl;
-						} catch (...){}
+					try {
+						clogN(1) << "Accepted connection from " << m_socket.remote_endpoint();
+					} catch (...){}
 					auto p = std::make_shared<PeerSession>(this, std::move(m_socket), m_requiredNetworkId);
-					m_peers.push_back(p);
+					handOff(p);
 					p->start();
 				}
 				catch (std::exception const& _e)
 				{
-					if (m_verbosity)
-						cerr << "*** ERROR: " << _e.what() << endl;
+					clogN(1) << "*** ERROR: " << _e.what();
 				}
 
 			m_accepting = false;
-			if (m_mode == NodeMode::PeerServer || m_peers.size() < m_idealPeerCount)
+			// A full node's process() has us accept more if it needs them.
+			if (m_mode == NodeMode::PeerServer)
 				ensureAccepting();
 		});
 	}
@@ -855,32 +1447,139 @@ void PeerServer::ensureAccepting()
 
 void PeerServer::connect(bi::tcp::endpoint const& _ep)
 {
-	if (m_verbosity >= 1)
-		cout << "Attempting connection to " << _ep << endl;
+	clogN(1) << "Attempting connection to " << _ep;
 	bi::tcp::socket* s = new bi::tcp::socket(m_ioService);
+	auto start = chrono::steady_clock::now();
 	s->async_connect(_ep, [=](boost::system::error_code const& ec)
 	{
+		{
+			lock_guard<mutex> l(m_nodesLock);
+			Node& n = m_nodes[_ep];
+			if (ec)
+				++n.failures;
+			else
+			{
+				++n.successes;
+				n.lastSeen = (unsigned)time(nullptr);
+				unsigned ms = max<unsigned>(1, chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count());
+				n.latency = n.latency ? (n.latency * 3 + ms) / 4 : ms;
+			}
+		}
 		if (ec)
 		{
-			if (m_verbosity >= 1)
-				cout << "Connection refused to " << _ep << " (" << ec.message() << ")" << endl;
+			clogN(1) << "Connection refused to " << _ep << " (" << ec.message() << ")";
 		}
 		else
 		{
 			auto p = make_shared<PeerSession>(this, std::move(*s), m_requiredNetworkId);
-			m_peers.push_back(p);
-			if (m_verbosity >= 1)
-				cout << "Connected to " << p->endpoint() << endl;
+			handOff(p);
+			clogN(1) << "Connected to " << p->endpoint();
 			p->start();
 		}
 		delete s;
 	});
 }
 
+double PeerServer::Node::score(unsigned _now) const
+{
+	double reliability = (successes + 1.0) / (successes + failures + 2.0);
+	double days = (_now > lastSeen ? _now - lastSeen : 0) / 86400.0;
+	return reliability / (1 + days) / (1 + latency / 1000.0);
+}
+
+void PeerServer::noteNode(bi::tcp::endpoint const& _ep)
+{
+	lock_guard<mutex> l(m_nodesLock);
+	m_nodes[_ep].lastSeen = (unsigned)time(nullptr);
+}
+
+bytes PeerServer::saveNodes() const
+{
+	unsigned now = (unsigned)time(nullptr);
+	vector<pair<double, pair<bi::tcp::endpoint, Node>>> nodes;
+	{
+		lock_guard<mutex> l(m_nodesLock);
+		for (auto const& i: m_nodes)
+			if (i.first.address().is_v4())
+				nodes.push_back(make_pair(i.second.score(now), i));
+	}
+	sort(nodes.begin(), nodes.end(), [](decltype(nodes[0]) const& a, decltype(nodes[0]) const& b) { return a.first > b.first; });
+	nodes.resize(min(nodes.size(), c_maxNodes));
+
+	RLPStream s;
+	s.appendList(nodes.size());
+	for (auto const& i: nodes)
+	{
+		auto const& ep = i.second.first;
+		auto const& n = i.second.second;
+		s.appendList(6) << ep.address().to_v4().to_bytes() << ep.port() << n.lastSeen << n.successes << n.failures << n.latency;
+	}
+	return s.out();
+}
+
+void PeerServer::restoreNodes(bytesConstRef _b)
+{
+	unsigned now = (unsigned)time(nullptr);
+	vector<pair<double, bi::tcp::endpoint>> best;
+	try
+	{
+		lock_guard<mutex> l(m_nodesLock);
+		for (auto const& i: RLP(_b))
+		{
+			auto ep = bi::tcp::endpoint(bi::address_v4(i[0].toArray<byte, 4>()), i[1].toInt<short>());
+			Node& n = m_nodes[ep];
+			n.lastSeen = max(n.lastSeen, i[2].toInt<unsigned>());
+			n.successes += i[3].toInt<unsigned>();
+			n.failures += i[4].toInt<unsigned>();
+			n.latency = n.latency ? n.latency : i[5].toInt<unsigned>();
+		}
+		for (auto const& i: m_nodes)
+		{
+			bool us = false;
+			for (auto const& a: m_addresses)
+				us = us || (i.first.address() == a && i.first.port() == listenPort());
+			if (i.first.port() && !us)
+				best.push_back(make_pair(i.second.score(now), i.first));
+		}
+	}
+	catch (...)
+	{
+		// Corrupt; we'll learn of nodes the usual way.
+		return;
+	}
+
+	// Dial the best at once, together; the rest wait their turn, best last.
+	sort(best.begin(), best.end(), [](decltype(best[0]) const& a, decltype(best[0]) const& b) { return a.first < b.first; });
+	for (unsigned i = 0; i < m_idealPeerCount && best.size(); ++i)
+	{
+		connect(best.back().second);
+		best.pop_back();
+	}
+	for (auto const& i: best)
+		if (find(m_incomingPeers.begin(), m_incomingPeers.end(), i.second) == m_incomingPeers.end())
+			m_incomingPeers.push_back(i.second);
+}
+
+void PeerServer::wait(unsigned _ms)
+{
+	unique_lock<mutex> l(m_x);
+	m_handedOff.wait_for(l, chrono::milliseconds(_ms), [&](){ return m_interrupted || m_newPeers.size() || m_handOffs.size(); });
+	m_interrupted = false;
+}
+
+void PeerServer::interrupt()
+{
+	{
+		lock_guard<mutex> l(m_x);
+		m_interrupted = true;
+	}
+	m_handedOff.notify_all();
+}
+
 bool PeerServer::process(BlockChain& _bc)
 {
 	bool ret = false;
-	m_ioService.poll();
+	processHandOffs();
 
 	auto n = chrono::steady_clock::now();
 	bool fullProcess = (n > m_lastFullProcess + chrono::seconds(1));
@@ -891,7 +1590,7 @@ bool PeerServer::process(BlockChain& _bc)
 		for (auto i = m_peers.begin(); i != m_peers.end();)
 		{
 			auto p = i->lock();
-			if (p && p->m_socket.is_open() &&
+			if (p && p->m_open &&
 					(p->m_disconnect == chrono::steady_clock::time_point::max() || chrono::steady_clock::now() - p->m_disconnect < chrono::seconds(1)))	// kill old peers that should be disconnected.
 				++i;
 			else
@@ -900,6 +1599,7 @@ bool PeerServer::process(BlockChain& _bc)
 				ret = true;
 			}
 		}
+	s_peers.set(m_peers.size());
 	return ret;
 }
 
@@ -911,8 +1611,7 @@ bool PeerServer::process(BlockChain& _bc, TransactionQueue& _tq, Overlay& _o)
 	{
 		// First time - just initialise.
 		m_latestBlockSent = _bc.currentHash();
-		if (m_verbosity)
-			cout << "Initialising: latest=" << m_latestBlockSent << endl;
+		clogN(1) << "Initialising: latest=" << m_latestBlockSent;
 
 		for (auto const& i: _tq.transactions())
 			m_transactionsSent.insert(i.first);
@@ -929,90 +1628,153 @@ bool PeerServer::process(BlockChain& _bc, TransactionQueue& _tq, Overlay& _o)
 
 	if (m_mode == NodeMode::Full)
 	{
+		// Leave verifying new transactions to the queue's own threads; they're admitted when next flushed.
 		for (auto it = m_incomingTransactions.begin(); it != m_incomingTransactions.end(); ++it)
-			if (_tq.import(*it))
-				ret = true;
+		{
+			auto h = sha3(*it);
+			if (_tq.transactions().count(h))
+				m_transactionsSent.insert(h);	// if we already had the transaction, then don't bother sending it on.
 			else
-				m_transactionsSent.insert(sha3(*it));	// if we already had the transaction, then don't bother sending it on.
+				_tq.enqueue(*it);
+		}
 		m_incomingTransactions.clear();
 
 		// Send any new transactions.
-		if (fullProcess)
+		// Build each message once and share it between all the peers that should get it.
+		auto transactionsMessage = [&](std::function<bool(h256 const&)> const& _f)
 		{
-			for (auto j: m_peers)
-				if (auto p = j.lock())
+			bytes b;
+			uint n = 0;
+			for (auto const& i: _tq.transactions())
+				if (_f(i.first))
 				{
-					bytes b;
-					uint n = 0;
-					for (auto const& i: _tq.transactions())
-						if ((!m_transactionsSent.count(i.first) && !p->m_knownTransactions.count(i.first)) || p->m_requireTransactions)
-						{
-							b += i.second;
-							++n;
-							m_transactionsSent.insert(i.first);
-						}
-					if (n)
-					{
-						RLPStream ts;
-						PeerSession::prep(ts);
-						ts.appendList(n + 1) << Transactions;
-						ts.appendRaw(b).swapOut(b);
-						seal(b);
-						p->send(&b);
-					}
-					p->m_knownTransactions.clear();
-					p->m_requireTransactions = false;
+					b += i.second;
+					++n;
 				}
-
-			// Send any new blocks.
-			auto h = _bc.currentHash();
-			if (h != m_latestBlockSent)
+			if (!n)
+				return shared_ptr<bytes const>();
+			RLPStream ts;
+			PeerSession::prep(ts);
+			ts.appendList(n + 1) << Transactions;
+			ts.appendRaw(b, n).swapOut(b);
+			seal(b);
+			return shared_ptr<bytes const>(make_shared<bytes>(move(b)));
+		};
+		h256s fresh;
+		for (auto const& i: _tq.transactions())
+			if (!m_transactionsSent.count(i.first))
+				fresh.push_back(i.first);
+		shared_ptr<bytes const> freshMsg = fresh.size() ? transactionsMessage([&](h256 const& _h){ return !m_transactionsSent.count(_h); }) : nullptr;
+		shared_ptr<bytes const> allMsg;
+		for (auto j: m_peers)
+			if (auto p = j.lock())
 			{
-				// TODO: find where they diverge and send complete new branch.
-				RLPStream ts;
-				PeerSession::prep(ts);
-				ts.appendList(2) << Blocks;
-				bytes b;
-				ts.appendRaw(_bc.block(_bc.currentHash())).swapOut(b);
-				seal(b);
-				for (auto j: m_peers)
-					if (auto p = j.lock())
-					{
-						if (!p->m_knownBlocks.count(_bc.currentHash()))
-							p->send(&b);
-						p->m_knownBlocks.clear();
-					}
+				shared_ptr<bytes const> msg = freshMsg;
+				if (p->m_requireTransactions)
+					msg = allMsg ? allMsg : (allMsg = transactionsMessage([](h256 const&){ return true; }));
+				else if (freshMsg)
+					for (auto const& h: fresh)
+						if (p->m_knownTransactions.count(h))
+						{
+							// They told us of some of these; leave those out.
+							msg = transactionsMessage([&](h256 const& _h){ return !m_transactionsSent.count(_h) && !p->m_knownTransactions.count(_h); });
+							break;
+						}
+				// A peer that isn't keeping up with what we send gets no more transactions until it has; then it gets
+				// all of them.
+				bool behind = p->queuedBytes() > c_writeHighWater;
+				if (msg && !behind)
+					p->send(msg);
+				p->m_requireTransactions = msg && behind;
 			}
-			m_latestBlockSent = h;
+		for (auto const& h: fresh)
+			m_transactionsSent.insert(h);
 
-			for (int accepted = 1; accepted;)
-			{
-				accepted = 0;
-				if (m_incomingBlocks.size())
-					for (auto it = prev(m_incomingBlocks.end());; --it)
+		// Tell peers of any new head: those that can fetch it themselves just get its hash, the rest the whole block.
+		auto h = _bc.currentHash();
+		if (h != m_latestBlockSent)
+		{
+			// TODO: find where they diverge and send complete new branch.
+			shared_ptr<bytes> announce;
+			shared_ptr<bytes> block;
+			for (auto j: m_peers)
+				if (auto p = j.lock())
+					if (!p->m_knownBlocks.count(h))
 					{
-						try
-						{
-							_bc.import(*it, _o);
-							it = m_incomingBlocks.erase(it);
-							++accepted;
-							ret = true;
-						}
-						catch (UnknownParent)
+						bool a = p->m_caps & c_capAnnounce;
+						auto& m = a ? announce : block;
+						if (!m)
 						{
-							// Don't (yet) know its parent. Leave it for later.
+							RLPStream ts;
+							PeerSession::prep(ts);
+							if (a)
+							{
+								auto d = _bc.details(h);
+								ts.appendList(2) << (uint)NewBlockHashes;
+								ts.appendList(3) << h << d.number << d.totalDifficulty;
+							}
+							else
+							{
+								ts.appendList(2) << Blocks;
+								ts.appendRaw(_bc.block(h).ref());
+							}
+							m = make_shared<bytes>();
+							ts.swapOut(*m);
+							seal(*m);
 						}
-						catch (...)
-						{
-							// Some other error - erase it.
-							it = m_incomingBlocks.erase(it);
-						}
-
-						if (it == m_incomingBlocks.begin())
-							break;
+						p->send(m);
+						p->m_knownBlocks.insert(h);
 					}
+		}
+		m_latestBlockSent = h;
+
+		// Those left over last time only wait on their parents, so there's no point trying them again until something
+		// new has come in (or a second has passed, in case the parents came some other way).
+		if (m_incomingBlocks.size() > m_incomingWaiting || (fullProcess && m_incomingBlocks.size()))
+		{
+			if (_bc.importBatch(m_incomingBlocks, _o))
+				ret = true;
+			m_incomingBlocksSize = 0;
+			for (auto const& b: m_incomingBlocks)
+				m_incomingBlocksSize += b.size();
+			if (m_incomingBlocksSize >= m_incomingBlocksLimit)
+			{
+				// All that's left is waiting on parents we've no sign of; with them holding the budget we'd ask for
+				// nothing more, so drop them. Headers will fill in the gap again.
+				clogN(2) << "Dropping " << m_incomingBlocks.size() << " blocks awaiting unknown parents.";
+				s_blocksShed += m_incomingBlocks.size();
+				m_incomingBlocks.clear();
+				m_incomingBlocksSize = 0;
 			}
+			m_incomingWaiting = m_incomingBlocks.size();
+		}
 
+		// Take back bodies from any peer that's sat on our request for too long.
+		for (auto const& i: m_peers)
+			if (auto p = i.lock())
+				if (p->m_blocksAsked.size() && n > p->m_blocksAskedAt + c_blocksStall)
+				{
+					clogN(2) << std::setw(2) << p->m_handle << " | Stalled on " << p->m_blocksAsked.size() << " blocks";
+					p->returnBlocksAsked();
+					p->m_blockRate /= 2;
+					p->m_lacksBlocks = true;	// until it answers or tells us of more.
+				}
+
+		// Spread the bodies we've yet to ask for over any peers that aren't busy, the fastest getting the lowest.
+		if (m_blocksNeeded.size())
+		{
+			vector<shared_ptr<PeerSession>> idle;
+			for (auto const& i: m_peers)
+				if (auto p = i.lock())
+					if ((p->m_caps & c_capHeaders) && p->m_blocksAsked.empty() && !p->m_lacksBlocks)
+						idle.push_back(p);
+			sort(idle.begin(), idle.end(), [](shared_ptr<PeerSession> const& a, shared_ptr<PeerSession> const& b) { return a->m_blockRate > b->m_blockRate; });
+			for (auto const& p: idle)
+				p->requestBlocks();
+		}
+
+		if (fullProcess)
+		{
 			// Connect to additional peers
 			while (m_peers.size() < m_idealPeerCount)
 			{
@@ -1021,18 +1783,17 @@ bool PeerServer::process(BlockChain& _bc, TransactionQueue& _tq, Overlay& _o)
 					if (chrono::steady_clock::now() > m_lastPeersRequest + chrono::seconds(10))
 					{
 						RLPStream s;
-						bytes b;
-						(PeerSession::prep(s).appendList(1) << GetPeers).swapOut(b);
-						seal(b);
+						auto b = make_shared<bytes>();
+						(PeerSession::prep(s).appendList(1) << GetPeers).swapOut(*b);
+						seal(*b);
 						for (auto const& i: m_peers)
 							if (auto p = i.lock())
-								p->send(&b);
+								p->send(b);
 						m_lastPeersRequest = chrono::steady_clock::now();
 					}
 
 
-					if (!m_accepting)
-						ensureAccepting();
+					m_ioService.post([=](){ ensureAccepting(); });
 
 					break;
 				}
@@ -1048,31 +1809,50 @@ bool PeerServer::process(BlockChain& _bc, TransactionQueue& _tq, Overlay& _o)
 
 	if (fullProcess)
 	{
+		// Keep each peer's latency up to date.
+		for (auto const& i: m_peers)
+			if (auto p = i.lock())
+				if (!p->m_awaitingPong && n > p->m_ping + c_pingInterval)
+					p->ping();
+
 		// We'll keep at most twice as many as is ideal, halfing what counts as "too young to kill" until we get there.
-		for (uint old = 15000; m_peers.size() > m_idealPeerCount * 2 && old > 100; old /= 2)
-			while (m_peers.size() > m_idealPeerCount)
-			{
-				// look for worst peer to kick off
-				// first work out how many are old enough to kick off.
-				shared_ptr<PeerSession> worst;
-				unsigned agedPeers = 0;
-				for (auto i: m_peers)
-					if (auto p = i.lock())
-						if ((m_mode != NodeMode::PeerServer || p->m_caps != 0x01) && chrono::steady_clock::now() > p->m_connect + chrono::milliseconds(old))	// don't throw off new peers; peer-servers should never kick off other peer-servers.
-						{
-							++agedPeers;
-							if ((!worst || p->m_rating < worst->m_rating || (p->m_rating == worst->m_rating && p->m_connect > worst->m_connect)))	// kill older ones
-								worst = p;
-						}
-				if (!worst || agedPeers <= m_idealPeerCount)
-					break;
-				worst->disconnect();
-			}
+		// Each time, those old enough to kick off are ranked by worth and as many of the worst as need be kicked at once.
+		size_t left = m_peers.size();
+		for (uint old = 15000; left > m_idealPeerCount * 2 && old > 100; old /= 2)
+		{
+			vector<pair<double, shared_ptr<PeerSession>>> aged;
+			for (auto const& i: m_peers)
+				if (auto p = i.lock())
+					if (p->m_disconnect == chrono::steady_clock::time_point::max() && (m_mode != NodeMode::PeerServer || p->m_caps != 0x01) && n > p->m_connect + chrono::milliseconds(old))	// don't throw off new peers; peer-servers should never kick off other peer-servers.
+						aged.push_back(make_pair(p->worth(n), p));
+			if (aged.size() <= m_idealPeerCount)
+				continue;
+			size_t kick = min(aged.size(), left) - m_idealPeerCount;
+			// Worst first: the least worth, and of those worth the same, the youngest.
+			nth_element(aged.begin(), aged.begin() + (kick - 1), aged.end(), [](decltype(aged[0]) const& a, decltype(aged[0]) const& b) { return a.first < b.first || (a.first == b.first && a.second->m_connect > b.second->m_connect); });
+			for (size_t i = 0; i < kick; ++i)
+				aged[i].second->disconnect();
+			left -= kick;
+		}
 	}
 
 	return ret;
 }
 
+size_t PeerServer::memoryUsed() const
+{
+	size_t ret = m_incomingBlocksSize + m_blocksNeeded.size() * sizeof(h256) + m_blocksWanted.size() * (sizeof(h256) + 2 * sizeof(void*)) + m_transactionsSent.bytes();
+	for (auto const& t: m_incomingTransactions)
+		ret += t.size();
+	// A peer's read buffer is resized by the I/O thread, so is taken to be the least it keeps room for.
+	size_t readSize = m_mode == NodeMode::PeerServer ? c_hubReadSize : c_readSize;
+	for (auto const& i: m_peers)
+		if (auto p = i.lock())
+			ret += sizeof(PeerSession) + readSize + p->m_queuedBytes + p->m_knownBlocks.bytes() + p->m_knownTransactions.bytes();
+	lock_guard<mutex> l(m_nodesLock);
+	return ret + m_nodes.size() * (sizeof(bi::tcp::endpoint) + sizeof(Node) + 4 * sizeof(void*));
+}
+
 std::vector<PeerInfo> PeerServer::peers() const
 {
 	const_cast<PeerServer*>(this)->pingAll();
@@ -1080,8 +1860,19 @@ std::vector<PeerInfo> PeerServer::peers() const
 	std::vector<PeerInfo> ret;
 	for (auto& i: m_peers)
 		if (auto j = i.lock())
-			if (j->m_socket.is_open())
+			if (j->m_open)
+			{
+				auto now = chrono::steady_clock::now();
 				ret.push_back(j->m_info);
+				ret.back().queued = j->queuedBytes();
+				ret.back().latency = j->m_latency;
+				ret.back().idle = now - j->m_lastReceived;
+				{
+					lock_guard<mutex> l(j->m_sentLock);
+					ret.back().sent = j->m_sent;
+				}
+				ret.back().received = j->m_received;
+			}
 	return ret;
 }
 
@@ -21,11 +21,17 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
+#include <atomic>
+#include <deque>
+#include <map>
 #include <utility>
 #include <boost/asio.hpp>
 #include <boost/asio/ip/tcp.hpp>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "RLP.h"
 #include "Common.h"
 namespace ba = boost::asio;
@@ -49,17 +55,66 @@ enum PacketType
 	Blocks,
 	GetChain,
 	NotInChain,
-	GetTransactions
+	GetTransactions,
+	GetHeaders,
+	Headers,
+	GetBlocks,
+	NewBlockHashes,
+	Compressed
 };
 
 class PeerServer;
 
+/**
+ * @brief Fixed-size record of the hashes seen lately, as two Bloom filters in turn.
+ * Hashes are added to the current filter and looked for in both; once the current one holds its capacity it replaces
+ * the older, which is emptied to take the next lot. So any of the last @a _capacity added is always found, nothing
+ * much older than twice that is, and something never added is wrongly found with about the given probability.
+ */
+class RollingBloom
+{
+public:
+	RollingBloom(unsigned _capacity, double _falsePositive = 0.001);
+
+	void insert(h256 const& _h);
+	bool count(h256 const& _h) const { return contains(m_filters[0], _h) || contains(m_filters[1], _h); }
+	void clear() { m_filters[0].assign(m_filters[0].size(), 0); m_filters[1].assign(m_filters[1].size(), 0); m_inserted = 0; }
+	/// @returns the number of bytes the filters take.
+	size_t bytes() const { return (m_filters[0].size() + m_filters[1].size()) * sizeof(uint64_t); }
+
+private:
+	/// @returns bit number @a _i of those for @a _h. The hashes are uniform already, so their words make fine indices.
+	size_t bit(h256 const& _h, unsigned _i) const;
+	bool contains(std::vector<uint64_t> const& _f, h256 const& _h) const;
+
+	unsigned m_capacity;
+	unsigned m_hashes;						///< Bits set per hash.
+	size_t m_bits;							///< Bits in each filter.
+	std::vector<uint64_t> m_filters[2];		///< Current, then older.
+	unsigned m_inserted = 0;				///< Hashes added to the current one.
+};
+
+/// Packets of one type sent to or received from a peer, and their total size in bytes, framing included.
+struct PacketCount
+{
+	unsigned packets;
+	size_t bytes;
+};
+
+/// Packet types counted separately; the rest aren't counted by type.
+static const unsigned c_packetTypes = 0x20;
+
 struct PeerInfo
 {
 	std::string clientVersion;
 	std::string host;
 	short port;
 	std::chrono::steady_clock::duration lastPing;
+	size_t queued;		///< Bytes waiting to be written to them.
+	std::chrono::steady_clock::duration latency;	///< Round-trip time of pings, as a moving average; zero until one's come back.
+	std::chrono::steady_clock::duration idle;		///< Time since anything last came from them.
+	std::array<PacketCount, c_packetTypes> sent;		///< Written to them, by packet type.
+	std::array<PacketCount, c_packetTypes> received;	///< Received from them, by packet type.
 };
 
 class PeerSession: public std::enable_shared_from_this<PeerSession>
@@ -77,44 +132,91 @@ public:
 
 	bi::tcp::endpoint endpoint() const;	///< for other peers to connect to.
 
+	/// @returns the number of bytes of messages waiting to be written to the peer. May be called from any thread.
+	size_t queuedBytes() const { return m_queuedBytes; }
+
 private:
+	/// Forget the peer: close the connection, give back what it was asked for and drop it from the server.
 	void dropped();
+	/// Close the socket, on the I/O thread; if @a _afterWrites, not until what's queued to be written has gone.
+	void close(bool _afterWrites = false);
 	void doRead();
 	void doWrite(std::size_t length);
 	bool interpret(RLP const& _r);
 
+	/// @returns hashes on our best chain from @a _h back to the genesis, the most recent first, spaced exponentially further apart.
+	h256s locator(h256 _h) const;
+	/// Ask the peer for the headers that follow whichever of the locator's blocks it has in its best chain.
+	void requestHeaders(h256 _from);
+	/// Ask the peer for the next batch of block bodies whose headers we've verified, if it isn't already busy with some.
+	/// The batch is the lowest of those yet to be asked for, sized to what the peer's been managing.
+	void requestBlocks();
+	/// Give back any blocks we asked for but never got, so another peer can be asked them first.
+	void returnBlocksAsked();
+
 	static RLPStream& prep(RLPStream& _s);
 	void sealAndSend(RLPStream& _s);
 	void sendDestroy(bytes& _msg);
-	void send(bytesConstRef _msg);
+	/// Queue a sealed message for sending; the same buffer may be shared between any number of sessions.
+	/// Big ones go compressed to peers that can take them so.
+	void send(std::shared_ptr<bytes const> const& _msg);
+	/// Write as many queued messages as will go in one gather write. I/O thread only.
+	void write();
+
+	/// @returns how long they take to answer a ping, counting one that's still unanswered as of @a _now.
+	std::chrono::steady_clock::duration latency(std::chrono::steady_clock::time_point _now) const;
+	/// @returns how much we value the peer: what it's given us, discounted by how slowly it answers.
+	double worth(std::chrono::steady_clock::time_point _now) const;
 
 	PeerServer* m_server;
-	bi::tcp::socket m_socket;
-	std::array<byte, 65536> m_data;
+	bi::tcp::socket m_socket;				///< I/O thread only, once connected; what the rest need of it is below.
+	std::atomic<bool> m_open{true};			///< Until close() is called.
+	bi::tcp::endpoint m_remote;				///< The peer's address, as of connecting; port zero if it was already gone.
+	bi::tcp::socket::native_handle_type m_handle;	///< For telling sessions apart in the log.
 	PeerInfo m_info;
+	bool m_dropped = false;		///< Set by dropped(); anything still to come from the peer is ignored.
+
+	std::deque<std::shared_ptr<bytes const>> m_writeQueue;	///< Messages waiting to be written, the front m_writing of them in progress. I/O thread only.
+	size_t m_writing = 0;
+	bool m_closeAfterWrites = false;						///< Set by close(true) while writing. I/O thread only.
+	std::vector<ba::const_buffer> m_writeBuffers;			///< The buffers of those being written.
+	std::atomic<size_t> m_queuedBytes{0};					///< Total size of the messages queued but not yet written.
 
-	bytes m_incoming;
+	bytes m_incoming;				///< Bytes read from the socket; those from m_incomingBegin to m_incomingEnd are yet to be interpreted.
+	size_t m_incomingBegin = 0;
+	size_t m_incomingEnd = 0;
 	uint m_protocolVersion;
 	uint m_networkId;
 	uint m_reqNetworkId;
 	short m_listenPort;			///< Port that the remote client is listening on for connections. Useful for giving to peers.
-	uint m_caps;
-
-	std::chrono::steady_clock::time_point m_ping;
+	std::atomic<unsigned> m_caps{0};	///< Capability bits from their Hello; read by send() on either thread.
+
+	std::chrono::steady_clock::time_point m_ping;		///< When we sent the last ping.
+	bool m_awaitingPong = false;						///< Whether it's yet to be answered.
+	std::chrono::steady_clock::duration m_latency{0};	///< Round-trip time of pings, as a moving average; zero until one's come back.
+	std::chrono::steady_clock::time_point m_lastReceived;
+	std::array<PacketCount, c_packetTypes> m_sent{};	///< Written to the peer, by packet type. Written on the I/O thread.
+	mutable std::mutex m_sentLock;						///< Guards m_sent, which peers() reads from any thread.
+	std::array<PacketCount, c_packetTypes> m_received{};	///< Received from the peer, by packet type.
 	std::chrono::steady_clock::time_point m_connect;
 	std::chrono::steady_clock::time_point m_disconnect;
 
 	unsigned m_rating;
-	bool m_requireTransactions;
+	bool m_requireTransactions = false;
+
+	RollingBloom m_knownBlocks;			///< Blocks the peer has, has sent us or has been told of.
+	RollingBloom m_knownTransactions;	///< Transactions the peer has sent us, which it needn't be sent back.
 
-	std::set<h256> m_knownBlocks;
-	std::set<h256> m_knownTransactions;
+	h256s m_blocksAsked;		///< Blocks we've asked this peer for with GetBlocks and are still waiting on.
+	std::chrono::steady_clock::time_point m_blocksAskedAt;	///< When we asked for them.
+	double m_blockRate = 0;		///< Blocks a second we've been getting in answer to GetBlocks, as a moving average; 0 if unknown.
+	bool m_lacksBlocks = false;	///< True if the peer didn't have some blocks we last asked it for; don't ask again until it tells us of more.
 };
 
 enum class NodeMode
 {
 	Full,
-	PeerServer
+	PeerServer		///< Just a hub for finding peers. Keeps little of each, so can have thousands: set the ideal peer count to suit.
 };
 
 struct UPnP;
@@ -136,10 +238,15 @@ public:
 
 	/// Sync with the BlockChain. It might contain one of our mined blocks, we might have new candidates from the network.
 	/// Conduct I/O, polling, syncing, whatever.
-	/// Ideally all time-consuming I/O is done in a background thread or otherwise asynchronously, but you get this call every 100ms or so anyway.
+	/// New transactions and blocks are passed on at once; peer upkeep is done at most once a second.
 	bool process(BlockChain& _bc, TransactionQueue&, Overlay& _o);
 	bool process(BlockChain& _bc);
 
+	/// Wait up to @a _ms milliseconds for packets or connections from the I/O thread. Call process() afterwards to act on them.
+	void wait(unsigned _ms);
+	/// Make a wait() in progress (or the next one) return at once. May be called from any thread.
+	void interrupt();
+
 	/// Set ideal number of peers.
 	void setIdealPeerCount(unsigned _n) { m_idealPeerCount = _n; }
 
@@ -152,18 +259,57 @@ public:
 	/// Get number of peers connected; equivalent to, but faster than, peers().size().
 	unsigned peerCount() const { return m_peers.size(); }
 
+	/// Set how many bytes of blocks received may await import before those we didn't ask for are dropped and no more
+	/// are asked for.
+	void setIncomingBlocksLimit(size_t _bytes) { m_incomingBlocksLimit = _bytes; }
+	/// @returns roughly how many bytes we hold for the network: what's been received and awaits import, each peer's
+	/// buffers, filters and unwritten messages, and the address book.
+	size_t memoryUsed() const;
+
 	/// Ping the peers, to update the latency information.
 	void pingAll();
 
 	/// Get the port we're listening on currently.
 	short listenPort() const { return m_public.port(); }
 
+	/// @returns what we know of the nodes we've connected to or heard of, for restoreNodes() to take up another time.
+	bytes saveNodes() const;
+	/// Take up what an earlier saveNodes() returned, and connect to the best of the nodes straight away.
+	void restoreNodes(bytesConstRef _b);
+
 private:
+	/// What we know of a node we could connect to.
+	struct Node
+	{
+		unsigned lastSeen = 0;		///< When we last connected to it or heard of it, in seconds since the epoch.
+		unsigned successes = 0;		///< Connections to it that were made.
+		unsigned failures = 0;		///< Connections to it that weren't.
+		unsigned latency = 0;		///< Milliseconds connecting takes, as a moving average; 0 if unknown.
+
+		/// @returns how keen we are to connect to it at time @a _now: the more reliable, recent and quick the better.
+		double score(unsigned _now) const;
+	};
+
+	/// Note that the node at @a _ep exists. Thread-safe.
+	void noteNode(bi::tcp::endpoint const& _ep);
+
 	void seal(bytes& _b);
 	void populateAddresses();
 	void determinePublic(std::string const& _publicAddress, bool _upnp);
 	void ensureAccepting();
 	std::vector<bi::tcp::endpoint> potentialPeers();
+	/// @returns the sealed Peers message a peer server answers GetPeers with; a sample of potentialPeers(), rebuilt
+	/// every few seconds rather than for each request.
+	std::shared_ptr<bytes const> peersMessage();
+
+	/// Start the I/O thread.
+	void startIO();
+	/// Pass a connection made on the I/O thread over to process().
+	void handOff(std::shared_ptr<PeerSession> const& _p);
+	/// Pass a packet received by @a _p on the I/O thread over to process(); an empty one means the connection was lost.
+	void handOff(std::shared_ptr<PeerSession> const& _p, bytes&& _packet);
+	/// Interpret what's been handed off by the I/O thread since last time.
+	void processHandOffs();
 
 	std::string m_clientVersion;
 	NodeMode m_mode = NodeMode::Full;
@@ -194,10 +340,22 @@ private:
 
 	std::vector<bytes> m_incomingTransactions;
 	std::vector<bytes> m_incomingBlocks;
-	std::vector<bi::tcp::endpoint> m_incomingPeers;
+	size_t m_incomingWaiting = 0;		///< Of those, how many were left waiting on their parents last time we imported.
+	size_t m_incomingBlocksSize = 0;	///< Bytes of m_incomingBlocks.
+	size_t m_incomingBlocksLimit;		///< Bytes of m_incomingBlocks beyond which we shed load; see setIncomingBlocksLimit().
+
+	std::deque<h256> m_blocksNeeded;	///< Blocks whose headers we've verified but whose bodies have yet to be asked for, oldest first.
+	h256Hash m_blocksWanted;			///< Blocks either in m_blocksNeeded or asked of some peer.
+	std::vector<bi::tcp::endpoint> m_incomingPeers;	///< Nodes to connect to, the best last.
+
+	std::map<bi::tcp::endpoint, Node> m_nodes;	///< Every node we've connected to or heard of; guarded by m_nodesLock.
+	mutable std::mutex m_nodesLock;
+
+	std::shared_ptr<bytes const> m_peersMessage;		///< Made by peersMessage().
+	std::chrono::steady_clock::time_point m_peersMessageAt;
 
 	h256 m_latestBlockSent;
-	std::set<h256> m_transactionsSent;
+	RollingBloom m_transactionsSent;	///< Transactions relayed already (or that were in the queue when we started).
 
 	std::chrono::steady_clock::time_point m_lastPeersRequest;
 	unsigned m_idealPeerCount = 5;
@@ -207,7 +365,19 @@ private:
 	std::vector<bi::address_v4> m_addresses;
 	std::vector<bi::address_v4> m_peerAddresses;
 
-	bool m_accepting = false;
+	bool m_accepting = false;			///< I/O thread only.
+
+	/// Socket I/O, connection and acceptance all happen on this thread, which runs m_ioService throughout. Everything
+	/// else, including interpreting packets, happens on the thread calling process(); the two meet only at m_handOffs.
+	std::thread m_ioThread;
+	std::unique_ptr<ba::io_service::work> m_ioWork;	///< Keeps m_ioService running while there's nothing to do.
+	std::atomic<bool> m_ioDone{false};				///< Set as m_ioThread finishes, m_ioService having run out of work.
+
+	std::mutex m_x;						///< Guards everything below.
+	std::condition_variable m_handedOff;	///< Signalled on a hand-off or interrupt().
+	std::vector<std::shared_ptr<PeerSession>> m_newPeers;	///< Connections made, for process() to add to m_peers.
+	std::deque<std::pair<std::shared_ptr<PeerSession>, bytes>> m_handOffs;	///< Packets received, in order, for process() to interpret.
+	bool m_interrupted = false;
 };
 
 
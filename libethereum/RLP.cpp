@@ -71,6 +71,20 @@ RLP RLP::operator[](uint _i) const
 	return RLP(m_lastItem);
 }
 
+RLPIndex::RLPIndex(RLP const& _list)
+{
+	if (!_list.isList())
+		return;
+	for (auto const& i: _list)
+	{
+		if (m_size < c_inlineItems)
+			m_inline[m_size] = i.data();
+		else
+			m_more.push_back(i.data());
+		++m_size;
+	}
+}
+
 RLPs RLP::toList() const
 {
 	RLPs ret;
@@ -156,21 +170,30 @@ void RLPStream::noteAppended(uint _itemCount)
 //	cdebug << "noteAppended(" << _itemCount << ")";
 	while (m_listStack.size())
 	{
-		assert(m_listStack.back().first >= _itemCount);
-		m_listStack.back().first -= _itemCount;
-		if (m_listStack.back().first)
+		assert(m_listStack.back().items >= _itemCount);
+		m_listStack.back().items -= _itemCount;
+		if (m_listStack.back().items)
 			break;
 		else
 		{
-			auto p = m_listStack.back().second;
+			auto p = m_listStack.back().pos;
+			auto reserved = m_listStack.back().header;
 			m_listStack.pop_back();
-			uint s = m_out.size() - p;		// list size
+			uint s = m_out.size() - p - reserved;		// list size
 			auto brs = bytesRequired(s);
 			uint encodeSize = s < c_rlpListImmLenCount ? 1 : (1 + brs);
 //			cdebug << "s: " << s << ", p: " << p << ", m_out.size(): " << m_out.size() << ", encodeSize: " << encodeSize << " (br: " << brs << ")";
-			auto os = m_out.size();
-			m_out.resize(os + encodeSize);
-			memmove(m_out.data() + p + encodeSize, m_out.data() + p, os - p);
+			// The items only need moving if the room left for the header was the wrong size.
+			if (encodeSize > reserved)
+			{
+				m_out.resize(m_out.size() + encodeSize - reserved);
+				memmove(m_out.data() + p + encodeSize, m_out.data() + p + reserved, s);
+			}
+			else if (encodeSize < reserved)
+			{
+				memmove(m_out.data() + p + encodeSize, m_out.data() + p + reserved, s);
+				m_out.resize(m_out.size() - (reserved - encodeSize));
+			}
 			if (s < c_rlpListImmLenCount)
 				m_out[p] = c_rlpListStart + s;
 			else
@@ -185,11 +208,18 @@ void RLPStream::noteAppended(uint _itemCount)
 	}
 }
 
-RLPStream& RLPStream::appendList(unsigned _items)
+RLPStream& RLPStream::appendList(unsigned _items, uint _sizeHint)
 {
 //	cdebug << "appendList(" << _items << ")";
 	if (_items)
-		m_listStack.push_back(std::make_pair(_items, m_out.size()));
+	{
+		uint header = _sizeHint < c_rlpListImmLenCount ? 1 : (1 + bytesRequired(_sizeHint));
+		uint needed = m_out.size() + header + _sizeHint;
+		if (needed > m_out.capacity())
+			m_out.reserve(std::max<uint>(needed, m_out.capacity() * 2));
+		m_listStack.push_back(OpenList{_items, (uint)m_out.size(), header});
+		m_out.resize(m_out.size() + header);
+	}
 	else
 		appendList(bytes());
 	return *this;
@@ -226,34 +256,34 @@ RLPStream& RLPStream::append(bytesConstRef _s, bool _compact)
 	return *this;
 }
 
-RLPStream& RLPStream::append(bigint _i)
+void RLPStream::pushCount(uint _count, byte _base)
+{
+	auto br = bytesRequired(_count);
+	m_out.push_back((byte)(br + _base));	// max 8 bytes.
+	pushInt(_count, br);
+}
+
+/// The pool of scratch streams, for each thread.
+static thread_local std::vector<std::unique_ptr<RLPStream>> s_scratch;
+/// Buffers that have grown larger than this aren't kept.
+static const size_t c_maxScratchSize = 1 << 16;
+
+ScratchRLPStream::ScratchRLPStream()
 {
-	if (!_i)
-		m_out.push_back(c_rlpDataImmLenStart);
-	else if (_i < c_rlpDataImmLenStart)
-		m_out.push_back((byte)_i);
+	if (s_scratch.empty())
+		m_s.reset(new RLPStream);
 	else
 	{
-		uint br = bytesRequired(_i);
-		if (br < c_rlpDataImmLenCount)
-			m_out.push_back((byte)(br + c_rlpDataImmLenStart));
-		else
-		{
-			auto brbr = bytesRequired(br);
-			m_out.push_back((byte)(c_rlpDataIndLenZero + brbr));
-			pushInt(br, brbr);
-		}
-		pushInt(_i, br);
+		m_s = move(s_scratch.back());
+		s_scratch.pop_back();
 	}
-	noteAppended();
-	return *this;
 }
 
-void RLPStream::pushCount(uint _count, byte _base)
+ScratchRLPStream::~ScratchRLPStream()
 {
-	auto br = bytesRequired(_count);
-	m_out.push_back((byte)(br + _base));	// max 8 bytes.
-	pushInt(_count, br);
+	m_s->clear();
+	if (m_s->out().capacity() <= c_maxScratchSize)
+		s_scratch.push_back(move(m_s));
 }
 
 std::ostream& eth::operator<<(std::ostream& _out, eth::RLP const& _d)
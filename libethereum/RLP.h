@@ -25,6 +25,7 @@
 
 #include <vector>
 #include <array>
+#include <memory>
 #include <exception>
 #include <iostream>
 #include <iomanip>
@@ -229,14 +230,14 @@ public:
 	/// @returns the data payload. Valid for all types.
 	bytesConstRef payload() const { return isSingleByte() ? m_data.cropped(0, 1) : m_data.cropped(1 + lengthSize()); }
 
+	/// @returns the size of this item's encoding, header included, as given by the RLP.
+	/// @note Under normal circumstances, is equivalent to data().size(); it's for when the data runs on beyond the item.
+	uint actualSize() const;
+
 private:
 	/// Single-byte data payload.
 	bool isSingleByte() const { return !isNull() && m_data[0] < c_rlpDataImmLenStart; }
 
-	/// @returns the theoretical size of this item; if it's a list, will require a deep traversal which could take a while.
-	/// @note Under normal circumstances, is equivalent to m_data.size() - use that unless you know it won't work.
-	uint actualSize() const;
-
 	/// @returns the bytes used to encode the length of the data. Valid for all types.
 	uint lengthSize() const { if (isData() && m_data[0] > c_rlpDataIndLenZero) return m_data[0] - c_rlpDataIndLenZero; if (isList() && m_data[0] > c_rlpListIndLenZero) return m_data[0] - c_rlpListIndLenZero; return 0; }
 
@@ -255,6 +256,30 @@ private:
 	mutable bytesConstRef m_lastItem;
 };
 
+/**
+ * @brief Random access to the items of an RLP list, all of which are found in a single pass on construction.
+ * Unlike RLP::operator[], any order of access is O(1). Lists of up to 17 items (a trie branch node) are indexed
+ * without allocating.
+ */
+class RLPIndex
+{
+public:
+	explicit RLPIndex(RLP const& _list);
+
+	/// @returns the number of items, zero if it isn't a list.
+	uint size() const { return m_size; }
+
+	/// @returns the item @a _i, or RLP() if there's no such item.
+	RLP operator[](uint _i) const { return _i < m_size ? RLP(_i < c_inlineItems ? m_inline[_i] : m_more[_i - c_inlineItems]) : RLP(); }
+
+private:
+	static const uint c_inlineItems = 17;
+
+	uint m_size = 0;
+	std::array<bytesConstRef, c_inlineItems> m_inline;
+	std::vector<bytesConstRef> m_more;			///< Any items beyond the first c_inlineItems.
+};
+
 /**
  * @brief Class for writing to an RLP bytestream.
  */
@@ -264,16 +289,16 @@ public:
 	/// Initializes empty RLPStream.
 	RLPStream() {}
 
-	/// Initializes the RLPStream as a list of @a _listItems items.
-	explicit RLPStream(uint _listItems) { appendList(_listItems); }
+	/// Initializes the RLPStream as a list of @a _listItems items, taking about @a _sizeHint bytes (see appendList()).
+	explicit RLPStream(uint _listItems, uint _sizeHint = 0) { appendList(_listItems, _sizeHint); }
 
 	~RLPStream() {}
 
 	/// Append given datum to the byte stream.
-	RLPStream& append(uint _s) { return append(bigint(_s)); }
-	RLPStream& append(u160 _s) { return append(bigint(_s)); }
-	RLPStream& append(u256 _s) { return append(bigint(_s)); }
-	RLPStream& append(bigint _s);
+	RLPStream& append(uint _s) { return appendInt(_s); }
+	RLPStream& append(u160 _s) { return appendInt(_s); }
+	RLPStream& append(u256 _s) { return appendInt(_s); }
+	RLPStream& append(bigint _s) { return appendInt(_s); }
 	RLPStream& append(bytesConstRef _s, bool _compact = false);
 	RLPStream& append(bytes const& _s) { return append(bytesConstRef(&_s)); }
 	RLPStream& append(std::string const& _s) { return append(bytesConstRef(_s)); }
@@ -288,8 +313,9 @@ public:
 	template <class _T> RLPStream& append(std::vector<_T> const& _s) { appendList(_s.size()); for (auto const& i: _s) append(i); return *this; }
 	template <class _T, size_t S> RLPStream& append(std::array<_T, S> const& _s) { appendList(_s.size()); for (auto const& i: _s) append(i); return *this; }
 
-	/// Appends a list.
-	RLPStream& appendList(unsigned _items);
+	/// Appends a list of @a _items items, which follow. Its header is written in place once they're in; given a rough
+	/// idea of their size, @a _sizeHint, room enough is left for it and the buffer grown to fit them at the outset.
+	RLPStream& appendList(unsigned _items, uint _sizeHint = 0);
 	RLPStream& appendList(bytesConstRef _rlp);
 	RLPStream& appendList(bytes const& _rlp) { return appendList(&_rlp); }
 	RLPStream& appendList(RLPStream const& _s) { return appendList(&_s.out()); }
@@ -313,6 +339,30 @@ public:
 private:
 	void noteAppended(uint _itemCount = 1);
 
+	/// Append an integer as a data item.
+	template <class _T> RLPStream& appendInt(_T _i)
+	{
+		if (!_i)
+			m_out.push_back(c_rlpDataImmLenStart);
+		else if (_i < c_rlpDataImmLenStart)
+			m_out.push_back((byte)_i);
+		else
+		{
+			uint br = bytesRequired(_i);
+			if (br < c_rlpDataImmLenCount)
+				m_out.push_back((byte)(br + c_rlpDataImmLenStart));
+			else
+			{
+				auto brbr = bytesRequired(br);
+				m_out.push_back((byte)(c_rlpDataIndLenZero + brbr));
+				pushInt(br, brbr);
+			}
+			pushInt(_i, br);
+		}
+		noteAppended();
+		return *this;
+	}
+
 	/// Push the node-type byte (using @a _base) along with the item count @a _count.
 	/// @arg _count is number of characters for strings, data-bytes for ints, or items for lists.
 	void pushCount(uint _count, byte _offset);
@@ -337,14 +387,38 @@ private:
 	/// Our output byte stream.
 	bytes m_out;
 
-	std::vector<std::pair<uint, uint>> m_listStack;
+	/// A list still to be finished.
+	struct OpenList
+	{
+		uint items;		///< The number of items yet to be appended.
+		uint pos;		///< Where the header goes in m_out.
+		uint header;	///< The bytes left there for the header.
+	};
+	std::vector<OpenList> m_listStack;
+};
+
+/**
+ * @brief An RLPStream lent from a pool kept by each thread and given back, cleared, on destruction, so that its buffer
+ * is reused rather than allocated afresh. For encodings only needed for a moment, e.g. to be hashed.
+ */
+class ScratchRLPStream
+{
+public:
+	ScratchRLPStream();
+	~ScratchRLPStream();
+
+	RLPStream& operator*() const { return *m_s; }
+	RLPStream* operator->() const { return m_s.get(); }
+
+private:
+	std::unique_ptr<RLPStream> m_s;
 };
 
 template <class _T> void rlpListAux(RLPStream& _out, _T _t) { _out << _t; }
 template <class _T, class ... _Ts> void rlpListAux(RLPStream& _out, _T _t, _Ts ... _ts) { rlpListAux(_out << _t, _ts...); }
 
 /// Export a single item in RLP format, returning a byte array.
-template <class _T> bytes rlp(_T _t) { return (RLPStream() << _t).out(); }
+template <class _T> bytes rlp(_T _t) { RLPStream s; s << _t; bytes ret; s.swapOut(ret); return ret; }
 
 /// Export a list of items in RLP format, returning a byte array.
 inline bytes rlpList() { return RLPStream(0).out(); }
@@ -352,7 +426,9 @@ template <class ... _Ts> bytes rlpList(_Ts ... _ts)
 {
 	RLPStream out(sizeof ...(_Ts));
 	rlpListAux(out, _ts...);
-	return out.out();
+	bytes ret;
+	out.swapOut(ret);
+	return ret;
 }
 
 /// The empty string in RLP format.
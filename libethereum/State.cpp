@@ -36,10 +36,15 @@
 #endif
 #include <time.h>
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "BlockChain.h"
 #include "Instruction.h"
 #include "Exceptions.h"
 #include "Dagger.h"
+#include "VMProfiler.h"
+#include "Metrics.h"
 #include "State.h"
 using namespace std;
 using namespace eth;
@@ -51,6 +56,8 @@ u256 const State::c_extroFee = 40000;
 u256 const State::c_cryptoFee = 50000;
 u256 const State::c_newContractFee = 60000;
 u256 const State::c_txFee = 0;
+unsigned const State::c_maxImageGap = 16;
+unsigned const State::c_initialStackSize = 64;
 u256 const State::c_blockReward = 1000000000;
 
 #if NDEBUG
@@ -59,9 +66,12 @@ u256 const eth::c_genesisDifficulty = (u256)1 << 22;
 u256 const eth::c_genesisDifficulty = (u256)1 << 22;
 #endif
 
-std::map<Address, AddressState> const& eth::genesisState()
+static Counter& s_transactionsPlayed = Metrics::counter("eth_transactions_played", "Transactions of blocks played back and found valid.");
+static Counter& s_vmSteps = Metrics::counter("eth_vm_steps", "Instructions executed by the VM, including those of transactions executed speculatively.");
+
+std::unordered_map<Address, AddressState> const& eth::genesisState()
 {
-	static std::map<Address, AddressState> s_ret;
+	static std::unordered_map<Address, AddressState> s_ret;
 	if (s_ret.empty())
 	{
 		// Initialise.
@@ -79,23 +89,83 @@ Overlay State::openDB(std::string _path, bool _killExisting)
 	if (_killExisting)
 		boost::filesystem::remove_all(_path + "/state");
 
-	ldb::Options o;
-	o.create_if_missing = true;
 	ldb::DB* db = nullptr;
-	ldb::DB::Open(o, _path + "/state", &db);
-	return Overlay(db);
+	ldb::DB::Open(dbOptions(Database::State), _path + "/state", &db);
+	Overlay ret(db);
+	ret.setSyncWrites(Defaults::s_syncWrites);
+	ret.setNodeCacheLimit(Defaults::memoryLimit(Cache::StateNodes, NodeCache::c_defaultLimit));
+	return ret;
+}
+
+namespace eth
+{
+
+/// How far the state DB is pruned: [ era, canonical hash, [ [ era, hash, [ pinned nodes... ] ], ... ] ].
+/// The last item is the list of restore points; each has a reference on every node of its state.
+struct PruneRecord
+{
+	PruneRecord(Overlay const& _db)
+	{
+		string s = _db.lookupAux("pruned");
+		if (s.empty())
+			return;
+		RLP r(s);
+		era = r[0].toInt<uint>();
+		hash = r[1].toHash<h256>();
+		for (auto const& i: r[2])
+			restorePoints.push_back(RestorePoint{i[0].toInt<uint>(), i[1].toHash<h256>(), i[2].toVector<h256>()});
+	}
+
+	void write(Overlay& _db) const
+	{
+		RLPStream s(3);
+		s << era << hash;
+		s.appendList(restorePoints.size());
+		for (auto const& i: restorePoints)
+			s.appendList(3) << i.era << i.hash << i.pinned;
+		_db.insertAux("pruned", &s.out());
+	}
+
+	bool isRestorePoint(h256 _hash) const
+	{
+		for (auto const& i: restorePoints)
+			if (i.hash == _hash)
+				return true;
+		return false;
+	}
+
+	struct RestorePoint
+	{
+		uint era;
+		h256 hash;
+		h256s pinned;
+	};
+
+	uint era = 0;
+	h256 hash = BlockInfo::genesis().hash;
+	std::vector<RestorePoint> restorePoints;
+};
+
 }
 
 State::State(Address _coinbaseAddress, Overlay const& _db): m_db(_db), m_state(&m_db), m_ourAddress(_coinbaseAddress)
 {
 	secp256k1_start();
 
-	// Initialise to the state entailed by the genesis block; this guarantees the trie is built correctly.
-	m_state.init();
-	eth::commit(genesisState(), m_db, m_state);
-	cout << "State::State: state root initialised to " << m_state.root() << endl;
-
+	// Initialise to the state entailed by the genesis block; this guarantees the trie is built correctly. It's written
+	// (pinned, so never pruned) just the once; a DB from before pinning has it written again, to pin it.
 	m_previousBlock = BlockInfo::genesis();
+	if (m_db.refCount(m_previousBlock.stateRoot) == Overlay::c_pinned)
+		m_state.setRoot(m_previousBlock.stateRoot);
+	else
+	{
+		m_state.init();
+		eth::commit(genesisState(), m_db, m_state);
+		m_db.commit();
+	}
+	clogv(ChainChannel, 3) << "State::State: state root initialised to" << m_state.root();
+
+	m_currentNumber = 1;
 	cnote << "Genesis headerhash-nononce:" << m_previousBlock.headerHashWithoutNonce();
 	{
 		RLPStream s;
@@ -108,8 +178,49 @@ State::State(Address _coinbaseAddress, Overlay const& _db): m_db(_db), m_state(&
 	assert(m_state.root() == m_previousBlock.stateRoot);
 }
 
-void State::ensureCached(Address _a, bool _requireMemory, bool _forceCreate) const
+State::State(State const& _s):
+	m_state(&m_db)
+{
+	*this = _s;
+}
+
+State& State::operator=(State const& _s)
+{
+	m_db = _s.m_db;
+	m_state.open(&m_db, _s.m_state.root());
+	m_transactions = _s.m_transactions;
+	m_transactionList = _s.m_transactionList;
+	m_cache = _s.m_cache;
+	m_checkpoints = _s.m_checkpoints;
+	m_previousBlock = _s.m_previousBlock;
+	m_currentBlock = _s.m_currentBlock;
+	m_currentBytes = _s.m_currentBytes;
+	m_currentNumber = _s.m_currentNumber;
+	m_currentTxs = _s.m_currentTxs;
+	m_currentUncles = _s.m_currentUncles;
+	m_currentTxData = _s.m_currentTxData;
+	m_committedTransactions = _s.m_committedTransactions;
+	m_rewarded = _s.m_rewarded;
+	m_rewardsApplied = _s.m_rewardsApplied;
+	m_ourAddress = _s.m_ourAddress;
+	m_readOnly = _s.m_readOnly;
+	return *this;
+}
+
+static AddressState fromRLP(RLP const& _state)
+{
+	if (_state.isNull())
+		return AddressState(0, 0);
+	else if (_state.itemCount() == 2)
+		return AddressState(_state[0].toInt<u256>(), _state[1].toInt<u256>());
+	else
+		return AddressState(_state[0].toInt<u256>(), _state[1].toInt<u256>(), _state[2].toHash<h256>());
+}
+
+void State::ensureCached(Address _a, bool _forceCreate) const
 {
+	if (m_speculation)
+		m_speculation->reads.insert(_a);
 	auto it = m_cache.find(_a);
 	if (it == m_cache.end())
 	{
@@ -117,33 +228,70 @@ void State::ensureCached(Address _a, bool _requireMemory, bool _forceCreate) con
 		string stateBack = m_state.at(_a);
 		if (stateBack.empty() && !_forceCreate)
 			return;
-		RLP state(stateBack);
-		AddressState s;
-		if (state.isNull())
-			s = AddressState(0, 0);
-		else if (state.itemCount() == 2)
-			s = AddressState(state[0].toInt<u256>(), state[1].toInt<u256>());
-		else
-			s = AddressState(state[0].toInt<u256>(), state[1].toInt<u256>(), state[2].toHash<h256>());
 		bool ok;
-		tie(it, ok) = m_cache.insert(make_pair(_a, s));
+		tie(it, ok) = m_cache.insert(make_pair(_a, fromRLP(RLP(stateBack))));
 	}
-	if (_requireMemory && !it->second.haveMemory())
+}
+
+AddressState const* State::addressState(Address _a, AddressState& o_read) const
+{
+	if (!m_readOnly)
+		ensureCached(_a, false);
+	auto it = m_cache.find(_a);
+	if (it != m_cache.end())
+		return &it->second;
+	if (!m_readOnly)
+		return nullptr;
+	string stateBack = m_state.at(_a);
+	if (stateBack.empty())
+		return nullptr;
+	o_read = fromRLP(RLP(stateBack));
+	return &o_read;
+}
+
+void State::journal(Address _a)
+{
+	if (m_checkpoints.empty())
+		return;
+	auto& saved = m_checkpoints.back().saved;
+	if (saved.count(_a))
+		return;
+	ensureCached(_a, false);
+	auto it = m_cache.find(_a);
+	saved[_a] = it == m_cache.end() ? make_pair(false, AddressState()) : make_pair(true, it->second);
+}
+
+void State::revert()
+{
+	assert(m_checkpoints.size());
+	for (auto& i: m_checkpoints.back().saved)
+		if (i.second.first)
+			m_cache[i.first] = move(i.second.second);
+		else
+			m_cache.erase(i.first);
+	for (unsigned i = m_checkpoints.back().transactions; i < m_transactionList.size(); ++i)
+		m_transactions.erase(m_transactionList[i]);
+	m_transactionList.resize(m_checkpoints.back().transactions);
+	m_checkpoints.pop_back();
+}
+
+void State::dropCheckpoint()
+{
+	assert(m_checkpoints.size());
+	if (m_checkpoints.size() > 1)
 	{
-		// Populate memory.
-		assert(it->second.type() == AddressType::Contract);
-		TrieDB<u256, Overlay> memdb(const_cast<Overlay*>(&m_db), it->second.oldRoot());		// promise we won't alter the overlay! :)
-		map<u256, u256>& mem = it->second.takeMemory();
-		for (auto const& i: memdb)
-			if (mem.find(i.first) == mem.end())
-				mem.insert(make_pair(i.first, RLP(i.second).toInt<u256>()));
-			else
-				mem.at(i.first) = RLP(i.second).toInt<u256>();
+		// Anything the enclosing checkpoint hadn't yet noted was, at its start, as we noted it.
+		auto& outer = m_checkpoints[m_checkpoints.size() - 2];
+		for (auto& i: m_checkpoints.back().saved)
+			if (!outer.saved.count(i.first))
+				outer.saved.insert(move(i));
 	}
+	m_checkpoints.pop_back();
 }
 
 void State::commit()
 {
+	assert(m_checkpoints.empty());
 	eth::commit(m_cache, m_db, m_state);
 	m_cache.clear();
 }
@@ -161,8 +309,8 @@ bool State::sync(BlockChain const& _bc, h256 _block)
 	try
 	{
 		auto b = _bc.block(_block);
-		bi.populate(b);
-		bi.verifyInternals(_bc.block(_block));
+		bi.populate(b.ref(), _block);
+		bi.verifyInternals(b.ref());
 	}
 	catch (...)
 	{
@@ -191,19 +339,46 @@ bool State::sync(BlockChain const& _bc, h256 _block)
 		// Find most recent state dump and replay what's left.
 		// (Most recent state dump might end up being genesis.)
 
+		// Only states descending from the last pruned canonical block, restore points and the genesis are
+		// sure to be complete; others may have lost nodes to their pruned ancestors being superceded.
+		PruneRecord r(m_db);
 		std::vector<h256> chain;
-		while (bi.stateRoot != BlockInfo::genesis().hash && m_db.lookup(bi.stateRoot).empty())	// while we don't have the state root of the latest block...
+		h256 newest;				// the most recent block above the last pruned era whose state we have.
+		uint newestAt = 0;
+		while (true)
 		{
+			uint n = _bc.details(bi.hash).number;
+			bool have = !m_db.lookup(bi.stateRoot).empty();
+			if (n > r.era && have && !newest)
+			{
+				if (!r.era)
+					break;				// nothing pruned yet - it's complete.
+				newest = bi.hash;
+				newestAt = chain.size();
+			}
+			if (newest && n == r.era && bi.hash == r.hash)
+			{
+				// We descend from the last pruned canonical block; the newest state we found is complete.
+				chain.resize(newestAt);
+				bi = _bc.info(newest);
+				break;
+			}
+			if (have && (!n || (n == r.era && bi.hash == r.hash) || r.isRestorePoint(bi.hash)))
+				break;
 			chain.push_back(bi.hash);				// push back for later replay.
-			bi.populate(_bc.block(bi.parentHash));	// move to parent.
+			bi = _bc.info(bi.parentHash);	// move to parent.
 		}
 
 		m_previousBlock = bi;
+		m_currentNumber = _bc.details(bi.hash).number + 1;
 		resetCurrent();
 
 		// Iterate through in reverse, playing back each of the blocks.
 		for (auto it = chain.rbegin(); it != chain.rend(); ++it)
-			playback(_bc.block(*it), true);
+		{
+			auto b = _bc.block(*it);
+			playback(b.ref(), true, &_bc);
+		}
 
 		m_currentNumber = _bc.details(_block).number + 1;
 		resetCurrent();
@@ -224,9 +399,53 @@ map<Address, u256> State::addresses() const
 	return ret;
 }
 
+map<Address, u256> State::addressesChanged(State const& _before, Addresses& o_gone) const
+{
+	// Those that might differ: any either has cached, and any whose entry in the trie differs.
+	set<Address> touched;
+	for (auto const& i: m_cache)
+		touched.insert(i.first);
+	for (auto const& i: _before.m_cache)
+		touched.insert(i.first);
+	m_state.diff(_before.m_state, [&](bytesConstRef _k, bytesConstRef, bytesConstRef) { touched.insert(Address(_k.data())); });
+
+	map<Address, u256> ret;
+	for (auto const& a: touched)
+	{
+		AddressState readBefore;
+		AddressState read;
+		auto b = _before.addressState(a, readBefore);
+		auto s = addressState(a, read);
+		bool was = b && b->type() != AddressType::Dead;
+		if (s && s->type() != AddressType::Dead)
+		{
+			if (!was || b->balance() != s->balance())
+				ret[a] = s->balance();
+		}
+		else if (was)
+			o_gone.push_back(a);
+	}
+	return ret;
+}
+
+size_t State::memoryUsed() const
+{
+	// Each cached address: its entry in the table (with a node and bucket pointer) plus any contract memory.
+	size_t ret = m_cache.size() * (sizeof(Address) + sizeof(AddressState) + 3 * sizeof(void*));
+	for (auto const& i: m_cache)
+		if (i.second.type() == AddressType::Contract)
+			ret += i.second.memory().bytes();
+	return ret + m_db.uncommittedSize();
+}
+
 void State::resetCurrent()
 {
 	m_transactions.clear();
+	m_transactionList.clear();
+	m_currentTxData.clear();
+	m_committedTransactions = 0;
+	m_rewarded.clear();
+	m_rewardsApplied = false;
 	m_cache.clear();
 	m_currentBlock = BlockInfo();
 	m_currentBlock.coinbaseAddress = m_ourAddress;
@@ -239,40 +458,51 @@ bool State::sync(TransactionQueue& _tq)
 {
 	// TRANSACTIONS
 	bool ret = false;
-	auto ts = _tq.transactions();
-	for (auto const& i: ts)
-		if (!m_transactions.count(i.first))
-			// don't have it yet! Execute it now.
-			try
+	for (auto const& h: _tq.ordered())
+		if (!m_transactions.count(h))
+		{
+			// don't have it yet! Check its nonce against what its sender has sent so far.
+			TransactionQueue::Info const& info = _tq.info(h);
+			u256 required = transactionsFrom(info.sender);
+			if (info.nonce > required)
+				// too new - wait for those before it (which, being ordered, we've already tried).
+				continue;
+			if (info.nonce < required)
 			{
-				execute(i.second);
+				// too old
+				_tq.drop(h);
 				ret = true;
+				continue;
 			}
-			catch (InvalidNonce const& in)
+
+			// Execute it now.
+			try
 			{
-				if (in.required > in.candidate)
-				{
-					// too old
-					_tq.drop(i.first);
-					ret = true;
-				}
+				if (m_rewardsApplied)
+					unapplyRewards();
+				checkpoint();
+				execute(_tq.transactions().at(h));
+				dropCheckpoint();
+				ret = true;
 			}
 			catch (std::exception const&)
 			{
-				// Something else went wrong - drop it.
-				_tq.drop(i.first);
+				// Something went wrong - undo anything it did and drop it.
+				revert();
+				_tq.drop(h);
 				ret = true;
 			}
+		}
 	return ret;
 }
 
-u256 State::playback(bytesConstRef _block, bool _fullCommit)
+u256 State::playback(bytesConstRef _block, bool _fullCommit, BlockChain const* _bc)
 {
 	try
 	{
 		m_currentBlock.populate(_block);
 		m_currentBlock.verifyInternals(_block);
-		return playback(_block, BlockInfo(), _fullCommit);
+		return playback(_block, BlockInfo(), _fullCommit, _bc);
 	}
 	catch (...)
 	{
@@ -282,21 +512,39 @@ u256 State::playback(bytesConstRef _block, bool _fullCommit)
 	}
 }
 
-u256 State::playback(bytesConstRef _block, BlockInfo const& _bi, BlockInfo const& _parent, BlockInfo const& _grandParent, bool _fullCommit)
+u256 State::playback(bytesConstRef _block, BlockInfo const& _bi, BlockInfo const& _parent, BlockInfo const& _grandParent, bool _fullCommit, BlockChain const* _bc)
 {
 	m_currentBlock = _bi;
 	m_previousBlock = _parent;
-	return playback(_block, _grandParent, _fullCommit);
+	return playback(_block, _grandParent, _fullCommit, _bc);
 }
 
-u256 State::playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _fullCommit)
+u256 State::playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _fullCommit, BlockChain const* _bc)
 {
 	if (m_currentBlock.parentHash != m_previousBlock.hash)
 		throw InvalidParentHash();
 
-	// All ok with the block generally. Play back the transactions now...
-	for (auto const& i: RLP(_block)[1])
-		execute(i.data());
+	// All ok with the block generally. Play back the transactions now, their senders having been recovered in parallel.
+	// Any that failed to decode or recover are executed from scratch, so they fail at the proper point.
+	RLP txs = RLP(_block)[1];
+	auto senders = recoverSenders(txs);
+	unsigned threads = Defaults::s_playbackThreads ? Defaults::s_playbackThreads : thread::hardware_concurrency();
+	if (threads > 1)
+		prefetch(senders, threads);
+	if (threads > 1 && senders.size() > 1 && m_cache.empty() && m_checkpoints.empty())
+		playbackParallel(txs, senders, min<unsigned>(threads, senders.size()));
+	else
+	{
+		unsigned n = 0;
+		for (auto const& i: txs)
+		{
+			if (senders[n].second)
+				execute(senders[n].first, senders[n].second);
+			else
+				execute(i.data());
+			++n;
+		}
+	}
 
 	// Initialise total difficulty calculation.
 	u256 tdIncrease = m_currentBlock.difficulty;
@@ -305,10 +553,14 @@ u256 State::playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _
 	Addresses rewarded;
 	for (auto const& i: RLP(_block)[2])
 	{
-		BlockInfo uncle(i.data());
+		// An uncle the chain holds decoded was checked against its parent when it was imported.
+		BlockInfo uncle;
+		bool known = _bc && _bc->cachedHeader(i.data(), uncle);
+		if (!known)
+			uncle.populateFromHeader(i);
 		if (m_previousBlock.parentHash != uncle.parentHash)
 			throw InvalidUncle();
-		if (_grandParent)
+		if (_grandParent && !known)
 			uncle.verifyParent(_grandParent);
 		tdIncrease += uncle.difficulty;
 		rewarded.push_back(uncle.coinbaseAddress);
@@ -327,13 +579,19 @@ u256 State::playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _
 		m_db.rollback();
 		throw InvalidStateRoot();
 	}
+	s_transactionsPlayed += txs.itemCount();
 
 	if (_fullCommit)
 	{
-		// Commit the new trie to disk.
-		m_db.commit();
+		// Commit the new trie to disk, journalled so that any nodes it supercedes can later be pruned.
+		// If its era is already pruned (i.e. we're replaying from a restore point), it's just kept.
+		if (Defaults::s_recentStates && m_currentNumber > PruneRecord(m_db).era)
+			m_db.commit(m_currentNumber, m_currentBlock.hash);
+		else
+			m_db.commit();
 
 		m_previousBlock = m_currentBlock;
+		m_currentNumber++;
 		resetCurrent();
 	}
 	else
@@ -345,69 +603,259 @@ u256 State::playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _
 	return tdIncrease;
 }
 
-// @returns the block that represents the difference between m_previousBlock and m_currentBlock.
-// (i.e. all the transactions we executed).
-void State::commitToMine(BlockChain const& _bc)
+void State::prefetch(std::vector<SenderRecovery> const& _senders, unsigned _threads) const
 {
-	if (m_currentBlock.sha3Transactions != h256() || m_currentBlock.sha3Uncles != h256())
+	// Only worth it if there's a DB to read and a cache to read into.
+	if (!m_db.nodeCache())
+		return;
+	set<Address> touched = { m_currentBlock.coinbaseAddress };
+	for (auto const& i: _senders)
+		if (i.second)
+		{
+			touched.insert(i.second);
+			if (i.first.receiveAddress)
+				touched.insert(i.first.receiveAddress);
+		}
+	if (touched.size() < 2)
 		return;
 
-	RLPStream uncles;
-	Addresses uncleAddresses;
+	// Reading the overlay concurrently is fine, so long as nothing's written meanwhile.
+	vector<Address> addresses(touched.begin(), touched.end());
+	h256 root = m_state.root();
+	Overlay* db = const_cast<Overlay*>(&m_db);			// promise we won't change the overlay! :)
+	parallelFor(addresses.size(), _threads, [&](unsigned i)
+	{
+		string s = TrieDB<Address, Overlay>(db, root).at(addresses[i]);
+		RLP r(s);
+		if (r.isList() && r.itemCount() > 2)
+		{
+			h256 memory = r[2].toHash<h256>();
+			if (memory && memory != c_shaNull)
+				TrieDB<h256, Overlay>(db, memory).at(h256());
+		}
+	});
+}
 
-	if (m_previousBlock != BlockInfo::genesis())
+void State::playbackParallel(RLP const& _txs, std::vector<SenderRecovery>& _senders, unsigned _threads)
+{
+	// Speculate: each thread executes transactions, as they come, on its own copy of the state as it was before the
+	// block, clearing the copy's cache in between. A checkpoint notes what each changes.
+	std::vector<Speculation> specs(_senders.size());
+	atomic<unsigned> next(0);
+	parallelFor(_threads, _threads, [&](unsigned)
 	{
-		// Find uncles if we're not a direct child of the genesis.
-//		cout << "Checking " << m_previousBlock.hash << ", parent=" << m_previousBlock.parentHash << endl;
-		auto us = _bc.details(m_previousBlock.parentHash).children;
-		assert(us.size() >= 1);	// must be at least 1 child of our grandparent - it's our own parent!
-		uncles.appendList(us.size() - 1);	// one fewer - uncles precludes our parent from the list of grandparent's children.
-		for (auto const& u: us)
-			if (u != m_previousBlock.hash)	// ignore our own parent - it's not an uncle.
+		State worker(*this);
+		for (unsigned i; (i = next++) < specs.size();)
+		{
+			if (!_senders[i].second)
+				continue;
+			worker.m_cache.clear();
+			worker.m_speculation = &specs[i];
+			worker.checkpoint();
+			try
+			{
+				worker.executeBare(_senders[i].first, _senders[i].second);
+				for (auto const& w: worker.m_checkpoints.back().saved)
+					specs[i].writes.push_back(make_pair(w.first, worker.m_cache.at(w.first)));
+				specs[i].ok = true;
+			}
+			catch (...)
 			{
-				BlockInfo ubi(_bc.block(u));
-				ubi.fillStream(uncles, true);
-				uncleAddresses.push_back(ubi.coinbaseAddress);
+				// It'll be executed again in order, and fail (or not) at the proper point.
 			}
+			worker.m_checkpoints.clear();
+			worker.m_speculation = nullptr;
+		}
+	});
+
+	// Validate, in order. Fees credited to the coinbase commute, so a transaction needn't have seen those of its
+	// predecessors unless it read the coinbase itself.
+	Address coinbase = m_currentBlock.coinbaseAddress;
+	unordered_set<Address> written;
+	unsigned n = 0;
+	for (auto const& i: _txs)
+	{
+		Speculation& s = specs[n];
+		bool valid = s.ok && !s.reads.count(coinbase);
+		for (auto it = s.reads.begin(); valid && it != s.reads.end(); ++it)
+			valid = !written.count(*it);
+
+		if (valid)
+		{
+			for (auto& w: s.writes)
+			{
+				written.insert(w.first);
+				m_cache[w.first] = move(w.second);
+			}
+			if (s.paidMiner)
+				addBalance(coinbase, s.minerFees);
+			auto h = _senders[n].first.sha3();
+			m_transactions.insert(make_pair(h, _senders[n].first));
+			m_transactionList.push_back(h);
+		}
+		else
+		{
+			// Do it for real, noting what it changes for the benefit of those after it.
+			checkpoint();
+			try
+			{
+				if (_senders[n].second)
+					execute(_senders[n].first, _senders[n].second);
+				else
+					execute(i.data());
+			}
+			catch (...)
+			{
+				dropCheckpoint();
+				throw;
+			}
+			for (auto const& w: m_checkpoints.back().saved)
+				written.insert(w.first);
+			dropCheckpoint();
+		}
+		++n;
 	}
-	else
-		uncles.appendList(0);
+}
 
-	applyRewards(uncleAddresses);
+void State::prune(BlockChain const& _bc)
+{
+	if (!Defaults::s_recentStates)
+		return;
+	PruneRecord r(m_db);
+	uint head = _bc.details().number;
+	if (r.era + Defaults::s_recentStates >= head)
+		return;
 
-	RLPStream txs(m_transactions.size());
-	for (auto const& i: m_transactions)
-		i.second.fillStream(txs);
+	uint pruned = 0;
+	for (uint n = r.era + 1; n + Defaults::s_recentStates <= head; ++n)
+	{
+		r.era++;
+		r.hash = _bc.numberHash(n);
+		pruned += m_db.prune(r.era, r.hash);
 
-	txs.swapOut(m_currentTxs);
-	uncles.swapOut(m_currentUncles);
+		if (Defaults::s_restoreInterval && r.era % Defaults::s_restoreInterval == 0)
+		{
+			// Pin every node of this state (including contract memory) before its successors' kills are applied.
+			PruneRecord::RestorePoint rp{r.era, r.hash, h256s()};
+			GenericTrieDB<Overlay> t(&m_db);
+			auto pin = [&](h256 _h) { if (m_db.ref(_h, false)) rp.pinned.push_back(_h); };
+			t.descendKey(_bc.info(r.hash).stateRoot, pin, [&](bytesConstRef _v)
+			{
+				RLP a(_v);
+				if (a.itemCount() == 3 && a[2].toHash<h256>())
+					t.descendKey(a[2].toHash<h256>(), pin, [](bytesConstRef) {});
+			});
+			r.restorePoints.push_back(rp);
+		}
+
+		// Unpin any restore points that have now expired.
+		while (r.restorePoints.size() && r.restorePoints.front().era + Defaults::s_restoreInterval * Defaults::s_restorePoints <= r.era)
+		{
+			for (auto const& i: r.restorePoints.front().pinned)
+				if (m_db.deref(i))
+					++pruned;
+			r.restorePoints.erase(r.restorePoints.begin());
+		}
+	}
+	r.write(m_db);
+	cnote << "Pruned" << pruned << "state nodes up to block" << r.era;
+}
+
+// @returns the block that represents the difference between m_previousBlock and m_currentBlock.
+// (i.e. all the transactions we executed).
+void State::commitToMine(BlockChain const& _bc)
+{
+	if (m_currentBlock.sha3Uncles == h256())
+	{
+		RLPStream uncles;
+		m_rewarded.clear();
+
+		if (m_previousBlock != BlockInfo::genesis())
+		{
+			// Find uncles if we're not a direct child of the genesis.
+//			cout << "Checking " << m_previousBlock.hash << ", parent=" << m_previousBlock.parentHash << endl;
+			auto us = _bc.details(m_previousBlock.parentHash).children;
+			assert(us.size() >= 1);	// must be at least 1 child of our grandparent - it's our own parent!
+			uncles.appendList(us.size() - 1);	// one fewer - uncles precludes our parent from the list of grandparent's children.
+			for (auto const& u: us)
+				if (u != m_previousBlock.hash)	// ignore our own parent - it's not an uncle.
+				{
+					BlockInfo ubi = _bc.info(u);
+					ubi.fillStream(uncles, true);
+					m_rewarded.push_back(ubi.coinbaseAddress);
+				}
+		}
+		else
+			uncles.appendList(0);
+
+		uncles.swapOut(m_currentUncles);
+		m_currentBlock.sha3Uncles = sha3(m_currentUncles);
+	}
+	else if (m_rewardsApplied)
+		// Nothing executed since last time.
+		return;
+
+	applyRewards(m_rewarded);
+	m_rewardsApplied = true;
 
+	// Append any transactions executed since last time to the block's list.
+	for (; m_committedTransactions < m_transactionList.size(); ++m_committedTransactions)
+		m_currentTxData += m_transactions[m_transactionList[m_committedTransactions]].rlp();
+	RLPStream txs;
+	txs.appendList(m_committedTransactions).appendRaw(m_currentTxData, m_committedTransactions);
+	txs.swapOut(m_currentTxs);
 	m_currentBlock.sha3Transactions = sha3(m_currentTxs);
-	m_currentBlock.sha3Uncles = sha3(m_currentUncles);
 
-	// Commit any and all changes to the trie that are in the cache, then update the state root accordingly.
+	// Commit the changes in the cache (i.e. to the accounts touched since last time) to the trie, then update the state root accordingly.
 	commit();
 	m_currentBlock.stateRoot = m_state.root();
 	m_currentBlock.parentHash = m_previousBlock.hash;
 }
 
-MineInfo State::mine(uint _msTimeout)
+void State::unapplyRewards()
+{
+	u256 r = c_blockReward;
+	for (auto const& i: m_rewarded)
+	{
+		subBalance(i, c_blockReward * 4 / 3);
+		r += c_blockReward / 8;
+	}
+	subBalance(m_currentBlock.coinbaseAddress, r);
+	m_rewardsApplied = false;
+}
+
+void State::prepareToMine()
 {
 	// Update timestamp according to clock.
 	m_currentBlock.timestamp = time(0);
 
 	// Update difficulty according to timestamp.
 	m_currentBlock.difficulty = m_currentBlock.calculateDifficulty(m_previousBlock);
+}
 
-	// TODO: Miner class that keeps dagger between mine calls (or just non-polling mining).
+MineInfo State::mine(uint _msTimeout)
+{
+	prepareToMine();
 	MineInfo ret = m_dagger.mine(/*out*/m_currentBlock.nonce, m_currentBlock.headerHashWithoutNonce(), m_currentBlock.difficulty, _msTimeout);
-	if (ret.completed)
+	completeMine(ret.completed);
+	return ret;
+}
+
+MineInfo State::mine(Miner& _miner, uint _msTimeout)
+{
+	prepareToMine();
+	_miner.setWork(m_currentBlock.headerHashWithoutNonce(), m_currentBlock.difficulty);
+	MineInfo ret = _miner.wait(/*out*/m_currentBlock.nonce, _msTimeout);
+	completeMine(ret.completed);
+	return ret;
+}
+
+void State::completeMine(bool _completed)
+{
+	if (_completed)
 	{
 		// Got it!
 
-		// Commit to disk.
-		m_db.commit();
-
 		// Compile block:
 		RLPStream ret;
 		ret.appendList(3);
@@ -416,44 +864,44 @@ MineInfo State::mine(uint _msTimeout)
 		ret.appendRaw(m_currentUncles);
 		ret.swapOut(m_currentBytes);
 		m_currentBlock.hash = sha3(m_currentBytes);
+
+		// Commit to disk, journalled as playback() would, so that the state is pruned like any other. Importing the
+		// block later journals nothing more.
+		if (Defaults::s_recentStates && m_currentNumber > PruneRecord(m_db).era)
+			m_db.commit(m_currentNumber, m_currentBlock.hash);
+		else
+			m_db.commit();
 		cout << "*** SUCCESS: Mined " << m_currentBlock.hash << " (parent: " << m_currentBlock.parentHash << ")" << endl;
 	}
 	else
 		m_currentBytes.clear();
-
-	return ret;
 }
 
 bool State::isNormalAddress(Address _id) const
 {
-	ensureCached(_id, false, false);
-	auto it = m_cache.find(_id);
-	if (it == m_cache.end())
-		return false;
-	return it->second.type() == AddressType::Normal;
+	AddressState read;
+	auto s = addressState(_id, read);
+	return s && s->type() == AddressType::Normal;
 }
 
 bool State::isContractAddress(Address _id) const
 {
-	ensureCached(_id, false, false);
-	auto it = m_cache.find(_id);
-	if (it == m_cache.end())
-		return false;
-	return it->second.type() == AddressType::Contract;
+	AddressState read;
+	auto s = addressState(_id, read);
+	return s && s->type() == AddressType::Contract;
 }
 
 u256 State::balance(Address _id) const
 {
-	ensureCached(_id, false, false);
-	auto it = m_cache.find(_id);
-	if (it == m_cache.end())
-		return 0;
-	return it->second.balance();
+	AddressState read;
+	auto s = addressState(_id, read);
+	return s ? s->balance() : 0;
 }
 
 void State::noteSending(Address _id)
 {
-	ensureCached(_id, false, false);
+	journal(_id);
+	ensureCached(_id, false);
 	auto it = m_cache.find(_id);
 	if (it == m_cache.end())
 		m_cache[_id] = AddressState(0, 1);
@@ -463,7 +911,8 @@ void State::noteSending(Address _id)
 
 void State::addBalance(Address _id, u256 _amount)
 {
-	ensureCached(_id, false, false);
+	journal(_id);
+	ensureCached(_id, false);
 	auto it = m_cache.find(_id);
 	if (it == m_cache.end())
 		m_cache[_id] = AddressState(_amount, 0);
@@ -473,7 +922,8 @@ void State::addBalance(Address _id, u256 _amount)
 
 void State::subBalance(Address _id, bigint _amount)
 {
-	ensureCached(_id, false, false);
+	journal(_id);
+	ensureCached(_id, false);
 	auto it = m_cache.find(_id);
 	if (it == m_cache.end() || (bigint)it->second.balance() < _amount)
 		throw NotEnoughCash();
@@ -483,43 +933,74 @@ void State::subBalance(Address _id, bigint _amount)
 
 u256 State::transactionsFrom(Address _id) const
 {
-	ensureCached(_id, false, false);
-	auto it = m_cache.find(_id);
-	if (it == m_cache.end())
-		return 0;
-	else
-		return it->second.nonce();
+	AddressState read;
+	auto s = addressState(_id, read);
+	return s ? s->nonce() : 0;
 }
 
 u256 State::contractMemory(Address _id, u256 _memory) const
 {
-	ensureCached(_id, false, false);
-	auto it = m_cache.find(_id);
-	if (it == m_cache.end() || it->second.type() != AddressType::Contract)
+	AddressState read;
+	auto s = addressState(_id, read);
+	if (!s || s->type() != AddressType::Contract)
 		return 0;
-	else if (it->second.haveMemory())
-	{
-		auto mit = it->second.memory().find(_memory);
-		if (mit == it->second.memory().end())
-			return 0;
-		return mit->second;
-	}
-	// Memory not cached - just grab one item from the DB rather than cache the lot.
-	TrieDB<u256, Overlay> memdb(const_cast<Overlay*>(&m_db), it->second.oldRoot());			// promise we won't change the overlay! :)
-	return RLP(memdb.at(_memory)).toInt<u256>();	// TODO: CHECK: check if this is actually an RLP decode
+	if (auto v = s->memory().find(_memory))
+		return *v;
+	return storedMemory(s->oldRoot(), _memory);
+}
+
+u256 State::storedMemory(h256 _root, u256 _memory) const
+{
+	if (!_root || _root == c_shaNull)
+		return 0;
+	TrieDB<h256, Overlay> memdb(const_cast<Overlay*>(&m_db), _root);			// promise we won't change the overlay! :)
+	string v = memdb.at(_memory);
+	return v.empty() ? 0 : RLP(v).toInt<u256>();	// TODO: CHECK: check if this is actually an RLP decode
+}
+
+eth::uint State::memoryCount(Address _contract) const
+{
+	AddressState const& s = m_cache.at(_contract);
+	uint ret = 0;
+	for (auto const& i: s.memory().ordered())
+		if (i.second)
+			++ret;
+	if (s.oldRoot() && s.oldRoot() != c_shaNull)
+		for (auto const& i: TrieDB<h256, Overlay>(const_cast<Overlay*>(&m_db), s.oldRoot()))
+			if (!s.memory().count(i.first))
+				++ret;
+	return ret;
 }
 
 void State::execute(bytesConstRef _rlp)
 {
 	// Entry point for a user-executed transaction.
 	Transaction t(_rlp);
-	executeBare(t, t.sender());
+	execute(t, t.sender());
+}
+
+void State::execute(Transaction const& _t, Address _sender)
+{
+	executeBare(_t, _sender);
 
 	// Add to the user-originated transactions that we've executed.
 	// NOTE: Here, contract-originated transactions will not get added to the transaction list.
 	// If this is wrong, move this line into execute(Transaction const& _t, Address _sender) and
 	// don't forget to allow unsigned transactions in the tx list if they concur with the script execution.
-	m_transactions.insert(make_pair(t.sha3(), t));
+	auto h = _t.sha3();
+	m_transactions.insert(make_pair(h, _t));
+	m_transactionList.push_back(h);
+}
+
+void State::payMiner(u256 _fee)
+{
+	if (m_speculation)
+	{
+		m_speculation->minerFees += _fee;
+		m_speculation->paidMiner = true;
+	}
+	else
+		addBalance(m_currentBlock.coinbaseAddress, _fee);
 }
 
 void State::applyRewards(Addresses const& _uncleAddresses)
@@ -555,7 +1036,7 @@ void State::executeBare(Transaction const& _t, Address _sender)
 	{
 		subBalance(_sender, _t.value + _t.fee);
 		addBalance(_t.receiveAddress, _t.value);
-		addBalance(m_currentBlock.coinbaseAddress, _t.fee);
+		payMiner(_t.fee);
 
 		if (isContractAddress(_t.receiveAddress))
 		{
@@ -575,17 +1056,16 @@ void State::executeBare(Transaction const& _t, Address _sender)
 			throw ContractAddressCollision();
 
 		// All OK - set it up.
-		m_cache[newAddress] = AddressState(0, 0, sha3(RLPNull));
-		auto& mem = m_cache[newAddress].takeMemory();
+		journal(newAddress);
+		m_cache[newAddress] = AddressState(0, 0, h256());
+		auto& mem = m_cache[newAddress].memory();
 		for (uint i = 0; i < _t.data.size(); ++i)
-			if (mem.find(i) == mem.end())
-				mem.insert(make_pair(i, _t.data[i]));
-			else
-				mem.at(i) = _t.data[i];
+			if (_t.data[i])
+				mem[i] = _t.data[i];
         
 		subBalance(_sender, _t.value + _t.fee);
 		addBalance(newAddress, _t.value);
-		addBalance(m_currentBlock.coinbaseAddress, _t.fee);
+		payMiner(_t.fee);
 	}
 }
 
@@ -597,115 +1077,188 @@ inline Address asAddress(u256 _item)
 	return left160(h256(_item));
 }
 
+// Native fast paths for VM arithmetic. Most stack items fit in a single limb, for which boost's
+// general multi-limb routines are several times slower than the machine's own instructions.
+inline bool isSmall(u256 const& _x) { return _x.backend().size() == 1; }
+inline uint64_t small(u256 const& _x) { return *_x.backend().limbs(); }
+
+/// The secp256k1 field size, group order and generator, for the EC opcodes.
+static const u256 c_secpP("0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F");
+static const u256 c_secpOrder("0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+static const u256 c_secpGx("0x79BE667EF9DCBBAC55A06295CE870B07029BFCDB2DCE28D959F2815B16F81798");
+static const u256 c_secpGy("0x483ADA7726A3C4655DA4FBFC0E1108A8FD17B448A68554199C47D08FFB10D4B8");
+
+// The EC opcodes hand secp256k1 the stack items as four 64-bit words, least significant first. On 64-bit
+// builds those are just the limbs; where limbs are narrower, each word is made of several.
+static const unsigned c_limbBits = sizeof(boost::multiprecision::limb_type) * 8;
+inline void toWords(u256 const& _x, uint64_t* o_w)
+{
+	memset(o_w, 0, 4 * sizeof(uint64_t));
+	auto const& b = _x.backend();
+	for (unsigned i = 0; i < b.size(); ++i)
+		o_w[i * c_limbBits / 64] |= (uint64_t)b.limbs()[i] << (i * c_limbBits % 64);
+}
+inline u256 fromWords(uint64_t const* _w)
+{
+	u256 ret;
+	unsigned limbs = 256 / c_limbBits;
+	ret.backend().resize(limbs, limbs);
+	for (unsigned i = 0; i < limbs; ++i)
+		ret.backend().limbs()[i] = (boost::multiprecision::limb_type)(_w[i * c_limbBits / 64] >> (i * c_limbBits % 64));
+	ret.backend().normalize();
+	return ret;
+}
+
 void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _txFee, u256s const& _txData, u256* _totalFee)
 {
-	std::vector<u256> stack;
+	// Per-instruction fees (on top of the step fee), indexed by opcode.
+	static const array<u256, 256> s_fees = []()
+	{
+		array<u256, 256> ret;
+		ret.fill(0);
+		ret[(uint8_t)Instruction::STORE] = ret[(uint8_t)Instruction::LOAD] = c_dataFee;
+		ret[(uint8_t)Instruction::EXTRO] = ret[(uint8_t)Instruction::BALANCE] = c_extroFee;
+		ret[(uint8_t)Instruction::MKTX] = c_txFee;
+		for (auto i: { Instruction::SHA256, Instruction::RIPEMD160, Instruction::ECMUL, Instruction::ECADD, Instruction::ECSIGN, Instruction::ECRECOVER, Instruction::ECVALID })
+			ret[(uint8_t)i] = c_cryptoFee;
+		return ret;
+	}();
+
+	// Borrow a stack from this thread's spares rather than growing a fresh one each call. There may be
+	// several in use at once, since MKTX can call into another contract.
+	static thread_local std::vector<u256s> s_spareStacks;
+	u256s stack;
+	if (!s_spareStacks.empty())
+	{
+		stack = move(s_spareStacks.back());
+		s_spareStacks.pop_back();
+	}
+	else
+		stack.reserve(c_initialStackSize);
+	struct StackReturner
+	{
+		~StackReturner() { stack.clear(); s_spareStacks.push_back(move(stack)); }
+		u256s& stack;
+	} stackReturner{stack};
 
 	// Set up some local functions.
-	auto require = [&](u256 _n)
+	auto require = [&](uint _n)
 	{
 		if (stack.size() < _n)
 			throw StackTooSmall(_n, stack.size());
 	};
-	ensureCached(_myAddress, true, true);
-	auto& myMemory = m_cache[_myAddress].takeMemory();
-
+	ensureCached(_myAddress, true);
+	journal(_myAddress);
+	auto& myMemory = m_cache[_myAddress].memory();
+	h256 myRoot = m_cache[_myAddress].oldRoot();
+
+	// Memory is loaded a position at a time, as it's needed; positions read from the trie are kept in
+	// a local cache, while writes go into myMemory, the contract's set of changes.
+	MemoryMap loaded;
 	auto mem = [&](u256 _n) -> u256
 	{
-		auto i = myMemory.find(_n);
-		return i == myMemory.end() ? 0 : i->second;
+		if (auto v = myMemory.find(_n))
+			return *v;
+		if (auto v = loaded.find(_n))
+			return *v;
+		return loaded[_n] = storedMemory(myRoot, _n);
+	};
+	// The code lives at the bottom of memory; it's decoded into a flat image as it's first fetched so that
+	// subsequent instruction and operand fetches are an index rather than a lookup. The image grows over
+	// fetches just past its end, so covers the code but not far-flung jump targets. Stores into the image's
+	// range keep it in step (code may be self-modifying), and it's dropped after MKTX, which may re-enter us.
+	std::vector<u256> image;
+	auto fetch = [&](u256 _n) -> u256
+	{
+		if (_n >= image.size() && _n < image.size() + c_maxImageGap)
+			while (image.size() <= _n)
+				image.push_back(mem(image.size()));
+		return _n < image.size() ? image[(size_t)_n] : mem(_n);
 	};
 	auto setMem = [&](u256 _n, u256 _v)
 	{
-		if (_v)
-		{
-			auto it = myMemory.find(_n);
-			if (it == myMemory.end())
-				myMemory.insert(make_pair(_n, _v));
-			else
-				myMemory.at(_n) = _v;
-		}
-		else
-			myMemory.erase(_n);
+		if (_n < image.size())
+			image[(size_t)_n] = _v;
+		myMemory[_n] = _v;
 	};
 
+	// Accounting of where the time goes, if it's wanted (see VMProfiler).
+	unique_ptr<VMProfiler::Run> profile(VMProfiler::enabled() ? new VMProfiler::Run(_myAddress) : nullptr);
+
 	u256 curPC = 0;
 	u256 nextPC = 1;
 	u256 stepCount = 0;
+	struct StepCounter
+	{
+		~StepCounter() { s_vmSteps += (uint64_t)steps; }
+		u256& steps;
+	} stepCounter{stepCount};
 	for (bool stopped = false; !stopped; curPC = nextPC, nextPC = curPC + 1)
 	{
 		stepCount++;
 
-		bigint minerFee = stepCount > 16 ? c_stepFee : 0;
-		bigint voidFee = 0;
-
-		auto rawInst = mem(curPC);
+		auto rawInst = fetch(curPC);
 		if (rawInst > 0xff)
 			throw BadInstruction();
 		Instruction inst = (Instruction)(uint8_t)rawInst;
 
-		switch (inst)
+		u256 minerFee = s_fees[(uint8_t)inst];
+		if (stepCount > 16)
+			minerFee += c_stepFee;
+		bigint voidFee = 0;
+		if (inst == Instruction::STORE)
 		{
-		case Instruction::STORE:
 			require(2);
 			if (!mem(stack.back()) && stack[stack.size() - 2])
 				voidFee += c_memoryFee;
 			if (mem(stack.back()) && !stack[stack.size() - 2])
 				voidFee -= c_memoryFee;
-			// continue on to...
-		case Instruction::LOAD:
-			minerFee += c_dataFee;
-			break;
-
-		case Instruction::EXTRO:
-		case Instruction::BALANCE:
-			minerFee += c_extroFee;
-			break;
-
-		case Instruction::MKTX:
-			minerFee += c_txFee;
-			break;
-
-		case Instruction::SHA256:
-		case Instruction::RIPEMD160:
-		case Instruction::ECMUL:
-		case Instruction::ECADD:
-		case Instruction::ECSIGN:
-		case Instruction::ECRECOVER:
-		case Instruction::ECVALID:
-			minerFee += c_cryptoFee;
-			break;
-		default:
-			break;
 		}
+		if (profile)
+			profile->step(inst, minerFee + voidFee > 0 ? (u256)(minerFee + voidFee) : 0);
 
-		if (minerFee + voidFee > balance(_myAddress))
-			throw NotEnoughCash();
-		subBalance(_myAddress, minerFee + voidFee);
-		*_totalFee += (u256)minerFee;
+		if (minerFee || voidFee)
+		{
+			if (minerFee + voidFee > balance(_myAddress))
+				throw NotEnoughCash();
+			subBalance(_myAddress, minerFee + voidFee);
+			*_totalFee += minerFee;
+		}
 
 		switch (inst)
 		{
 		case Instruction::ADD:
 			//pops two items and pushes S[-1] + S[-2] mod 2^256.
 			require(2);
-			stack[stack.size() - 2] += stack.back();
+			if (isSmall(stack.back()) && isSmall(stack[stack.size() - 2]) && small(stack.back()) + small(stack[stack.size() - 2]) >= small(stack.back()))
+				stack[stack.size() - 2] = small(stack.back()) + small(stack[stack.size() - 2]);
+			else
+				stack[stack.size() - 2] += stack.back();
 			stack.pop_back();
 			break;
 		case Instruction::MUL:
 			//pops two items and pushes S[-1] * S[-2] mod 2^256.
 			require(2);
-			stack[stack.size() - 2] *= stack.back();
+			if (isSmall(stack.back()) && isSmall(stack[stack.size() - 2]) && small(stack.back()) <= 0xffffffff && small(stack[stack.size() - 2]) <= 0xffffffff)
+				stack[stack.size() - 2] = small(stack.back()) * small(stack[stack.size() - 2]);
+			else
+				stack[stack.size() - 2] *= stack.back();
 			stack.pop_back();
 			break;
 		case Instruction::SUB:
 			require(2);
-			stack[stack.size() - 2] = stack.back() - stack[stack.size() - 2];
+			if (isSmall(stack.back()) && isSmall(stack[stack.size() - 2]) && small(stack.back()) >= small(stack[stack.size() - 2]))
+				stack[stack.size() - 2] = small(stack.back()) - small(stack[stack.size() - 2]);
+			else
+				stack[stack.size() - 2] = stack.back() - stack[stack.size() - 2];
 			stack.pop_back();
 			break;
 		case Instruction::DIV:
 			require(2);
-			stack[stack.size() - 2] = stack.back() / stack[stack.size() - 2];
+			if (isSmall(stack.back()) && isSmall(stack[stack.size() - 2]) && small(stack[stack.size() - 2]))
+				stack[stack.size() - 2] = small(stack.back()) / small(stack[stack.size() - 2]);
+			else
+				stack[stack.size() - 2] = stack.back() / stack[stack.size() - 2];
 			stack.pop_back();
 			break;
 		case Instruction::SDIV:
@@ -715,7 +1268,10 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 			break;
 		case Instruction::MOD:
 			require(2);
-			stack[stack.size() - 2] = stack.back() % stack[stack.size() - 2];
+			if (isSmall(stack.back()) && isSmall(stack[stack.size() - 2]) && small(stack[stack.size() - 2]))
+				stack[stack.size() - 2] = small(stack.back()) % small(stack[stack.size() - 2]);
+			else
+				stack[stack.size() - 2] = stack.back() % stack[stack.size() - 2];
 			stack.pop_back();
 			break;
 		case Instruction::SMOD:
@@ -724,17 +1280,11 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 			stack.pop_back();
 			break;
 		case Instruction::EXP:
-		{
-			// TODO: better implementation?
+			//pops two items and pushes S[-1] ^ S[-2] mod 2^256.
 			require(2);
-			auto n = stack.back();
-			auto x = stack[stack.size() - 2];
+			stack[stack.size() - 2] = exp256(stack.back(), stack[stack.size() - 2]);
 			stack.pop_back();
-			for (u256 i = 0; i < x; ++i)
-				n *= n;
-			stack.back() = n;
 			break;
-		}
 		case Instruction::NEG:
 			require(1);
 			stack.back() = ~(stack.back() - 1);
@@ -846,7 +1396,32 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 			// ECMUL - pops three items.
 			// If (S[-2],S[-1]) are a valid point in secp256k1, including both coordinates being less than P, pushes (S[-1],S[-2]) * S[-3], using (0,0) as the point at infinity.
 			// Otherwise, pushes (0,0).
+			// As it has always done, it leaves the point as it is for a zero factor or one of at least the group order,
+			// and coordinates of P or more are taken modulo P; the latter is rare enough to leave to the bytewise path.
 			require(3);
+			if (stack[stack.size() - 2] < c_secpP && stack.back() < c_secpP)
+			{
+				uint64_t x[4], y[4], n[4], rx[4], ry[4];
+				toWords(stack[stack.size() - 2], x);
+				toWords(stack.back(), y);
+				u256 const& factor = stack[stack.size() - 3];
+				if (!secp256k1_ec_point_valid(x, y))
+					stack[stack.size() - 3] = stack[stack.size() - 2] = 0;
+				else if (factor && factor < c_secpOrder)
+				{
+					toWords(factor, n);
+					secp256k1_ec_point_mul(rx, ry, x, y, n);
+					stack[stack.size() - 3] = fromWords(rx);
+					stack[stack.size() - 2] = fromWords(ry);
+				}
+				else
+				{
+					stack[stack.size() - 3] = stack[stack.size() - 2];
+					stack[stack.size() - 2] = stack.back();
+				}
+				stack.pop_back();
+				break;
+			}
 
 			bytes pub(1, 4);
 			pub += toBigEndian(stack[stack.size() - 2]);
@@ -873,7 +1448,35 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 		case Instruction::ECADD:
 		{
 			// ECADD - pops four items and pushes (S[-4],S[-3]) + (S[-2],S[-1]) if both points are valid, otherwise (0,0).
+			// What it has always actually added to (S[-2],S[-1]) is a multiple of G: the first 32 bytes of the encoded
+			// point (S[-4],S[-3]), so its 0x04 prefix and the top 31 bytes of S[-4]. Coordinates of P or more, and a sum
+			// at infinity, are rare enough to leave to the bytewise path.
 			require(4);
+			if (stack[stack.size() - 4] < c_secpP && stack[stack.size() - 3] < c_secpP && stack[stack.size() - 2] < c_secpP && stack.back() < c_secpP)
+			{
+				uint64_t ax[4], ay[4], bx[4], by[4], gx[4], gy[4], n[4], tx[4], ty[4], rx[4], ry[4];
+				toWords(stack[stack.size() - 2], ax);
+				toWords(stack.back(), ay);
+				toWords(stack[stack.size() - 4], bx);
+				toWords(stack[stack.size() - 3], by);
+				bool valid = secp256k1_ec_point_valid(ax, ay) && secp256k1_ec_point_valid(bx, by);
+				if (valid)
+				{
+					toWords(c_secpGx, gx);
+					toWords(c_secpGy, gy);
+					toWords((u256(4) << 248) | (stack[stack.size() - 4] >> 8), n);
+					secp256k1_ec_point_mul(tx, ty, gx, gy, n);
+					secp256k1_ec_point_add(rx, ry, ax, ay, tx, ty);
+				}
+				if (!valid || (rx[0] | rx[1] | rx[2] | rx[3] | ry[0] | ry[1] | ry[2] | ry[3]))
+				{
+					stack[stack.size() - 4] = valid ? fromWords(rx) : 0;
+					stack[stack.size() - 3] = valid ? fromWords(ry) : 0;
+					stack.pop_back();
+					stack.pop_back();
+					break;
+				}
+			}
 
 			bytes pub(1, 4);
 			pub += toBigEndian(stack[stack.size() - 2]);
@@ -948,7 +1551,19 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 		}
 		case Instruction::ECVALID:
 		{
+			// ECVALID - pops (S[-2],S[-1]) and sets the item below them to 1 if it's a valid point, otherwise 0.
 			require(2);
+			if (stack[stack.size() - 2] < c_secpP && stack.back() < c_secpP)
+			{
+				uint64_t x[4], y[4];
+				toWords(stack[stack.size() - 2], x);
+				toWords(stack.back(), y);
+				stack.pop_back();
+				stack.pop_back();
+				stack.back() = secp256k1_ec_point_valid(x, y) ? 1 : 0;
+				break;
+			}
+
 			bytes pub(1, 4);
 			pub += toBigEndian(stack[stack.size() - 2]);
 			pub += toBigEndian(stack.back());
@@ -978,7 +1593,7 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 		}
 		case Instruction::PUSH:
 		{
-			stack.push_back(mem(curPC + 1));
+			stack.push_back(fetch(curPC + 1));
 			nextPC = curPC + 2;
 			break;
 		}
@@ -992,7 +1607,7 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 			break;
 		case Instruction::DUPN:
 		{
-			auto s = mem(curPC + 1);
+			auto s = fetch(curPC + 1);
 			if (s == 0 || s > stack.size())
 				throw OperandOutOfRange(1, stack.size(), s);
 			stack.push_back(stack[stack.size() - (uint)s]);
@@ -1011,7 +1626,7 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 		{
 			require(1);
 			auto d = stack.back();
-			auto s = mem(curPC + 1);
+			auto s = fetch(curPC + 1);
 			if (s == 0 || s > stack.size())
 				throw OperandOutOfRange(1, stack.size(), s);
 			stack.back() = stack[stack.size() - (uint)s];
@@ -1085,13 +1700,19 @@ void State::execute(Address _myAddress, Address _txSender, u256 _txValue, u256 _
 			t.nonce = transactionsFrom(_myAddress);
 			executeBare(t, _myAddress);
 
+			// The call may have come back into this contract and stored to its memory (code included) or killed
+			// it, so forget what we've read of it.
+			image.clear();
+			loaded.clear();
+			auto const& me = m_cache[_myAddress];
+			myRoot = me.type() == AddressType::Contract ? me.oldRoot() : h256();
 			break;
 		}
 		case Instruction::SUICIDE:
 		{
 			require(1);
 			Address dest = asAddress(stack.back());
-			u256 minusVoidFee = myMemory.size() * c_memoryFee;
+			u256 minusVoidFee = memoryCount(_myAddress) * c_memoryFee;
 			addBalance(dest, balance(_myAddress) + minusVoidFee);
 			m_cache[_myAddress].kill();
 			// ...follow through to...
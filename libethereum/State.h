@@ -24,6 +24,7 @@
 #include <array>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include "Common.h"
 #include "RLP.h"
 #include "TransactionQueue.h"
@@ -33,6 +34,7 @@
 #include "Transaction.h"
 #include "TrieDB.h"
 #include "Dagger.h"
+#include "Miner.h"
 
 namespace eth
 {
@@ -40,7 +42,7 @@ namespace eth
 class BlockChain;
 
 extern const u256 c_genesisDifficulty;
-std::map<Address, AddressState> const& genesisState();
+std::unordered_map<Address, AddressState> const& genesisState();
 
 /**
  * @brief Model of the current state of the ledger.
@@ -53,6 +55,14 @@ public:
 	/// Construct state object.
 	State(Address _coinbaseAddress, Overlay const& _db);
 
+	/// Copy state object; the copy has its own overlay (and so trie) and cache.
+	State(State const& _s);
+	State& operator=(State const& _s);
+
+	/// @returns a copy of this state that's only to be read. Unlike other States, it may be read from several
+	/// threads at once, since reads of accounts not yet in its cache don't fill the cache.
+	State snapshot() const { State ret(*this); ret.m_readOnly = true; return ret; }
+
 	/// Set the coinbase address for any transactions we do.
 	/// This causes a complete reset of current block.
 	void setAddress(Address _coinbaseAddress) { m_ourAddress = _coinbaseAddress; resetCurrent(); }
@@ -62,21 +72,37 @@ public:
 	static Overlay openDB(std::string _path, bool _killExisting = false);
 	static Overlay openDB(bool _killExisting = false) { return openDB(std::string(), _killExisting); }
 
+	/// The DB on which this state is built.
+	Overlay const& db() const { return m_db; }
+
+	/// The block on which our current block is built (i.e. the last block played back or synced to).
+	BlockInfo const& previousBlock() const { return m_previousBlock; }
+
 	/// @returns the set containing all addresses currently in use in Ethereum.
 	std::map<Address, u256> addresses() const;
 
+	/// @returns the addresses in use whose balances differ from those in @a _before (or which weren't in use there),
+	/// with their balances; those in use there but not here are put in @a o_gone. Only the parts of the state trie
+	/// that differ between the two are read, so it's cheap however many addresses are in use. @a _before may be
+	/// read on another thread meanwhile if it's a snapshot().
+	/// @throws MissingTrieNode if part of either's state has been pruned.
+	std::map<Address, u256> addressesChanged(State const& _before, Addresses& o_gone) const;
+
+	/// @returns roughly how many bytes our cached addresses and the nodes not yet committed to the state DB take.
+	size_t memoryUsed() const;
+
 	/// Cancels transactions and rolls back the state to the end of the previous block.
 	/// @warning This will only work for on any transactions after you called the last commitToMine().
 	/// It's one or the other.
-	void rollback() { m_cache.clear(); }
+	void rollback() { m_cache.clear(); m_checkpoints.clear(); }
 
 	/// Prepares the current state for mining.
 	/// Commits all transactions into the trie, compiles uncles and transactions list, applies all
 	/// rewards and populates the current block header with the appropriate hashes.
 	/// The only thing left to do after this is to actually mine().
 	///
-	/// This may be called multiple times and without issue, however, until the current state is cleared,
-	/// calls after the first are ignored.
+	/// This may be called multiple times and without issue. Only the first call gathers the uncles; later
+	/// ones just append any transactions executed since to the block and commit the accounts they touched.
 	void commitToMine(BlockChain const& _bc);
 
 	/// Attempt to find valid nonce for block that this state represents.
@@ -85,6 +111,10 @@ public:
 	/// to get the block if you need it later.
 	MineInfo mine(uint _msTimeout = 1000);
 
+	/// As mine(), but the search is done by @a _miner's threads, which carry on in the background after
+	/// this returns. Calling again continues the search, swapping in the new header if it has changed.
+	MineInfo mine(Miner& _miner, uint _msTimeout = 1000);
+
 	/// Get the complete current block, including valid nonce.
 	/// Only valid after mine() returns true.
 	bytes const& blockData() const { return m_currentBytes; }
@@ -97,8 +127,20 @@ public:
 	bool sync(BlockChain const& _bc, h256 _blockHash);
 
 	/// Sync our transactions, killing those from the queue that we have and assimilating those that we don't.
+	/// They're taken in the queue's order, and those whose nonce is still ahead of their sender's are left for later.
 	bool sync(TransactionQueue& _tq);
 
+	/// Prune the state DB of all nodes which aren't needed by the states we retain (see Defaults::setStateRetention).
+	/// Those of the blocks that have fallen out of the retention window get pruned, except for the restore points.
+	void prune(BlockChain const& _bc);
+
+	/// Begin a checkpoint; changes made to the state after this may be undone with revert(). Checkpoints nest.
+	void checkpoint() { m_checkpoints.push_back(Checkpoint{{}, (unsigned)m_transactionList.size()}); }
+	/// Undo all changes made since the last checkpoint and drop it.
+	void revert();
+	/// Keep the changes made since the last checkpoint and drop it. An enclosing checkpoint may still revert them.
+	void dropCheckpoint();
+
 	/// Execute a given transaction.
 	void execute(bytes const& _rlp) { return execute(&_rlp); }
 	void execute(bytesConstRef _rlp);
@@ -143,37 +185,94 @@ public:
 	/// Execute all transactions within a given block.
 	/// @returns the additional total difficulty.
 	/// If the _grandParent is passed, it will check the validity of each of the uncles.
+	/// Uncles that @a _bc holds decoded (see BlockChain::cachedHeader()) are taken from it rather than decoded again.
 	/// This might throw.
-	u256 playback(bytesConstRef _block, BlockInfo const& _bi, BlockInfo const& _parent, BlockInfo const& _grandParent, bool _fullCommit);
+	u256 playback(bytesConstRef _block, BlockInfo const& _bi, BlockInfo const& _parent, BlockInfo const& _grandParent, bool _fullCommit, BlockChain const* _bc = nullptr);
 
 private:
+	/// Bring the current block's timestamp and difficulty up to date before searching for its nonce.
+	void prepareToMine();
+	/// Compile the block into m_currentBytes if mining @a _completed, otherwise clear it.
+	void completeMine(bool _completed);
+	/// Take back the rewards commitToMine() applied, so that further transactions execute before them, as on playback.
+	void unapplyRewards();
+
+	/// The changes made since a checkpoint: the prior cached state of each address touched (or nothing if
+	/// it wasn't in the cache), and how many transactions had been executed.
+	struct Checkpoint
+	{
+		std::unordered_map<Address, std::pair<bool, AddressState>> saved;
+		unsigned transactions;
+	};
+
+	/// Note the current state of @a _a in the innermost checkpoint (if there is one), unless already noted.
+	/// Must be called before altering @a _a in the cache.
+	void journal(Address _a);
+
 	/// Fee-adder on destruction RAII class.
 	struct MinerFeeAdder
 	{
-		~MinerFeeAdder() { state->addBalance(state->m_currentBlock.coinbaseAddress, fee); }
+		~MinerFeeAdder() { state->payMiner(fee); }
 		State* state;
 		u256 fee;
 	};
 
-	/// Retrieve all information about a given address into the cache.
-	/// If _requireMemory is true, grab the full memory should it be a contract item.
+	/// Credit the current block's coinbase with @a _fee or, if we're speculating, note that it's owed.
+	void payMiner(u256 _fee);
+
+	/// What a transaction executed speculatively did, on a state of its own starting from that before the block.
+	struct Speculation
+	{
+		std::unordered_set<Address> reads;		///< Every address whose state it read, including those it changed.
+		std::vector<std::pair<Address, AddressState>> writes;	///< The resulting state of each address it changed.
+		u256 minerFees;							///< The fees it paid the coinbase, held back rather than credited.
+		bool paidMiner = false;
+		bool ok = false;						///< Whether it executed without throwing.
+	};
+
+	/// Execute the transactions @a _txs (whose senders are @a _senders) as if in order, but speculatively across
+	/// @a _threads threads. Each runs against the state from before the block; then, in order, those that read
+	/// nothing an earlier one changed, nor the coinbase, have their changes applied, and the rest are executed
+	/// again, for real. The result is exactly that of executing them in order.
+	void playbackParallel(RLP const& _txs, std::vector<SenderRecovery>& _senders, unsigned _threads);
+
+	/// Read the state of each account the transactions with senders @a _senders will surely touch (and the top of
+	/// any contract's memory), and the coinbase's, on @a _threads threads, so that the DB's node cache has them by
+	/// the time they're executed.
+	void prefetch(std::vector<SenderRecovery> const& _senders, unsigned _threads) const;
+
+	/// @returns the state of @a _a, or nullptr if it has none. It's looked up in the cache or, failing that, read
+	/// from the trie: into the cache normally, or into @a o_read if we're read-only.
+	AddressState const* addressState(Address _a, AddressState& o_read) const;
+
+	/// Retrieve all information about a given address into the cache. A contract's memory isn't
+	/// loaded; positions are read from its trie as they're needed (see storedMemory()).
 	/// If _forceCreate is true, then insert a default item into the cache, in the case it doesn't
 	/// exist in the DB.
-	void ensureCached(Address _a, bool _requireMemory, bool _forceCreate) const;
+	void ensureCached(Address _a, bool _forceCreate) const;
+
+	/// Get the value of a memory position as of the last commit, given the root of the contract's memory trie.
+	u256 storedMemory(h256 _root, u256 _memory) const;
+
+	/// @returns the number of non-zero memory positions of the (cached) contract @a _contract.
+	uint memoryCount(Address _contract) const;
 
 	/// Commit all changes waiting in the address cache to the DB.
 	void commit();
 
 	/// Execute the given block on our previous block. This will set up m_currentBlock first, then call the other playback().
 	/// Any failure will be critical.
-	u256 playback(bytesConstRef _block, bool _fullCommit);
+	u256 playback(bytesConstRef _block, bool _fullCommit, BlockChain const* _bc = nullptr);
 
 	/// Execute the given block, assuming it corresponds to m_currentBlock. If _grandParent is passed, it will be used to check the uncles.
 	/// Throws on failure.
-	u256 playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _fullCommit);
+	u256 playback(bytesConstRef _block, BlockInfo const& _grandParent, bool _fullCommit, BlockChain const* _bc = nullptr);
 
-	/// Execute a decoded transaction object, given a sender.
+	/// Execute a decoded transaction object, given its (already recovered) sender.
 	/// This will append @a _t to the transaction list and change the state accordingly.
+	void execute(Transaction const& _t, Address _sender);
+
+	/// Execute a decoded transaction object, given a sender, without adding it to the transaction list.
 	void executeBare(Transaction const& _t, Address _sender);
 
 	/// Execute a contract transaction.
@@ -182,11 +281,14 @@ private:
 	/// Sets m_currentBlock to a clean state, (i.e. no change from m_previousBlock).
 	void resetCurrent();
 
+
 	Overlay m_db;								///< Our overlay for the state tree.
 	TrieDB<Address, Overlay> m_state;			///< Our state tree, as an Overlay DB.
 	std::map<h256, Transaction> m_transactions;	///< The current list of transactions that we've included in the state.
+	h256s m_transactionList;					///< The hashes of m_transactions in the order executed, which is their order in the block.
 
-	mutable std::map<Address, AddressState> m_cache;	///< Our address cache. This stores the states of each address that has (or at least might have) been changed.
+	mutable std::unordered_map<Address, AddressState> m_cache;	///< Our address cache. This stores the states of each address that has (or at least might have) been changed.
+	std::vector<Checkpoint> m_checkpoints;		///< The open checkpoints, innermost last.
 
 	BlockInfo m_previousBlock;					///< The previous block's information.
 	BlockInfo m_currentBlock;					///< The current block's information.
@@ -195,8 +297,14 @@ private:
 
 	bytes m_currentTxs;
 	bytes m_currentUncles;
+	bytes m_currentTxData;						///< The RLPs of the first m_committedTransactions of m_transactionList, concatenated.
+	unsigned m_committedTransactions = 0;
+	Addresses m_rewarded;						///< The uncles' coinbases rewarded by commitToMine().
+	bool m_rewardsApplied = false;				///< Whether commitToMine()'s rewards are in the state.
 
 	Address m_ourAddress;						///< Our address (i.e. the address to which fees go).
+	bool m_readOnly = false;					///< Whether we're a snapshot(), whose cache mustn't be filled by reads.
+	Speculation* m_speculation = nullptr;		///< If set, we're speculating: reads are noted in it and miner fees held back.
 
 	Dagger m_dagger;
 	
@@ -210,6 +318,11 @@ private:
 	static const u256 c_txFee;
 	static const u256 c_blockReward;
 
+	/// The longest run of zero words tolerated within a contract's flat code image (see execute()).
+	static const unsigned c_maxImageGap;
+	/// The capacity with which a VM stack starts out; stacks are then recycled between calls (see execute()).
+	static const unsigned c_initialStackSize;
+
 	static std::string c_defaultPath;
 
 	friend std::ostream& operator<<(std::ostream& _out, State const& _s);
@@ -239,31 +352,40 @@ inline std::ostream& operator<<(std::ostream& _out, State const& _s)
 }
 
 template <class DB>
-void commit(std::map<Address, AddressState> const& _cache, DB& _db, TrieDB<Address, DB>& _state)
+void commit(std::unordered_map<Address, AddressState> const& _cache, DB& _db, TrieDB<Address, DB>& _state)
 {
+	// Gathered up and applied as a batch, so the upper levels of the tries are only rewritten the once.
+	std::map<Address, bytes> changes;
 	for (auto const& i: _cache)
 		if (i.second.type() == AddressType::Dead)
-			_state.remove(i.first);
+			changes[i.first];
 		else
 		{
 			RLPStream s(i.second.type() == AddressType::Contract ? 3 : 2);
 			s << i.second.balance() << i.second.nonce();
 			if (i.second.type() == AddressType::Contract)
 			{
-				if (i.second.haveMemory())
+				if (i.second.memory().empty())
+					s << i.second.oldRoot();
+				else
 				{
-					TrieDB<u256, DB> memdb(&_db);
-					memdb.init();
-					for (auto const& j: i.second.memory())
-						if (j.second)
-							memdb.insert(j.first, rlp(j.second));
+					// Apply just the changed positions to the contract's existing memory trie.
+					TrieDB<h256, DB> memdb(&_db);
+					if (!i.second.oldRoot() || i.second.oldRoot() == c_shaNull)
+						memdb.init();
+					else
+						memdb.setRoot(i.second.oldRoot());
+					// Positions come in order (h256s order as the numbers do), so each goes on the end.
+					std::map<h256, bytes> memChanges;
+					for (auto const& j: i.second.memory().ordered())
+						memChanges.emplace_hint(memChanges.end(), j.first, j.second ? rlp(j.second) : bytes());
+					memdb.applyBatch(memChanges, 0);
 					s << memdb.root();
 				}
-				else
-					s << i.second.oldRoot();
 			}
-			_state.insert(i.first, &s.out());
+			s.swapOut(changes[i.first]);
 		}
+	_state.applyBatch(changes, 0);
 }
 
 }
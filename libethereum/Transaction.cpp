@@ -19,6 +19,10 @@
  * @date 2014
  */
 
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <secp256k1.h>
 #include "vector_ref.h"
 #include "Exceptions.h"
@@ -26,9 +30,82 @@
 using namespace std;
 using namespace eth;
 
+namespace eth
+{
+
+/**
+ * @brief Recovered senders of transactions, keyed by the hash of the signed transaction.
+ * Transactions are seen several times over (on arrival, when the queue is synced and when a block containing them is
+ * played back), so this saves recovering their signatures more than once. Thread-safe; the oldest entries are dropped
+ * once it's full.
+ */
+class SenderCache
+{
+public:
+	bool lookup(h256 const& _tx, Address& o_sender) const
+	{
+		lock_guard<mutex> l(m_lock);
+		auto it = m_senders.find(_tx);
+		if (it == m_senders.end())
+			return false;
+		o_sender = it->second;
+		return true;
+	}
+
+	void insert(h256 const& _tx, Address const& _sender)
+	{
+		lock_guard<mutex> l(m_lock);
+		if (!m_senders.insert(make_pair(_tx, _sender)).second)
+			return;
+		m_order.push_back(_tx);
+		if (m_order.size() > c_limit)
+		{
+			m_senders.erase(m_order.front());
+			m_order.pop_front();
+		}
+	}
+
+private:
+	static const size_t c_limit = 65536;
+
+	mutable mutex m_lock;
+	unordered_map<h256, Address> m_senders;
+	deque<h256> m_order;			///< Oldest first.
+};
+
+static SenderCache s_senders;
+
+/// Recover the sender of the transaction with hash @a _hash, which signed @a _msg with @a _vrs, and remember it.
+static Address recoverSender(h256 const& _hash, h256 const& _msg, Signature const& _vrs)
+{
+	secp256k1_start();
+
+	h256 sig[2] = { _vrs.r, _vrs.s };
+	byte pubkey[65];
+	int pubkeylen = 65;
+	if (!secp256k1_ecdsa_recover_compact(_msg.data(), 32, sig[0].data(), pubkey, &pubkeylen, 0, (int)_vrs.v - 27))
+		throw InvalidSignature();
+
+	// TODO: check right160 is correct and shouldn't be left160.
+	Address ret = right160(eth::sha3(bytesConstRef(&(pubkey[1]), 64)));
+	s_senders.insert(_hash, ret);
+
+#if ETH_ADDRESS_DEBUG
+	cout << "---- RECOVER -------------------------------" << endl;
+	cout << "MSG: " << _msg << endl;
+	cout << "R S V: " << sig[0] << " " << sig[1] << " " << (int)(_vrs.v - 27) << "+27" << endl;
+	cout << "PUB: " << asHex(bytesConstRef(&(pubkey[1]), 64)) << endl;
+	cout << "ADR: " << ret << endl;
+#endif
+	return ret;
+}
+
+}
+
 Transaction::Transaction(bytesConstRef _rlpData)
 {
-	RLP rlp(_rlpData);
+	RLP r(_rlpData);
+	RLPIndex rlp(r);
 	nonce = rlp[0].toInt<u256>();
 	receiveAddress = rlp[1].toHash<Address>();
 	value = rlp[2].toInt<u256>();
@@ -41,27 +118,64 @@ Transaction::Transaction(bytesConstRef _rlpData)
 
 Address Transaction::sender() const
 {
-	secp256k1_start();
+	h256 h = sha3();
+	Address ret;
+	if (s_senders.lookup(h, ret))
+		return ret;
+	return recoverSender(h, sha3(false), vrs);
+}
 
-	h256 sig[2] = { vrs.r, vrs.s };
-	h256 msg = sha3(false);
+TransactionView::TransactionView(bytesConstRef _rlp): m_rlp(_rlp)
+{
+	RLP r(_rlp);
+	RLPIndex rlp(r);
+	m_nonce = rlp[0].toInt<u256>();
+	m_receiveAddress = rlp[1].toHash<Address>();
+	m_value = rlp[2].toInt<u256>();
+	m_fee = rlp[3].toInt<u256>();
+	m_data = rlp[4];
+	// Refuse what toInt<u256>() would, without decoding.
+	m_data.itemCountStrict();
+	for (auto const& i: m_data)
+		if (!i.isInt() || i.toBytesConstRef().size() > intTraits<u256>::maxSize)
+			throw RLP::BadCast();
+	m_vrs = Signature{ rlp[5].toInt<byte>(), rlp[6].toInt<u256>(), rlp[7].toInt<u256>() };
+	ScratchRLPStream s;
+	fillStream(*s, true);
+	m_hash = eth::sha3(s->out());
+}
 
-	byte pubkey[65];
-	int pubkeylen = 65;
-	if (!secp256k1_ecdsa_recover_compact(msg.data(), 32, sig[0].data(), pubkey, &pubkeylen, 0, (int)vrs.v - 27))
-		throw InvalidSignature();
+void TransactionView::fillStream(RLPStream& _s, bool _sig) const
+{
+	_s.appendList(_sig ? 8 : 5);
+	_s << m_nonce << m_receiveAddress << m_value << m_fee;
+	_s.appendList(m_data.itemCount());
+	for (auto const& i: m_data)
+	{
+		// Those encoded just as they would be (the shortest header) are copied over as they are.
+		bytesConstRef p = i.toBytesConstRef();
+		if (i.actualSize() == (p.size() == 1 && p[0] < c_rlpDataImmLenStart ? 1 : 1 + p.size()))
+			_s.appendRaw(i.data());
+		else
+			_s << i.toInt<u256>();
+	}
+	if (_sig)
+		_s << m_vrs.v << m_vrs.r << m_vrs.s;
+}
 
-	// TODO: check right160 is correct and shouldn't be left160.
-	auto ret = right160(eth::sha3(bytesConstRef(&(pubkey[1]), 64)));
+h256 TransactionView::signingHash() const
+{
+	ScratchRLPStream s;
+	fillStream(*s, false);
+	return eth::sha3(s->out());
+}
 
-#if ETH_ADDRESS_DEBUG
-	cout << "---- RECOVER -------------------------------" << endl;
-	cout << "MSG: " << msg << endl;
-	cout << "R S V: " << sig[0] << " " << sig[1] << " " << (int)(vrs.v - 27) << "+27" << endl;
-	cout << "PUB: " << asHex(bytesConstRef(&(pubkey[1]), 64)) << endl;
-	cout << "ADR: " << ret << endl;
-#endif
-	return ret;
+Address TransactionView::sender() const
+{
+	Address ret;
+	if (s_senders.lookup(m_hash, ret))
+		return ret;
+	return recoverSender(m_hash, signingHash(), m_vrs);
 }
 
 void Transaction::sign(Secret _priv)
@@ -70,6 +184,8 @@ void Transaction::sign(Secret _priv)
 
 	secp256k1_start();
 
+	// The fields have likely just been set.
+	noteChanged();
 	h256 msg = sha3(false);
 	h256 sig[2];
 	h256 nonce = kFromMessage(msg, _priv);
@@ -87,6 +203,7 @@ void Transaction::sign(Secret _priv)
 	vrs.v = (byte)(v + 27);
 	vrs.r = (u256)sig[0];
 	vrs.s = (u256)sig[1];
+	m_hash = h256();
 }
 
 void Transaction::fillStream(RLPStream& _s, bool _sig) const
@@ -115,3 +232,85 @@ h256 Transaction::kFromMessage(h256 _msg, h256 _priv)
 	return _msg ^ _priv;
 }
 
+
+/// Signatures recovered together; enough to make the shared inversions all but free.
+static const unsigned c_recoveryBatch = 32;
+
+std::vector<Address> eth::recoverSenders(std::vector<Transaction> const& _txs)
+{
+	std::vector<Address> ret(_txs.size());
+	std::vector<h256> hashes(_txs.size());
+	std::vector<size_t> todo;
+	for (size_t i = 0; i < _txs.size(); ++i)
+	{
+		hashes[i] = _txs[i].sha3();
+		if (!s_senders.lookup(hashes[i], ret[i]))
+			todo.push_back(i);
+	}
+
+	// Initialise secp256k1 here, once; it's thread-safe thereafter.
+	secp256k1_start();
+
+	parallelFor((todo.size() + c_recoveryBatch - 1) / c_recoveryBatch, 0, [&](unsigned b)
+	{
+		size_t begin = b * c_recoveryBatch;
+		int n = (int)min<size_t>(c_recoveryBatch, todo.size() - begin);
+		std::array<h256, c_recoveryBatch> msgs;
+		std::array<std::array<h256, 2>, c_recoveryBatch> sigs;
+		std::array<std::array<byte, 65>, c_recoveryBatch> pubkeys;
+		std::array<unsigned char const*, c_recoveryBatch> msgPtrs;
+		std::array<unsigned char const*, c_recoveryBatch> sigPtrs;
+		std::array<unsigned char*, c_recoveryBatch> pubkeyPtrs;
+		std::array<int, c_recoveryBatch> pubkeyLens;
+		std::array<int, c_recoveryBatch> recids;
+		std::array<int, c_recoveryBatch> results;
+		for (int j = 0; j < n; ++j)
+		{
+			Transaction const& t = _txs[todo[begin + j]];
+			msgs[j] = t.sha3(false);
+			sigs[j] = {{ t.vrs.r, t.vrs.s }};
+			msgPtrs[j] = msgs[j].data();
+			sigPtrs[j] = sigs[j][0].data();
+			pubkeyPtrs[j] = pubkeys[j].data();
+			pubkeyLens[j] = 65;
+			recids[j] = (int)t.vrs.v - 27;
+		}
+		secp256k1_ecdsa_recover_compact_batch(n, msgPtrs.data(), sigPtrs.data(), pubkeyPtrs.data(), pubkeyLens.data(), 0, recids.data(), results.data());
+		for (int j = 0; j < n; ++j)
+			if (results[j])
+			{
+				size_t i = todo[begin + j];
+				ret[i] = right160(eth::sha3(bytesConstRef(&(pubkeys[j][1]), 64)));
+				s_senders.insert(hashes[i], ret[i]);
+			}
+	});
+	return ret;
+}
+
+std::vector<SenderRecovery> eth::recoverSenders(RLP const& _txs)
+{
+	std::vector<SenderRecovery> ret;
+	std::vector<Transaction> decoded;
+	std::vector<size_t> index;
+	for (auto const& i: _txs)
+	{
+		ret.push_back(SenderRecovery());
+		try
+		{
+			decoded.push_back(Transaction(i.data()));
+			index.push_back(ret.size() - 1);
+		}
+		catch (...)
+		{
+			// Leave the sender null; the failure will show up when it's executed.
+		}
+	}
+
+	auto senders = recoverSenders(decoded);
+	for (size_t i = 0; i < decoded.size(); ++i)
+	{
+		ret[index[i]].first = move(decoded[i]);
+		ret[index[i]].second = senders[i];
+	}
+	return ret;
+}
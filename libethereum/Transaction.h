@@ -38,6 +38,8 @@ struct Signature
 struct Transaction
 {
 	Transaction() {}
+	/// Decode from @a _rlp, which must be exactly one transaction. It's hashed as re-encoded, so input that isn't canonical
+	/// (leading zeros, say) gets the same hash, and so contract address, as it will once mined.
 	Transaction(bytesConstRef _rlp);
 	Transaction(bytes const& _rlp): Transaction(&_rlp) {}
 
@@ -54,12 +56,74 @@ struct Transaction
 	static h256 kFromMessage(h256 _msg, h256 _priv);
 
 	void fillStream(RLPStream& _s, bool _sig = true) const;
-	bytes rlp(bool _sig = true) const { RLPStream s; fillStream(s, _sig); return s.out(); }
+	bytes rlp(bool _sig = true) const { RLPStream s; fillStream(s, _sig); bytes ret; s.swapOut(ret); return ret; }
 	std::string rlpString(bool _sig = true) const { return asString(rlp(_sig)); }
-	h256 sha3(bool _sig = true) const { RLPStream s; fillStream(s, _sig); return eth::sha3(s.out()); }
-	bytes sha3Bytes(bool _sig = true) const { RLPStream s; fillStream(s, _sig); return eth::sha3Bytes(s.out()); }
+	h256 sha3(bool _sig = true) const { h256& h = _sig ? m_hash : m_signingHash; if (!h) { ScratchRLPStream s; fillStream(*s, _sig); h = eth::sha3(s->out()); } return h; }
+	bytes sha3Bytes(bool _sig = true) const { return sha3(_sig).asBytes(); }
+
+	/// Forget the hashes remembered by sha3(); call after changing any field of a transaction that's been hashed.
+	void noteChanged() { m_hash = m_signingHash = h256(); }
+
+private:
+	// Both are null until first needed. Not thread-safe until then.
+	mutable h256 m_hash;			///< sha3(true).
+	mutable h256 m_signingHash;		///< sha3(false).
 };
 
+/**
+ * @brief A transaction read in place from its RLP, which must outlive it.
+ * Only the fixed-size fields are decoded; the data items are checked, but left as RLP until asked for, so that
+ * transactions which are only being queued, relayed or recognised needn't have their data decoded at all. Accepts
+ * just what Transaction(bytesConstRef) does, and gives the same hashes and sender.
+ */
+class TransactionView
+{
+public:
+	explicit TransactionView(bytesConstRef _rlp);
+
+	u256 const& nonce() const { return m_nonce; }
+	Address const& receiveAddress() const { return m_receiveAddress; }
+	u256 const& value() const { return m_value; }
+	u256 const& fee() const { return m_fee; }
+	Signature const& vrs() const { return m_vrs; }
+	/// The data items, still encoded.
+	RLP data() const { return m_data; }
+
+	/// @returns the hash of the transaction as Transaction would encode it, which needn't be that of what it was read from.
+	h256 const& sha3() const { return m_hash; }
+	/// @returns the hash the sender signed: that of the transaction without its signature.
+	h256 signingHash() const;
+	Address sender() const;
+
+	/// @returns the fully decoded transaction.
+	Transaction toTransaction() const { return Transaction(m_rlp); }
+
+private:
+	/// Encode the transaction into @a _s as Transaction::fillStream() would.
+	void fillStream(RLPStream& _s, bool _sig) const;
+
+	bytesConstRef m_rlp;
+	u256 m_nonce;
+	Address m_receiveAddress;
+	u256 m_value;
+	u256 m_fee;
+	RLP m_data;
+	Signature m_vrs;
+	h256 m_hash;
+};
+
+/// A decoded transaction and its sender; the sender is null if the transaction couldn't be decoded or its signature
+/// recovered.
+using SenderRecovery = std::pair<Transaction, Address>;
+
+/// Recover the sender of each of @a _txs, null where the signature can't be recovered. Signatures are recovered in
+/// batches, which share their modular inversions, and the batches are spread across the available cores. The senders
+/// are remembered, so a later Transaction::sender() on any of them is free.
+std::vector<Address> recoverSenders(std::vector<Transaction> const& _txs);
+
+/// Decode each of the RLP-encoded transactions in the list @a _txs and recover its sender.
+std::vector<SenderRecovery> recoverSenders(RLP const& _txs);
+
 }
 
 
@@ -19,33 +19,212 @@
  * @date 2014
  */
 
+#include <queue>
+#include <secp256k1.h>
+#include "Metrics.h"
 #include "Transaction.h"
 #include "TransactionQueue.h"
 using namespace std;
 using namespace eth;
 
-bool TransactionQueue::import(bytes const& _block)
+/// Transactions each verifier thread takes at a time.
+static const unsigned c_verifyBatch = 64;
+
+static Gauge& s_queued = Metrics::gauge("eth_txqueue_size", "Transactions waiting in the queue.");
+static Counter& s_admitted = Metrics::counter("eth_txqueue_admitted", "Transactions taken into the queue.");
+static Counter& s_invalid = Metrics::counter("eth_txqueue_invalid", "Transactions refused for a bad encoding or signature.");
+static Counter& s_dropped = Metrics::counter("eth_txqueue_dropped", "Transactions refused or evicted for paying too little.");
+
+TransactionQueue::~TransactionQueue()
 {
-	// Check if we already know this transaction.
-	h256 h = sha3(_block);
-	if (m_data.count(h))
-		return false;
+	{
+		lock_guard<mutex> l(m_x);
+		m_exiting = true;
+	}
+	m_incomingChanged.notify_all();
+	for (auto& t: m_verifiers)
+		t.join();
+	s_queued += -(int64_t)m_data.size();
+}
 
+bool TransactionQueue::import(bytes const& _block)
+{
 	try
 	{
+		// Check if we already know this transaction. It's keyed by the hash of its canonical encoding, not of _block.
+		TransactionView t(&_block);
+		if (m_data.count(t.sha3()))
+			return false;
+
 		// Check validity of _block as a transaction. To do this we just deserialise and attempt to determine the sender. If it doesn't work, the signature is bad.
 		// The transaction's nonce may yet be invalid (or, it could be "valid" but we may be missing a marginally older transaction).
-		Transaction t(_block);
-		t.sender();
-
-		// If valid, append to blocks.
-		m_data[h] = _block;
+		return import(t.sha3(), _block, t, t.sender());
 	}
 	catch (std::exception const& _e)
 	{
-		cout << "*** Ignoring invalid transaction: " << _e.what();
+		clogv(ChainChannel, 2) << "Ignoring invalid transaction:" << _e.what();
+		++s_invalid;
 		return false;
 	}
+}
 
+bool TransactionQueue::import(h256 const& _txHash, bytes const& _block, TransactionView const& _t, Address const& _sender)
+{
+	if (m_data.count(_txHash))
+		return false;
+	Info info{_sender, _t.nonce(), _t.fee()};
+
+	// If we've one from the same sender with the same nonce, keep whichever pays more.
+	auto& nonces = m_bySender[info.sender];
+	auto it = nonces.find(info.nonce);
+	if (it != nonces.end())
+	{
+		++s_dropped;
+		if (m_info[it->second].fee >= info.fee)
+			return false;
+		drop(it->second);
+	}
+
+	// If valid, append to blocks.
+	m_data[_txHash] = _block;
+	s_queued += 1;
+	m_info[_txHash] = info;
+	m_bySender[info.sender][info.nonce] = _txHash;
+	m_byFee.insert(make_pair(info.fee, _txHash));
+
+	// Make room by evicting the cheapest; that may be this one.
+	while (m_data.size() > m_limit)
+	{
+		drop(m_byFee.begin()->second);
+		++s_dropped;
+	}
+	if (!m_data.count(_txHash))
+		return false;
+	++s_admitted;
 	return true;
 }
+
+void TransactionQueue::enqueue(bytes const& _block)
+{
+	{
+		lock_guard<mutex> l(m_x);
+		if (m_verifiers.empty())
+		{
+			// Initialise secp256k1 here, once; it's thread-safe thereafter.
+			secp256k1_start();
+			for (unsigned i = 0; i < max(1u, thread::hardware_concurrency()); ++i)
+				m_verifiers.push_back(thread([=](){ verify(); }));
+		}
+		m_incoming.push_back(_block);
+	}
+	m_incomingChanged.notify_one();
+}
+
+void TransactionQueue::verify()
+{
+	vector<bytes> batch;
+	vector<Verified> verified;
+	while (true)
+	{
+		{
+			unique_lock<mutex> l(m_x);
+			m_incomingChanged.wait(l, [&](){ return m_exiting || !m_incoming.empty(); });
+			if (m_exiting)
+				return;
+			batch.clear();
+			for (unsigned i = 0; i < c_verifyBatch && !m_incoming.empty(); ++i)
+			{
+				batch.push_back(move(m_incoming.front()));
+				m_incoming.pop_front();
+			}
+		}
+
+		verified.clear();
+		for (auto& i: batch)
+			try
+			{
+				TransactionView t(&i);
+				verified.push_back(Verified{t.sha3(), t.sender(), move(i)});
+			}
+			catch (std::exception const& _e)
+			{
+				clogv(ChainChannel, 2) << "Ignoring invalid transaction:" << _e.what();
+				++s_invalid;
+			}
+
+		{
+			lock_guard<mutex> l(m_x);
+			m_verified.insert(m_verified.end(), make_move_iterator(verified.begin()), make_move_iterator(verified.end()));
+		}
+		if (verified.size() && m_onVerified)
+			m_onVerified();
+	}
+}
+
+unsigned TransactionQueue::flush(std::function<bool(TransactionView const&, Address const&)> const& _precheck)
+{
+	vector<Verified> verified;
+	{
+		lock_guard<mutex> l(m_x);
+		swap(verified, m_verified);
+	}
+	unsigned ret = 0;
+	for (auto const& i: verified)
+	{
+		TransactionView t(&i.rlp);
+		if (_precheck(t, i.sender) && import(i.hash, i.rlp, t, i.sender))
+			++ret;
+	}
+	return ret;
+}
+
+void TransactionQueue::drop(h256 _txHash)
+{
+	auto it = m_info.find(_txHash);
+	if (it == m_info.end())
+		return;
+	auto s = m_bySender.find(it->second.sender);
+	s->second.erase(it->second.nonce);
+	if (s->second.empty())
+		m_bySender.erase(s);
+	for (auto f = m_byFee.lower_bound(it->second.fee); f != m_byFee.end() && f->first == it->second.fee; ++f)
+		if (f->second == _txHash)
+		{
+			m_byFee.erase(f);
+			break;
+		}
+	m_info.erase(it);
+	m_data.erase(_txHash);
+	s_queued += -1;
+}
+
+size_t TransactionQueue::memoryUsed() const
+{
+	// The data itself, plus an entry in each of the four indexes: a hash table node or tree node apiece.
+	size_t ret = m_data.size() * (3 * sizeof(h256) + sizeof(Info) + sizeof(u256) + 2 * sizeof(h256) + 12 * sizeof(void*));
+	for (auto const& i: m_data)
+		ret += i.second.capacity();
+	return ret;
+}
+
+h256s TransactionQueue::ordered() const
+{
+	// Merge the senders' nonce-ordered lists, always taking the head with the greatest fee.
+	typedef pair<map<u256, h256>::const_iterator, map<u256, h256>::const_iterator> Range;
+	auto cheaper = [&](Range const& _a, Range const& _b) { return m_info.at(_a.first->second).fee < m_info.at(_b.first->second).fee; };
+	priority_queue<Range, vector<Range>, decltype(cheaper)> heads(cheaper);
+	for (auto const& i: m_bySender)
+		heads.push(make_pair(i.second.begin(), i.second.end()));
+
+	h256s ret;
+	ret.reserve(m_data.size());
+	while (!heads.empty())
+	{
+		Range r = heads.top();
+		heads.pop();
+		ret.push_back(r.first->second);
+		if (++r.first != r.second)
+			heads.push(r);
+	}
+	return ret;
+}
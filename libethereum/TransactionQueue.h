@@ -21,31 +21,105 @@
 
 #pragma once
 
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <functional>
+#include <condition_variable>
 #include "Common.h"
+#include "Transaction.h"
 
 namespace eth
 {
 
 class BlockChain;
 
+/// Roughly how many bytes a queued transaction takes, with its entries in the indexes; for sizing the queue to a
+/// memory budget.
+static const size_t c_queuedTransactionBytes = 512;
+
 /**
  * @brief A queue of Transactions, each stored as RLP.
+ * Indexed by sender and nonce, and by fee, so that it can give the order in which they may be executed
+ * (each sender's in nonce order, richest fee first) and, when full, evict the least valuable.
+ *
+ * Transactions may also be handed over with enqueue() from any thread; a pool of threads (started on first use)
+ * decodes them and recovers their senders, and flush() then admits the results in one batch. Everything else
+ * must be called from the one thread that owns the queue.
  */
 class TransactionQueue
 {
 public:
+	/// What we note of each transaction as it's imported, so we needn't decode it again.
+	struct Info
+	{
+		Address sender;
+		u256 nonce;
+		u256 fee;
+	};
+
+	explicit TransactionQueue(unsigned _limit = 1024): m_limit(_limit) {}
+	~TransactionQueue();
+
 	bool attemptImport(bytes const& _block) { try { import(_block); return true; } catch (...) { return false; } }
 
+	/// Import the RLP-encoded transaction @a _block. A transaction with the same sender and nonce as one already
+	/// queued replaces it only if it pays a greater fee.
+	/// @returns true if it was new and is now in the queue.
 	bool import(bytes const& _block);
 
-	void drop(h256 _txHash) { m_data.erase(_txHash); }
+	/// Import a transaction that's already been read, with hash @a _txHash and sender @a _sender.
+	bool import(h256 const& _txHash, bytes const& _block, TransactionView const& _t, Address const& _sender);
+
+	/// Queue the RLP-encoded transaction @a _block for verification. Thread-safe; doesn't wait for the verification.
+	void enqueue(bytes const& _block);
+	/// Import each transaction verified since the last call for which @a _precheck (given it and its sender) is true.
+	/// @returns the number imported.
+	unsigned flush(std::function<bool(TransactionView const&, Address const&)> const& _precheck);
+	/// Have @a _f called (from a verifier thread) whenever there are newly verified transactions to flush().
+	/// Set it before anything's enqueued.
+	void onVerified(std::function<void()> const& _f) { m_onVerified = _f; }
+
+	void drop(h256 _txHash);
+
+	/// Set the most transactions we'll queue; any more are evicted as the next is imported.
+	void setLimit(unsigned _limit) { m_limit = _limit; }
+	unsigned limit() const { return m_limit; }
+	/// @returns roughly how many bytes the queued transactions and their indexes take.
+	size_t memoryUsed() const;
 
-	std::map<h256, bytes> const& transactions() const { return m_data; }
+	std::unordered_map<h256, bytes> const& transactions() const { return m_data; }
+	Info const& info(h256 _txHash) const { return m_info.at(_txHash); }
+
+	/// @returns the hashes of all queued transactions, each sender's in nonce order, interleaved so that the
+	/// next of whichever sender offers the greatest fee always comes first.
+	h256s ordered() const;
 
 private:
-	std::map<h256, bytes> m_data;	///< the queue.
-};
+	std::unordered_map<h256, bytes> m_data;	///< the queue.
+	std::unordered_map<h256, Info> m_info;	///< what we know of each transaction in the queue.
+	std::map<Address, std::map<u256, h256>> m_bySender;	///< each sender's queued transactions, by nonce.
+	std::multimap<u256, h256> m_byFee;		///< the queued transactions, cheapest first.
+	unsigned m_limit;						///< the most transactions we'll queue.
+
+	/// A transaction that's been through verification.
+	struct Verified
+	{
+		h256 hash;
+		Address sender;
+		bytes rlp;
+	};
 
+	void verify();
+
+	std::vector<std::thread> m_verifiers;
+	std::function<void()> m_onVerified;
+	std::mutex m_x;							///< Guards everything below.
+	std::condition_variable m_incomingChanged;	///< Signalled on new incoming transactions or exit.
+	std::deque<bytes> m_incoming;			///< Transactions yet to be verified.
+	std::vector<Verified> m_verified;		///< Transactions verified but not yet flushed into the queue.
+	bool m_exiting = false;
+};
 }
 
 
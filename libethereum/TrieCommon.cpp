@@ -40,20 +40,50 @@ namespace eth
  * [1,2,3,4,T]       0x201234
  */
 
+/// Write the nibbles [@a _begin, @a _end) of @a _data into the zeroed buffer @a o_out, starting at its nibble @a _at.
+/// @returns the nibble of @a o_out following the last written.
+static uint writeNibbles(byte* o_out, uint _at, bytesConstRef _data, uint _begin, uint _end)
+{
+	if (_begin < _end && (_at & 1))
+		o_out[_at++ / 2] |= nibble(_data, _begin++);
+	uint n = (_end - std::min(_begin, _end)) / 2;
+	byte* o = o_out + _at / 2;
+	byte const* d = _data.data() + _begin / 2;
+	if (!(_begin & 1))
+		memcpy(o, d, n);
+	else
+		for (uint i = 0; i < n; ++i)
+			o[i] = (byte)(d[i] << 4) | (d[i + 1] >> 4);
+	_at += n * 2;
+	_begin += n * 2;
+	if (_begin < _end)
+		o_out[_at++ / 2] = nibble(_data, _begin) << 4;
+	return _at;
+}
+
+/// @returns a zeroed hex-prefix buffer for @a _nibbles nibbles with the flags already in place.
+static std::string hexPrefixBuffer(uint _nibbles, bool _leaf)
+{
+	std::string ret(_nibbles / 2 + 1, 0);
+	ret[0] = ((_leaf ? 2 : 0) | (_nibbles & 1)) * 16;
+	return ret;
+}
+
 std::string hexPrefixEncode(bytes const& _hexVector, bool _leaf, int _begin, int _end)
 {
 	uint begin = _begin;
 	uint end = _end < 0 ? _hexVector.size() + 1 + _end : _end;
 	bool odd = ((end - begin) % 2) != 0;
 
-	std::string ret(1, ((_leaf ? 2 : 0) | (odd ? 1 : 0)) * 16);
+	std::string ret = hexPrefixBuffer(end - begin, _leaf);
 	if (odd)
 	{
 		ret[0] |= _hexVector[begin];
 		++begin;
 	}
+	char* o = &ret[1];
 	for (uint i = begin; i < end; i += 2)
-		ret += _hexVector[i] * 16 + _hexVector[i + 1];
+		*(o++) = _hexVector[i] * 16 + _hexVector[i + 1];
 	return ret;
 }
 
@@ -61,52 +91,20 @@ std::string hexPrefixEncode(bytesConstRef _data, bool _leaf, int _beginNibble, i
 {
 	uint begin = _beginNibble + _offset;
 	uint end = (_endNibble < 0 ? (_data.size() * 2 - _offset) + 1 + _endNibble : _endNibble) + _offset;
-	bool odd = (end - begin) & 1;
-
-	std::string ret(1, ((_leaf ? 2 : 0) | (odd ? 1 : 0)) * 16);
-	ret.reserve((end - begin) / 2 + 1);
 
-	uint d = odd ? 1 : 2;
-	for (auto i = begin; i < end; ++i, ++d)
-	{
-		byte n = nibble(_data, i);
-		if (d & 1)	// odd
-			ret.back() |= n;		// or the nibble onto the back
-		else
-			ret.push_back(n << 4);	// push the nibble on to the back << 4
-	}
+	std::string ret = hexPrefixBuffer(end - begin, _leaf);
+	writeNibbles((byte*)&ret[0], ((end - begin) & 1) ? 1 : 2, _data, begin, end);
 	return ret;
 }
 
 std::string hexPrefixEncode(bytesConstRef _d1, uint _o1, bytesConstRef _d2, uint _o2, bool _leaf)
 {
-	uint begin1 = _o1;
-	uint end1 = _d1.size() * 2;
-	uint begin2 = _o2;
-	uint end2 = _d2.size() * 2;
-
-	bool odd = (end1 - begin1 + end2 - begin2) & 1;
-
-	std::string ret(1, ((_leaf ? 2 : 0) | (odd ? 1 : 0)) * 16);
-	ret.reserve((end1 - begin1 + end2 - begin2) / 2 + 1);
+	uint n1 = _d1.size() * 2 - _o1;
+	uint n2 = _d2.size() * 2 - _o2;
 
-	uint d = odd ? 1 : 2;
-	for (auto i = begin1; i < end1; ++i, ++d)
-	{
-		byte n = nibble(_d1, i);
-		if (d & 1)	// odd
-			ret.back() |= n;		// or the nibble onto the back
-		else
-			ret.push_back(n << 4);	// push the nibble on to the back << 4
-	}
-	for (auto i = begin2; i < end2; ++i, ++d)
-	{
-		byte n = nibble(_d2, i);
-		if (d & 1)	// odd
-			ret.back() |= n;		// or the nibble onto the back
-		else
-			ret.push_back(n << 4);	// push the nibble on to the back << 4
-	}
+	std::string ret = hexPrefixBuffer(n1 + n2, _leaf);
+	uint at = writeNibbles((byte*)&ret[0], ((n1 + n2) & 1) ? 1 : 2, _d1, _o1, _o1 + n1);
+	writeNibbles((byte*)&ret[0], at, _d2, _o2, _o2 + n2);
 	return ret;
 }
 
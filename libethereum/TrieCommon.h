@@ -21,6 +21,10 @@
 
 #pragma once
 
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "Common.h"
 #include "RLP.h"
 
@@ -32,10 +36,57 @@ inline byte nibble(bytesConstRef _data, uint _i)
 	return (_i & 1) ? (_data[_i / 2] & 15) : (_data[_i / 2] >> 4);
 }
 
+/// @returns the number of bytes at the start of @a _a and @a _b (each at least @a _n long) that are equal, at most @a _n.
+/// Compares a 64-bit word at a time; the first differing byte of a word is found from its XOR's trailing (or, on
+/// big-endian machines, leading) zero bits.
+inline uint sharedBytes(byte const* _a, byte const* _b, uint _n)
+{
+	uint ret = 0;
+#if defined(__GNUC__) || defined(_MSC_VER)
+	for (; ret + 8 <= _n; ret += 8)
+	{
+		uint64_t wa;
+		uint64_t wb;
+		memcpy(&wa, _a + ret, 8);
+		memcpy(&wb, _b + ret, 8);
+		if (uint64_t x = wa ^ wb)
+		{
+#if defined(_MSC_VER)
+			unsigned long i;
+			_BitScanForward64(&i, x);
+			return ret + i / 8;
+#elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			return ret + __builtin_clzll(x) / 8;
+#else
+			return ret + __builtin_ctzll(x) / 8;
+#endif
+		}
+	}
+#endif
+	for (; ret < _n && _a[ret] == _b[ret]; ++ret) {}
+	return ret;
+}
+
 inline uint sharedNibbles(bytesConstRef _a, uint _ab, uint _ae, bytesConstRef _b, uint _bb, uint _be)
 {
+	uint n = std::min(_ae - std::min(_ab, _ae), _be - std::min(_bb, _be));
 	uint ret = 0;
-	for (uint ai = _ab, bi = _bb; ai < _ae && bi < _be && nibble(_a, ai) == nibble(_b, bi); ++ai, ++bi, ++ret) {}
+	if ((_ab & 1) == (_bb & 1))
+	{
+		// Both start at the same point in a byte, so all but the ends can be compared a byte (or a word) at a time.
+		if ((_ab & 1) && n)
+		{
+			if (nibble(_a, _ab) != nibble(_b, _bb))
+				return 0;
+			ret = 1;
+		}
+		uint bytes = (n - ret) / 2;
+		uint sb = sharedBytes(_a.data() + (_ab + ret) / 2, _b.data() + (_bb + ret) / 2, bytes);
+		ret += sb * 2;
+		if (sb < bytes)
+			return ret + (nibble(_a, _ab + ret) == nibble(_b, _bb + ret) ? 1 : 0);
+	}
+	for (; ret < n && nibble(_a, _ab + ret) == nibble(_b, _bb + ret); ++ret) {}
 	return ret;
 }
 
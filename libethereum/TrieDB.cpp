@@ -20,6 +20,7 @@
  */
 
 #include "Common.h"
+#include "Metrics.h"
 #include "TrieDB.h"
 using namespace std;
 using namespace eth;
@@ -30,3 +31,312 @@ namespace eth
 const h256 c_shaNull = sha3(rlp(""));
 
 }
+
+static string refKey(h256 _h)
+{
+	return string((char const*)_h.data(), 32) + "r";
+}
+
+static string journalKey(eth::uint _era)
+{
+	return "journal:" + toString(_era);
+}
+
+shared_ptr<string const> NodeCache::lookup(h256 const& _h) const
+{
+	Shard& s = shard(_h);
+	lock_guard<mutex> l(s.x);
+	auto it = s.nodes.find(_h);
+	if (it == s.nodes.end())
+	{
+		++m_misses;
+		return nullptr;
+	}
+	++m_hits;
+	return it->second;
+}
+
+void NodeCache::insert(h256 const& _h, shared_ptr<string const> const& _v)
+{
+	Shard& s = shard(_h);
+	lock_guard<mutex> l(s.x);
+	if (!s.nodes.insert(make_pair(_h, _v)).second)
+		return;
+	s.order.push_back(_h);
+	s.bytes += _v->size();
+	while (s.bytes > m_limit / c_shards && !s.order.empty())
+	{
+		auto it = s.nodes.find(s.order.front());
+		if (it != s.nodes.end())
+		{
+			s.bytes -= it->second->size();
+			s.nodes.erase(it);
+		}
+		s.order.pop_front();
+	}
+}
+
+void NodeCache::forget(h256 const& _h)
+{
+	Shard& s = shard(_h);
+	lock_guard<mutex> l(s.x);
+	auto it = s.nodes.find(_h);
+	if (it != s.nodes.end())
+	{
+		s.bytes -= it->second->size();
+		s.nodes.erase(it);
+	}
+}
+
+size_t NodeCache::bytes() const
+{
+	size_t ret = 0;
+	for (Shard const& s: m_shards)
+	{
+		lock_guard<mutex> l(s.x);
+		ret += s.bytes;
+	}
+	return ret;
+}
+
+size_t Overlay::uncommittedSize() const
+{
+	size_t ret = 0;
+	for (Layer const* l = m_layer.get(); l; l = l->below.get())
+	{
+		for (auto const& i: l->nodes)
+			ret += sizeof(h256) + i.second.size();
+		ret += l->refs.size() * (sizeof(h256) + sizeof(int));
+	}
+	return ret;
+}
+
+Overlay::Layer& Overlay::top()
+{
+	if (!m_layer)
+		m_layer = make_shared<Layer>();
+	else if (m_layer.use_count() > 1)
+	{
+		// A copy has it too: it mustn't change under them.
+		auto l = make_shared<Layer>();
+		l->below = m_layer;
+		l->depth = m_layer->depth + 1;
+		m_layer = l;
+		if (m_layer->depth > c_maxLayers)
+			flatten();
+	}
+	return *m_layer;
+}
+
+void Overlay::flatten()
+{
+	if (!m_layer || !m_layer->below)
+		return;
+	auto l = make_shared<Layer>();
+	for (Layer const* i = m_layer.get(); i; i = i->below.get())
+	{
+		for (auto const& r: i->refs)
+			l->refs[r.first] += r.second;
+		for (auto const& n: i->nodes)
+			l->nodes.insert(n);		// the topmost copy wins; they're all the same anyway.
+	}
+	for (auto it = l->refs.begin(); it != l->refs.end();)
+		if (it->second <= 0)
+		{
+			l->nodes.erase(it->first);
+			it = it->second ? next(it) : l->refs.erase(it);
+		}
+		else
+			++it;
+	m_layer = l;
+}
+
+static Counter& s_nodesWritten = Metrics::counter("eth_trie_nodes_written", "Trie nodes committed to the state DB.");
+static Counter& s_nodeBytesWritten = Metrics::counter("eth_trie_bytes_written", "Bytes of trie nodes committed to the state DB.");
+static Counter& s_dbReads = Metrics::counter("eth_trie_db_reads", "Trie nodes read from the state DB, having not been cached.");
+
+uint64_t Overlay::nodesWritten()
+{
+	return s_nodesWritten.value();
+}
+
+uint64_t Overlay::nodeBytesWritten()
+{
+	return s_nodeBytesWritten.value();
+}
+
+Overlay Overlay::snapshot() const
+{
+	Overlay ret(*this);
+	if (m_db)
+	{
+		auto db = m_db;
+		ret.m_snapshot = shared_ptr<ldb::Snapshot const>(m_db->GetSnapshot(), [=](ldb::Snapshot const* _s){ db->ReleaseSnapshot(_s); });
+		ret.m_readOptions.snapshot = ret.m_snapshot.get();
+	}
+	return ret;
+}
+
+string Overlay::lookup(h256 _h) const
+{
+	// A node never changes, so whichever layer has it will do.
+	for (Layer const* l = m_layer.get(); l; l = l->below.get())
+	{
+		auto it = l->nodes.find(_h);
+		if (it != l->nodes.end())
+			return it->second;
+	}
+	string ret;
+	if (m_nodes)
+		if (auto n = m_nodes->lookup(_h))
+			return *n;
+	m_db->Get(m_readOptions, ldb::Slice((char const*)_h.data(), 32), &ret);
+	++s_dbReads;
+	// A snapshot may find nodes since pruned; they mustn't be cached as though they were still there.
+	if (m_nodes && !ret.empty() && !m_snapshot)
+		m_nodes->insert(_h, make_shared<string const>(ret));
+	return ret;
+}
+
+void Overlay::commit()
+{
+	if (!m_layer)
+		return;
+	flatten();
+	ldb::WriteBatch batch;
+	bytes pinned = rlp(c_pinned);
+	for (auto const& i: m_layer->nodes)
+	{
+		batch.Put(ldb::Slice((char const*)i.first.data(), i.first.size), ldb::Slice(i.second.data(), i.second.size()));
+		batch.Put(ldb::Slice(refKey(i.first)), (ldb::Slice)eth::ref(pinned));
+		s_nodeBytesWritten += i.second.size();
+	}
+	s_nodesWritten += m_layer->nodes.size();
+	write(batch, h256s());
+	m_layer.reset();
+}
+
+void Overlay::write(ldb::WriteBatch& _batch, h256s const& _deleted)
+{
+	m_db->Write(m_writeOptions, &_batch);
+	if (!m_nodes)
+		return;
+	for (auto const& h: _deleted)
+		m_nodes->forget(h);
+	// What's just been written is what's about to be read: the new upper levels of the trie.
+	if (m_layer)
+		for (auto const& i: m_layer->nodes)
+			m_nodes->insert(i.first, make_shared<string const>(i.second));
+}
+
+void Overlay::commit(eth::uint _era, h256 _id)
+{
+	// Journal is: [ [ id, [ inserted... ], [ killed... ] ], ... ]
+	string j = lookupAux(journalKey(_era));
+	bool counted = false;
+	if (!j.empty())
+		for (auto const& i: RLP(j))
+			if (i[0].toHash<h256>() == _id)
+				counted = true;
+
+	// Nodes, reference counts and journal all go in a single batch, so a crash can't leave them out of step.
+	flatten();
+	Layer empty;
+	Layer const& l = m_layer ? *m_layer : empty;
+	ldb::WriteBatch batch;
+	for (auto const& i: l.nodes)
+	{
+		batch.Put(ldb::Slice((char const*)i.first.data(), i.first.size), ldb::Slice(i.second.data(), i.second.size()));
+		s_nodeBytesWritten += i.second.size();
+	}
+	s_nodesWritten += l.nodes.size();
+
+	if (!counted)
+	{
+		h256s inserted;
+		h256s killed;
+		std::unordered_map<h256, int> refs;
+		for (auto const& i: l.refs)
+			if (i.second > 0)
+			{
+				inserted.insert(inserted.end(), i.second, i.first);
+				refs[i.first] = i.second;
+			}
+			else if (i.second < 0)
+				killed.insert(killed.end(), -i.second, i.first);
+		h256s deleted;	// stays empty: only increments here.
+		writeRefs(refs, batch, deleted);
+
+		RLPStream s(RLP(j).itemCount() + 1);
+		for (auto const& i: RLP(j))
+			s.appendRaw(i.data());
+		s.appendList(3) << _id << inserted << killed;
+		batch.Put(ldb::Slice(journalKey(_era)), (ldb::Slice)eth::ref(s.out()));
+	}
+
+	write(batch, h256s());
+	m_layer.reset();
+}
+
+eth::uint Overlay::prune(eth::uint _era, h256 _canonical)
+{
+	std::unordered_map<h256, int> refs;
+	string j = lookupAux(journalKey(_era));
+	for (auto const& i: RLP(j))
+		for (auto const& h: i[i[0].toHash<h256>() == _canonical ? 2 : 1])
+			refs[h.toHash<h256>()]--;
+
+	ldb::WriteBatch batch;
+	h256s deleted;
+	writeRefs(refs, batch, deleted);
+	batch.Delete(ldb::Slice(journalKey(_era)));
+	write(batch, deleted);
+	return deleted.size();
+}
+
+bool Overlay::ref(h256 _h, bool _track)
+{
+	eth::uint c = refCount(_h);
+	if ((!_track && !c) || c == c_pinned)
+		return false;
+	ldb::WriteBatch batch;
+	h256s deleted;
+	writeRefs({{_h, 1}}, batch, deleted);
+	write(batch, deleted);
+	return true;
+}
+
+bool Overlay::deref(h256 _h)
+{
+	ldb::WriteBatch batch;
+	h256s deleted;
+	writeRefs({{_h, -1}}, batch, deleted);
+	write(batch, deleted);
+	return deleted.size();
+}
+
+eth::uint Overlay::refCount(h256 _h) const
+{
+	string r;
+	m_db->Get(m_readOptions, ldb::Slice(refKey(_h)), &r);
+	return r.empty() ? 0 : RLP(r).toInt<eth::uint>();
+}
+
+void Overlay::writeRefs(std::unordered_map<h256, int> const& _refs, ldb::WriteBatch& _batch, h256s& o_deleted) const
+{
+	// A batch's writes aren't visible until it's written, so each node's changes must arrive here already summed.
+	for (auto const& i: _refs)
+	{
+		eth::uint c = refCount(i.first);
+		if ((!c && i.second <= 0) || c == c_pinned)
+			continue;	// not reference counted, or pinned - leave alone.
+		if ((sint)c + i.second > 0)
+			_batch.Put(ldb::Slice(refKey(i.first)), (ldb::Slice)eth::ref(rlp(c + i.second)));
+		else
+		{
+			_batch.Delete(ldb::Slice(refKey(i.first)));
+			_batch.Delete(ldb::Slice((char const*)i.first.data(), 32));
+			o_deleted.push_back(i.first);
+		}
+	}
+}
@@ -23,8 +23,14 @@
 
 #include <map>
 #include <memory>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <deque>
 #include <leveldb/db.h>
+#include <leveldb/write_batch.h>
 #include "TrieCommon.h"
+#include "Exceptions.h"
 namespace ldb = leveldb;
 
 namespace eth
@@ -44,15 +50,15 @@ public:
 	BasicMap() {}
 
 	void clear() { m_over.clear(); }
-	std::map<h256, std::string> const& get() const { return m_over; }
+	std::unordered_map<h256, std::string> const& get() const { return m_over; }
 
 	std::string lookup(h256 _h) const { auto it = m_over.find(_h); if (it != m_over.end()) return it->second; return std::string(); }
 	void insert(h256 _h, bytesConstRef _v) { m_over[_h] = _v.toString(); m_refCount[_h]++; }
-	void kill(h256 _h) { if (!--m_refCount[_h]) m_over.erase(_h); }
+	void kill(h256 _h) { if (!--m_refCount[_h]) { m_over.erase(_h); m_refCount.erase(_h); } }
 
 protected:
-	std::map<h256, std::string> m_over;
-	std::map<h256, uint> m_refCount;
+	std::unordered_map<h256, std::string> m_over;
+	std::unordered_map<h256, int> m_refCount;		///< Net references gained since the last commit; negative for nodes killed but only found in the backing DB.
 };
 
 inline std::ostream& operator<<(std::ostream& _out, BasicMap const& _m)
@@ -67,23 +73,149 @@ inline std::ostream& operator<<(std::ostream& _out, BasicMap const& _m)
 	return _out;
 }
 
-class Overlay: public BasicMap
+/**
+ * @brief Nodes read from (or written to) a backing DB, kept so that the hot ones, such as the upper levels of the state
+ * trie, needn't be fetched from it again. A node never changes, being keyed by its hash, so the only invalidation needed
+ * is when it's deleted from the DB. Thread-safe; shared between all the Overlays on one DB. Sharded, and within each
+ * shard the oldest nodes are dropped once it's full.
+ */
+class NodeCache
 {
 public:
-	Overlay(ldb::DB* _db = nullptr): m_db(_db) {}
+	/// @returns the node @a _h, or nullptr if it isn't cached.
+	std::shared_ptr<std::string const> lookup(h256 const& _h) const;
+	void insert(h256 const& _h, std::shared_ptr<std::string const> const& _v);
+	/// Drop the node @a _h, since it's no longer in the DB.
+	void forget(h256 const& _h);
 
-	ldb::DB* db() const { return m_db.get(); }
-	void setDB(ldb::DB* _db, bool _clearOverlay = true) { m_db = std::shared_ptr<ldb::DB>(_db); if (_clearOverlay) m_over.clear(); }
+	uint64_t hits() const { return m_hits; }
+	uint64_t misses() const { return m_misses; }
 
-	void commit() { for (auto const& i: m_over) m_db->Put(m_writeOptions, ldb::Slice((char const*)i.first.data(), i.first.size), ldb::Slice(i.second.data(), i.second.size())); m_over.clear(); m_refCount.clear(); }
-	void rollback() { m_over.clear(); m_refCount.clear(); }
+	/// Set how many bytes of node data we'll keep, over all shards. Shards over their part of it shrink as nodes are next
+	/// inserted into them.
+	void setLimit(size_t _bytes) { m_limit = _bytes; }
+	size_t limit() const { return m_limit; }
+	/// @returns the number of bytes of node data held, over all shards.
+	size_t bytes() const;
 
-	std::string lookup(h256 _h) const { std::string ret = BasicMap::lookup(_h); if (ret.empty()) m_db->Get(m_readOptions, ldb::Slice((char const*)_h.data(), 32), &ret); return ret; }
+	static const size_t c_defaultLimit = 32 << 20;
 
 private:
-	using BasicMap::clear;
+	static const unsigned c_shards = 16;
+
+	struct Shard
+	{
+		mutable std::mutex x;
+		std::unordered_map<h256, std::shared_ptr<std::string const>> nodes;
+		std::deque<h256> order;		///< Oldest first; may name nodes since forgotten.
+		size_t bytes = 0;
+	};
+	Shard& shard(h256 const& _h) const { return m_shards[_h[0] % c_shards]; }
+
+	mutable std::array<Shard, c_shards> m_shards;
+	std::atomic<size_t> m_limit{c_defaultLimit};
+	mutable std::atomic<uint64_t> m_hits{0};
+	mutable std::atomic<uint64_t> m_misses{0};
+};
+
+/**
+ * @brief A backing DB, fronted by the nodes inserted and killed since they were last committed to it.
+ * Those are kept in a stack of layers shared between copies, so that copying an Overlay (and so a State) costs nothing
+ * however much is uncommitted: once a layer's shared, each copy writes to one of its own on top of it. Committing
+ * merges the layers down.
+ */
+class Overlay
+{
+public:
+	Overlay(ldb::DB* _db = nullptr): m_db(_db), m_nodes(_db ? std::make_shared<NodeCache>() : nullptr) {}
+
+	/// Set whether writes to the backing DB should be flushed to disk before returning.
+	void setSyncWrites(bool _sync) { m_writeOptions.sync = _sync; }
+
+	ldb::DB* db() const { return m_db.get(); }
+	void setDB(ldb::DB* _db, bool _clearOverlay = true) { auto nodes = std::make_shared<NodeCache>(); if (m_nodes) nodes->setLimit(m_nodes->limit()); m_db = std::shared_ptr<ldb::DB>(_db); m_nodes = nodes; m_snapshot.reset(); m_readOptions.snapshot = nullptr; if (_clearOverlay) m_layer.reset(); }
+
+	/// The cache of nodes from the backing DB, shared by all copies of this Overlay.
+	NodeCache const* nodeCache() const { return m_nodes.get(); }
+	/// Set how many bytes of node data the cache shared by all copies of this Overlay keeps.
+	void setNodeCacheLimit(size_t _bytes) { if (m_nodes) m_nodes->setLimit(_bytes); }
+
+	/// @returns roughly how many bytes the nodes inserted since the last commit take, over all our layers; those of
+	/// layers shared with copies are counted by each.
+	size_t uncommittedSize() const;
+
+	/// The reference count of a node that's never to be pruned, whatever later commits and prunes do.
+	static const uint c_pinned = ~(uint)0;
+
+	/// Write all nodes of the overlay to the backing DB. They're pinned rather than counted, so they'll never be pruned,
+	/// even should a later commit(era, id) insert them again.
+	void commit();
+	/// Write all nodes of the overlay to the backing DB as the changes made by block @a _id, number @a _era.
+	/// Nodes inserted have their persistent reference counts raised; those killed are journalled and stay in
+	/// the DB until prune() is called for @a _era. If @a _id is already journalled then nothing is counted.
+	void commit(uint _era, h256 _id);
+	void rollback() { m_layer.reset(); }
+
+	/// Discard the journal of @a _era: the kills of block @a _canonical take effect while the other blocks of the
+	/// era, being on dead branches, have their inserts undone.
+	/// @returns the number of nodes removed from the backing DB.
+	uint prune(uint _era, h256 _canonical);
+
+	/// Add a persistent reference to the node @a _h. If @a _track is false, nodes that aren't reference counted
+	/// are left that way. Pinned nodes are always left alone.
+	/// @returns true if the reference was counted.
+	bool ref(h256 _h, bool _track = true);
+	/// Remove a persistent reference to the node @a _h, deleting it from the backing DB if none remain.
+	/// @returns true if the node was deleted.
+	bool deref(h256 _h);
+	/// @returns the persistent reference count of the node @a _h, zero if it isn't reference counted, c_pinned if it's pinned.
+	uint refCount(h256 _h) const;
+
+	/// Number of nodes, and bytes of their data, written to backing DBs by all Overlays since we started.
+	static uint64_t nodesWritten();
+	static uint64_t nodeBytesWritten();
+
+	/// @returns a copy that reads the backing DB as it is now, whatever is written to it afterwards (by this or any
+	/// other Overlay), so that nodes pruned meanwhile stay readable through it. Take it on the thread that owns this
+	/// Overlay; it may then be used on another. The backing DB lasts at least as long as the snapshot does.
+	Overlay snapshot() const;
+
+	std::string lookup(h256 _h) const;
+	void insert(h256 _h, bytesConstRef _v) { auto& l = top(); l.nodes[_h] = _v.toString(); l.refs[_h]++; }
+	void kill(h256 _h) { auto& l = top(); if (!--l.refs[_h]) { l.nodes.erase(_h); l.refs.erase(_h); } }
+
+	/// Auxilliary (non-node) data, stored directly in the backing DB under keys that are never 32 bytes long.
+	std::string lookupAux(std::string const& _k) const { assert(_k.size() != 32); std::string ret; m_db->Get(m_readOptions, ldb::Slice(_k), &ret); return ret; }
+	void insertAux(std::string const& _k, bytesConstRef _v) { assert(_k.size() != 32); m_db->Put(m_writeOptions, ldb::Slice(_k), ldb::Slice((char const*)_v.data(), _v.size())); }
+	void killAux(std::string const& _k) { assert(_k.size() != 32); m_db->Delete(m_writeOptions, ldb::Slice(_k)); }
+
+private:
+	/// Layers above this many deep are merged into one, so lookups don't get slower and slower.
+	static const unsigned c_maxLayers = 8;
+
+	struct Layer
+	{
+		std::unordered_map<h256, std::string> nodes;
+		std::unordered_map<h256, int> refs;		///< Net references gained; negative for nodes killed but only found below.
+		std::shared_ptr<Layer const> below;
+		unsigned depth = 1;
+	};
+
+	/// @returns the layer to write to, first putting a fresh one on top if ours is shared with a copy.
+	Layer& top();
+	/// Merge all the layers into one. Nodes whose references net to nothing or less are dropped, being in the DB.
+	void flatten();
+
+	/// Queue the reference count changes @a _refs into @a _batch, deleting those nodes left with no references.
+	/// The nodes deleted are added to @a o_deleted.
+	void writeRefs(std::unordered_map<h256, int> const& _refs, ldb::WriteBatch& _batch, h256s& o_deleted) const;
+	/// Write @a _batch to the backing DB, then drop the nodes @a _deleted by it from the cache.
+	void write(ldb::WriteBatch& _batch, h256s const& _deleted);
 
 	std::shared_ptr<ldb::DB> m_db;
+	std::shared_ptr<NodeCache> m_nodes;
+	std::shared_ptr<Layer> m_layer;		///< The top layer; null if there's nothing uncommitted.
+	std::shared_ptr<ldb::Snapshot const> m_snapshot;	///< What m_readOptions reads from, if we're a snapshot.
 
 	ldb::ReadOptions m_readOptions;
 	ldb::WriteOptions m_writeOptions;
@@ -96,6 +228,35 @@ private:
 
 extern const h256 c_shaNull;
 
+/**
+ * @brief Reads nodes from another DB (through a function, so one of these can front any kind), but just records the
+ * nodes inserted and killed, for replay() to make afterwards. With one each, several threads can work on disjoint parts
+ * of a trie at once, the DB itself being left alone until they're done.
+ */
+class DeferredDB
+{
+public:
+	DeferredDB(std::function<std::string(h256)> const& _lookup): m_lookup(_lookup) {}
+
+	std::string lookup(h256 _h) const { return m_lookup(_h); }
+	void insert(h256 _h, bytesConstRef _v) { m_inserted.push_back(std::make_pair(_h, _v.toString())); }
+	void kill(h256 _h) { m_killed.push_back(_h); }
+
+	/// Make the recorded inserts and kills to @a _db.
+	template <class DB> void replay(DB& _db) const
+	{
+		for (auto const& i: m_inserted)
+			_db.insert(i.first, bytesConstRef(i.second));
+		for (auto const& i: m_killed)
+			_db.kill(i);
+	}
+
+private:
+	std::function<std::string(h256)> m_lookup;
+	std::vector<std::pair<h256, std::string>> m_inserted;
+	h256s m_killed;
+};
+
 /**
  * @brief Merkle Patricia Tree "Trie": a modifed base-16 Radix tree.
  * This version uses an LDB backend
@@ -103,12 +264,14 @@ extern const h256 c_shaNull;
 template <class DB>
 class GenericTrieDB
 {
+	template <class> friend class GenericTrieDB;
+
 public:
 	GenericTrieDB(DB* _db): m_db(_db) {}
 	GenericTrieDB(DB* _db, h256 _root) { open(_db, _root); }
 	~GenericTrieDB() {}
 
-	void open(DB* _db, h256 _root) { setRoot(_root); m_db = _db; assert(node(m_root).size()); }
+	void open(DB* _db, h256 _root) { m_db = _db; setRoot(_root); }
 
 	void init();
 	void setRoot(h256 _root) { m_root = _root == h256() ? c_shaNull : _root; /*std::cout << "Setting root to " << _root << " (patched to " << m_root << ")" << std::endl;*/ assert(node(m_root).size()); }
@@ -118,9 +281,21 @@ public:
 	void debugPrint() {}
 
 	std::string at(bytesConstRef _key) const;
+	/// As at(), for a key of exactly @a _N bytes at @a _key. Its length being known at compile time, the walk down is
+	/// a single loop over its nibbles, with neither slices nor recursion.
+	template <unsigned _N> std::string atFixed(byte const* _key) const;
 	void insert(bytesConstRef _key, bytesConstRef _value);
 	void remove(bytesConstRef _key);
 
+	/// Keys, each with the value to put there or, if that's empty, to be removed.
+	using Changes = std::vector<std::pair<bytesConstRef, bytesConstRef>>;
+
+	/// Make all of @a _changes, which must be sorted by key with no key more than once. Equivalent to an insert() or
+	/// remove() for each, but the trie is walked just the once and each node affected is rewritten (and hashed) just
+	/// the once, rather than once for every change beneath it. If @a _threads isn't 1 and there are enough changes, the
+	/// subtrees of the first branch are worked on side by side on that many threads (zero for one per core).
+	void applyBatch(Changes const& _changes, unsigned _threads = 1);
+
 	class iterator
 	{
 	public:
@@ -130,9 +305,16 @@ public:
 		iterator(GenericTrieDB const* _db)
 		{
 			m_that = _db;
-			m_trail.push_back(Node{_db->node(_db->m_root), std::string(1, '\0'), 255});	// one null byte is the HPE for the empty key.
+			enter(_db->m_root);
 			next();
 		}
+		/// Start at the first entry whose key isn't less than @a _key.
+		iterator(GenericTrieDB const* _db, bytesConstRef _key)
+		{
+			m_that = _db;
+			enter(_db->m_root);
+			seek(_key);
+		}
 
 		iterator& operator++()
 		{
@@ -143,133 +325,216 @@ public:
 		value_type operator*() const { return at(); }
 		value_type operator->() const { return at(); }
 
-		bool operator==(iterator const& _c) const { return _c.m_trail == m_trail; }
-		bool operator!=(iterator const& _c) const { return _c.m_trail != m_trail; }
+		bool operator==(iterator const& _c) const { return m_trail.empty() == _c.m_trail.empty() && m_key == _c.m_key; }
+		bool operator!=(iterator const& _c) const { return !operator==(_c); }
 
 		value_type at() const
 		{
 			assert(m_trail.size());
-			Node const& b = m_trail.back();
-			assert(b.key.size());
-			assert(!(b.key[0] & 0x10));	// should be an integer number of bytes (i.e. not an odd number of nibbles).
+			return std::make_pair(bytesConstRef(&m_keyBytes), m_value);
+		}
+
+	private:
+		/// A node on the way down to the current entry. Inline nodes share the data of the node they're in.
+		struct Node
+		{
+			Node(std::shared_ptr<std::string const> const& _data, RLP const& _rlp, unsigned _key): data(_data), rlp(_rlp), items(_rlp), key(_key) {}
 
-			RLP rlp(b.rlp);
-			if (rlp.itemCount() == 2)
-				return std::make_pair(bytesConstRef(b.key).cropped(1), rlp[1].payload());
+			std::shared_ptr<std::string const> data;
+			RLP rlp;
+			RLPIndex items;
+			unsigned key;			///< The number of nibbles of m_key leading to this node.
+			byte child = 255;		///< 255 -> entering; a branch then goes through 16 (its value), 0 to 15 and 17 (done).
+		};
+
+		void enter(h256 _h)
+		{
+			auto d = std::make_shared<std::string const>(m_that->node(_h));
+			m_trail.push_back(Node(d, RLP(*d), m_key.size()));
+		}
+
+		void enter(RLP const& _ref)
+		{
+			if (_ref.isList())
+				m_trail.push_back(Node(m_trail.back().data, _ref, m_key.size()));
 			else
-				return std::make_pair(bytesConstRef(b.key).cropped(1), rlp[16].payload());
+				enter(_ref.toHash<h256>());
 		}
 
-	private:
-		void next()
+		void appendKey(NibbleSlice _k)
 		{
-			while (true)
-			{
-				if (m_trail.empty())
-				{
-					m_that = nullptr;
-					return;
-				}
+			for (unsigned i = 0; i < _k.size(); ++i)
+				m_key.push_back(_k[i]);
+		}
 
-				Node const& b = m_trail.back();
-				RLP rlp(b.rlp);
+		void found(bytesConstRef _value)
+		{
+			assert(!(m_key.size() & 1));	// should be an integer number of bytes (i.e. not an odd number of nibbles).
+			m_keyBytes.resize(m_key.size() / 2);
+			for (unsigned i = 0; i < m_keyBytes.size(); ++i)
+				m_keyBytes[i] = (m_key[i * 2] << 4) | m_key[i * 2 + 1];
+			m_value = _value;
+		}
 
-				if (m_trail.back().child == 255)
+		void finished()
+		{
+			m_that = nullptr;
+			m_key.clear();
+		}
+
+		void next()
+		{
+			while (!m_trail.empty())
+			{
+				Node& b = m_trail.back();
+				m_key.resize(b.key);
+				if (b.child == 255)
 				{
 					// Entering. Look for first...
-					if (rlp.isEmpty())
+					if (b.rlp.isEmpty())
 					{
 						m_trail.pop_back();
 						continue;
 					}
-					if (!(rlp.isList() && (rlp.itemCount() == 2 || rlp.itemCount() == 17)))
-					{
-						cdebug << b.rlp.size() << asHex(b.rlp);
-						cdebug << rlp;
-						auto c = rlp.itemCount();
-						cdebug << c;
-						assert(rlp.isList() && (rlp.itemCount() == 2 || rlp.itemCount() == 17));
-					}
-					if (rlp.itemCount() == 2)
+					assert(b.rlp.isList() && (b.items.size() == 2 || b.items.size() == 17));
+					if (b.items.size() == 2)
 					{
-						// Just turn it into a valid Branch
-						m_trail.back().key = hexPrefixEncode(keyOf(m_trail.back().key), keyOf(rlp), false);
-						if (isLeaf(rlp))
+						appendKey(keyOf(b.rlp));
+						b.child = 17;
+						if (isLeaf(b.rlp))
 						{
 							// leaf - exit now.
-							m_trail.back().child = 0;
+							found(b.items[1].payload());
 							return;
 						}
-
 						// enter child.
-						m_trail.back().rlp = m_that->deref(rlp[1]);
-						// no need to set .child as 255 - it's already done.
+						enter(b.items[1]);
 						continue;
 					}
-					else
-					{
-						// Already a branch - look for first valid.
-						m_trail.back().setFirstChild();
-						// run through to...
-					}
+					b.child = 16;
+				}
+				else if (b.child == 17)
+				{
+					// Finished here.
+					m_trail.pop_back();
+					continue;
 				}
 				else
+					b.child = b.child == 16 ? 0 : b.child == 15 ? 17 : (b.child + 1);
+
+				// A branch - look for the next thing in use.
+				for (; b.child != 17; b.child = b.child == 16 ? 0 : b.child == 15 ? 17 : (b.child + 1))
+					if (!b.items[b.child].isEmpty())
+						break;
+				if (b.child == 16)
 				{
-					// Continuing/exiting. Look for next...
-					if (!(rlp.isList() && rlp.itemCount() == 17))
-					{
-						m_trail.pop_back();
-						continue;
-					}
-					// else run through to...
-					m_trail.back().incrementChild();
+					// have a value at this node - exit now.
+					found(b.items[16].payload());
+					return;
 				}
+				if (b.child != 17)
+				{
+					// lead-on to another node - enter child.
+					m_key.push_back(b.child);
+					enter(b.items[b.child]);
+				}
+			}
+			finished();
+		}
 
-				// ...here. should only get here if we're a list.
-				assert(rlp.isList() && rlp.itemCount() == 17);
-				for (;; m_trail.back().incrementChild())
-					if (m_trail.back().child == 17)
+		/// Go down towards @a _key, leaving the trail where next() will find the first entry not before it.
+		void seek(bytesConstRef _key)
+		{
+			bytes t(_key.size() * 2);
+			for (unsigned i = 0; i < t.size(); ++i)
+				t[i] = nibble(_key, i);
+
+			while (true)
+			{
+				Node& b = m_trail.back();
+				unsigned p = b.key;
+				if (b.rlp.isEmpty())
+				{
+					// Nothing here.
+					m_trail.pop_back();
+					break;
+				}
+				if (b.items.size() == 2)
+				{
+					auto k = keyOf(b.rlp);
+					unsigned s = 0;
+					for (; s < k.size() && p + s < t.size() && k[s] == t[p + s]; ++s) {}
+					if (s < k.size())
 					{
-						// finished here.
-						m_trail.pop_back();
+						// We part from the key: all of us is either after it or before it.
+						if (p + s < t.size() && k[s] < t[p + s])
+							m_trail.pop_back();
 						break;
 					}
-					else if (!rlp[m_trail.back().child].isEmpty())
+					appendKey(k);
+					b.child = 17;
+					if (isLeaf(b.rlp))
 					{
-						if (m_trail.back().child == 16)
-							return;	// have a value at this node - exit now.
-						else
+						if (p + s == t.size())
 						{
-							// lead-on to another node - enter child.
-							m_trail.push_back(m_trail.back());
-							m_trail.back().key = hexPrefixEncode(keyOf(m_trail.back().key), NibbleSlice(bytesConstRef(&m_trail.back().child, 1), 1), false);
-							m_trail.back().rlp = m_that->deref(rlp[m_trail.back().child]);
-							m_trail.back().child = 255;
-							break;
+							found(b.items[1].payload());
+							return;
 						}
+						// Our key is shorter, so before.
+						m_trail.pop_back();
+						break;
 					}
+					enter(b.items[1]);
+					continue;
+				}
+				if (p == t.size())
+					// The key ends here, so everything here is after it.
+					break;
+				// Our value and the children before the key's next nibble are all before it.
+				b.child = t[p];
+				if (b.items[b.child].isEmpty())
+					break;
+				m_key.push_back(b.child);
+				enter(b.items[b.child]);
 			}
+			next();
 		}
 
-		struct Node
-		{
-			std::string rlp;
-			std::string key;		// as hexPrefixEncoding.
-			byte child;				// 255 -> entering
-
-			void setFirstChild() { child = 16; }
-			void incrementChild() { child = child == 16 ? 0 : child == 15 ? 17 : (child + 1); }
-
-			bool operator==(Node const& _c) const { return rlp == _c.rlp && key == _c.key && child == _c.child; }
-			bool operator!=(Node const& _c) const { return !operator==(_c); }
-		};
-
 		std::vector<Node> m_trail;
-		GenericTrieDB<DB> const* m_that;
+		bytes m_key;				///< The nibbles leading to the current node.
+		bytes m_keyBytes;			///< The current entry's key.
+		bytesConstRef m_value;		///< The current entry's value, in the data of the node at the end of m_trail.
+		GenericTrieDB<DB> const* m_that = nullptr;
 	};
 
 	iterator begin() const { return this; }
 	iterator end() const { return iterator(); }
+	/// @returns an iterator to the first entry whose key isn't less than @a _key.
+	iterator lower_bound(bytesConstRef _key) const { return iterator(this, _key); }
+	/// @returns the entries whose keys begin with @a _prefix.
+	std::pair<iterator, iterator> prefixRange(bytesConstRef _prefix) const
+	{
+		// The end is the first key after all of those beginning with the prefix: the prefix, less any trailing 0xff bytes, incremented.
+		bytes after = _prefix.toBytes();
+		while (!after.empty() && after.back() == 0xff)
+			after.pop_back();
+		if (after.empty())
+			return std::make_pair(lower_bound(_prefix), end());
+		++after.back();
+		return std::make_pair(lower_bound(_prefix), lower_bound(&after));
+	}
+
+	/// Call @a _f with every key whose value differs between @a _before and us (whose DBs may differ), giving the value
+	/// in each, empty where there's none. Subtrees the two have in common aren't read, so the cost goes with the number
+	/// of changes rather than the size of the tries. Keys come in order.
+	/// @throws MissingTrieNode if a node of either isn't in its DB (e.g. it's been pruned).
+	template <class DB2> void diff(GenericTrieDB<DB2> const& _before, std::function<void(bytesConstRef _key, bytesConstRef _before, bytesConstRef _after)> const& _f) const;
+
+	/// Call @a _node with the hash of every stored node reachable from the node @a _k, and @a _leaf with every value found.
+	/// Nodes are reported once for every reference to them.
+	void descendKey(h256 _k, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const;
+	void descendEntry(RLP const& _r, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const;
+	void descendList(RLP const& _r, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const;
 
 private:
 	RLPStream& streamNode(RLPStream& _s, bytes const& _b);
@@ -282,6 +547,18 @@ private:
 	bool deleteAtAux(RLPStream& _out, RLP const& _replace, NibbleSlice _key);
 	bytes deleteAt(RLP const& _replace, NibbleSlice _k);
 
+	/// Make the changes from @a _b to @a _e, whose keys all begin with the @a _d nibbles leading to @a _orig, to the
+	/// node @a _orig, which the caller kills if need be. @returns false, leaving @a o_node alone, if there's nothing
+	/// to change; otherwise sets @a o_node to the new node, unhashed and without its own reference.
+	bool applyAt(RLP const& _orig, typename Changes::const_iterator _b, typename Changes::const_iterator _e, uint _d, bytes& o_node, unsigned _threads = 1);
+	/// As applyAt(), but for the node referenced by @a _ref (inline, by hash or empty), which is killed if changed.
+	bool applyAtAux(RLP const& _ref, typename Changes::const_iterator _b, typename Changes::const_iterator _e, uint _d, bytes& o_node, unsigned _threads = 1);
+
+	/// The fewest changes for which applyBatch() will use more than one thread.
+	static const unsigned c_minParallelChanges = 128;
+	/// Stream the unchanged reference @a _ref, which may be an inline node too large to stay inline.
+	RLPStream& streamRef(RLPStream& _s, RLP const& _ref) { return _ref.isList() ? streamNode(_s, _ref.data().toBytes()) : _s.appendRaw(_ref.data()); }
+
 	// in: null (DEL)  -- OR --  [_k, V] (DEL)
 	// out: [_k, _s]
 	// -- OR --
@@ -319,6 +596,23 @@ private:
 	// out: [null ** i, H, null ** (16 - i)] ; [K, V] => H (INS)  (being [null ** i, [K, V], null ** (16 - i)]  if necessary)
 	bytes branch(RLP const& _orig);
 
+	/// Where diff() has got to in one of the tries: a node (empty if there's nothing there) and, if it's a pair, how
+	/// many nibbles of its key are behind us. Inline nodes share the data of the node they're in.
+	struct Place
+	{
+		std::shared_ptr<std::string const> data;
+		RLP rlp;
+		unsigned used = 0;
+	};
+	/// @returns the place referenced by @a _ref (inline, by hash or empty), found in @a _in; through it if it's an extension.
+	Place placeOf(RLP const& _ref, std::shared_ptr<std::string const> const& _in) const;
+	/// @returns the place reached from @a _p by the nibble @a _i.
+	Place step(Place const& _p, unsigned _i) const;
+	/// @returns the value at @a _p, if any.
+	static bytesConstRef valueAt(Place const& _p);
+	/// diff() from @a _before, at @a _p in its trie, to @a _after in ours; both being reached by the nibbles @a _key.
+	template <class DB2> void diffAux(GenericTrieDB<DB2> const& _before, typename GenericTrieDB<DB2>::Place const& _p, Place const& _after, bytes& _key, std::function<void(bytesConstRef, bytesConstRef, bytesConstRef)> const& _f) const;
+
 	bool isTwoItemNode(RLP const& _n) const;
 	std::string deref(RLP const& _n) const;
 
@@ -354,11 +648,21 @@ public:
 
 	std::string operator[](KeyType _k) const { return at(_k); }
 
-	std::string at(KeyType _k) const { return GenericTrieDB<DB>::at(bytesConstRef((byte const*)&_k, sizeof(KeyType))); }
+	std::string at(KeyType _k) const { return GenericTrieDB<DB>::template atFixed<sizeof(KeyType)>((byte const*)&_k); }
 	void insert(KeyType _k, bytesConstRef _value) { GenericTrieDB<DB>::insert(bytesConstRef((byte const*)&_k, sizeof(KeyType)), _value); }
 	void insert(KeyType _k, bytes const& _value) { insert(_k, bytesConstRef(&_value)); }
 	void remove(KeyType _k) { GenericTrieDB<DB>::remove(bytesConstRef((byte const*)&_k, sizeof(KeyType))); }
 
+	/// Put each of @a _changes' values at its key or, if the value is empty, remove the key. See GenericTrieDB::applyBatch().
+	void applyBatch(std::map<KeyType, bytes> const& _changes, unsigned _threads = 1)
+	{
+		typename GenericTrieDB<DB>::Changes c;
+		c.reserve(_changes.size());
+		for (auto const& i: _changes)
+			c.push_back(std::make_pair(bytesConstRef((byte const*)&i.first, sizeof(KeyType)), bytesConstRef(&i.second)));
+		GenericTrieDB<DB>::applyBatch(c, _threads);
+	}
+
 	class iterator: public GenericTrieDB<DB>::iterator
 	{
 	public:
@@ -367,6 +671,7 @@ public:
 
 		iterator() {}
 		iterator(TrieDB const* _db): Super(_db) {}
+		iterator(TrieDB const* _db, KeyType _k): Super(_db, bytesConstRef((byte const*)&_k, sizeof(KeyType))) {}
 
 		value_type operator*() const { return at(); }
 		value_type operator->() const { return at(); }
@@ -384,6 +689,7 @@ public:
 
 	iterator begin() const { return this; }
 	iterator end() const { return iterator(); }
+	iterator lower_bound(KeyType _k) const { return iterator(this, _k); }
 };
 
 template <class KeyType, class DB>
@@ -457,6 +763,54 @@ template <class DB> std::string GenericTrieDB<DB>::atAux(RLP const& _here, Nibbl
 	}
 }
 
+template <class DB> template <unsigned _N> std::string GenericTrieDB<DB>::atFixed(byte const* _key) const
+{
+	constexpr unsigned c_nibbles = _N * 2;
+	auto keyNibble = [&](unsigned _i) -> byte { return (_i & 1) ? (_key[_i / 2] & 15) : (_key[_i / 2] >> 4); };
+
+	std::string n = node(m_root);
+	RLP here(n);
+	for (unsigned d = 0;;)
+	{
+		if (here.isEmpty() || here.isNull())
+			return std::string();
+		RLP next;
+		if (here.itemCount() == 2)
+		{
+			// The hex-prefix encoded key fragment: the first nibble flags a leaf (2) and an odd length (1).
+			bytesConstRef hpe = here[0].payload();
+			unsigned begin = hpe.size() && (hpe[0] & 0x10) ? 1 : 2;
+			unsigned length = hpe.size() * 2 - std::min<unsigned>(begin, hpe.size() * 2);
+			if (d + length > c_nibbles)
+				return std::string();
+			for (unsigned i = 0; i < length; ++i)
+				if (nibble(hpe, begin + i) != keyNibble(d + i))
+					return std::string();
+			d += length;
+			if (isLeaf(here))
+				return d == c_nibbles ? here[1].toString() : std::string();
+			next = here[1];
+		}
+		else
+		{
+			if (d == c_nibbles)
+				return here[16].toString();
+			next = here[keyNibble(d++)];
+			if (next.isEmpty())
+				return std::string();
+		}
+		if (next.isList())
+			here = next;
+		else
+		{
+			// Careful: next points into n.
+			h256 h = next.toHash<h256>();
+			n = node(h);
+			here = RLP(n);
+		}
+	}
+}
+
 template <class DB> bytes GenericTrieDB<DB>::mergeAt(RLP const& _orig, NibbleSlice _k, bytesConstRef _v)
 {
 //	::operator<<(std::cout << "mergeAt ", _orig) << _k << _v.toString() << std::endl;
@@ -552,12 +906,356 @@ template <class DB> void GenericTrieDB<DB>::remove(bytesConstRef _key)
 	}
 }
 
+template <class DB> void GenericTrieDB<DB>::applyBatch(Changes const& _changes, unsigned _threads)
+{
+	std::string rv = node(m_root);
+	assert(rv.size());
+	bytes b;
+	if (applyAt(RLP(rv), _changes.begin(), _changes.end(), 0, b, _changes.size() < c_minParallelChanges ? 1 : _threads))
+	{
+		// The root is always hashed, whatever its size.
+		killNode(m_root);
+		m_root = insertNode(&b);
+	}
+}
+
+template <class DB> bool GenericTrieDB<DB>::applyAtAux(RLP const& _ref, typename Changes::const_iterator _b, typename Changes::const_iterator _e, uint _d, bytes& o_node, unsigned _threads)
+{
+	if (_b == _e)
+		return false;
+	if (_ref.isList() || _ref.isEmpty())
+		return applyAt(_ref, _b, _e, _d, o_node, _threads);
+	h256 h = _ref.toHash<h256>();
+	std::string s = node(h);
+	assert(s.size());
+	if (!applyAt(RLP(s), _b, _e, _d, o_node, _threads))
+		return false;
+	killNode(h);
+	return true;
+}
+
+template <class DB> bool GenericTrieDB<DB>::applyAt(RLP const& _orig, typename Changes::const_iterator _b, typename Changes::const_iterator _e, uint _d, bytes& o_node, unsigned _threads)
+{
+	if (_b == _e)
+		return false;
+
+	if (_orig.isEmpty())
+	{
+		auto put = _e;
+		unsigned puts = 0;
+		for (auto i = _b; i != _e; ++i)
+			if (i->second.size())
+				put = i, ++puts;
+		if (!puts)
+			return false;
+		if (puts == 1)
+		{
+			o_node = (RLPStream(2) << hexPrefixEncode(NibbleSlice(put->first, _d), true) << put->second).out();
+			return true;
+		}
+		// Several to go here - share them out from an empty branch.
+		RLPStream r(17);
+		for (uint i = 0; i < 17; ++i)
+			r << "";
+		return applyAt(RLP(r.out()), _b, _e, _d, o_node, _threads);
+	}
+
+	RLPIndex o(_orig);
+	assert(o.size() == 2 || o.size() == 17);
+	if (o.size() == 2)
+	{
+		NibbleSlice k = keyOf(_orig);
+		bool leaf = isLeaf(_orig);
+		uint p = k.size();
+		for (auto i = _b; i != _e; ++i)
+			p = std::min(p, k.shared(NibbleSlice(i->first, _d)));
+
+		if (!leaf && p == k.size())
+		{
+			// Every change is beneath us - apply them to our child, then graft it onto us if it's no longer a branch.
+			bytes c;
+			if (!applyAtAux(o[1], _b, _e, _d + p, c, _threads))
+				return false;
+			RLP cr(c);
+			if (cr.isEmpty())
+				o_node = RLPNull;
+			else if (cr.itemCount() == 2)
+				o_node = (RLPStream(2) << hexPrefixEncode(k, keyOf(cr), isLeaf(cr)) << cr[1]).out();
+			else
+				o_node = streamNode(RLPStream(2) << o[0], c).out();
+			return true;
+		}
+
+		// Some changes diverge from our key after p nibbles: apply them to the equivalent (if non-canonical) extension
+		// of those p nibbles onto a branch holding the rest of us; the branch will put things back in shape.
+		RLPStream b(17);
+		for (uint i = 0; i < 16; ++i)
+			if (p < k.size() && i == k[p])
+				if (leaf || p + 1 < k.size())
+					b.appendList(2) << hexPrefixEncode(k.mid(p + 1), leaf) << o[1];
+				else
+					b << o[1];
+			else
+				b << "";
+		if (p == k.size())
+			b << o[1];
+		else
+			b << "";
+		if (!p)
+			return applyAt(RLP(b.out()), _b, _e, _d, o_node, _threads);
+		RLPStream x(2);
+		x << hexPrefixEncode(k, false, 0, p);
+		x.appendRaw(b.out());
+		return applyAt(RLP(x.out()), _b, _e, _d, o_node, _threads);
+	}
+
+	// Branch: the value first, the change to it being the only one whose key ends here (and so the first)...
+	auto i = _b;
+	bytesConstRef value = o[16].payload();
+	bool changed = false;
+	if (NibbleSlice(i->first, _d).size() == 0)
+	{
+		changed = i->second.size() != value.size() || memcmp(i->second.data(), value.data(), value.size());
+		value = i->second;
+		++i;
+	}
+	// ...then the children, whose changes come in runs of the same next nibble.
+	std::array<typename Changes::const_iterator, 17> bounds;
+	for (uint n = 0; n < 16; ++n)
+	{
+		bounds[n] = i;
+		for (; i != _e && NibbleSlice(i->first, _d)[0] == n; ++i) {}
+	}
+	bounds[16] = i;
+	std::array<bytes, 16> children;
+	std::array<bool, 16> childChanged;
+	if (_threads == 1)
+		for (uint n = 0; n < 16; ++n)
+			childChanged[n] = applyAtAux(o[n], bounds[n], bounds[n + 1], _d + 1, children[n]);
+	else
+	{
+		// The children are disjoint subtrees, so can be worked on side by side if their inserts and kills wait till after.
+		DB const* db = m_db;
+		std::vector<DeferredDB> dbs(16, DeferredDB([=](h256 _h) { return db->lookup(_h); }));
+		parallelFor(16, _threads, [&](unsigned n)
+		{
+			GenericTrieDB<DeferredDB> t(&dbs[n]);
+			childChanged[n] = t.applyAtAux(o[n], bounds[n], bounds[n + 1], _d + 1, children[n]);
+		});
+		for (auto const& db: dbs)
+			db.replay(*m_db);
+	}
+	for (uint n = 0; n < 16; ++n)
+		changed = changed || childChanged[n];
+	if (!changed)
+		return false;
+
+	// Nodes are only streamed (and thus hashed) once we know we're staying a branch.
+	auto child = [&](uint _i) { return childChanged[_i] ? RLP(children[_i]) : o[_i]; };
+	byte used = 255;
+	unsigned count = 0;
+	for (uint j = 0; j < 16; ++j)
+		if (!child(j).isEmpty())
+			used = j, ++count;
+
+	if (!count && value.empty())
+		o_node = RLPNull;
+	else if (!count)
+		o_node = (RLPStream(2) << hexPrefixEncode(bytes(), true) << value).out();
+	else if (count == 1 && value.empty())
+	{
+		// Just the one child left; become an extension onto it or, if it's a two-item node, absorb it.
+		std::string s;
+		RLP c = child(used);
+		if (!childChanged[used] && !c.isList())
+		{
+			s = node(c.toHash<h256>());
+			c = RLP(s);
+		}
+		if (c.itemCount() == 2)
+		{
+			if (!s.empty())
+				killNode(o[used].toHash<h256>());
+			o_node = (RLPStream(2) << hexPrefixEncode(NibbleSlice(bytesConstRef(&used, 1), 1), keyOf(c), isLeaf(c)) << c[1]).out();
+		}
+		else
+		{
+			RLPStream r(2);
+			r << hexPrefixEncode(bytesConstRef(&used, 1), false, 1, 2, 0);
+			if (childChanged[used])
+				streamNode(r, children[used]);
+			else
+				streamRef(r, o[used]);
+			r.swapOut(o_node);
+		}
+	}
+	else
+	{
+		// The changed children too big to inline are hashed together.
+		std::vector<bytesConstRef> big;
+		for (uint j = 0; j < 16; ++j)
+			if (childChanged[j] && children[j].size() >= 32)
+				big.push_back(&children[j]);
+		h256s hashes(big.size());
+		sha3Batch(big, hashes.data());
+
+		// Children are mostly hashes; sized so, the header's written in place and the buffer allocated just the once.
+		RLPStream r(17, count * 33 + (16 - count) + value.size() + 1);
+		auto h = hashes.begin();
+		for (uint j = 0; j < 16; ++j)
+			if (childChanged[j] && children[j].size() >= 32)
+			{
+				insertNode(*h, &children[j]);
+				r << *(h++);
+			}
+			else if (childChanged[j])
+				r.appendRaw(children[j]);
+			else
+				streamRef(r, o[j]);
+		r << value;
+		r.swapOut(o_node);
+	}
+	return true;
+}
+
 template <class DB> bool GenericTrieDB<DB>::isTwoItemNode(RLP const& _n) const
 {
 	return (_n.isData() && RLP(node(_n.toHash<h256>())).itemCount() == 2)
 			|| (_n.isList() && _n.itemCount() == 2);
 }
 
+template <class DB> void GenericTrieDB<DB>::descendKey(h256 _k, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const
+{
+	_node(_k);
+	std::string n = node(_k);
+	descendList(RLP(n), _node, _leaf);
+}
+
+template <class DB> void GenericTrieDB<DB>::descendEntry(RLP const& _r, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const
+{
+	if (_r.isData() && _r.size() == 32)
+		descendKey(_r.toHash<h256>(), _node, _leaf);
+	else if (_r.isList())
+		descendList(_r, _node, _leaf);
+}
+
+template <class DB> void GenericTrieDB<DB>::descendList(RLP const& _r, std::function<void(h256)> const& _node, std::function<void(bytesConstRef)> const& _leaf) const
+{
+	if (!_r.isList())
+		return;
+	if (_r.itemCount() == 2)
+	{
+		if (isLeaf(_r))
+			_leaf(_r[1].toBytesConstRef());
+		else
+			descendEntry(_r[1], _node, _leaf);
+	}
+	else if (_r.itemCount() == 17)
+	{
+		for (unsigned i = 0; i < 16; ++i)
+			if (!_r[i].isEmpty())
+				descendEntry(_r[i], _node, _leaf);
+		if (!_r[16].isEmpty())
+			_leaf(_r[16].toBytesConstRef());
+	}
+}
+
+template <class DB> typename GenericTrieDB<DB>::Place GenericTrieDB<DB>::placeOf(RLP const& _ref, std::shared_ptr<std::string const> const& _in) const
+{
+	Place ret;
+	if (_ref.isEmpty())
+		return ret;
+	if (_ref.isList())
+	{
+		ret.data = _in;
+		ret.rlp = _ref;
+	}
+	else
+	{
+		ret.data = std::make_shared<std::string const>(node(_ref.toHash<h256>()));
+		if (ret.data->empty())
+			throw MissingTrieNode();
+		ret.rlp = RLP(*ret.data);
+	}
+	if (ret.rlp.itemCount() == 2 && !isLeaf(ret.rlp) && !keyOf(ret.rlp).size())
+		return placeOf(ret.rlp[1], ret.data);
+	return ret;
+}
+
+template <class DB> typename GenericTrieDB<DB>::Place GenericTrieDB<DB>::step(Place const& _p, unsigned _i) const
+{
+	if (_p.rlp.itemCount() == 17)
+		return placeOf(_p.rlp[_i], _p.data);
+	if (_p.rlp.itemCount() == 2)
+	{
+		auto k = keyOf(_p.rlp);
+		if (_p.used < k.size() && k[_p.used] == _i)
+		{
+			if (_p.used + 1 == k.size() && !isLeaf(_p.rlp))
+				return placeOf(_p.rlp[1], _p.data);
+			Place ret = _p;
+			ret.used++;
+			return ret;
+		}
+	}
+	return Place();
+}
+
+template <class DB> bytesConstRef GenericTrieDB<DB>::valueAt(Place const& _p)
+{
+	if (_p.rlp.itemCount() == 17)
+		return _p.rlp[16].payload();
+	if (_p.rlp.itemCount() == 2 && isLeaf(_p.rlp) && _p.used == keyOf(_p.rlp).size())
+		return _p.rlp[1].payload();
+	return bytesConstRef();
+}
+
+template <class DB> template <class DB2> void GenericTrieDB<DB>::diff(GenericTrieDB<DB2> const& _before, std::function<void(bytesConstRef, bytesConstRef, bytesConstRef)> const& _f) const
+{
+	if (m_root == _before.m_root)
+		return;
+	auto rootOf = [](std::string const& _n) { auto d = std::make_shared<std::string const>(_n); return std::make_pair(d, RLP(*d)); };
+	auto b = rootOf(_before.node(_before.m_root));
+	auto a = rootOf(node(m_root));
+	if (b.first->empty() || a.first->empty())
+		throw MissingTrieNode();
+	bytes key;
+	diffAux(_before, _before.placeOf(b.second, b.first), placeOf(a.second, a.first), key, _f);
+}
+
+template <class DB> template <class DB2> void GenericTrieDB<DB>::diffAux(GenericTrieDB<DB2> const& _before, typename GenericTrieDB<DB2>::Place const& _p, Place const& _after, bytes& _key, std::function<void(bytesConstRef, bytesConstRef, bytesConstRef)> const& _f) const
+{
+	auto same = [](bytesConstRef _a, bytesConstRef _b) { return _a.size() == _b.size() && !memcmp(_a.data(), _b.data(), _a.size()); };
+	if (_p.used == _after.used && same(_p.rlp.data(), _after.rlp.data()))
+		return;
+
+	auto vb = _before.valueAt(_p);
+	auto va = valueAt(_after);
+	if (!same(vb, va))
+	{
+		assert(!(_key.size() & 1));
+		bytes k(_key.size() / 2);
+		for (unsigned i = 0; i < k.size(); ++i)
+			k[i] = (_key[i * 2] << 4) | _key[i * 2 + 1];
+		_f(&k, vb, va);
+	}
+
+	bool branches = _p.rlp.itemCount() == 17 && _after.rlp.itemCount() == 17;
+	for (unsigned i = 0; i < 16; ++i)
+	{
+		// Children referenced alike are the same subtree, whether inline or by hash.
+		if (branches && same(_p.rlp[i].data(), _after.rlp[i].data()))
+			continue;
+		auto cb = _before.step(_p, i);
+		auto ca = step(_after, i);
+		if (cb.rlp.isNull() && ca.rlp.isNull())
+			continue;
+		_key.push_back(i);
+		diffAux(_before, cb, ca, _key, _f);
+		_key.pop_back();
+	}
+}
+
 template <class DB> std::string GenericTrieDB<DB>::deref(RLP const& _n) const
 {
 	return _n.isList() ? _n.data().toString() : node(_n.toHash<h256>());
@@ -40,9 +40,10 @@ namespace eth
 bool g_hashDebug = false;
 #endif
 
-void hash256aux(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp);
+void hash256aux(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp, unsigned _threads = 1);
 
-void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp)
+/// @param _threads if not 1, the children of the first branch are encoded side by side on this many threads (zero for one per core).
+void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp, unsigned _threads = 1)
 {
 #if ENABLE_DEBUG_PRINT
 	static std::string s_indent;
@@ -65,15 +66,10 @@ void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_i
 	{
 		// find the number of common prefix nibbles shared
 		// i.e. the minimum number of nibbles shared at the beginning between the first hex string and each successive.
-		uint sharedPre = (uint)-1;
-		uint c = 0;
-		for (auto i = std::next(_begin); i != _end && sharedPre; ++i, ++c)
-		{
-			uint x = std::min(sharedPre, std::min((uint)_begin->first.size(), (uint)i->first.size()));
-			uint shared = _preLen;
-			for (; shared < x && _begin->first[shared] == i->first[shared]; ++shared) {}
-			sharedPre = std::min(shared, sharedPre);
-		}
+		// The keys are sorted, so that's just what the first and last share.
+		auto last = std::prev(_end);
+		uint x = std::min((uint)_begin->first.size(), (uint)last->first.size());
+		uint sharedPre = _preLen + sharedBytes(_begin->first.data() + _preLen, last->first.data() + _preLen, x - _preLen);
 		if (sharedPre > _preLen)
 		{
 			// if they all have the same next nibble, we also want a pair.
@@ -82,7 +78,7 @@ void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_i
 				std::cerr << s_indent << asHex(bytesConstRef(_begin->first.data() + _preLen, sharedPre), 1) << ": " << std::endl;
 #endif
 			_rlp.appendList(2) << hexPrefixEncode(_begin->first, false, _preLen, (int)sharedPre);
-			hash256aux(_s, _begin, _end, (unsigned)sharedPre, _rlp);
+			hash256aux(_s, _begin, _end, (unsigned)sharedPre, _rlp, _threads);
 #if ENABLE_DEBUG_PRINT
 			if (g_hashDebug)
 				std::cerr << s_indent << "= " << hex << sha3(_rlp.out()) << dec << std::endl;
@@ -101,21 +97,36 @@ void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_i
 #endif
 				++b;
 			}
+			std::array<HexMap::const_iterator, 17> bounds;
 			for (auto i = 0; i < 16; ++i)
 			{
-				auto n = b;
-				for (; n != _end && n->first[_preLen] == i; ++n) {}
-				if (b == n)
-					_rlp << "";
+				bounds[i] = b;
+				for (; b != _end && b->first[_preLen] == i; ++b) {}
+			}
+			bounds[16] = b;
+			auto child = [&](unsigned i, RLPStream& _out)
+			{
+				if (bounds[i] == bounds[i + 1])
+					_out << "";
 				else
 				{
 #if ENABLE_DEBUG_PRINT
 					if (g_hashDebug)
 						std::cerr << s_indent << std::hex << i << ": " << std::dec << std::endl;
 #endif
-					hash256aux(_s, b, n, _preLen + 1, _rlp);
+					hash256aux(_s, bounds[i], bounds[i + 1], _preLen + 1, _out);
 				}
-				b = n;
+			};
+			if (_threads == 1)
+				for (unsigned i = 0; i < 16; ++i)
+					child(i, _rlp);
+			else
+			{
+				// The children are independent subtrees; encode them side by side and append them in order.
+				std::array<RLPStream, 16> children;
+				parallelFor(16, _threads, [&](unsigned i) { child(i, children[i]); });
+				for (auto const& c: children)
+					_rlp.appendRaw(c.out());
 			}
 			if (_preLen == _begin->first.size())
 				_rlp << _begin->second;
@@ -134,10 +145,10 @@ void hash256rlp(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_i
 #endif
 }
 
-void hash256aux(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp)
+void hash256aux(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_iterator _end, unsigned _preLen, RLPStream& _rlp, unsigned _threads)
 {
 	RLPStream rlp;
-	hash256rlp(_s, _begin, _end, _preLen, rlp);
+	hash256rlp(_s, _begin, _end, _preLen, rlp, _threads);
 	if (rlp.out().size() < 32)
 	{
 		// RECURSIVE RLP
@@ -155,7 +166,7 @@ void hash256aux(HexMap const& _s, HexMap::const_iterator _begin, HexMap::const_i
 	}
 }
 
-h256 hash256(StringMap const& _s)
+h256 hash256(StringMap const& _s, unsigned _threads)
 {
 	// build patricia tree.
 	if (_s.empty())
@@ -164,7 +175,7 @@ h256 hash256(StringMap const& _s)
 	for (auto i = _s.rbegin(); i != _s.rend(); ++i)
 		hexMap[toHex(i->first)] = i->second;
 	RLPStream s;
-	hash256rlp(hexMap, hexMap.cbegin(), hexMap.cend(), 0, s);
+	hash256rlp(hexMap, hexMap.cbegin(), hexMap.cend(), 0, s, _threads);
 	return sha3(s.out());
 }
 
@@ -181,7 +192,7 @@ bytes rlp256(StringMap const& _s)
 	return s.out();
 }
 
-h256 hash256(u256Map const& _s)
+h256 hash256(u256Map const& _s, unsigned _threads)
 {
 	// build patricia tree.
 	if (_s.empty())
@@ -190,7 +201,7 @@ h256 hash256(u256Map const& _s)
 	for (auto i = _s.rbegin(); i != _s.rend(); ++i)
 		hexMap[toHex(toBigEndianString(i->first))] = asString(rlp(i->second));
 	RLPStream s;
-	hash256rlp(hexMap, hexMap.cbegin(), hexMap.cend(), 0, s);
+	hash256rlp(hexMap, hexMap.cbegin(), hexMap.cend(), 0, s, _threads);
 	return sha3(s.out());
 }
 
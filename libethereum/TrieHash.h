@@ -27,7 +27,8 @@ namespace eth
 {
 
 bytes rlp256(StringMap const& _s);
-h256 hash256(StringMap const& _s);
-h256 hash256(u256Map const& _s);
+/// The root hash of the trie of @a _s. If @a _threads isn't 1, the top-level subtrees are hashed on that many threads (zero for one per core).
+h256 hash256(StringMap const& _s, unsigned _threads = 1);
+h256 hash256(u256Map const& _s, unsigned _threads = 1);
 
 }
@@ -0,0 +1,122 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file VMProfiler.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#include <chrono>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "VMProfiler.h"
+using namespace std;
+using namespace eth;
+
+atomic<bool> VMProfiler::s_enabled(false);
+mutex VMProfiler::s_lock;
+array<VMProfileEntry, 256> VMProfiler::s_byInstruction;
+map<Address, VMProfileEntry> VMProfiler::s_byContract;
+
+static char const* instructionName(uint8_t _i)
+{
+	static const map<uint8_t, char const*> c_names = {
+		{ 0x00, "STOP" }, { 0x01, "ADD" }, { 0x02, "SUB" }, { 0x03, "MUL" }, { 0x04, "DIV" }, { 0x05, "SDIV" }, { 0x06, "MOD" },
+		{ 0x07, "SMOD" }, { 0x08, "EXP" }, { 0x09, "NEG" }, { 0x0a, "LT" }, { 0x0b, "LE" }, { 0x0c, "GT" }, { 0x0d, "GE" },
+		{ 0x0e, "EQ" }, { 0x0f, "NOT" }, { 0x10, "MYADDRESS" }, { 0x11, "TXSENDER" }, { 0x12, "TXVALUE" }, { 0x13, "TXFEE" },
+		{ 0x14, "TXDATAN" }, { 0x15, "TXDATA" }, { 0x16, "BLK_PREVHASH" }, { 0x17, "BLK_COINBASE" }, { 0x18, "BLK_TIMESTAMP" },
+		{ 0x19, "BLK_NUMBER" }, { 0x1a, "BLK_DIFFICULTY" }, { 0x20, "SHA256" }, { 0x21, "RIPEMD160" }, { 0x22, "ECMUL" },
+		{ 0x23, "ECADD" }, { 0x24, "ECSIGN" }, { 0x25, "ECRECOVER" }, { 0x26, "ECVALID" }, { 0x27, "SHA3" }, { 0x30, "PUSH" },
+		{ 0x31, "POP" }, { 0x32, "DUP" }, { 0x33, "DUPN" }, { 0x34, "SWAP" }, { 0x35, "SWAPN" }, { 0x36, "LOAD" }, { 0x37, "STORE" },
+		{ 0x40, "JMP" }, { 0x41, "JMPI" }, { 0x42, "IND" }, { 0x50, "EXTRO" }, { 0x51, "BALANCE" }, { 0x60, "MKTX" },
+		{ 0xff, "SUICIDE" }
+	};
+	auto it = c_names.find(_i);
+	return it == c_names.end() ? nullptr : it->second;
+}
+
+VMProfiler::Run::~Run()
+{
+	uint64_t t = now();
+	if (m_current)
+		m_current->ticks += t - m_last;
+
+	VMProfileEntry total;
+	lock_guard<mutex> l(s_lock);
+	for (unsigned i = 0; i < 256; ++i)
+		if (m_byInstruction[i].count)
+		{
+			s_byInstruction[i] += m_byInstruction[i];
+			total += m_byInstruction[i];
+		}
+	s_byContract[m_contract] += total;
+}
+
+void VMProfiler::reset()
+{
+	lock_guard<mutex> l(s_lock);
+	s_byInstruction.fill(VMProfileEntry());
+	s_byContract.clear();
+}
+
+array<VMProfileEntry, 256> VMProfiler::byInstruction()
+{
+	lock_guard<mutex> l(s_lock);
+	return s_byInstruction;
+}
+
+map<Address, VMProfileEntry> VMProfiler::byContract()
+{
+	lock_guard<mutex> l(s_lock);
+	return s_byContract;
+}
+
+void VMProfiler::streamCSV(ostream& _out)
+{
+	auto ins = byInstruction();
+	auto cons = byContract();
+	auto busiest = [](pair<string, VMProfileEntry> const& _a, pair<string, VMProfileEntry> const& _b) { return _a.second.ticks > _b.second.ticks; };
+
+	vector<pair<string, VMProfileEntry>> rows;
+	for (unsigned i = 0; i < 256; ++i)
+		if (ins[i].count)
+		{
+			auto n = instructionName((uint8_t)i);
+			rows.push_back(make_pair(n ? string(n) : "0x" + asHex(bytes(1, (byte)i)), ins[i]));
+		}
+	sort(rows.begin(), rows.end(), busiest);
+	_out << "kind,name,count,ticks,fees" << endl;
+	for (auto const& r: rows)
+		_out << "instruction," << r.first << "," << r.second.count << "," << r.second.ticks << "," << r.second.fees << endl;
+
+	rows.clear();
+	for (auto const& c: cons)
+		rows.push_back(make_pair(asHex(c.first.asArray()), c.second));
+	sort(rows.begin(), rows.end(), busiest);
+	for (auto const& r: rows)
+		_out << "contract," << r.first << "," << r.second.count << "," << r.second.ticks << "," << r.second.fees << endl;
+}
+
+uint64_t VMProfiler::now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
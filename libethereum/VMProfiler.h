@@ -0,0 +1,105 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file VMProfiler.h
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ */
+
+#pragma once
+
+#include <array>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include "Common.h"
+#include "Instruction.h"
+
+namespace eth
+{
+
+/// What the VM has spent on an opcode or a contract.
+struct VMProfileEntry
+{
+	uint64_t count = 0;		///< Instructions executed.
+	uint64_t ticks = 0;		///< Time taken over them, in CPU cycles (nanoseconds where there's no cycle counter).
+	u256 fees = 0;			///< Fees paid for them.
+
+	VMProfileEntry& operator+=(VMProfileEntry const& _e) { count += _e.count; ticks += _e.ticks; fees += _e.fees; return *this; }
+};
+
+/**
+ * @brief Optional accounting of the VM's work, per opcode and per contract, for finding out what playback spends its
+ * time on.
+ * Off by default, at which point it costs State::execute() a single check per call. When on, each call keeps its own
+ * tally in a Run, merged into the totals as it returns, so that threads don't contend at every step. A contract's
+ * figures include those of any contract it calls.
+ */
+class VMProfiler
+{
+public:
+	/// The tally of a single contract execution.
+	class Run
+	{
+	public:
+		explicit Run(Address _contract): m_contract(_contract), m_last(now()) {}
+		~Run();
+
+		/// Note that instruction @a _inst is about to execute, charged @a _fee; the time since the previous one goes to that.
+		void step(Instruction _inst, u256 const& _fee)
+		{
+			uint64_t t = now();
+			if (m_current)
+				m_current->ticks += t - m_last;
+			m_last = t;
+			m_current = &m_byInstruction[(uint8_t)_inst];
+			++m_current->count;
+			m_current->fees += _fee;
+		}
+
+	private:
+		Address m_contract;
+		std::array<VMProfileEntry, 256> m_byInstruction;
+		VMProfileEntry* m_current = nullptr;
+		uint64_t m_last;
+	};
+
+	/// Turn profiling on or off. Executions already under way are unaffected.
+	static void setEnabled(bool _enabled) { s_enabled = _enabled; }
+	static bool enabled() { return s_enabled; }
+
+	/// Forget everything recorded so far.
+	static void reset();
+
+	/// @returns the totals for each opcode, indexed by its value.
+	static std::array<VMProfileEntry, 256> byInstruction();
+	/// @returns the totals for each contract executed.
+	static std::map<Address, VMProfileEntry> byContract();
+
+	/// Write the totals as CSV: a row for each opcode and then for each contract, the busiest first.
+	static void streamCSV(std::ostream& _out);
+
+	/// The current value of the clock ticks are counted by.
+	static uint64_t now();
+
+private:
+	static std::atomic<bool> s_enabled;
+	static std::mutex s_lock;
+	static std::array<VMProfileEntry, 256> s_byInstruction;
+	static std::map<Address, VMProfileEntry> s_byContract;
+};
+
+}
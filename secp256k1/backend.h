@@ -0,0 +1,102 @@
+// Copyright (c) 2013 Pieter Wuille
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef _SECP256K1_BACKEND_
+#define _SECP256K1_BACKEND_
+
+#include <stdint.h>
+
+/** The library is compiled once for each field implementation (see the backend_*.c files), the public
+ *  functions of each copy being renamed to secp256k1_<backend>_*; everything else is static. dispatch.c
+ *  then provides the public API, forwarding to whichever copy is selected at run time. */
+typedef struct {
+    const char *name;
+    void (*start)(void);
+    void (*stop)(void);
+    int (*ecdsa_verify)(const unsigned char *msg, int msglen, const unsigned char *sig, int siglen, const unsigned char *pubkey, int pubkeylen);
+    int (*ecdsa_sign)(const unsigned char *msg, int msglen, unsigned char *sig, int *siglen, const unsigned char *seckey, const unsigned char *nonce);
+    int (*ecdsa_sign_compact)(const unsigned char *msg, int msglen, unsigned char *sig64, const unsigned char *seckey, const unsigned char *nonce, int *recid);
+    int (*ecdsa_recover_compact)(const unsigned char *msg, int msglen, const unsigned char *sig64, unsigned char *pubkey, int *pubkeylen, int compressed, int recid);
+    int (*ecdsa_recover_compact_batch)(int n, const unsigned char * const *msgs, const unsigned char * const *sig64s, unsigned char * const *pubkeys, int *pubkeylens, int compressed, const int *recids, int *results);
+    int (*ecdsa_seckey_verify)(const unsigned char *seckey);
+    int (*ecdsa_pubkey_verify)(const unsigned char *pubkey, int pubkeylen);
+    int (*ecdsa_pubkey_create)(unsigned char *pubkey, int *pubkeylen, const unsigned char *seckey, int compressed);
+    int (*ecdsa_pubkey_decompress)(unsigned char *pubkey, int *pubkeylen);
+    int (*ecdsa_privkey_export)(const unsigned char *seckey, unsigned char *privkey, int *privkeylen, int compressed);
+    int (*ecdsa_privkey_import)(unsigned char *seckey, const unsigned char *privkey, int privkeylen);
+    int (*ecdsa_privkey_tweak_add)(unsigned char *seckey, const unsigned char *tweak);
+    int (*ecdsa_pubkey_tweak_add)(unsigned char *pubkey, int pubkeylen, const unsigned char *tweak);
+    int (*ecdsa_privkey_tweak_mul)(unsigned char *seckey, const unsigned char *tweak);
+    int (*ecdsa_pubkey_tweak_mul)(unsigned char *pubkey, int pubkeylen, const unsigned char *tweak);
+    int (*ec_point_valid)(const uint64_t *x, const uint64_t *y);
+    int (*ec_point_mul)(uint64_t *rx, uint64_t *ry, const uint64_t *x, const uint64_t *y, const uint64_t *n);
+    int (*ec_point_add)(uint64_t *rx, uint64_t *ry, const uint64_t *ax, const uint64_t *ay, const uint64_t *bx, const uint64_t *by);
+} secp256k1_backend_t;
+
+#define SECP256K1_PASTE(a, b) a ## b
+#define SECP256K1_XPASTE(a, b) SECP256K1_PASTE(a, b)
+
+#ifdef SECP256K1_BACKEND
+
+#define SECP256K1_RENAME(f) SECP256K1_XPASTE(SECP256K1_BACKEND, _ ## f)
+
+#define secp256k1_start                         SECP256K1_RENAME(start)
+#define secp256k1_stop                          SECP256K1_RENAME(stop)
+#define secp256k1_ecdsa_verify                  SECP256K1_RENAME(ecdsa_verify)
+#define secp256k1_ecdsa_sign                    SECP256K1_RENAME(ecdsa_sign)
+#define secp256k1_ecdsa_sign_compact            SECP256K1_RENAME(ecdsa_sign_compact)
+#define secp256k1_ecdsa_recover_compact         SECP256K1_RENAME(ecdsa_recover_compact)
+#define secp256k1_ecdsa_recover_compact_batch   SECP256K1_RENAME(ecdsa_recover_compact_batch)
+#define secp256k1_ecdsa_seckey_verify           SECP256K1_RENAME(ecdsa_seckey_verify)
+#define secp256k1_ecdsa_pubkey_verify           SECP256K1_RENAME(ecdsa_pubkey_verify)
+#define secp256k1_ecdsa_pubkey_create           SECP256K1_RENAME(ecdsa_pubkey_create)
+#define secp256k1_ecdsa_pubkey_decompress       SECP256K1_RENAME(ecdsa_pubkey_decompress)
+#define secp256k1_ecdsa_privkey_export          SECP256K1_RENAME(ecdsa_privkey_export)
+#define secp256k1_ecdsa_privkey_import          SECP256K1_RENAME(ecdsa_privkey_import)
+#define secp256k1_ecdsa_privkey_tweak_add       SECP256K1_RENAME(ecdsa_privkey_tweak_add)
+#define secp256k1_ecdsa_pubkey_tweak_add        SECP256K1_RENAME(ecdsa_pubkey_tweak_add)
+#define secp256k1_ecdsa_privkey_tweak_mul       SECP256K1_RENAME(ecdsa_privkey_tweak_mul)
+#define secp256k1_ecdsa_pubkey_tweak_mul        SECP256K1_RENAME(ecdsa_pubkey_tweak_mul)
+#define secp256k1_ec_point_valid                SECP256K1_RENAME(ec_point_valid)
+#define secp256k1_ec_point_mul                  SECP256K1_RENAME(ec_point_mul)
+#define secp256k1_ec_point_add                  SECP256K1_RENAME(ec_point_add)
+
+/** The table of this copy's functions, for dispatch.c; goes after the #include of secp256k1.c. */
+#define SECP256K1_BACKEND_TABLE(name) \
+    const secp256k1_backend_t SECP256K1_RENAME(backend) = { \
+        name, \
+        secp256k1_start, \
+        secp256k1_stop, \
+        secp256k1_ecdsa_verify, \
+        secp256k1_ecdsa_sign, \
+        secp256k1_ecdsa_sign_compact, \
+        secp256k1_ecdsa_recover_compact, \
+        secp256k1_ecdsa_recover_compact_batch, \
+        secp256k1_ecdsa_seckey_verify, \
+        secp256k1_ecdsa_pubkey_verify, \
+        secp256k1_ecdsa_pubkey_create, \
+        secp256k1_ecdsa_pubkey_decompress, \
+        secp256k1_ecdsa_privkey_export, \
+        secp256k1_ecdsa_privkey_import, \
+        secp256k1_ecdsa_privkey_tweak_add, \
+        secp256k1_ecdsa_pubkey_tweak_add, \
+        secp256k1_ecdsa_privkey_tweak_mul, \
+        secp256k1_ecdsa_pubkey_tweak_mul, \
+        secp256k1_ec_point_valid, \
+        secp256k1_ec_point_mul, \
+        secp256k1_ec_point_add \
+    }
+
+#endif
+
+/** Which field implementations can be built here. GMP and 10x26 always can; 5x52 needs a 128-bit
+ *  integer type or, for the assembly version, an x86-64 target and yasm (HAVE_FIELD_5X52_ASM). */
+#if defined(HAVE_FIELD_5X52_ASM) && defined(__x86_64__)
+#define SECP256K1_HAVE_5X52_ASM 1
+#endif
+#if defined(__SIZEOF_INT128__)
+#define SECP256K1_HAVE_5X52_INT128 1
+#endif
+
+#endif
@@ -0,0 +1,14 @@
+// Copyright (c) 2013 Pieter Wuille
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// The library on the 10x26 field implementation; see backend.h.
+
+#define SECP256K1_BACKEND secp256k1_10x26
+#include "backend.h"
+
+#define USE_FIELD_10X26
+#define USE_FIELD_INV_BUILTIN
+#include "secp256k1.c"
+
+SECP256K1_BACKEND_TABLE("10x26");
@@ -0,0 +1,19 @@
+// Copyright (c) 2013 Pieter Wuille
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// The library on the 5x52-asm field implementation; see backend.h.
+
+#define SECP256K1_BACKEND secp256k1_5x52_asm
+#include "backend.h"
+
+#if SECP256K1_HAVE_5X52_ASM
+
+#define USE_FIELD_5X52
+#define USE_FIELD_5X52_ASM
+#define USE_FIELD_INV_BUILTIN
+#include "secp256k1.c"
+
+SECP256K1_BACKEND_TABLE("5x52-asm");
+
+#endif
@@ -0,0 +1,14 @@
+// Copyright (c) 2013 Pieter Wuille
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// The library on the gmp field implementation; see backend.h.
+
+#define SECP256K1_BACKEND secp256k1_gmp
+#include "backend.h"
+
+#define USE_FIELD_GMP
+#define USE_FIELD_INV_NUM
+#include "secp256k1.c"
+
+SECP256K1_BACKEND_TABLE("gmp");
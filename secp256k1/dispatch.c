@@ -0,0 +1,151 @@
+// Copyright (c) 2013 Pieter Wuille
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <stdlib.h>
+#include <string.h>
+#include "secp256k1.h"
+#include "backend.h"
+
+#if SECP256K1_HAVE_5X52_ASM
+extern const secp256k1_backend_t secp256k1_5x52_asm_backend;
+#endif
+#if SECP256K1_HAVE_5X52_INT128
+extern const secp256k1_backend_t secp256k1_5x52_int128_backend;
+#endif
+extern const secp256k1_backend_t secp256k1_10x26_backend;
+extern const secp256k1_backend_t secp256k1_gmp_backend;
+
+/** The backends built, in order of preference: 64-bit limbs where the machine has them, GMP last as
+ *  it pays for its generality on every operation. */
+static const secp256k1_backend_t * const secp256k1_backends_all[] = {
+#if SECP256K1_HAVE_5X52_ASM
+    &secp256k1_5x52_asm_backend,
+#endif
+#if SECP256K1_HAVE_5X52_INT128
+    &secp256k1_5x52_int128_backend,
+#endif
+    &secp256k1_10x26_backend,
+    &secp256k1_gmp_backend,
+    NULL
+};
+
+static const char *secp256k1_backend_names[sizeof(secp256k1_backends_all) / sizeof(secp256k1_backends_all[0])];
+
+static const secp256k1_backend_t *secp256k1_current = NULL;
+
+static const secp256k1_backend_t *secp256k1_backend_find(const char *name) {
+    for (int i = 0; secp256k1_backends_all[i]; i++)
+        if (!strcmp(secp256k1_backends_all[i]->name, name))
+            return secp256k1_backends_all[i];
+    return NULL;
+}
+
+const char * const *secp256k1_backends(void) {
+    for (int i = 0; secp256k1_backends_all[i]; i++)
+        secp256k1_backend_names[i] = secp256k1_backends_all[i]->name;
+    return secp256k1_backend_names;
+}
+
+const char *secp256k1_backend(void) {
+    return secp256k1_current ? secp256k1_current->name : secp256k1_backends_all[0]->name;
+}
+
+int secp256k1_set_backend(const char *name) {
+    const secp256k1_backend_t *b = secp256k1_backend_find(name);
+    if (!b)
+        return 0;
+    int started = secp256k1_current != NULL;
+    secp256k1_current = b;
+    if (started)
+        b->start();
+    return 1;
+}
+
+void secp256k1_start(void) {
+    if (secp256k1_current == NULL) {
+        const char *env = getenv("SECP256K1_BACKEND");
+        const secp256k1_backend_t *b = env ? secp256k1_backend_find(env) : NULL;
+        secp256k1_current = b ? b : secp256k1_backends_all[0];
+    }
+    secp256k1_current->start();
+}
+
+void secp256k1_stop(void) {
+    // Any of them may have been started, by secp256k1_set_backend; stopping is harmless for the rest.
+    for (int i = 0; secp256k1_backends_all[i]; i++)
+        secp256k1_backends_all[i]->stop();
+    secp256k1_current = NULL;
+}
+
+int secp256k1_ecdsa_verify(const unsigned char *msg, int msglen, const unsigned char *sig, int siglen, const unsigned char *pubkey, int pubkeylen) {
+    return secp256k1_current->ecdsa_verify(msg, msglen, sig, siglen, pubkey, pubkeylen);
+}
+
+int secp256k1_ecdsa_sign(const unsigned char *msg, int msglen, unsigned char *sig, int *siglen, const unsigned char *seckey, const unsigned char *nonce) {
+    return secp256k1_current->ecdsa_sign(msg, msglen, sig, siglen, seckey, nonce);
+}
+
+int secp256k1_ecdsa_sign_compact(const unsigned char *msg, int msglen, unsigned char *sig64, const unsigned char *seckey, const unsigned char *nonce, int *recid) {
+    return secp256k1_current->ecdsa_sign_compact(msg, msglen, sig64, seckey, nonce, recid);
+}
+
+int secp256k1_ecdsa_recover_compact(const unsigned char *msg, int msglen, const unsigned char *sig64, unsigned char *pubkey, int *pubkeylen, int compressed, int recid) {
+    return secp256k1_current->ecdsa_recover_compact(msg, msglen, sig64, pubkey, pubkeylen, compressed, recid);
+}
+
+int secp256k1_ecdsa_recover_compact_batch(int n, const unsigned char * const *msgs, const unsigned char * const *sig64s, unsigned char * const *pubkeys, int *pubkeylens, int compressed, const int *recids, int *results) {
+    return secp256k1_current->ecdsa_recover_compact_batch(n, msgs, sig64s, pubkeys, pubkeylens, compressed, recids, results);
+}
+
+int secp256k1_ecdsa_seckey_verify(const unsigned char *seckey) {
+    return secp256k1_current->ecdsa_seckey_verify(seckey);
+}
+
+int secp256k1_ecdsa_pubkey_verify(const unsigned char *pubkey, int pubkeylen) {
+    return secp256k1_current->ecdsa_pubkey_verify(pubkey, pubkeylen);
+}
+
+int secp256k1_ecdsa_pubkey_create(unsigned char *pubkey, int *pubkeylen, const unsigned char *seckey, int compressed) {
+    return secp256k1_current->ecdsa_pubkey_create(pubkey, pubkeylen, seckey, compressed);
+}
+
+int secp256k1_ecdsa_pubkey_decompress(unsigned char *pubkey, int *pubkeylen) {
+    return secp256k1_current->ecdsa_pubkey_decompress(pubkey, pubkeylen);
+}
+
+int secp256k1_ecdsa_privkey_export(const unsigned char *seckey, unsigned char *privkey, int *privkeylen, int compressed) {
+    return secp256k1_current->ecdsa_privkey_export(seckey, privkey, privkeylen, compressed);
+}
+
+int secp256k1_ecdsa_privkey_import(unsigned char *seckey, const unsigned char *privkey, int privkeylen) {
+    return secp256k1_current->ecdsa_privkey_import(seckey, privkey, privkeylen);
+}
+
+int secp256k1_ecdsa_privkey_tweak_add(unsigned char *seckey, const unsigned char *tweak) {
+    return secp256k1_current->ecdsa_privkey_tweak_add(seckey, tweak);
+}
+
+int secp256k1_ecdsa_pubkey_tweak_add(unsigned char *pubkey, int pubkeylen, const unsigned char *tweak) {
+    return secp256k1_current->ecdsa_pubkey_tweak_add(pubkey, pubkeylen, tweak);
+}
+
+int secp256k1_ecdsa_privkey_tweak_mul(unsigned char *seckey, const unsigned char *tweak) {
+    return secp256k1_current->ecdsa_privkey_tweak_mul(seckey, tweak);
+}
+
+int secp256k1_ecdsa_pubkey_tweak_mul(unsigned char *pubkey, int pubkeylen, const unsigned char *tweak) {
+    return secp256k1_current->ecdsa_pubkey_tweak_mul(pubkey, pubkeylen, tweak);
+}
+
+int secp256k1_ec_point_valid(const uint64_t *x, const uint64_t *y) {
+    return secp256k1_current->ec_point_valid(x, y);
+}
+
+int secp256k1_ec_point_mul(uint64_t *rx, uint64_t *ry, const uint64_t *x, const uint64_t *y, const uint64_t *n) {
+    return secp256k1_current->ec_point_mul(rx, ry, x, y, n);
+}
+
+int secp256k1_ec_point_add(uint64_t *rx, uint64_t *ry, const uint64_t *ax, const uint64_t *ay, const uint64_t *bx, const uint64_t *by) {
+    return secp256k1_current->ec_point_add(rx, ry, ax, ay, bx, by);
+}
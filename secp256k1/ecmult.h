@@ -15,5 +15,8 @@ static void secp256k1_ecmult_stop(void);
 static void secp256k1_ecmult_gen(secp256k1_gej_t *r, const secp256k1_num_t *a);
 /** Double multiply: R = na*A + ng*G */
 static void secp256k1_ecmult(secp256k1_gej_t *r, const secp256k1_gej_t *a, const secp256k1_num_t *na, const secp256k1_num_t *ng);
+/** Double multiply a batch: R[i] = na[i]*A[i] + ng[i]*G. The odd multiples of all the A[i] are brought
+ *  into affine coordinates together, for one field inversion, so every addition is a mixed one. */
+static void secp256k1_ecmult_batch(size_t len, secp256k1_gej_t r[], const secp256k1_gej_t a[], const secp256k1_num_t na[], const secp256k1_num_t ng[]);
 
 #endif
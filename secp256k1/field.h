@@ -89,6 +89,11 @@ void static secp256k1_fe_inv(secp256k1_fe_t *r, const secp256k1_fe_t *a);
 /** Potentially faster version of secp256k1_fe_inv, without constant-time guarantee. */
 void static secp256k1_fe_inv_var(secp256k1_fe_t *r, const secp256k1_fe_t *a);
 
+/** Calculate the (modular) inverses of a batch of field elements, with a single inversion and three
+ *  multiplications per element (Montgomery's trick). The inputs must all be non-zero, and r must
+ *  not overlap a. No constant-time guarantee. */
+void static secp256k1_fe_inv_all_var(size_t len, secp256k1_fe_t r[], const secp256k1_fe_t a[]);
+
 
 /** Convert a field element to a hexadecimal string. */
 void static secp256k1_fe_get_hex(char *r, int *rlen, const secp256k1_fe_t *a);
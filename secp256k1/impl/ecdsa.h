@@ -110,7 +110,8 @@ int static secp256k1_ecdsa_sig_recompute(secp256k1_num_t *r2, const secp256k1_ec
     return ret;
 }
 
-int static secp256k1_ecdsa_sig_recover(const secp256k1_ecdsa_sig_t *sig, secp256k1_ge_t *pubkey, const secp256k1_num_t *message, int recid) {
+/** Find the point R whose x coordinate (mod the order) is sig->r, as chosen by recid. */
+int static secp256k1_ecdsa_sig_recover_r(secp256k1_gej_t *xj, const secp256k1_ecdsa_sig_t *sig, int recid) {
     const secp256k1_ge_consts_t *c = secp256k1_ge_consts;
 
     if (secp256k1_num_is_neg(&sig->r) || secp256k1_num_is_neg(&sig->s))
@@ -137,8 +138,16 @@ int static secp256k1_ecdsa_sig_recover(const secp256k1_ecdsa_sig_t *sig, secp256
     secp256k1_ge_set_xo(&x, &fx, recid & 1);
     if (!secp256k1_ge_is_valid(&x))
         return 0;
+    secp256k1_gej_set_ge(xj, &x);
+    return 1;
+}
+
+int static secp256k1_ecdsa_sig_recover(const secp256k1_ecdsa_sig_t *sig, secp256k1_ge_t *pubkey, const secp256k1_num_t *message, int recid) {
+    const secp256k1_ge_consts_t *c = secp256k1_ge_consts;
+
     secp256k1_gej_t xj;
-    secp256k1_gej_set_ge(&xj, &x);
+    if (!secp256k1_ecdsa_sig_recover_r(&xj, sig, recid))
+        return 0;
     secp256k1_num_t rn, u1, u2;
     secp256k1_num_init(&rn);
     secp256k1_num_init(&u1);
@@ -156,6 +165,77 @@ int static secp256k1_ecdsa_sig_recover(const secp256k1_ecdsa_sig_t *sig, secp256
     return 1;
 }
 
+/** As secp256k1_ecdsa_sig_recover, for each of len signatures; ok[i] is set to whether pubkey[i] was
+ *  recovered. The inverses of the r values are found together (Montgomery's trick, mod the order), as
+ *  are the affine forms of the results, and the multiplications share their table conversion.
+ *  Returns the number recovered. */
+int static secp256k1_ecdsa_sig_recover_batch(size_t len, const secp256k1_ecdsa_sig_t sig[], secp256k1_ge_t pubkey[], const secp256k1_num_t message[], const int recid[], int ok[]) {
+    const secp256k1_ge_consts_t *c = secp256k1_ge_consts;
+
+    // Those that pass the checks go on, packed into the first count entries.
+    secp256k1_gej_t *xj = (secp256k1_gej_t*)malloc(sizeof(secp256k1_gej_t) * len);
+    size_t *index = (size_t*)malloc(sizeof(size_t) * len);
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        ok[i] = secp256k1_ecdsa_sig_recover_r(&xj[count], &sig[i], recid[i]);
+        if (ok[i])
+            index[count++] = i;
+    }
+
+    // prefix[k] = r[0]*...*r[k] (mod order); one inversion, then each inverse is peeled off in turn.
+    secp256k1_num_t *prefix = (secp256k1_num_t*)malloc(sizeof(secp256k1_num_t) * (count + 1));
+    secp256k1_num_t *u1 = (secp256k1_num_t*)malloc(sizeof(secp256k1_num_t) * (count + 1));
+    secp256k1_num_t *u2 = (secp256k1_num_t*)malloc(sizeof(secp256k1_num_t) * (count + 1));
+    for (size_t k = 0; k < count; k++) {
+        secp256k1_num_init(&prefix[k]);
+        secp256k1_num_init(&u1[k]);
+        secp256k1_num_init(&u2[k]);
+        if (k)
+            secp256k1_num_mod_mul(&prefix[k], &prefix[k-1], &sig[index[k]].r, &c->order);
+        else
+            secp256k1_num_copy(&prefix[k], &sig[index[k]].r);
+    }
+    if (count) {
+        secp256k1_num_t inv, rn;
+        secp256k1_num_init(&inv);
+        secp256k1_num_init(&rn);
+        secp256k1_num_mod_inverse(&inv, &prefix[count-1], &c->order);
+        for (size_t k = count; k-- > 0;) {
+            if (k) {
+                secp256k1_num_mod_mul(&rn, &prefix[k-1], &inv, &c->order);
+                secp256k1_num_mod_mul(&inv, &inv, &sig[index[k]].r, &c->order);
+            } else {
+                secp256k1_num_copy(&rn, &inv);
+            }
+            secp256k1_num_mod_mul(&u1[k], &rn, &message[index[k]], &c->order);
+            secp256k1_num_sub(&u1[k], &c->order, &u1[k]);
+            secp256k1_num_mod_mul(&u2[k], &rn, &sig[index[k]].s, &c->order);
+        }
+        secp256k1_num_free(&inv);
+        secp256k1_num_free(&rn);
+    }
+
+    secp256k1_gej_t *qj = (secp256k1_gej_t*)malloc(sizeof(secp256k1_gej_t) * (count + 1));
+    secp256k1_ge_t *q = (secp256k1_ge_t*)malloc(sizeof(secp256k1_ge_t) * (count + 1));
+    secp256k1_ecmult_batch(count, qj, xj, u2, u1);
+    secp256k1_ge_set_all_gej_var(count, q, qj);
+    for (size_t k = 0; k < count; k++) {
+        pubkey[index[k]] = q[k];
+        secp256k1_num_free(&prefix[k]);
+        secp256k1_num_free(&u1[k]);
+        secp256k1_num_free(&u2[k]);
+    }
+
+    free(q);
+    free(qj);
+    free(u2);
+    free(u1);
+    free(prefix);
+    free(index);
+    free(xj);
+    return count;
+}
+
 int static secp256k1_ecdsa_sig_verify(const secp256k1_ecdsa_sig_t *sig, const secp256k1_ge_t *pubkey, const secp256k1_num_t *message) {
     secp256k1_num_t r2;
     secp256k1_num_init(&r2);
@@ -256,4 +256,67 @@ void static secp256k1_ecmult(secp256k1_gej_t *r, const secp256k1_gej_t *a, const
     secp256k1_num_free(&ng_128);
 }
 
+void static secp256k1_ecmult_batch(size_t len, secp256k1_gej_t r[], const secp256k1_gej_t a[], const secp256k1_num_t na[], const secp256k1_num_t ng[]) {
+#ifdef USE_ENDOMORPHISM
+    // The lambda tables would need converting too; not worth it for now.
+    for (size_t k = 0; k < len; k++)
+        secp256k1_ecmult(&r[k], &a[k], &na[k], &ng[k]);
+#else
+    const secp256k1_ecmult_consts_t *c = secp256k1_ecmult_consts;
+    const int tsize = ECMULT_TABLE_SIZE(WINDOW_A);
+
+    // calculate odd multiples of each a, then convert them all to affine at once
+    secp256k1_gej_t *prej = (secp256k1_gej_t*)malloc(sizeof(secp256k1_gej_t) * tsize * len);
+    secp256k1_ge_t *pre = (secp256k1_ge_t*)malloc(sizeof(secp256k1_ge_t) * tsize * len);
+    for (size_t k = 0; k < len; k++)
+        secp256k1_ecmult_table_precomp_gej(&prej[k * tsize], &a[k], WINDOW_A);
+    secp256k1_ge_set_all_gej_var(tsize * len, pre, prej);
+    free(prej);
+
+    for (size_t k = 0; k < len; k++) {
+        const secp256k1_ge_t *pre_a = &pre[k * tsize];
+
+        // build wnaf representation for na.
+        int wnaf_na[257];     int bits_na     = secp256k1_ecmult_wnaf(wnaf_na,     &na[k],  WINDOW_A);
+        int bits = bits_na;
+
+        // split ng into ng_1 and ng_128 (where gn = gn_1 + gn_128*2^128, and gn_1 and gn_128 are ~128 bit)
+        secp256k1_num_t ng_1, ng_128;
+        secp256k1_num_init(&ng_1);
+        secp256k1_num_init(&ng_128);
+        secp256k1_num_split(&ng_1, &ng_128, &ng[k], 128);
+
+        // Build wnaf representation for ng_1 and ng_128
+        int wnaf_ng_1[129];   int bits_ng_1   = secp256k1_ecmult_wnaf(wnaf_ng_1,   &ng_1,   WINDOW_G);
+        int wnaf_ng_128[129]; int bits_ng_128 = secp256k1_ecmult_wnaf(wnaf_ng_128, &ng_128, WINDOW_G);
+        if (bits_ng_1 > bits) bits = bits_ng_1;
+        if (bits_ng_128 > bits) bits = bits_ng_128;
+
+        secp256k1_gej_set_infinity(&r[k]);
+        secp256k1_ge_t tmpa;
+
+        for (int i=bits-1; i>=0; i--) {
+            secp256k1_gej_double(&r[k], &r[k]);
+            int n;
+            if (i < bits_na && (n = wnaf_na[i])) {
+                ECMULT_TABLE_GET_GE(&tmpa, pre_a, n, WINDOW_A);
+                secp256k1_gej_add_ge(&r[k], &r[k], &tmpa);
+            }
+            if (i < bits_ng_1 && (n = wnaf_ng_1[i])) {
+                ECMULT_TABLE_GET_GE(&tmpa, c->pre_g, n, WINDOW_G);
+                secp256k1_gej_add_ge(&r[k], &r[k], &tmpa);
+            }
+            if (i < bits_ng_128 && (n = wnaf_ng_128[i])) {
+                ECMULT_TABLE_GET_GE(&tmpa, c->pre_g_128, n, WINDOW_G);
+                secp256k1_gej_add_ge(&r[k], &r[k], &tmpa);
+            }
+        }
+
+        secp256k1_num_free(&ng_1);
+        secp256k1_num_free(&ng_128);
+    }
+    free(pre);
+#endif
+}
+
 #endif
@@ -144,6 +144,24 @@ void static secp256k1_fe_inv_var(secp256k1_fe_t *r, const secp256k1_fe_t *a) {
 #endif
 }
 
+void static secp256k1_fe_inv_all_var(size_t len, secp256k1_fe_t r[], const secp256k1_fe_t a[]) {
+    if (len < 1)
+        return;
+
+    // r[i] = a[0]*...*a[i]
+    r[0] = a[0];
+    for (size_t i = 1; i < len; i++)
+        secp256k1_fe_mul(&r[i], &r[i-1], &a[i]);
+
+    // u = 1/(a[0]*...*a[i]), working down; each step peels off one inverse.
+    secp256k1_fe_t u; secp256k1_fe_inv_var(&u, &r[len-1]);
+    for (size_t i = len-1; i > 0; i--) {
+        secp256k1_fe_mul(&r[i], &r[i-1], &u);
+        secp256k1_fe_mul(&u, &u, &a[i]);
+    }
+    r[0] = u;
+}
+
 void static secp256k1_fe_start(void) {
     static const unsigned char secp256k1_fe_consts_p[] = {
         0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,0xFF,
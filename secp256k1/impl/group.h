@@ -6,6 +6,7 @@
 #define _SECP256K1_GROUP_IMPL_H_
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "../num.h"
 #include "../field.h"
@@ -66,6 +67,31 @@ void static secp256k1_ge_set_gej(secp256k1_ge_t *r, secp256k1_gej_t *a) {
     r->y = a->y;
 }
 
+void static secp256k1_ge_set_all_gej_var(size_t len, secp256k1_ge_t r[], const secp256k1_gej_t a[]) {
+    size_t count = 0;
+    secp256k1_fe_t *az = (secp256k1_fe_t*)malloc(sizeof(secp256k1_fe_t) * len);
+    for (size_t i = 0; i < len; i++)
+        if (!a[i].infinity)
+            az[count++] = a[i].z;
+
+    secp256k1_fe_t *azi = (secp256k1_fe_t*)malloc(sizeof(secp256k1_fe_t) * count);
+    secp256k1_fe_inv_all_var(count, azi, az);
+    free(az);
+
+    count = 0;
+    for (size_t i = 0; i < len; i++) {
+        r[i].infinity = a[i].infinity;
+        if (!a[i].infinity) {
+            secp256k1_fe_t *zi = &azi[count++];
+            secp256k1_fe_t zi2; secp256k1_fe_sqr(&zi2, zi);
+            secp256k1_fe_t zi3; secp256k1_fe_mul(&zi3, &zi2, zi);
+            secp256k1_fe_mul(&r[i].x, &a[i].x, &zi2);
+            secp256k1_fe_mul(&r[i].y, &a[i].y, &zi3);
+        }
+    }
+    free(azi);
+}
+
 void static secp256k1_gej_set_infinity(secp256k1_gej_t *r) {
     r->infinity = 1;
 }
@@ -111,6 +111,33 @@ int secp256k1_ecdsa_recover_compact(const unsigned char *msg, int msglen, const
     return ret;
 }
 
+int secp256k1_ecdsa_recover_compact_batch(int n, const unsigned char * const *msgs, const unsigned char * const *sig64s, unsigned char * const *pubkeys, int *pubkeylens, int compressed, const int *recids, int *results) {
+    if (n <= 0)
+        return 0;
+    secp256k1_num_t *m = (secp256k1_num_t*)malloc(sizeof(secp256k1_num_t) * n);
+    secp256k1_ecdsa_sig_t *sig = (secp256k1_ecdsa_sig_t*)malloc(sizeof(secp256k1_ecdsa_sig_t) * n);
+    secp256k1_ge_t *q = (secp256k1_ge_t*)malloc(sizeof(secp256k1_ge_t) * n);
+    for (int i = 0; i < n; i++) {
+        secp256k1_num_init(&m[i]);
+        secp256k1_ecdsa_sig_init(&sig[i]);
+        secp256k1_num_set_bin(&sig[i].r, sig64s[i], 32);
+        secp256k1_num_set_bin(&sig[i].s, sig64s[i] + 32, 32);
+        secp256k1_num_set_bin(&m[i], msgs[i], 32);
+    }
+
+    int ret = secp256k1_ecdsa_sig_recover_batch(n, sig, q, m, recids, results);
+    for (int i = 0; i < n; i++) {
+        if (results[i])
+            secp256k1_ecdsa_pubkey_serialize(&q[i], pubkeys[i], &pubkeylens[i], compressed);
+        secp256k1_ecdsa_sig_free(&sig[i]);
+        secp256k1_num_free(&m[i]);
+    }
+    free(q);
+    free(sig);
+    free(m);
+    return ret;
+}
+
 int secp256k1_ecdsa_seckey_verify(const unsigned char *seckey) {
     secp256k1_num_t sec;
     secp256k1_num_init(&sec);
@@ -267,3 +294,96 @@ int secp256k1_ecdsa_privkey_import(unsigned char *seckey, const unsigned char *p
     secp256k1_num_free(&key);
     return ret;
 }
+
+void static secp256k1_words_get_b32(unsigned char *r, const uint64_t *a) {
+    for (int i = 0; i < 32; i++)
+        r[31 - i] = a[i / 8] >> (8 * (i % 8));
+}
+
+void static secp256k1_words_set_b32(uint64_t *r, const unsigned char *a) {
+    for (int i = 0; i < 4; i++) {
+        r[i] = 0;
+        for (int j = 0; j < 8; j++)
+            r[i] |= (uint64_t)a[31 - 8 * i - j] << (8 * j);
+    }
+}
+
+/** Set a group element from coordinates given as words, (0,0) being infinity. Returns 0 unless the
+ *  coordinates are both less than the field size and, other than for infinity, on the curve. */
+int static secp256k1_ge_set_words(secp256k1_ge_t *r, const uint64_t *x, const uint64_t *y) {
+    if (!(x[0] | x[1] | x[2] | x[3] | y[0] | y[1] | y[2] | y[3])) {
+        secp256k1_ge_set_infinity(r);
+        return 1;
+    }
+    static const uint64_t p0 = 0xFFFFFFFEFFFFFC2FULL;
+    if ((x[3] & x[2] & x[1]) == ~(uint64_t)0 && x[0] >= p0)
+        return 0;
+    if ((y[3] & y[2] & y[1]) == ~(uint64_t)0 && y[0] >= p0)
+        return 0;
+    unsigned char b[32];
+    secp256k1_fe_t fx, fy;
+    secp256k1_words_get_b32(b, x);
+    secp256k1_fe_set_b32(&fx, b);
+    secp256k1_words_get_b32(b, y);
+    secp256k1_fe_set_b32(&fy, b);
+    secp256k1_ge_set_xy(r, &fx, &fy);
+    return secp256k1_ge_is_valid(r);
+}
+
+void static secp256k1_gej_get_words(uint64_t *rx, uint64_t *ry, secp256k1_gej_t *a) {
+    if (secp256k1_gej_is_infinity(a)) {
+        memset(rx, 0, 32);
+        memset(ry, 0, 32);
+        return;
+    }
+    secp256k1_ge_t p;
+    secp256k1_ge_set_gej(&p, a);
+    secp256k1_fe_normalize(&p.x);
+    secp256k1_fe_normalize(&p.y);
+    unsigned char b[32];
+    secp256k1_fe_get_b32(b, &p.x);
+    secp256k1_words_set_b32(rx, b);
+    secp256k1_fe_get_b32(b, &p.y);
+    secp256k1_words_set_b32(ry, b);
+}
+
+int secp256k1_ec_point_valid(const uint64_t *x, const uint64_t *y) {
+    secp256k1_ge_t p;
+    return secp256k1_ge_set_words(&p, x, y) && !secp256k1_ge_is_infinity(&p);
+}
+
+int secp256k1_ec_point_mul(uint64_t *rx, uint64_t *ry, const uint64_t *x, const uint64_t *y, const uint64_t *n) {
+    secp256k1_ge_t p;
+    if (!secp256k1_ge_set_words(&p, x, y))
+        return 0;
+    unsigned char b[32];
+    secp256k1_words_get_b32(b, n);
+    secp256k1_num_t factor, zero;
+    secp256k1_num_init(&factor);
+    secp256k1_num_init(&zero);
+    secp256k1_num_set_bin(&factor, b, 32);
+    secp256k1_num_mod(&factor, &secp256k1_ge_consts->order);
+    secp256k1_num_set_int(&zero, 0);
+    secp256k1_gej_t pt;
+    secp256k1_gej_set_ge(&pt, &p);
+    if (secp256k1_num_is_zero(&factor))
+        secp256k1_gej_set_infinity(&pt);
+    else if (!secp256k1_ge_is_infinity(&p))
+        secp256k1_ecmult(&pt, &pt, &factor, &zero);
+    secp256k1_num_free(&zero);
+    secp256k1_num_free(&factor);
+    secp256k1_gej_get_words(rx, ry, &pt);
+    return 1;
+}
+
+int secp256k1_ec_point_add(uint64_t *rx, uint64_t *ry, const uint64_t *ax, const uint64_t *ay, const uint64_t *bx, const uint64_t *by) {
+    secp256k1_ge_t a, b;
+    if (!secp256k1_ge_set_words(&a, ax, ay) || !secp256k1_ge_set_words(&b, bx, by))
+        return 0;
+    secp256k1_gej_t aj, bj;
+    secp256k1_gej_set_ge(&aj, &a);
+    secp256k1_gej_set_ge(&bj, &b);
+    secp256k1_gej_add(&aj, &aj, &bj);
+    secp256k1_gej_get_words(rx, ry, &aj);
+    return 1;
+}
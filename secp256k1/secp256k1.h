@@ -1,6 +1,8 @@
 #ifndef _SECP256K1_
 #define _SECP256K1_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -17,6 +19,24 @@ void secp256k1_start(void);
  */
 void secp256k1_stop(void);
 
+/** The field arithmetic implementations built in, by name, fastest first; NULL-terminated.
+ *  Each is a complete copy of the library, giving identical results.
+ */
+const char * const *secp256k1_backends(void);
+
+/** The name of the implementation in use, or to be used once secp256k1_start() is called. Unless
+ *  chosen with secp256k1_set_backend() or the SECP256K1_BACKEND environment variable, it's the
+ *  first of secp256k1_backends().
+ */
+const char *secp256k1_backend(void);
+
+/** Switch to the named implementation, starting it if the library has been started already.
+ *  Like secp256k1_start(), it cannot run in parallel with any other functions.
+ *  Returns: 1: switched
+ *           0: no such implementation built
+ */
+int secp256k1_set_backend(const char *name);
+
 /** Verify an ECDSA signature.
  *  Returns: 1: correct signature
  *           0: incorrect signature
@@ -75,6 +95,23 @@ int secp256k1_ecdsa_recover_compact(const unsigned char *msg, int msglen,
                                     unsigned char *pubkey, int *pubkeylen,
                                     int compressed, int recid);
 
+/** Recover the ECDSA public keys from a number of compact signatures at once. Cheaper than calling
+ *  secp256k1_ecdsa_recover_compact for each, as the inversions are shared across the batch.
+ *  Returns: the number of public keys succesfully recovered.
+ *  In:      n:          the number of signatures
+ *           msgs:       the n messages assumed to be signed, each 32 bytes
+ *           sig64s:     the n signatures, each a 64 byte array
+ *           compressed: whether to recover compressed or uncompressed pubkeys
+ *           recids:     the n recovery ids
+ *  Out:     pubkeys:    n pointers to 33 or 65 byte arrays to put the pubkeys.
+ *           pubkeylens: n ints that will contain the pubkey lengths.
+ *           results:    n ints that will be 1 where the pubkey was recovered and 0 otherwise.
+ */
+int secp256k1_ecdsa_recover_compact_batch(int n, const unsigned char * const *msgs,
+                                          const unsigned char * const *sig64s,
+                                          unsigned char * const *pubkeys, int *pubkeylens,
+                                          int compressed, const int *recids, int *results);
+
 /** Verify an ECDSA secret key.
  *  Returns: 1: secret key is valid
  *           0: secret key is invalid
@@ -114,6 +151,30 @@ int secp256k1_ecdsa_pubkey_tweak_add(unsigned char *pubkey, int pubkeylen, const
 int secp256k1_ecdsa_privkey_tweak_mul(unsigned char *seckey, const unsigned char *tweak);
 int secp256k1_ecdsa_pubkey_tweak_mul(unsigned char *pubkey, int pubkeylen, const unsigned char *tweak);
 
+/** Point arithmetic for callers that hold 256-bit integers natively (the Ethereum VM), saving them
+ *  serialising points to bytes and back. Numbers are four 64-bit words, least significant first;
+ *  points are affine, (0,0) standing for the point at infinity. A point is valid if both coordinates
+ *  are less than the field size and it lies on the curve.
+ */
+
+/** Check a point.
+ *  Returns: 1: (x,y) is a valid point other than the point at infinity
+ *           0: otherwise
+ */
+int secp256k1_ec_point_valid(const uint64_t *x, const uint64_t *y);
+
+/** Multiply a point by a number, which is taken modulo the group order.
+ *  Returns: 1: (rx,ry) is set to n*(x,y)
+ *           0: (x,y) isn't valid nor the point at infinity; (rx,ry) is untouched
+ */
+int secp256k1_ec_point_mul(uint64_t *rx, uint64_t *ry, const uint64_t *x, const uint64_t *y, const uint64_t *n);
+
+/** Add two points.
+ *  Returns: 1: (rx,ry) is set to (ax,ay) + (bx,by)
+ *           0: either point isn't valid nor the point at infinity; (rx,ry) is untouched
+ */
+int secp256k1_ec_point_add(uint64_t *rx, uint64_t *ry, const uint64_t *ax, const uint64_t *ay, const uint64_t *bx, const uint64_t *by);
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,11 +30,133 @@ using namespace eth;
 
 int cryptoTest()
 {
-	// Test transaction.
-	bytes tx = fromUserHex("88005401010101010101010101010101010101010101011f0de0b6b3a76400001ce8d4a5100080181c373130a009ba1f10285d4e659568bfcfec85067855c5a3c150100815dad4ef98fd37cf0593828c89db94bd6c64e210a32ef8956eaa81ea9307194996a3b879441f5d");
+	// SHA-3, singly and batched, over lengths either side of the block boundaries.
+	assert(asHex(sha3(bytes()).asBytes()) == "c5d2460186f7233c927e7db2dcc703c0e500b653ca82273b7bfad8045d85a470");
+	{
+		bytes data(300);
+		for (unsigned i = 0; i < data.size(); ++i)
+			data[i] = (byte)(i * 7);
+		std::vector<bytesConstRef> inputs;
+		for (unsigned l = 0; l <= data.size(); l += 3)
+			inputs.push_back(bytesConstRef(&data).cropped(0, l));
+		h256s hashes(inputs.size());
+		sha3Batch(inputs, hashes.data());
+		for (unsigned i = 0; i < inputs.size(); ++i)
+			assert(hashes[i] == sha3(inputs[i]));
+	}
+
+	// Fixed hashes, handled a word at a time, still order, combine and convert as their big-endian bytes do.
+	{
+		mt19937_64 rng(42);
+		for (unsigned i = 0; i < 1000; ++i)
+		{
+			h256 a;
+			h256 b;
+			for (unsigned j = 0; j < 32; ++j)
+			{
+				// Keep the bytes small half the time, so some differ only late on.
+				a[j] = (byte)(rng() & (i % 2 ? 1 : 255));
+				b[j] = (byte)(rng() & (i % 2 ? 1 : 255));
+			}
+			assert((a < b) == (memcmp(a.data(), b.data(), 32) < 0) && (a == b) == !memcmp(a.data(), b.data(), 32));
+			assert((u256)a == fromBigEndian<u256>(a.asArray()) && h256((u256)a) == a && ((a ^ b) ^ b) == a);
+			Address c(a.data());
+			Address d(b.data());
+			assert((c < d) == (memcmp(c.data(), d.data(), 20) < 0) && Address((u160)c) == c);
+		}
+		assert(!h256() && h256(1) && !Address() && Address(1) && Address(1)[19] == 1);
+	}
+
+	// Batch sender recovery agrees with recovering one at a time, and leaves a bad signature's sender null.
+	{
+		std::vector<Transaction> txs(40);
+		for (unsigned i = 0; i < txs.size(); ++i)
+		{
+			txs[i].nonce = i;
+			txs[i].value = i * 1000;
+			txs[i].receiveAddress = toAddress(sha3(toString(i)));
+			txs[i].sign(sha3("batch" + toString(i % 7)));
+		}
+		txs[5].vrs.s = 0;
+		auto senders = recoverSenders(txs);
+		for (unsigned i = 0; i < txs.size(); ++i)
+			assert(i == 5 ? !senders[i] : senders[i] == toAddress(sha3("batch" + toString(i % 7))));
+	}
+
+	// A transaction read in place agrees with one decoded, even where a data item isn't encoded as it would be;
+	// and refuses what decoding would.
+	{
+		Transaction t;
+		t.nonce = 3;
+		t.value = 100;
+		t.fee = 7;
+		t.receiveAddress = toAddress(sha3("view"));
+		t.data = { 0, 1, 0x7f, 0x80, (u256)sha3("data") };
+		t.sign(sha3("view"));
+		bytes r = t.rlp();
+		TransactionView v(&r);
+		assert(v.nonce() == 3 && v.value() == 100 && v.fee() == 7 && v.receiveAddress() == t.receiveAddress && v.data().itemCount() == 5);
+		assert(v.sha3() == t.sha3() && v.signingHash() == t.sha3(false) && v.sender() == t.sender());
+
+		// The same, but with the data item 5 given a needless length prefix.
+		RLPStream s(8);
+		s << t.nonce << t.receiveAddress << t.value << t.fee;
+		s.appendList(1).appendRaw(bytes{0x81, 5});
+		s << t.vrs.v << t.vrs.r << t.vrs.s;
+		bytes odd = s.out();
+		assert(TransactionView(&odd).signingHash() == Transaction(odd).sha3(false));
+
+		// Both hash it as it'd be mined, not as it came; likewise with the address cut short.
+		Transaction canon = t;
+		canon.data = { 5 };
+		canon.noteChanged();
+		assert(TransactionView(&odd).sha3() == canon.sha3() && Transaction(odd).sha3() == canon.sha3() && canon.sha3() != sha3(odd));
+		RLPStream sh(8);
+		sh << t.nonce << bytesConstRef(t.receiveAddress.data() + 1, 19) << t.value << t.fee;
+		sh.appendList(1) << 5;
+		sh << t.vrs.v << t.vrs.r << t.vrs.s;
+		canon.receiveAddress[0] = 0;
+		canon.noteChanged();
+		bytes shortAddress = sh.out();
+		assert(TransactionView(&shortAddress).sha3() == canon.sha3() && Transaction(shortAddress).sha3() == canon.sha3());
+
+		RLPStream b(8);
+		b << t.nonce << t.receiveAddress << t.value << t.fee;
+		b.appendList(1).appendRaw(bytes{0x82, 0, 5});
+		b << t.vrs.v << t.vrs.r << t.vrs.s;
+		bytes bad = b.out();
+		bool refused = false;
+		try { TransactionView w(&bad); } catch (...) { refused = true; }
+		bool refusedDecoded = false;
+		try { Transaction d(bad); } catch (...) { refusedDecoded = true; }
+		assert(refused && refusedDecoded);
+	}
+
+	// A decoded transaction's hash is that of its encoding; a changed one is rehashed once noted.
+	{
+		Transaction t;
+		t.value = 1;
+		t.sign(sha3("hash"));
+		bytes r = t.rlp();
+		Transaction d(r);
+		assert(d.sha3() == sha3(r) && d.sha3() == t.sha3() && d.sha3(false) == t.sha3(false));
+		d.value = 2;
+		d.noteChanged();
+		assert(d.sha3() != t.sha3() && d.sha3(false) != t.sha3(false));
+	}
+
+	// Test transaction: signed, encoded and decoded again, its sender recovered.
+	Transaction t1;
+	t1.nonce = 0;
+	t1.fee = 0;
+	t1.value = 1;
+	t1.receiveAddress = toAddress(sha3("456"));
+	t1.sign(sha3("123"));
+	bytes tx = t1.rlp();
 	cout << "TX: " << RLP(tx) << endl;
 
 	Transaction t2(tx);
+	assert(t2.sender() == toAddress(sha3("123")));
 	cout << "SENDER: " << hex << t2.sender() << dec << endl;
 
 	secp256k1_start();
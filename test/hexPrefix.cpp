@@ -52,6 +52,33 @@ int hexPrefixTest()
 	assert(asHex(hexPrefixEncode({1, 2, 3, 4, 5}, true)) == "312345");
 	assert(asHex(hexPrefixEncode({1, 2, 3, 4}, true)) == "201234");
 
+	// The packed forms must agree with the nibble vector, whatever the alignment.
+	bytes d = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef, 0x01, 0x23};
+	bytes h = toHex(asString(d));
+	for (unsigned o = 0; o < 4; ++o)
+		for (unsigned b = 0; b + o <= h.size(); ++b)
+			for (unsigned e = b; e + o <= h.size(); ++e)
+				assert(hexPrefixEncode(NibbleSlice(&d, o), true, b, e) == hexPrefixEncode(h, true, b + o, e + o));
+	for (unsigned o1 = 0; o1 < 3; ++o1)
+		for (unsigned o2 = 0; o2 < 3; ++o2)
+			assert(hexPrefixEncode(NibbleSlice(&d, o1), NibbleSlice(bytesConstRef(&d).cropped(5), o2), false) == hexPrefixEncode(h + bytes(h.begin() + 10 + o2, h.end()), false, o1));
+
+	// Change one nibble at a time and check the shared length from every pair of offsets against a nibble-wise count.
+	for (unsigned i = 0; i < h.size(); ++i)
+	{
+		bytes d2 = d;
+		d2[i / 2] ^= (i & 1) ? 0x01 : 0x10;
+		for (unsigned o1 = 0; o1 < h.size(); ++o1)
+			for (unsigned o2 = 0; o2 < h.size(); ++o2)
+			{
+				NibbleSlice s1(&d, o1);
+				NibbleSlice s2(&d2, o2);
+				unsigned n = 0;
+				for (; n < s1.size() && n < s2.size() && s1[n] == s2[n]; ++n) {}
+				assert(s1.shared(s2) == n);
+			}
+	}
+
 	return 0;
 }
 
@@ -28,7 +28,9 @@ int daggerTest();
 int cryptoTest();
 int stateTest();
 int hexPrefixTest();
+int vmTest();
 int peerTest(int argc, char** argv);
+int bloomTest();
 
 #include <BlockInfo.h>
 using namespace eth;
@@ -44,9 +46,11 @@ int main(int argc, char** argv)
 	hexPrefixTest();
 	rlpTest();
 	trieTest();
+	vmTest();
 //	daggerTest();
-//	cryptoTest();
-//	stateTest();
+	cryptoTest();
+	stateTest();
+	bloomTest();
 //	peerTest(argc, argv);
 	return 0;
 }
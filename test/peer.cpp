@@ -26,6 +26,21 @@ using namespace std;
 using namespace eth;
 using boost::asio::ip::tcp;
 
+int bloomTest()
+{
+	// The most recent of what's been added to a rolling filter are always found, and what never was seldom is.
+	RollingBloom f(1000);
+	for (unsigned i = 0; i < 5000; ++i)
+		f.insert(sha3(toString(i)));
+	for (unsigned i = 4000; i < 5000; ++i)
+		assert(f.count(sha3(toString(i))));
+	unsigned wrong = 0;
+	for (unsigned i = 10000; i < 20000; ++i)
+		wrong += f.count(sha3(toString(i)));
+	assert(wrong < 50);
+	return 0;
+}
+
 int peerTest(int argc, char** argv)
 {
 	short listenPort = 30303;
@@ -42,6 +42,35 @@ int rlpTest()
 	assert(twoItemList[1] == "dog");
 	assert(asString(rlpList(15, "dog")) == "\xc5\x0f\x83""dog");
 
+	// long list, whatever size it's guessed to be beforehand.
+	{
+		bytes expected;
+		for (unsigned hint: {0, 10, 80, 1000})
+		{
+			RLPStream s(20, hint);
+			for (unsigned i = 0; i < 20; ++i)
+				s << "dog";
+			assert(s.out().size() == 82 && s.out()[0] == 0xf8 && s.out()[1] == 80);
+			assert(expected.empty() || s.out() == expected);
+			expected = s.out();
+		}
+		assert(RLP(expected)[19] == "dog");
+	}
+
+	// indexed list, read backwards and past its end; long enough to spill past the items indexed in place.
+	{
+		RLPStream s(20);
+		for (unsigned i = 0; i < 20; ++i)
+			s << i;
+		RLPIndex index((RLP(s.out())));
+		assert(index.size() == 20);
+		for (unsigned i = 20; i--;)
+			assert(index[i] == i);
+		assert(index[20].isNull());
+		assert(RLPIndex(twoItemList)[1] == "dog");
+		assert(!RLPIndex(RLP("\x83""dog")).size());
+	}
+
 	// null
 	assert(RLP("\x80") == "");
 	assert(asString(rlp("")) == "\x80");
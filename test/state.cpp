@@ -20,9 +20,12 @@
  * State test functions.
  */
 
+#include <thread>
+#include <chrono>
 #include <secp256k1.h>
 #include <BlockChain.h>
 #include <State.h>
+#include <Instruction.h>
 using namespace std;
 using namespace eth;
 
@@ -34,8 +37,9 @@ int stateTest()
 
 	Defaults::setDBPath("/tmp");
 
-	Overlay stateDB = State::openDB();
-	BlockChain bc;
+	// Start afresh, so what's mined below doesn't depend on what earlier runs left.
+	Overlay stateDB = State::openDB(std::string(), true);
+	BlockChain bc(true);
 	State s(myMiner.address(), stateDB);
 
 	cout << bc;
@@ -56,6 +60,14 @@ int stateTest()
 
 	cout << s;
 
+	// Snapshots stay as they were taken, whatever's written afterwards.
+	BlockChainSnapshot chainThen = bc.snapshot();
+	Overlay stateThen = stateDB.snapshot();
+	stateDB.insertAux("snapshot test", bytesConstRef(string("written")));
+	assert(stateDB.lookupAux("snapshot test") == "written" && stateThen.lookupAux("snapshot test").empty());
+	assert(chainThen.currentHash() == bc.currentHash() && chainThen.block() == bc.block());
+	assert(chainThen.details().number == bc.details().number && chainThen.numberHash(bc.details().number) == bc.currentHash());
+
 	// Inject a transaction to transfer funds from miner to me.
 	bytes tx;
 	{
@@ -83,6 +95,144 @@ int stateTest()
 
 	cout << s;
 
+	// Mine two children of our best; a child of the first then names the second as an uncle, whose header the chain
+	// already has decoded, and imports.
+	{
+		// A block's timestamp, in whole seconds, must be later than its parent's.
+		auto waitAfter = [&](h256 _parent) { while ((u256)time(0) <= bc.info(_parent).timestamp) this_thread::sleep_for(chrono::milliseconds(50)); };
+
+		h256 head = bc.currentHash();
+		h256 siblings[2];
+		waitAfter(head);
+		for (int i = 0; i < 2; ++i)
+		{
+			State c(Address(i + 1), stateDB);
+			c.sync(bc, head);
+			c.commitToMine(bc);
+			while (!c.mine(100).completed) {}
+			bc.attemptImport(c.blockData(), stateDB);
+			siblings[i] = BlockInfo(&c.blockData()).hash;
+		}
+		BlockInfo uncle;
+		RLPStream header;
+		bc.info(siblings[1]).fillStream(header, true);
+		assert(bc.cachedHeader(&header.out(), uncle) && uncle.hash == siblings[1]);
+
+		// Blocks are handed out shared, not copied, and a handle outlives its block's eviction from the cache: reading
+		// the second sibling, never read before, trims the cache to just that.
+		BlockData b = bc.block(siblings[0]);
+		bytes copy = b.toBytes();
+		assert(bc.block(siblings[0]).data() == b.data());
+		eth::uint misses = bc.cacheMisses();
+		bc.setCacheLimit(1);
+		bc.block(siblings[1]);
+		assert(bc.cacheMisses() > misses && bc.block(siblings[0]).data() != b.data() && b.toBytes() == copy);
+		bc.setCacheLimit(c_defaultCacheLimit);
+
+		waitAfter(siblings[0]);
+		State n(myMiner.address(), stateDB);
+		n.sync(bc, siblings[0]);
+		n.commitToMine(bc);
+		while (!n.mine(100).completed) {}
+		bool imported = bc.attemptImport(n.blockData(), stateDB);
+		assert(imported && RLP(n.blockData())[2].itemCount() == 1);
+	}
+
+	// Over their limit, the decoded details are dropped, and read again from disk as needed.
+	{
+		h256 best = bc.currentHash();
+		eth::uint number = bc.details().number;
+		bc.setDetailsLimit(1);
+		bc.process();
+		assert(!bc.detailsSize());
+		assert(bc.details(best).number == number && bc.numberHash(number) == best && bc.info(best).hash == best);
+		bc.setDetailsLimit(c_defaultDetailsLimit);
+	}
+
+	// A block that won't import takes those descending from it in the same batch with it; those whose parents are
+	// just unknown are kept, though no more than the latest 1024.
+	{
+		bytes best = bc.block().toBytes();
+		auto withHeader = [&](h256 const& _parent, bool _badDifficulty)
+		{
+			BlockInfo bi(&best);
+			bi.parentHash = _parent;
+			bi.difficulty += _badDifficulty;
+			RLPStream s(3);
+			bi.fillStream(s, true);
+			s.appendRaw(RLP(best)[1].data()).appendRaw(RLP(best)[2].data());
+			return s.out();
+		};
+		std::vector<bytes> blocks;
+		blocks.push_back(withHeader(BlockInfo(&best).parentHash, true));
+		for (int i = 0; i < 2; ++i)
+			blocks.push_back(withHeader(sha3(blocks.back()), false));
+		bytes orphan = withHeader(sha3("nowhere"), false);
+		blocks.push_back(orphan);
+		assert(bc.importBatch(blocks, stateDB, false) == 0 && blocks.size() == 1 && blocks[0] == orphan);
+
+		blocks.clear();
+		for (int i = 0; i < 1100; ++i)
+			blocks.push_back(withHeader(sha3(toString(i)), false));
+		bytes latest = blocks.back();
+		bc.importBatch(blocks, stateDB, false);
+		assert(blocks.size() == 1024 && blocks.back() == latest);
+	}
+
+	// The genesis state is written once, pinned; a node committed untracked like it outlasts being journalled and pruned.
+	{
+		uint64_t written = Overlay::nodesWritten();
+		State again(myMiner.address(), stateDB);
+		assert(Overlay::nodesWritten() == written && stateDB.refCount(BlockInfo::genesis().stateRoot) == Overlay::c_pinned);
+
+		bytes v = rlp("pinned node");
+		h256 h = sha3(v);
+		stateDB.insert(h, &v);
+		stateDB.commit();
+		stateDB.insert(h, &v);
+		stateDB.commit(1u << 30, sha3("dead branch"));
+		stateDB.prune(1u << 30, sha3("canonical"));
+		assert(stateDB.lookup(h) == asString(v));
+	}
+
+	// A contract that calls itself (MKTX taking the address from the top 160 bits), the inner call rewriting the
+	// operand of its first PUSH; the outer one then jumps back and must see the new code, storing what it pushes at 200.
+	{
+		typedef Instruction I;
+		u256 const inner = 38;
+		u256 const done = 34;
+		u256s code = {
+			(u256)I::PUSH, 111,
+			(u256)I::PUSH, inner, (u256)I::TXSENDER, (u256)I::MYADDRESS, (u256)I::EQ, (u256)I::JMPI,
+			(u256)I::PUSH, done, (u256)I::PUSH, 100, (u256)I::LOAD, (u256)I::JMPI,
+			(u256)I::PUSH, 1, (u256)I::PUSH, 100, (u256)I::STORE,
+			(u256)I::PUSH, 0, (u256)I::PUSH, 0, (u256)I::PUSH, 0, (u256)I::PUSH, u256(1) << 96, (u256)I::MYADDRESS, (u256)I::MUL, (u256)I::MKTX,
+			(u256)I::POP, (u256)I::PUSH, 0, (u256)I::JMP,
+			(u256)I::PUSH, 200, (u256)I::STORE, (u256)I::STOP,
+			(u256)I::POP, (u256)I::PUSH, 222, (u256)I::PUSH, 1, (u256)I::STORE, (u256)I::STOP
+		};
+		assert(code.size() == inner + 7);
+
+		Transaction c;
+		c.nonce = s.transactionsFrom(myMiner.address());
+		c.value = 10000000;
+		c.fee = 2000000;		// Enough to store its code.
+		c.data = code;
+		c.sign(myMiner.secret());
+		s.execute(c.rlp());
+		Address contract = low160(c.sha3());
+		assert(s.isContractAddress(contract));
+
+		Transaction t;
+		t.nonce = s.transactionsFrom(myMiner.address());
+		t.value = 0;
+		t.fee = 0;
+		t.receiveAddress = contract;
+		t.sign(myMiner.secret());
+		s.execute(t.rlp());
+		assert(s.contractMemory(contract, 1) == 222 && s.contractMemory(contract, 200) == 222);
+	}
+
 	return 0;
 }
 
@@ -21,6 +21,7 @@
  */
 
 #include <random>
+#include <set>
 #include <TrieHash.h>
 #include <TrieDB.h>
 #include <MemTrie.h>
@@ -186,6 +187,140 @@ int trieTest()
 			}
 		}
 	}
+	{
+		// Batches of inserts and removes, applied together, should leave the same trie as one at a time, with no
+		// node left behind that isn't in it. Every other batch is big enough to be worked on by several threads.
+		BasicMap m;
+		GenericTrieDB<BasicMap> d(&m);
+		d.init();
+		StringMap s;
+		for (int a = 0; a < 40; ++a)
+		{
+			int n = a % 2 ? 200 : 30;
+			map<string, string> batch;
+			for (int i = 0; i < n; ++i)
+				batch[randomWord()] = toString(a * 200 + i);
+			for (auto const& i: s)
+				if ((int)batch.size() < n * 3 / 2 && rand() % 3 == 0)
+					batch[i.first] = a % 4 ? string() : toString(a);
+			GenericTrieDB<BasicMap>::Changes c;
+			for (auto const& i: batch)
+			{
+				c.push_back(make_pair(bytesConstRef(i.first), bytesConstRef(i.second)));
+				if (i.second.empty())
+					s.erase(i.first);
+				else
+					s[i.first] = i.second;
+			}
+			d.applyBatch(c, 0);
+			assert(d.root() == hash256(s));
+			assert(d.root() == hash256(s, 0));
+			for (auto const& i: s)
+			{
+				(void)i;
+				assert(d.at(i.first) == i.second);
+			}
+			// Iterating, from the start or from any key, should go as the map does.
+			auto sit = s.begin();
+			for (auto const& i: d)
+			{
+				assert(sit != s.end() && i.first.toString() == sit->first && i.second.toString() == sit->second);
+				++sit;
+			}
+			assert(sit == s.end());
+			for (int i = 0; i < 10; ++i)
+			{
+				string k = randomWord().substr(0, i % 3 + 1);
+				auto dit = d.lower_bound(bytesConstRef(k));
+				sit = s.lower_bound(k);
+				assert((dit == d.end()) == (sit == s.end()));
+				assert(sit == s.end() || (*dit).first.toString() == sit->first);
+				auto r = d.prefixRange(bytesConstRef(k));
+				unsigned n = 0;
+				for (auto it = r.first; it != r.second; ++it, ++n)
+					assert((*it).first.toString().compare(0, k.size(), k) == 0);
+				assert(n == (unsigned)distance(s.lower_bound(k), s.lower_bound(k + "\xff")));
+			}
+			set<h256> reachable;
+			d.descendKey(d.root() ? d.root() : c_shaNull, [&](h256 _h){ reachable.insert(_h); }, [](bytesConstRef){});
+			assert(reachable.size() == m.get().size());
+		}
+	}
+	{
+		// Diffing two tries, each in its own DB, finds just the keys whose values differ, in order, with both values.
+		for (int a = 0; a < 20; ++a)
+		{
+			StringMap s[2];
+			for (int i = 0; i < 100; ++i)
+				s[0][randomWord()] = toString(i);
+			s[1] = s[0];
+			for (int i = 0; i < a * 3; ++i)
+				if (rand() % 2)
+					s[1][randomWord()] = toString(i % 5 ? i : 1);
+				else
+				{
+					auto it = s[1].begin();
+					advance(it, rand() % s[1].size());
+					s[1].erase(it);
+				}
+			BasicMap m[2];
+			GenericTrieDB<BasicMap> d[2] = { GenericTrieDB<BasicMap>(&m[0]), GenericTrieDB<BasicMap>(&m[1]) };
+			for (int i = 0; i < 2; ++i)
+			{
+				d[i].init();
+				for (auto const& j: s[i])
+					d[i].insert(j.first, j.second);
+			}
+			vector<string> expected;
+			for (auto const& i: s[0])
+				if (!s[1].count(i.first) || s[1][i.first] != i.second)
+					expected.push_back(i.first);
+			for (auto const& i: s[1])
+				if (!s[0].count(i.first))
+					expected.push_back(i.first);
+			sort(expected.begin(), expected.end());
+			vector<string> found;
+			d[1].diff(d[0], [&](bytesConstRef _k, bytesConstRef _before, bytesConstRef _after)
+			{
+				string k = _k.toString();
+				assert(_before.toString() == (s[0].count(k) ? s[0][k] : string()) && _after.toString() == (s[1].count(k) ? s[1][k] : string()));
+				found.push_back(k);
+			});
+			assert(found == expected);
+			d[0].diff(d[0], [](bytesConstRef, bytesConstRef, bytesConstRef) { assert(false); });
+		}
+	}
+	{
+		// Fixed-length keys are looked up as generic ones are, present or not, with values inline or not.
+		BasicMap m;
+		TrieDB<Address, BasicMap> d(&m);
+		d.init();
+		for (int i = 0; i < 300; ++i)
+			d.insert(toAddress(sha3(toString(i))), asBytes(string(i % 40, 'x')));
+		for (int i = 0; i < 400; ++i)
+		{
+			Address a = toAddress(sha3(toString(i)));
+			string v = d.at(a);
+			assert(v == d.GenericTrieDB<BasicMap>::at(bytesConstRef(a.data(), a.size)));
+			assert(i < 300 ? v == string(i % 40, 'x') : v.empty());
+		}
+	}
+	{
+		// Build (and tear down) a large trie with nodes from the heap and then from the pool; see benchtrie for timings.
+		std::vector<std::pair<string, string>> kvs;
+		for (int i = 0; i < 20000; ++i)
+			kvs.push_back(make_pair(asString(sha3(toString(i)).asBytes()), toString(i)));
+
+		h256 roots[2];
+		for (int pooled = 0; pooled <= 1; ++pooled)
+		{
+			unique_ptr<MemTrie> t(new MemTrie(!!pooled));
+			for (auto const& i: kvs)
+				t->insert(i.first, i.second);
+			roots[pooled] = t->hash256();
+		}
+		assert(roots[0] == roots[1]);
+	}
 	return 0;
 }
 
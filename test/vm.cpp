@@ -0,0 +1,260 @@
+/*
+	This file is part of cpp-ethereum.
+
+	cpp-ethereum is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Foobar is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/** @file vm.cpp
+ * @author Gav Wood <i@gavwood.com>
+ * @date 2014
+ * VM arithmetic test functions.
+ */
+
+#include <sstream>
+#include <secp256k1.h>
+#include <Common.h>
+#include <AddressState.h>
+#include <VMProfiler.h>
+#include <Instruction.h>
+#include <State.h>
+using namespace std;
+using namespace eth;
+
+/// A secp256k1 point as secp256k1_ec_point_* take them: each coordinate four 64-bit words, least significant first.
+struct Point
+{
+	uint64_t x[4];
+	uint64_t y[4];
+	bool operator==(Point const& _c) const { return !memcmp(this, &_c, sizeof(Point)); }
+};
+
+static void toWords(u256 _v, uint64_t* o_w)
+{
+	for (unsigned i = 0; i < 4; ++i, _v >>= 64)
+		o_w[i] = (uint64_t)(_v & ~(uint64_t)0);
+}
+
+static u256 fromWords(uint64_t const* _w)
+{
+	u256 ret;
+	for (unsigned i = 4; i--;)
+		ret = (ret << 64) | _w[i];
+	return ret;
+}
+
+static Point pubkeyPoint(h256 const& _secret)
+{
+	byte pub[65];
+	int l = 65;
+	secp256k1_ecdsa_pubkey_create(pub, &l, _secret.data(), 0);
+	Point ret;
+	toWords(h256(pub + 1), ret.x);
+	toWords(h256(pub + 33), ret.y);
+	return ret;
+}
+
+int vmTest()
+{
+	// EXP against repeated multiplication, and modExp against arbitrary-precision arithmetic.
+	u256 bases[] = { 0, 1, 2, 3, 7, 255, 256, (u256)sha3("base"), ~(u256)0 };
+	for (auto b: bases)
+	{
+		u256 n = 1;
+		for (unsigned x = 0; x < 300; ++x, n *= b)
+			assert(exp256(b, x) == n);
+
+		u256 mods[] = { 0, 1, 2, 97, u256(1) << 255, (u256)sha3("mod") };
+		for (auto m: mods)
+			for (unsigned x = 0; x < 40; ++x)
+				assert(modExp(b, x, m) == (m ? (u256)(boost::multiprecision::pow((bigint)b, x) % m) : 0));
+	}
+
+	// Large exponents, which used to take time linear in the exponent.
+	assert(exp256(2, 255) == u256(1) << 255);
+	assert(exp256(2, 256) == 0);
+	assert(exp256(2, ~(u256)0) == 0);
+	assert(exp256(3, ~(u256)0) == (u256)boost::multiprecision::powm((bigint)3, (bigint)~(u256)0, (bigint)1 << 256));
+	assert(exp256(~(u256)0, ~(u256)0) == ~(u256)0);
+	assert(exp256(~(u256)0, ~(u256)0 - 1) == 1);
+	u256 p = (u256)sha3("prime?") | 1;
+	assert(modExp(5, ~(u256)0, p) == (u256)boost::multiprecision::powm((bigint)5, (bigint)~(u256)0, (bigint)p));
+
+	// Point arithmetic on words against key generation.
+	secp256k1_start();
+	{
+		Point g = pubkeyPoint(u256(1));
+		Point inf = {};
+		Point r;
+		uint64_t n[4];
+		assert(secp256k1_ec_point_valid(g.x, g.y));
+		assert(!secp256k1_ec_point_valid(inf.x, inf.y));
+
+		toWords(u256(5), n);
+		assert(secp256k1_ec_point_mul(r.x, r.y, g.x, g.y, n) && r == pubkeyPoint(u256(5)));
+		toWords((u256)sha3("k"), n);
+		Point k = pubkeyPoint(sha3("k"));
+		assert(secp256k1_ec_point_mul(r.x, r.y, g.x, g.y, n) && r == k);
+		assert(secp256k1_ec_point_add(r.x, r.y, g.x, g.y, g.x, g.y) && r == pubkeyPoint(u256(2)));
+		assert(secp256k1_ec_point_add(r.x, r.y, k.x, k.y, pubkeyPoint(u256(3)).x, pubkeyPoint(u256(3)).y) && r == pubkeyPoint(u256(sha3("k")) + 3));
+		assert(secp256k1_ec_point_add(r.x, r.y, g.x, g.y, inf.x, inf.y) && r == g);
+
+		// The group order takes any point to infinity, as does adding its negation.
+		u256 order("0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+		toWords(order, n);
+		assert(secp256k1_ec_point_mul(r.x, r.y, k.x, k.y, n) && r == inf);
+		assert(secp256k1_ec_point_add(r.x, r.y, k.x, k.y, pubkeyPoint(order - u256(sha3("k"))).x, pubkeyPoint(order - u256(sha3("k"))).y) && r == inf);
+
+		// A point off the curve is rejected.
+		Point bad = g;
+		bad.y[0] ^= 1;
+		assert(!secp256k1_ec_point_valid(bad.x, bad.y) && !secp256k1_ec_point_mul(r.x, r.y, bad.x, bad.y, n));
+	}
+
+	// The EC opcodes, run by a contract that stores what each leaves on the stack from position 1000 on. They give what
+	// they always have, quirks included, whether on the word path or (for coordinates of P or more) the bytewise one.
+	{
+		typedef Instruction I;
+		u256s code;
+		auto push = [&](u256 _v) { code.push_back((u256)I::PUSH); code.push_back(_v); };
+		auto op = [&](I _i) { code.push_back((u256)_i); };
+		auto keep = [&](unsigned _at, unsigned _n) { for (unsigned i = _n; i--;) { push(1000 + _at + i); op(I::STORE); } };
+
+		u256 p("0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEFFFFFC2F");
+		u256 order("0xFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFFEBAAEDCE6AF48A03BBFD25E8CD0364141");
+		Point g = pubkeyPoint(u256(1));
+		Point g2 = pubkeyPoint(u256(2));
+		u256 gx = fromWords(g.x);
+		u256 gy = fromWords(g.y);
+
+		// A point with an x small enough that x + P still fits in a word.
+		Point low = {};
+		for (low.x[0] = 1; ; ++low.x[0])
+		{
+			u256 rhs = (u256)(((bigint)low.x[0] * low.x[0] * low.x[0] + 7) % p);
+			u256 y = modExp(rhs, (p + 1) / 4, p);
+			if ((u256)((bigint)y * y % p) == rhs)
+			{
+				toWords(y, low.y);
+				break;
+			}
+		}
+		assert(secp256k1_ec_point_valid(low.x, low.y));
+		Point low2;
+		uint64_t two[4] = { 2 };
+		secp256k1_ec_point_mul(low2.x, low2.y, low.x, low.y, two);
+
+		h256 msg = sha3("message");
+		h256 sig[2];
+		int v;
+		secp256k1_ecdsa_sign_compact(msg.data(), 32, sig[0].data(), sha3("signer").data(), sha3("nonce").data(), &v);
+
+		push(5); push(gx); push(gy); op(I::ECMUL); keep(0, 2);
+		push(order + 5); push(gx); push(gy); op(I::ECMUL); keep(2, 2);
+		push(0); push(gx); push(gy); op(I::ECMUL); keep(4, 2);
+		push(5); push(gx); push(gy ^ 1); op(I::ECMUL); keep(6, 2);
+		push(2); push(fromWords(low.x) + p); push(fromWords(low.y)); op(I::ECMUL); keep(8, 2);
+		push(gx); push(gy); push(fromWords(g2.x)); push(fromWords(g2.y)); op(I::ECADD); keep(10, 2);
+		push(gx); push(gy); push(fromWords(low.x) + p); push(fromWords(low.y)); op(I::ECADD); keep(12, 2);
+		push(msg); push(v + 27); push(sig[0]); push(sig[1]); op(I::ECRECOVER); keep(14, 2);
+		push(7); push(gx); push(gy); op(I::ECVALID); keep(16, 1);
+		push(7); push(gx); push(gy ^ 1); op(I::ECVALID); keep(17, 1);
+		push(7); push(fromWords(low.x) + p); push(fromWords(low.y)); op(I::ECVALID); keep(18, 1);
+		op(I::STOP);
+
+		State s(Address(), State::openDB("/tmp/vmtest", true));
+		KeyPair k = sha3("contract owner");
+		s.addBalance(k.address(), u256(1) << 64);
+		Transaction c;
+		c.nonce = 0;
+		c.value = 1000000000;
+		c.fee = 10000000;		// Enough to store its code.
+		c.data = code;
+		c.sign(k.secret());
+		s.execute(c.rlp());
+		Address contract = low160(c.sha3());
+
+		Transaction t;
+		t.nonce = 1;
+		t.value = 0;
+		t.fee = 0;
+		t.receiveAddress = contract;
+		t.sign(k.secret());
+		s.execute(t.rlp());
+
+		auto at = [&](unsigned _i) { return s.contractMemory(contract, 1000 + _i); };
+		auto pointAt = [&](unsigned _i) { Point p; toWords(at(_i), p.x); toWords(at(_i + 1), p.y); return p; };
+		Point inf = {};
+		assert(pointAt(0) == pubkeyPoint(u256(5)));
+		// A zero or out-of-range factor leaves the point be, and an invalid point gives (0,0).
+		assert(pointAt(2) == g && pointAt(4) == g && pointAt(6) == inf);
+		// Coordinates of P or more are taken modulo P.
+		assert(pointAt(8) == low2);
+		// ECADD adds to (S[-2],S[-1]) the multiple of G given by the first 32 bytes of (S[-4],S[-3]), encoded.
+		u256 tweak = (u256(4) << 248) | (gx >> 8);
+		assert(pointAt(10) == pubkeyPoint(tweak + 2));
+		Point lowPlus;
+		uint64_t tw[4];
+		toWords(tweak, tw);
+		secp256k1_ec_point_mul(lowPlus.x, lowPlus.y, g.x, g.y, tw);
+		secp256k1_ec_point_add(lowPlus.x, lowPlus.y, lowPlus.x, lowPlus.y, low.x, low.y);
+		assert(pointAt(12) == lowPlus);
+		// ECRECOVER gives (0,0) for a key it recovers.
+		assert(pointAt(14) == inf);
+		// ECVALID replaces the item below the point.
+		assert(at(16) == 1 && !at(17) && at(18) == 1);
+	}
+
+	// Contract memory agrees with an ordered map, for positions either side of the dense range and beyond a word.
+	{
+		MemoryMap m;
+		map<u256, u256> ref;
+		assert(m.empty() && !m.find(0));
+		for (unsigned i = 0; i < 5000; ++i)
+		{
+			u256 k = i % 3 ? u256(i * 7 % 2000) : (u256(1) << (64 + i % 190)) + i;
+			m[k] = i;
+			ref[k] = i;
+		}
+		assert(m.size() == ref.size() && !m.count(1999 * 7) && !m.count(u256(1) << 255));
+		for (auto const& i: ref)
+			assert(m.find(i.first) && *m.find(i.first) == i.second);
+		auto o = m.ordered();
+		assert(o == decltype(o)(ref.begin(), ref.end()));
+		m.clear();
+		assert(m.empty() && !m.find(7));
+	}
+
+	// Profiles merge into the totals as each run finishes.
+	{
+		VMProfiler::reset();
+		Address a = toAddress(sha3("contract"));
+		for (unsigned i = 0; i < 2; ++i)
+		{
+			VMProfiler::Run run(a);
+			run.step(Instruction::PUSH, 100);
+			run.step(Instruction::ADD, 100);
+			run.step(Instruction::STOP, 0);
+		}
+		auto ins = VMProfiler::byInstruction();
+		assert(ins[(uint8_t)Instruction::ADD].count == 2 && ins[(uint8_t)Instruction::ADD].fees == 200);
+		assert(ins[(uint8_t)Instruction::SUB].count == 0);
+		auto cons = VMProfiler::byContract();
+		assert(cons.size() == 1 && cons[a].count == 6 && cons[a].fees == 400);
+		stringstream csv;
+		VMProfiler::streamCSV(csv);
+		assert(csv.str().find("\ninstruction,ADD,2,") != string::npos);
+		assert(csv.str().find("\ncontract," + asHex(a.asArray()) + ",6,") != string::npos);
+		VMProfiler::reset();
+	}
+	return 0;
+}